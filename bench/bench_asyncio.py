@@ -0,0 +1,153 @@
+# inotipy, a transparent wrapper for the Linux inotify system call
+# Copyright (C) 2020  Aayush Agarwal
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, If not, see <https://www.gnu.org/licenses/>
+
+"""Benchmark for consuming inotify events from asyncio.
+
+Compares Inotify.events() against the loop people write by hand today:
+loop.add_reader() on the descriptor, read() and get_event_list() in the
+callback, and one asyncio.Queue item per event. Two things are measured in
+a scratch directory (on tmpfs when /dev/shm is available):
+
+  * throughput: a thread creates files in bursts while the loop consumes
+    every event;
+  * latency: the time from creating one file to its event reaching the
+    consumer, over many rounds.
+
+    python3 bench/bench_asyncio.py [events] [rounds]
+"""
+
+import asyncio
+import os
+import statistics
+import sys
+import tempfile
+import threading
+import time
+
+import inotipy
+import inotipyutils
+
+BURST = 500
+
+
+def storm(directory, count):
+    # Every file produces one IN_CREATE.
+    for i in range(count):
+        os.close(os.open(os.path.join(directory, "f%d" % i),
+                         os.O_CREAT | os.O_WRONLY, 0o600))
+        if i % BURST == BURST - 1:
+            time.sleep(0)
+
+
+class HandRolled:
+    # add_reader() with a callback that queues every event separately.
+    def __init__(self, reader):
+        self.fd = reader.fileno()
+        self.queue = asyncio.Queue()
+        asyncio.get_running_loop().add_reader(self.fd, self.ready)
+
+    def ready(self):
+        try:
+            inotipyutils.read(self.fd)
+        except (BlockingIOError, EOFError):
+            return
+        for event in inotipyutils.get_event_list():
+            self.queue.put_nowait(event)
+
+    async def take(self):
+        # One await per event
+        await self.queue.get()
+        return 1
+
+    def close(self):
+        asyncio.get_running_loop().remove_reader(self.fd)
+
+
+class Native:
+    # Inotify.events(), one Batch per wakeup.
+    def __init__(self, reader):
+        self.stream = reader.events()
+
+    async def take(self):
+        return len(await self.stream.__anext__())
+
+    def close(self):
+        self.stream.close()
+
+
+def open_reader(directory):
+    reader = inotipyutils.Inotify(flags=inotipy.IN_NONBLOCK)
+    inotipy.inotify_add_watch(reader.fileno(), directory, inotipy.IN_CREATE)
+    return reader
+
+
+async def throughput(consumer_type, events):
+    with tempfile.TemporaryDirectory(dir=scratch()) as directory:
+        with open_reader(directory) as reader:
+            consumer = consumer_type(reader)
+            producer = threading.Thread(target=storm,
+                                        args=(directory, events))
+            start = time.perf_counter()
+            producer.start()
+            seen = 0
+            while seen < events:
+                seen += await consumer.take()
+            elapsed = time.perf_counter() - start
+            producer.join()
+            consumer.close()
+            return elapsed
+
+
+async def latency(consumer_type, rounds):
+    with tempfile.TemporaryDirectory(dir=scratch()) as directory:
+        with open_reader(directory) as reader:
+            consumer = consumer_type(reader)
+            loop = asyncio.get_running_loop()
+            samples = []
+            for i in range(rounds):
+                path = os.path.join(directory, "l%d" % i)
+                # Create the file from another callback, once the consumer
+                # is already waiting.
+                stamp = []
+                loop.call_soon(lambda: (stamp.append(time.perf_counter()),
+                                        os.close(os.open(path, os.O_CREAT |
+                                                         os.O_WRONLY,
+                                                         0o600))))
+                await consumer.take()
+                samples.append(time.perf_counter() - stamp[0])
+            consumer.close()
+            return samples
+
+
+def scratch():
+    return "/dev/shm" if os.path.isdir("/dev/shm") else None
+
+
+async def run(events, rounds):
+    for label, consumer_type in (("add_reader + Queue", HandRolled),
+                                 ("Inotify.events()", Native)):
+        elapsed = await throughput(consumer_type, events)
+        samples = sorted(await latency(consumer_type, rounds))
+        print("%-20s %10.0f events/s  latency median %6.1f us, "
+              "p99 %6.1f us" %
+              (label, events / elapsed,
+               statistics.median(samples) * 1e6,
+               samples[int(len(samples) * 0.99) - 1] * 1e6))
+
+
+if __name__ == "__main__":
+    asyncio.run(run(int(sys.argv[1]) if len(sys.argv) > 1 else 100000,
+                    int(sys.argv[2]) if len(sys.argv) > 2 else 1000))
@@ -0,0 +1,291 @@
+# inotipy, a transparent wrapper for the Linux inotify system call
+# Copyright (C) 2020  Aayush Agarwal
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, If not, see <https://www.gnu.org/licenses/>
+
+"""Benchmark for the whole read, parse and deliver pipeline.
+
+Generates controlled storms of creates, modifies and renames spread over a
+number of directories in a scratch directory (on tmpfs when /dev/shm is
+available), of which some are watched, and measures:
+
+* events/sec through drain() and get_event_list()
+* ns/event to hand a full queue back with get_event(), get_event_list()
+  and get_batch()
+* syscalls and read(2) calls per 1000 events
+* peak RSS
+* how many events the kernel queues before it reports IN_Q_OVERFLOW
+
+The results are written as JSON so that runs can be compared:
+
+    python3 bench/bench_pipeline.py [--events N] [--dirs M] [--watches K]
+                                    [--ops create,modify,rename]
+                                    [--files F] [--rounds R] [--output FILE]
+
+With --ops modify, --files spreads the storm over F files per directory
+only, so that the same few names are delivered over and over.
+
+It is also run by "python3 setup.py bench", which builds both extensions in
+place first.
+"""
+
+import argparse
+import json
+import os
+import platform
+import resource
+import sys
+import tempfile
+import time
+
+import inotipy
+import inotipyutils
+
+OPERATIONS = ("create", "modify", "rename")
+
+# The events each operation produces, so every storm watches for exactly
+# those and nothing else.
+MASK = (inotipy.IN_CREATE | inotipy.IN_MODIFY | inotipy.IN_MOVED_FROM |
+        inotipy.IN_MOVED_TO)
+
+
+def scratch_root():
+    return "/dev/shm" if os.path.isdir("/dev/shm") else None
+
+
+def make_dirs(root, dirs):
+    paths = [os.path.join(root, "d%d" % i) for i in range(dirs)]
+    for path in paths:
+        os.mkdir(path)
+    return paths
+
+
+def prepare(paths, events, ops, files=None):
+    # Files to modify and rename must exist before the storm starts, so
+    # that their IN_CREATE is not part of it.
+    names = []
+    for i in range(events):
+        directory = paths[i % len(paths)]
+        number = (i // len(paths)) % files if files else i
+        name = os.path.join(directory, "f%d" % number)
+        if ops[i % len(ops)] != "create" and not os.path.exists(name):
+            os.close(os.open(name, os.O_CREAT | os.O_WRONLY, 0o600))
+        names.append(name)
+    return names
+
+
+def storm(names, ops):
+    # One event per operation, IN_MOVED_FROM and IN_MOVED_TO aside.
+    for i, name in enumerate(names):
+        op = ops[i % len(ops)]
+        if op == "create":
+            os.close(os.open(name, os.O_CREAT | os.O_WRONLY, 0o600))
+        elif op == "modify":
+            fd = os.open(name, os.O_WRONLY)
+            os.write(fd, b"x")
+            os.close(fd)
+        else:
+            os.rename(name, name + ".r")
+
+
+def clean(paths):
+    for path in paths:
+        for name in os.listdir(path):
+            os.unlink(os.path.join(path, name))
+
+
+def drain_all(reader):
+    # Returns (events queued, syscalls made), reading until the kernel has
+    # nothing left for us.
+    queued = syscalls = 0
+    while True:
+        try:
+            count, calls, _ = reader.drain()
+        except BlockingIOError:
+            return queued, syscalls + 1
+        queued = count
+        syscalls += calls
+
+
+def throughput(paths, args, ops):
+    # The pipeline end to end: read and parse with drain(), then deliver
+    # with get_event_list().
+    total_ns = delivered = syscalls = 0
+    with inotipyutils.Inotify(flags=inotipy.IN_NONBLOCK) as reader:
+        for path in paths[:args.watches]:
+            inotipy.inotify_add_watch(reader.fileno(), path, MASK)
+        for _ in range(args.rounds):
+            names = prepare(paths, args.events, ops, args.files)
+            drain_all(reader)
+            reader.get_event_list()
+            storm(names, ops)
+            start = time.perf_counter_ns()
+            _, calls = drain_all(reader)
+            delivered += len(reader.get_event_list())
+            total_ns += time.perf_counter_ns() - start
+            syscalls += calls
+            clean(paths)
+            drain_all(reader)
+            reader.get_event_list()
+        stats = reader.stats()
+    return {
+        "events": delivered,
+        "events_per_sec": delivered * 1e9 / total_ns if total_ns else 0.0,
+        "ns_per_event": total_ns / delivered if delivered else 0.0,
+        "syscalls_per_1000_events":
+            syscalls * 1000 / delivered if delivered else 0.0,
+        "reads_per_1000_events":
+            stats["reads"] * 1000 / stats["events"] if stats["events"]
+            else 0.0,
+        "overflows": stats["overflows"],
+        "peak_queue_length": stats["peak_queue_length"],
+        "buffer_regrowths": stats["buffer_regrowths"],
+        "queue_regrowths": stats["queue_regrowths"],
+        "name_cache_hits": stats.get("name_cache_hits"),
+        "name_cache_misses": stats.get("name_cache_misses"),
+    }
+
+
+def delivery(paths, args, ops):
+    # The cost of handing a queue that is already full back to Python.
+    def get_event(reader):
+        count = 0
+        while True:
+            try:
+                reader.get_event()
+            except IndexError:
+                return count
+            count += 1
+
+    consumers = {
+        "get_event": get_event,
+        "get_event_list": lambda reader: len(reader.get_event_list()),
+        "get_batch": lambda reader: len(reader.get_batch()),
+    }
+    results = {}
+    with inotipyutils.Inotify(flags=inotipy.IN_NONBLOCK) as reader:
+        for path in paths[:args.watches]:
+            inotipy.inotify_add_watch(reader.fileno(), path, MASK)
+        for label, consume in consumers.items():
+            total_ns = delivered = 0
+            for _ in range(args.rounds):
+                names = prepare(paths, args.events, ops, args.files)
+                drain_all(reader)
+                reader.get_event_list()
+                storm(names, ops)
+                drain_all(reader)
+                start = time.perf_counter_ns()
+                delivered += consume(reader)
+                total_ns += time.perf_counter_ns() - start
+                clean(paths)
+                drain_all(reader)
+                reader.get_event_list()
+            results[label] = total_ns / delivered if delivered else 0.0
+    return results
+
+
+def overflow_onset(root):
+    # Create files without reading until the kernel queue overflows, and
+    # count the events it held before the IN_Q_OVERFLOW event.
+    try:
+        with open("/proc/sys/fs/inotify/max_queued_events") as limit:
+            max_queued = int(limit.read())
+    except OSError:
+        return None
+    directory = tempfile.mkdtemp(dir=root)
+    try:
+        with inotipyutils.Inotify(flags=inotipy.IN_NONBLOCK) as reader:
+            inotipy.inotify_add_watch(reader.fileno(), directory,
+                                      inotipy.IN_CREATE)
+            for i in range(max_queued + max_queued // 4):
+                os.close(os.open(os.path.join(directory, "f%d" % i),
+                                 os.O_CREAT | os.O_WRONLY, 0o600))
+            drain_all(reader)
+            masks = reader.get_batch().masks()
+        onset = next((i for i, mask in enumerate(masks)
+                      if mask & inotipy.IN_Q_OVERFLOW), None)
+    finally:
+        clean([directory])
+        os.rmdir(directory)
+    return {"max_queued_events": max_queued, "onset": onset}
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--events", type=int, default=10000,
+                        help="operations per storm")
+    parser.add_argument("--dirs", type=int, default=16,
+                        help="directories the operations are spread over")
+    parser.add_argument("--watches", type=int, default=None,
+                        help="directories that are watched (default: all)")
+    parser.add_argument("--ops", default=",".join(OPERATIONS),
+                        help="comma-separated mix of create, modify, rename")
+    parser.add_argument("--files", type=int, default=None,
+                        help="files per directory for --ops modify "
+                             "(default: one per operation)")
+    parser.add_argument("--rounds", type=int, default=5)
+    parser.add_argument("--output", default=None,
+                        help="file to write the JSON to (default: stdout)")
+    args = parser.parse_args()
+    ops = args.ops.split(",")
+    if not ops or any(op not in OPERATIONS for op in ops):
+        parser.error("--ops takes a mix of %s" % ", ".join(OPERATIONS))
+    if args.dirs < 1 or args.events < 1 or args.rounds < 1:
+        parser.error("--events, --dirs and --rounds must be positive")
+    if args.files is not None and (ops != ["modify"] or args.files < 1):
+        parser.error("--files takes a positive count and --ops modify")
+    if args.watches is None or args.watches > args.dirs:
+        args.watches = args.dirs
+
+    root = scratch_root()
+    rss_before = resource.getrusage(resource.RUSAGE_SELF).ru_maxrss
+    with tempfile.TemporaryDirectory(dir=root) as directory:
+        paths = make_dirs(directory, args.dirs)
+        results = {
+            "throughput": throughput(paths, args, ops),
+            "delivery_ns_per_event": delivery(paths, args, ops),
+        }
+    results["overflow"] = overflow_onset(root)
+    results["peak_rss_kib"] = {
+        "before": rss_before,
+        "after": resource.getrusage(resource.RUSAGE_SELF).ru_maxrss,
+    }
+    report = {
+        "parameters": {
+            "events": args.events,
+            "dirs": args.dirs,
+            "watches": args.watches,
+            "ops": ops,
+            "files": args.files,
+            "rounds": args.rounds,
+            "scratch": root or tempfile.gettempdir(),
+        },
+        "environment": {
+            "python": platform.python_version(),
+            "kernel": platform.release(),
+            "machine": platform.machine(),
+            "time": time.strftime("%Y-%m-%dT%H:%M:%S%z"),
+        },
+        "results": results,
+    }
+    text = json.dumps(report, indent=2)
+    if args.output:
+        with open(args.output, "w") as out:
+            out.write(text + "\n")
+    else:
+        print(text)
+
+
+if __name__ == "__main__":
+    sys.exit(main())
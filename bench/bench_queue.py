@@ -0,0 +1,88 @@
+# inotipy, a transparent wrapper for the Linux inotify system call
+# Copyright (C) 2020  Aayush Agarwal
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, If not, see <https://www.gnu.org/licenses/>
+
+"""Microbenchmark for the inotipyutils event queue.
+
+Generates a storm of events in a scratch directory (on tmpfs when /dev/shm
+is available), pulls them into the queue with read() and measures how long
+it takes to queue them and to hand them back with get_event_list(). Run it
+against two builds of inotipyutils to compare their event queues:
+
+    python3 bench/bench_queue.py [events] [rounds]
+"""
+
+import array
+import fcntl
+import os
+import sys
+import tempfile
+import termios
+import time
+
+import inotipy
+import inotipyutils
+
+
+def storm(directory, count):
+    # Every touch produces IN_CREATE, IN_OPEN and IN_CLOSE_WRITE.
+    for i in range(count):
+        os.close(os.open(os.path.join(directory, "f%d" % i),
+                         os.O_CREAT | os.O_WRONLY, 0o600))
+
+
+def pending(fd):
+    count = array.array("i", [0])
+    fcntl.ioctl(fd, termios.FIONREAD, count, True)
+    return count[0]
+
+
+def read_all(fd):
+    # Only call read() while the kernel has events queued, so the loop does
+    # not depend on how a given build reports an empty queue.
+    while pending(fd) > 0:
+        inotipyutils.read(fd)
+
+
+def run(events, rounds):
+    root = "/dev/shm" if os.path.isdir("/dev/shm") else None
+    queue_ns = deliver_ns = delivered = 0
+    with tempfile.TemporaryDirectory(dir=root) as directory:
+        fd = inotipy.inotify_init1(inotipy.IN_NONBLOCK)
+        inotipy.inotify_add_watch(fd, directory, inotipy.IN_ALL_EVENTS)
+        for _ in range(rounds):
+            storm(directory, events // 3)
+            start = time.perf_counter_ns()
+            read_all(fd)
+            queued = time.perf_counter_ns()
+            delivered += len(inotipyutils.get_event_list())
+            done = time.perf_counter_ns()
+            queue_ns += queued - start
+            deliver_ns += done - queued
+            for name in os.listdir(directory):
+                os.unlink(os.path.join(directory, name))
+            read_all(fd)
+            inotipyutils.get_event_list()
+        os.close(fd)
+    print("events delivered:   %d" % delivered)
+    print("queue ns/event:     %.1f" % (queue_ns / delivered))
+    print("deliver ns/event:   %.1f" % (deliver_ns / delivered))
+    print("events/sec:         %.0f" % (delivered * 1e9 /
+                                        (queue_ns + deliver_ns)))
+
+
+if __name__ == "__main__":
+    run(int(sys.argv[1]) if len(sys.argv) > 1 else 15000,
+        int(sys.argv[2]) if len(sys.argv) > 2 else 20)
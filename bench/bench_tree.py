@@ -0,0 +1,106 @@
+# inotipy, a transparent wrapper for the Linux inotify system call
+# Copyright (C) 2020  Aayush Agarwal
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License along
+# with this program; if not, If not, see <https://www.gnu.org/licenses/>
+
+"""Benchmark for setting up recursive watches.
+
+Builds a tree of directories in a scratch directory (on tmpfs when /dev/shm
+is available) and compares Inotify.add_tree() against walking the tree with
+os.walk() and calling inotify_add_watch() once per directory:
+
+    python3 bench/bench_tree.py [directories] [fanout]
+
+Both are bounded by /proc/sys/fs/inotify/max_user_watches; raise it to
+benchmark trees larger than that.
+
+The tree is idle, so every event either of them queues is one it caused
+itself by reading the directories it watches. They are drained and counted
+after each walk, along with whether the kernel queue overflowed.
+"""
+
+import os
+import sys
+import tempfile
+import time
+
+import inotipy
+import inotipyutils
+
+
+def build(root, directories, fanout):
+    # Breadth-first, so that every level but the last has fanout children.
+    pending, made = [root], 0
+    while made < directories:
+        parent = pending.pop(0)
+        for i in range(min(fanout, directories - made)):
+            path = os.path.join(parent, "d%d" % i)
+            os.mkdir(path)
+            pending.append(path)
+            made += 1
+
+
+def queued(reader):
+    # Returns (events queued, whether the kernel queue overflowed).
+    while True:
+        try:
+            reader.drain()
+        except BlockingIOError:
+            break
+    masks = reader.get_batch().masks()
+    return len(masks), any(mask & inotipy.IN_Q_OVERFLOW for mask in masks)
+
+
+def python_walk(root):
+    with inotipyutils.Inotify(flags=inotipy.IN_NONBLOCK) as reader:
+        added = failed = 0
+        start = time.perf_counter()
+        for path, _, _ in os.walk(root):
+            if inotipy.inotify_add_watch(reader.fileno(), path,
+                                         inotipy.IN_ALL_EVENTS) == -1:
+                failed += 1
+            else:
+                added += 1
+        elapsed = time.perf_counter() - start
+        return (elapsed, added, failed) + queued(reader)
+
+
+def native_walk(root):
+    with inotipyutils.Inotify(flags=inotipy.IN_NONBLOCK) as reader:
+        start = time.perf_counter()
+        added, failed = reader.add_tree(root, inotipy.IN_ALL_EVENTS)
+        elapsed = time.perf_counter() - start
+        return (elapsed, added, failed) + queued(reader)
+
+
+def run(directories, fanout):
+    base = "/dev/shm" if os.path.isdir("/dev/shm") else None
+    with tempfile.TemporaryDirectory(dir=base) as root:
+        start = time.perf_counter()
+        build(root, directories, fanout)
+        print("built %d directories in %.2fs" %
+              (directories + 1, time.perf_counter() - start))
+        for label, walk in (("os.walk + add_watch", python_walk),
+                            ("Inotify.add_tree", native_walk)):
+            elapsed, added, failed, events, overflow = walk(root)
+            print("%-20s %8.3fs  %d watches, %d failed, %.2f us/dir, "
+                  "%d events queued%s" %
+                  (label, elapsed, added, failed,
+                   elapsed * 1e6 / max(added + failed, 1), events,
+                   " (overflowed)" if overflow else ""))
+
+
+if __name__ == "__main__":
+    run(int(sys.argv[1]) if len(sys.argv) > 1 else 100000,
+        int(sys.argv[2]) if len(sys.argv) > 2 else 50)
@@ -0,0 +1,176 @@
+// inotipy, a transparent wrapper for the Linux inotify system call
+// Copyright (C) 2020  Aayush Agarwal
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, If not, see <https://www.gnu.org/licenses/>
+
+
+// An extension that consumes inotipyutils through its C API (see
+// inotipyutils.h) instead of through Python objects. It is built with the
+// other two by setup.py, which keeps the header and the capsule honest.
+//
+//     reader = inotipyconsumer.open()
+//     inotify_add_watch(reader.fileno(), path, mask)
+//     inotipyconsumer.count(reader)   # records drained, no objects built
+//     inotipyconsumer.events(reader)  # [(wd, mask, cookie, name, path)]
+
+#ifndef PY_SSIZE_T_CLEAN
+#define PY_SSIZE_T_CLEAN
+#endif
+#include <Python.h>
+#include <limits.h>
+#include <sys/inotify.h>
+#include "inotipyutils.h"
+
+// Room for a few hundred records per call; drain_into() leaves the rest
+// queued.
+#define CONSUMER_BUFFER_SIZE (16 * 1024)
+
+typedef struct {
+    const InotipyUtils_CAPI *api;
+} consumer_state;
+
+static inline consumer_state * get_consumer_state(PyObject *module) {
+    return (consumer_state *) PyModule_GetState(module);
+}
+
+static PyObject * consumer_open(PyObject *self, PyObject *args,
+                                PyObject *kwargs) {
+    static char *kwlist[] = {"fd", "flags", NULL};
+    int fd = -1, flags = IN_NONBLOCK;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|ii", kwlist, &fd,
+                                     &flags)) {
+        return NULL;
+    }
+    return get_consumer_state(self)->api->reader_open(fd, flags);
+}
+
+static PyObject * consumer_count(PyObject *self, PyObject *reader) {
+    // Drain everything pending and count it, without a single Python object
+    // per record.
+    const InotipyUtils_CAPI *api = get_consumer_state(self)->api;
+    char buffer[CONSUMER_BUFFER_SIZE];
+    long total = 0;
+    for (;;) {
+        size_t used;
+        Py_ssize_t count = api->drain_into(reader, buffer, sizeof buffer,
+                                           &used);
+        if (count == -1) return NULL;
+        if (count == 0) break;
+        size_t offset = 0;
+        while (api->next_event(buffer, used, &offset) != NULL) total++;
+    }
+    return PyLong_FromLong(total);
+}
+
+static PyObject * consumer_path(const InotipyUtils_CAPI *api,
+                                PyObject *reader, int wd) {
+    // The directory wd watches through add_tree(), or None.
+    char path[PATH_MAX];
+    Py_ssize_t len = api->wd_path(reader, wd, path, sizeof path);
+    if (len == -2) return NULL;
+    if (len < 0 || (size_t) len >= sizeof path) Py_RETURN_NONE;
+    return PyUnicode_DecodeFSDefaultAndSize(path, len);
+}
+
+static PyObject * consumer_name(const char *name, size_t len) {
+    // Names are padded with NULs up to the record length.
+    return PyUnicode_DecodeFSDefaultAndSize(name, strnlen(name, len));
+}
+
+static PyObject * consumer_events(PyObject *self, PyObject *reader) {
+    // Drain one buffer's worth of records into a list of
+    // (wd, mask, cookie, name, path) tuples. Paired renames get a second
+    // (wd, name, path) tuple for their destination.
+    const InotipyUtils_CAPI *api = get_consumer_state(self)->api;
+    char buffer[CONSUMER_BUFFER_SIZE];
+    size_t used, offset = 0;
+    if (api->drain_into(reader, buffer, sizeof buffer, &used) == -1)
+        return NULL;
+    PyObject *list = PyList_New(0);
+    if (!list) return NULL;
+    const struct inotify_event *event;
+    while ((event = api->next_event(buffer, used, &offset)) != NULL) {
+        PyObject *name = consumer_name(event->name, event->len);
+        PyObject *path = name ? consumer_path(api, reader, event->wd) : NULL;
+        PyObject *item = NULL;
+        int to_wd;
+        const char *to_name;
+        size_t to_len;
+        if (path && api->moved_destination(event, &to_wd, &to_name,
+                                           &to_len)) {
+            PyObject *to_path = consumer_path(api, reader, to_wd);
+            PyObject *to_name_object = to_path ?
+                consumer_name(to_name, to_len) : NULL;
+            if (to_name_object) {
+                item = Py_BuildValue("(iIINN(iNN))", event->wd, event->mask,
+                                     event->cookie, name, path, to_wd,
+                                     to_name_object, to_path);
+            }
+            else {
+                Py_XDECREF(to_path);
+                Py_DECREF(path);
+                Py_DECREF(name);
+            }
+        }
+        else if (path) {
+            item = Py_BuildValue("(iIINN)", event->wd, event->mask,
+                                 event->cookie, name, path);
+        }
+        else Py_XDECREF(name);
+        if (!item || PyList_Append(list, item) == -1) {
+            Py_XDECREF(item);
+            Py_DECREF(list);
+            return NULL;
+        }
+        Py_DECREF(item);
+    }
+    return list;
+}
+
+static PyMethodDef consumer_methods[] = {
+    {"open", (PyCFunction)(void(*)(void)) consumer_open,
+     METH_VARARGS | METH_KEYWORDS,
+     "open(fd=-1, flags=IN_NONBLOCK)\n\n"
+     "Return a new inotipyutils.Inotify reader through the C API."},
+    {"count", consumer_count, METH_O,
+     "count(reader)\n\n"
+     "Drain every pending record and return how many there were."},
+    {"events", consumer_events, METH_O,
+     "events(reader)\n\n"
+     "Drain up to one buffer of records as a list of (wd, mask, cookie, "
+     "name, path) tuples."},
+    {NULL, NULL, 0, NULL}
+};
+
+static int consumer_exec(PyObject *module) {
+    get_consumer_state(module)->api = InotipyUtils_Import();
+    return get_consumer_state(module)->api ? 0 : -1;
+}
+
+static PyModuleDef_Slot consumer_slots[] = {
+    {Py_mod_exec, consumer_exec},
+    {0, NULL}
+};
+
+static PyModuleDef consumer = {
+    PyModuleDef_HEAD_INIT,
+    .m_name = "inotipyconsumer",
+    .m_size = sizeof (consumer_state),
+    .m_methods = consumer_methods,
+    .m_slots = consumer_slots
+};
+
+PyMODINIT_FUNC PyInit_inotipyconsumer(void) {
+    return PyModuleDef_Init(&consumer);
+}
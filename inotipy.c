@@ -20,14 +20,25 @@
 #endif
 #include <Python.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <sys/inotify.h>
+#include <sys/fanotify.h>
 //#include <unistd.h>
 
-// NOTE: Do not touch this! Only functions that have errors will use it!
-// If you need to access the value of this variable, call inotipy.errno()
-static int _inotipy_errno = 0;
+typedef struct {
+    // NOTE: Do not touch this! Only functions that have errors will use it!
+    // If you need to access the value of this variable, use inotipy.errno
+    int _inotipy_errno;
+} inotipy_state;
 
-#define CLR_INOTIPY_ERRNO() _inotipy_errno = 0
+static inline inotipy_state * get_inotipy_state(PyObject *module) {
+    return (inotipy_state *) PyModule_GetState(module);
+}
+
+#define SET_INOTIPY_ERRNO(module) \
+    get_inotipy_state(module)->_inotipy_errno = errno
+#define CLR_INOTIPY_ERRNO(module) \
+    get_inotipy_state(module)->_inotipy_errno = 0
 
 PyDoc_STRVAR(inotipy_inotify_init_doc,
              "A wrapper for the inotify_init() system call.\n\n"
@@ -38,10 +49,10 @@ PyDoc_STRVAR(inotipy_inotify_init_doc,
              "See the errno module and the inotify_init(2) manpage for "
              "details.");
 
-static PyObject * inotipy_inotify_init(PyObject *self) {
+static PyObject * inotipy_inotify_init(PyObject *self, PyObject *unused) {
     int fd = inotify_init();
-    if (fd == -1) _inotipy_errno = errno;
-    else CLR_INOTIPY_ERRNO();
+    if (fd == -1) SET_INOTIPY_ERRNO(self);
+    else CLR_INOTIPY_ERRNO(self);
     return PyLong_FromLong((long)fd);
 }
 
@@ -66,8 +77,8 @@ static PyObject * inotipy_inotify_init1(PyObject *self, PyObject *args,
     // Upon successful assignment of flags, invoke inotify_init1
     int flags = (int) _flags;
     int fd = inotify_init1(flags);
-    if (fd == -1) _inotipy_errno = errno;
-    else CLR_INOTIPY_ERRNO();
+    if (fd == -1) SET_INOTIPY_ERRNO(self);
+    else CLR_INOTIPY_ERRNO(self);
     return PyLong_FromLong((long) fd);
 }
 
@@ -113,8 +124,8 @@ static PyObject * inotipy_inotify_add_watch(PyObject *self, PyObject *args,
     // If the variables are safely assigned, we cast _mask as uint32_t mask.
     mask = (uint32_t) _mask;
     int wd = inotify_add_watch(fd, pathname, mask);
-    if (wd == -1) _inotipy_errno = errno;
-    else CLR_INOTIPY_ERRNO();
+    if (wd == -1) SET_INOTIPY_ERRNO(self);
+    else CLR_INOTIPY_ERRNO(self);
     return PyLong_FromLong((long) wd);
 }
 
@@ -137,8 +148,212 @@ static PyObject * inotipy_inotify_rm_watch(PyObject *self, PyObject *args,
     if (!PyArg_ParseTupleAndKeywords(args, kwargs, "ii", kwlist, &fd, &wd))
         return NULL;
     int status = inotify_rm_watch(fd, wd);
-    if (status == -1) _inotipy_errno = errno;
-    else CLR_INOTIPY_ERRNO();
+    if (status == -1) SET_INOTIPY_ERRNO(self);
+    else CLR_INOTIPY_ERRNO(self);
+    return PyLong_FromLong(status);
+}
+
+PyDoc_STRVAR(inotipy_inotify_add_watches_doc,
+             "Call inotify_add_watch() once for every path, in a single call."
+             "\n\n"
+             "Parameters:\n\n"
+             "fd (int): The file descriptor.\n"
+             "paths (iterable): The paths to be watched, as str, bytes or\n"
+             "path-like objects.\n"
+             "mask (int): The bit masks which describe the monitored events,\n"
+             "as for inotify_add_watch().\n\n"
+             "The paths are encoded up front and the system calls are made\n"
+             "without holding the GIL.\n\n"
+             "Returns:\n\n"
+             "tuple: (wds, errnos), two array.array('i') with one item per\n"
+             "path: its watch descriptor, or -1 on failure, and the errno\n"
+             "of the failure, or 0. The module errno is left untouched.");
+
+static PyObject * int_array(const int *values, Py_ssize_t count) {
+    // Return an array.array('i') holding a copy of values.
+    PyObject *array_module = PyImport_ImportModule("array");
+    if (!array_module) return NULL;
+    PyObject *array = PyObject_CallMethod(array_module, "array", "sy#", "i",
+                                          (const char *) values,
+                                          count * (Py_ssize_t) sizeof (int));
+    Py_DECREF(array_module);
+    return array;
+}
+
+static PyObject * inotipy_inotify_add_watches(PyObject *self, PyObject *args,
+                                              PyObject *kwargs) {
+    int fd;
+    PyObject *paths;
+    unsigned long _mask;
+    char *kwlist[] = {"fd", "paths", "mask", NULL};
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "iOk", kwlist, &fd,
+        &paths, &_mask))
+        return NULL;
+    uint32_t mask = (uint32_t) _mask;
+    PyObject *items = PySequence_Fast(paths, "paths must be iterable");
+    if (!items) return NULL;
+    Py_ssize_t count = PySequence_Fast_GET_SIZE(items);
+    // Every path is encoded before the GIL is released; the bytes objects
+    // keep the strings handed to the system calls alive.
+    PyObject **encoded = PyMem_Calloc(count ? (size_t) count : 1,
+                                      sizeof (PyObject *));
+    int *wds = PyMem_Malloc((count ? (size_t) count : 1) * sizeof (int));
+    int *errnos = PyMem_Malloc((count ? (size_t) count : 1) * sizeof (int));
+    PyObject *result = NULL;
+    if (!encoded || !wds || !errnos) {
+        PyErr_NoMemory();
+        goto done;
+    }
+    for (Py_ssize_t i = 0; i < count; i++) {
+        PyObject *item = PySequence_Fast_GET_ITEM(items, i);
+        if (!PyUnicode_FSConverter(item, &encoded[i])) goto done;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    for (Py_ssize_t i = 0; i < count; i++) {
+        wds[i] = inotify_add_watch(fd, PyBytes_AS_STRING(encoded[i]), mask);
+        errnos[i] = (wds[i] == -1) ? errno : 0;
+    }
+    Py_END_ALLOW_THREADS
+    PyObject *wd_array = int_array(wds, count);
+    PyObject *errno_array = wd_array ? int_array(errnos, count) : NULL;
+    if (errno_array) result = PyTuple_Pack(2, wd_array, errno_array);
+    Py_XDECREF(wd_array);
+    Py_XDECREF(errno_array);
+done:
+    if (encoded) {
+        for (Py_ssize_t i = 0; i < count; i++) Py_XDECREF(encoded[i]);
+    }
+    PyMem_Free(encoded);
+    PyMem_Free(wds);
+    PyMem_Free(errnos);
+    Py_DECREF(items);
+    return result;
+}
+
+PyDoc_STRVAR(inotipy_inotify_rm_watches_doc,
+             "Call inotify_rm_watch() once for every watch descriptor, in a\n"
+             "single call.\n\n"
+             "Parameters:\n\n"
+             "fd (int): The file descriptor.\n"
+             "wds (iterable): The watch descriptors to be removed.\n\n"
+             "The system calls are made without holding the GIL.\n\n"
+             "Returns:\n\n"
+             "array.array('i'): The errno of every removal that failed, or\n"
+             "0 for those that succeeded. The module errno is left untouched.");
+
+static PyObject * inotipy_inotify_rm_watches(PyObject *self, PyObject *args,
+                                             PyObject *kwargs) {
+    int fd;
+    PyObject *wd_list;
+    char *kwlist[] = {"fd", "wds", NULL};
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "iO", kwlist, &fd,
+        &wd_list))
+        return NULL;
+    PyObject *items = PySequence_Fast(wd_list, "wds must be iterable");
+    if (!items) return NULL;
+    Py_ssize_t count = PySequence_Fast_GET_SIZE(items);
+    int *wds = PyMem_Malloc((count ? (size_t) count : 1) * sizeof (int));
+    int *errnos = PyMem_Malloc((count ? (size_t) count : 1) * sizeof (int));
+    PyObject *result = NULL;
+    if (!wds || !errnos) {
+        PyErr_NoMemory();
+        goto done;
+    }
+    for (Py_ssize_t i = 0; i < count; i++) {
+        int overflow;
+        long wd = PyLong_AsLongAndOverflow(PySequence_Fast_GET_ITEM(items, i),
+                                           &overflow);
+        if (wd == -1 && PyErr_Occurred()) goto done;
+        if (overflow || wd < INT_MIN || wd > INT_MAX) {
+            PyErr_SetString(PyExc_OverflowError,
+                            "watch descriptor does not fit in an int");
+            goto done;
+        }
+        wds[i] = (int) wd;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    for (Py_ssize_t i = 0; i < count; i++)
+        errnos[i] = (inotify_rm_watch(fd, wds[i]) == -1) ? errno : 0;
+    Py_END_ALLOW_THREADS
+    result = int_array(errnos, count);
+done:
+    PyMem_Free(wds);
+    PyMem_Free(errnos);
+    Py_DECREF(items);
+    return result;
+}
+
+PyDoc_STRVAR(inotipy_fanotify_init_doc,
+             "A wrapper for the fanotify_init() system call.\n\n"
+             "Parameters:\n\n"
+             "flags (int): The notification class and the flags of the\n"
+             "group, such as\n\n"
+             "FAN_CLASS_NOTIF\nFAN_CLOEXEC\nFAN_NONBLOCK\n"
+             "FAN_UNLIMITED_QUEUE\nFAN_REPORT_FID\nFAN_REPORT_DFID_NAME\n\n"
+             "event_f_flags (int): The status flags of the file descriptors\n"
+             "handed out with events (default: O_RDONLY). They are unused\n"
+             "when events report file handles.\n\n"
+             "Returns:\n\n"
+             "int: The file descriptor on success, or -1 on failure.\n"
+             "Sets errno (int) on failure.\n\nPossible errors are:\n\n"
+             "EINVAL\nEMFILE\nENOMEM\nENOSYS\nEPERM\n\n"
+             "See the errno module and the fanotify_init(2) manpage for "
+             "details.");
+
+static PyObject * inotipy_fanotify_init(PyObject *self, PyObject *args,
+                                        PyObject *kwargs) {
+    unsigned int flags;
+    unsigned int event_f_flags = O_RDONLY;
+    char *kwlist[] = {"flags", "event_f_flags", NULL};
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "I|I", kwlist, &flags,
+        &event_f_flags))
+        return NULL;
+    int fd = fanotify_init(flags, event_f_flags);
+    if (fd == -1) SET_INOTIPY_ERRNO(self);
+    else CLR_INOTIPY_ERRNO(self);
+    return PyLong_FromLong((long) fd);
+}
+
+PyDoc_STRVAR(inotipy_fanotify_mark_doc,
+             "A wrapper for the fanotify_mark() system call.\n\n"
+             "Parameters:\n\n"
+             "fd (int): The fanotify file descriptor.\n"
+             "flags (int): What to do, FAN_MARK_ADD, FAN_MARK_REMOVE or\n"
+             "FAN_MARK_FLUSH, and on what, such as FAN_MARK_INODE,\n"
+             "FAN_MARK_MOUNT or FAN_MARK_FILESYSTEM. One FAN_MARK_FILESYSTEM\n"
+             "mark covers every directory of the filesystem.\n"
+             "mask (int): The events, such as\n\n"
+             "FAN_ACCESS\nFAN_MODIFY\nFAN_ATTRIB\nFAN_CLOSE_WRITE\n"
+             "FAN_CLOSE_NOWRITE\nFAN_OPEN\nFAN_MOVED_FROM\nFAN_MOVED_TO\n"
+             "FAN_CREATE\nFAN_DELETE\nFAN_DELETE_SELF\nFAN_MOVE_SELF\n"
+             "FAN_RENAME\nFAN_ONDIR\nFAN_EVENT_ON_CHILD\n\n"
+             "dirfd (int): The directory pathname is relative to\n"
+             "(default: AT_FDCWD).\n"
+             "pathname (str): The object to mark, or None for dirfd itself.\n"
+             "\n"
+             "Returns:\n\n"
+             "int: 0 on success, -1 on failure.\n"
+             "Sets errno (int) on failure.\n\nPossible errors are:\n\n"
+             "EBADF\nEEXIST\nEINVAL\nENODEV\nENOENT\nENOMEM\nENOSPC\n"
+             "ENOSYS\nENOTDIR\nEOPNOTSUPP\nEPERM\nEXDEV\n\n"
+             "See the errno module and the fanotify_mark(2) manpage for "
+             "details.");
+
+static PyObject * inotipy_fanotify_mark(PyObject *self, PyObject *args,
+                                        PyObject *kwargs) {
+    int fd;
+    unsigned int flags;
+    // The mask is 64 bits wide, unlike the inotify one.
+    unsigned long long mask;
+    int dirfd = AT_FDCWD;
+    const char *pathname = NULL;
+    char *kwlist[] = {"fd", "flags", "mask", "dirfd", "pathname", NULL};
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "iIK|iz", kwlist, &fd,
+        &flags, &mask, &dirfd, &pathname))
+        return NULL;
+    int status = fanotify_mark(fd, flags, (uint64_t) mask, dirfd, pathname);
+    if (status == -1) SET_INOTIPY_ERRNO(self);
+    else CLR_INOTIPY_ERRNO(self);
     return PyLong_FromLong(status);
 }
 
@@ -153,8 +368,10 @@ static PyObject * inotipy__getattr__(PyObject *self, PyObject *args,
     char *kwlist[] = {"name", NULL};
     if (!PyArg_ParseTupleAndKeywords(args, kwargs, "U", kwlist, &name))
         return NULL;
-    if (PyUnicode_CompareWithASCIIString(name, "errno") == 0)
-        return PyLong_FromLong((long) _inotipy_errno);
+    if (PyUnicode_CompareWithASCIIString(name, "errno") == 0) {
+        inotipy_state *state = get_inotipy_state(self);
+        return PyLong_FromLong((long) state->_inotipy_errno);
+    }
     return PyErr_Format(PyExc_AttributeError,
                         "module \'inotipy\' has no attribute \'%U\'", name);
 }
@@ -185,6 +402,30 @@ static PyMethodDef inotipy_methods[] = {
         .ml_flags = METH_VARARGS | METH_KEYWORDS,
         .ml_doc = inotipy_inotify_rm_watch_doc
     },
+    {
+        .ml_name = "inotify_add_watches",
+        .ml_meth = (PyCFunction) inotipy_inotify_add_watches,
+        .ml_flags = METH_VARARGS | METH_KEYWORDS,
+        .ml_doc = inotipy_inotify_add_watches_doc
+    },
+    {
+        .ml_name = "inotify_rm_watches",
+        .ml_meth = (PyCFunction) inotipy_inotify_rm_watches,
+        .ml_flags = METH_VARARGS | METH_KEYWORDS,
+        .ml_doc = inotipy_inotify_rm_watches_doc
+    },
+    {
+        .ml_name = "fanotify_init",
+        .ml_meth = (PyCFunction) inotipy_fanotify_init,
+        .ml_flags = METH_VARARGS | METH_KEYWORDS,
+        .ml_doc = inotipy_fanotify_init_doc
+    },
+    {
+        .ml_name = "fanotify_mark",
+        .ml_meth = (PyCFunction) inotipy_fanotify_mark,
+        .ml_flags = METH_VARARGS | METH_KEYWORDS,
+        .ml_doc = inotipy_fanotify_mark_doc
+    },
     {
         .ml_name = "__getattr__",
         .ml_meth = (PyCFunction) inotipy__getattr__,
@@ -201,20 +442,10 @@ static PyMethodDef inotipy_methods[] = {
 
 PyDoc_STRVAR(inotipy_doc,
              "A module that provides semantically transparent access to the "
-             "Linux\n inotify(7) system call.");
-
-static PyModuleDef inotipy = {
-    .m_base = PyModuleDef_HEAD_INIT,
-    .m_name = "inotipy",
-    .m_doc = inotipy_doc,
-    .m_size = -1,
-    .m_methods = inotipy_methods
-};
-
+             "Linux\n inotify(7) system call, and to fanotify(7).");
 
-
-PyMODINIT_FUNC PyInit_inotipy(void) {
-    PyObject *module = PyModule_Create(&inotipy);
+static int inotipy_exec(PyObject *module) {
+    CLR_INOTIPY_ERRNO(module);
     int add_flag_status = 0;
     // NOTE: Always ensure that the number
     // the number of char *flags!
@@ -232,7 +463,7 @@ PyMODINIT_FUNC PyInit_inotipy(void) {
     if(add_flag_status == -1) {
         PyErr_SetString(PyExc_AttributeError,
                         "Unable to add flags to module!");
-        return NULL;
+        return -1;
     }
     int add_mask_status = 0;
     uint32_t masks[] = {
@@ -279,8 +510,93 @@ PyMODINIT_FUNC PyInit_inotipy(void) {
     if(add_mask_status == -1) {
         PyErr_SetString(PyExc_AttributeError,
                         "Unable to add masks to module!");
-        return NULL;
+        return -1;
+    }
+    int add_fan_status = 0;
+    // NOTE: Check fanotify_init(2), fanotify_mark(2) and fanotify(7). Most
+    // event bits have the same value as their IN_* counterpart.
+    unsigned long fan_values[] = {
+        // fanotify_init() flags
+        FAN_CLOEXEC, FAN_NONBLOCK, FAN_CLASS_NOTIF, FAN_CLASS_CONTENT,
+        FAN_CLASS_PRE_CONTENT, FAN_UNLIMITED_QUEUE, FAN_UNLIMITED_MARKS,
+        FAN_REPORT_TID, FAN_REPORT_FID, FAN_REPORT_DIR_FID, FAN_REPORT_NAME,
+        FAN_REPORT_DFID_NAME,
+        // fanotify_mark() flags
+        FAN_MARK_ADD, FAN_MARK_REMOVE, FAN_MARK_FLUSH, FAN_MARK_DONT_FOLLOW,
+        FAN_MARK_ONLYDIR, FAN_MARK_INODE, FAN_MARK_MOUNT,
+        FAN_MARK_FILESYSTEM, FAN_MARK_IGNORED_MASK,
+        FAN_MARK_IGNORED_SURV_MODIFY,
+        // Events
+        FAN_ACCESS, FAN_MODIFY, FAN_ATTRIB, FAN_CLOSE_WRITE,
+        FAN_CLOSE_NOWRITE, FAN_OPEN, FAN_MOVED_FROM, FAN_MOVED_TO,
+        FAN_CREATE, FAN_DELETE, FAN_DELETE_SELF, FAN_MOVE_SELF,
+        FAN_OPEN_EXEC, FAN_Q_OVERFLOW, FAN_ONDIR, FAN_EVENT_ON_CHILD,
+        // Convenience Macros
+        FAN_CLOSE, FAN_MOVE
+    };
+    const char *fan_names[] = {
+        // fanotify_init() flags
+        "FAN_CLOEXEC", "FAN_NONBLOCK", "FAN_CLASS_NOTIF", "FAN_CLASS_CONTENT",
+        "FAN_CLASS_PRE_CONTENT", "FAN_UNLIMITED_QUEUE", "FAN_UNLIMITED_MARKS",
+        "FAN_REPORT_TID", "FAN_REPORT_FID", "FAN_REPORT_DIR_FID",
+        "FAN_REPORT_NAME", "FAN_REPORT_DFID_NAME",
+        // fanotify_mark() flags
+        "FAN_MARK_ADD", "FAN_MARK_REMOVE", "FAN_MARK_FLUSH",
+        "FAN_MARK_DONT_FOLLOW", "FAN_MARK_ONLYDIR", "FAN_MARK_INODE",
+        "FAN_MARK_MOUNT", "FAN_MARK_FILESYSTEM", "FAN_MARK_IGNORED_MASK",
+        "FAN_MARK_IGNORED_SURV_MODIFY",
+        // Events
+        "FAN_ACCESS", "FAN_MODIFY", "FAN_ATTRIB", "FAN_CLOSE_WRITE",
+        "FAN_CLOSE_NOWRITE", "FAN_OPEN", "FAN_MOVED_FROM", "FAN_MOVED_TO",
+        "FAN_CREATE", "FAN_DELETE", "FAN_DELETE_SELF", "FAN_MOVE_SELF",
+        "FAN_OPEN_EXEC", "FAN_Q_OVERFLOW", "FAN_ONDIR", "FAN_EVENT_ON_CHILD",
+        // Convenience Macros
+        "FAN_CLOSE", "FAN_MOVE"
+    };
+    int fan_len = sizeof(fan_values)/sizeof(unsigned long);
+    for(int k = 0; k < fan_len && add_fan_status == 0; k++) {
+        add_fan_status = PyModule_AddIntConstant(module, fan_names[k],
+                                                 (long) fan_values[k]);
+    }
+    // Only in kernel headers from Linux 5.17 on
+#ifdef FAN_RENAME
+    if (add_fan_status == 0)
+        add_fan_status = PyModule_AddIntConstant(module, "FAN_RENAME",
+                                                 FAN_RENAME);
+#endif
+    if (add_fan_status == 0)
+        add_fan_status = PyModule_AddIntConstant(module, "AT_FDCWD",
+                                                 AT_FDCWD);
+    if(add_fan_status == -1) {
+        PyErr_SetString(PyExc_AttributeError,
+                        "Unable to add fanotify flags to module!");
+        return -1;
+    }
+    return 0;
+}
+
+static PyModuleDef_Slot inotipy_slots[] = {
+    {
+        .slot = Py_mod_exec,
+        .value = inotipy_exec
+    },
+    {
+        .slot = 0,
+        .value = NULL
     }
-    return module;
+};
+
+static PyModuleDef inotipy = {
+    .m_base = PyModuleDef_HEAD_INIT,
+    .m_name = "inotipy",
+    .m_doc = inotipy_doc,
+    .m_size = sizeof (inotipy_state),
+    .m_methods = inotipy_methods,
+    .m_slots = inotipy_slots
+};
+
+PyMODINIT_FUNC PyInit_inotipy(void) {
+    return PyModuleDef_Init(&inotipy);
 }
+#undef SET_INOTIPY_ERRNO
 #undef CLR_INOTIPY_ERRNO
@@ -0,0 +1,110 @@
+// inotipy, a transparent wrapper for the Linux inotify system call
+// Copyright (C) 2020  Aayush Agarwal
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License along
+// with this program; if not, If not, see <https://www.gnu.org/licenses/>
+
+
+// The C API of inotipyutils, for extensions that consume events without
+// building a Python object per event. The module exports a table of
+// functions as the capsule inotipyutils._C_API:
+//
+//     const InotipyUtils_CAPI *api = InotipyUtils_Import();
+//     if (!api) return NULL;
+//     PyObject *reader = api->reader_open(-1, IN_NONBLOCK);
+//     ...
+//     size_t used, offset = 0;
+//     Py_ssize_t count = api->drain_into(reader, buffer, sizeof buffer,
+//                                        &used);
+//     const struct inotify_event *event;
+//     while ((event = api->next_event(buffer, used, &offset)) != NULL)
+//         ...
+//
+// Records are handed out in the kernel layout of struct inotify_event,
+// after filtering, coalescing, rename pairing and path resolution, exactly
+// as get_batch() would hold them. Every function must be called with the
+// GIL held.
+
+#ifndef INOTIPYUTILS_H
+#define INOTIPYUTILS_H
+
+#include <Python.h>
+#include <stddef.h>
+#include <sys/inotify.h>
+
+#define INOTIPYUTILS_CAPSULE "inotipyutils._C_API"
+// Functions are only ever appended to the table, and the version is bumped
+// when they are, so an extension built against an older header keeps
+// working with a newer module.
+#define INOTIPYUTILS_API_VERSION 1
+
+typedef struct InotipyUtils_CAPI {
+    // The INOTIPYUTILS_API_VERSION the module was built with, and the size
+    // of its table.
+    unsigned int version;
+    size_t size;
+
+    // Return a new inotipyutils.Inotify reader for fd, or for a new inotify
+    // instance created with inotify_init1(flags) if fd is negative, or NULL
+    // with an exception set.
+    PyObject * (*reader_open)(int fd, int flags);
+
+    // Return the inotify descriptor of reader, or -1 with an exception set
+    // if it is not a reader or has been closed.
+    int (*reader_fd)(PyObject *reader);
+
+    // Move as many queued records as fit into the capacity bytes at buffer,
+    // back to back, and store the number of bytes written in *used. If the
+    // queue is empty, the descriptor is drained first, without the GIL,
+    // blocking if it is a blocking one. Returns the number of records, 0 if
+    // a non-blocking descriptor had nothing pending, or -1 with an
+    // exception set. The records moved out are journaled like any others.
+    Py_ssize_t (*drain_into)(PyObject *reader, char *buffer, size_t capacity,
+                             size_t *used);
+
+    // Return the record at *offset of the size bytes at buffer and move
+    // *offset past it, or return NULL once the records run out.
+    const struct inotify_event * (*next_event)(const char *buffer,
+                                               size_t size, size_t *offset);
+
+    // If record is a paired rename (both IN_MOVED_FROM and IN_MOVED_TO
+    // set), store the watch descriptor and name of its destination and
+    // return 1. Returns 0 for any other record. The name is not
+    // NUL-terminated in general; *len holds its length.
+    int (*moved_destination)(const struct inotify_event *record, int *wd,
+                             const char **name, size_t *len);
+
+    // Copy the path of the directory wd watched through add_tree() into
+    // out, NUL-terminated, and return its length. Returns -1 if wd is not
+    // part of the tree. If out cannot hold the path and its NUL, nothing
+    // is written but the length is returned all the same, so a result of
+    // size or more means out was too small. Returns -2 with an exception
+    // set if reader is not a reader.
+    Py_ssize_t (*wd_path)(PyObject *reader, int wd, char *out, size_t size);
+} InotipyUtils_CAPI;
+
+static inline const InotipyUtils_CAPI * InotipyUtils_Import(void) {
+    // Import inotipyutils and return its table, or NULL with an exception
+    // set.
+    const InotipyUtils_CAPI *api = (const InotipyUtils_CAPI *)
+        PyCapsule_Import(INOTIPYUTILS_CAPSULE, 0);
+    if (api && api->version < INOTIPYUTILS_API_VERSION) {
+        PyErr_Format(PyExc_ImportError,
+                     "inotipyutils C API version %u is older than %d",
+                     api->version, INOTIPYUTILS_API_VERSION);
+        return NULL;
+    }
+    return api;
+}
+
+#endif
@@ -1,16 +1,76 @@
-from distutils.core import setup, Extension
+import os
+import subprocess
+import sys
+from distutils.core import setup, Extension, Command
+
+
+class bench(Command):
+    description = 'build the extensions in place and run the benchmarks'
+    user_options = [
+        ('output=', 'o', 'file to write the JSON results to'),
+        ('events=', 'e', 'operations per storm'),
+        ('rounds=', 'r', 'storms per measurement'),
+    ]
+
+    def initialize_options(self):
+        self.output = 'bench-results.json'
+        self.events = None
+        self.rounds = None
+
+    def finalize_options(self):
+        pass
+
+    def run(self):
+        self.reinitialize_command('build_ext', inplace=1)
+        self.run_command('build_ext')
+        # setup() is called once per extension. The benchmark needs inotipy
+        # and inotipyutils, so it runs once inotipyutils, set up after
+        # inotipy, is built; the C API example comes later and is not used.
+        if self.distribution.get_name() != 'inotipyutils':
+            return
+        here = os.path.dirname(os.path.abspath(__file__))
+        command = [sys.executable,
+                   os.path.join(here, 'bench', 'bench_pipeline.py'),
+                   '--output', self.output]
+        if self.events:
+            command += ['--events', str(self.events)]
+        if self.rounds:
+            command += ['--rounds', str(self.rounds)]
+        # The extensions were built next to this file.
+        env = dict(os.environ)
+        env['PYTHONPATH'] = os.pathsep.join(
+            filter(None, [here, env.get('PYTHONPATH')]))
+        subprocess.check_call(command, env=env)
+        print('benchmark results written to %s' % self.output)
+
 
 inotipy_module = Extension('inotipy', sources = ['inotipy.c'])
 
-inotipy_utils_module = Extension('inotipyutils', sources = ['utils.c'])
+inotipy_utils_module = Extension('inotipyutils', sources = ['utils.c'],
+                                 depends = ['inotipyutils.h'])
+
+# Consumes inotipyutils through its C API only, so that the header and the
+# capsule are built against each other.
+inotipy_consumer_module = Extension('inotipyconsumer',
+                                    sources = ['examples/consumer.c'],
+                                    include_dirs = ['.'],
+                                    depends = ['inotipyutils.h'])
 
 setup (name = 'inotipy',
        version = '0.01a',
        description = 'inotipy, a transparent interface for the inotify system '
                      'call',
-       ext_modules = [inotipy_module])
+       ext_modules = [inotipy_module],
+       cmdclass = {'bench': bench})
 
 setup (name = 'inotipyutils',
        version = '0.01a',
        description = 'utils for inotipy',
-       ext_modules = [inotipy_utils_module])
+       ext_modules = [inotipy_utils_module],
+       cmdclass = {'bench': bench})
+
+setup (name = 'inotipyconsumer',
+       version = '0.01a',
+       description = 'an example consumer of the inotipyutils C API',
+       ext_modules = [inotipy_consumer_module],
+       cmdclass = {'bench': bench})
@@ -21,258 +21,9039 @@
 #include <Python.h>
 #include <errno.h>
 #include <unistd.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <fnmatch.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/fanotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
 #include <sys/inotify.h>
+#include <linux/futex.h>
+#include <pythread.h>
+#include "inotipyutils.h"
 
 #define INT_SIZE sizeof (int)
 #define FOUR_BYTES sizeof (uint32_t)
 #define SIXTEEN_BYTES (INT_SIZE + 3*FOUR_BYTES)
-// We work with the assumption that a filename is reasonably sized
-#define INITIAL_BUFFER_SIZE (SIXTEEN_BYTES + 128)
 // This is the linux-specific max number of bytes read() will return
 // If buffer grows bigger than this, we have a problem.
 #define MAX_READABLE_BYTES 2147479552
-// This is pretty much the largest a single inotify_event can get.
-// On ReiserFS the max file length is 4032 bytes. On sane operating systems
-// it usually does not cross 255 bytes, while reaching upto 1020 bytes on some
-// rarer systems.
-#define MAX_BUFFER_SIZE 4096
+// This is the largest a single inotify_event can get, so a read(2) of at
+// least this many bytes can never fail with EINVAL.
+#define MIN_READ_SIZE (SIXTEEN_BYTES + NAME_MAX + 1)
+// The default number of bytes drain() will pull from the kernel per call.
+#define DEFAULT_DRAIN_CAPACITY (64 * 1024)
 
-// The buffer which stores a read event.
-static char *buffer = NULL;
-// The index of a pointer to the buffer
-static int buffer_pos = -1;
-static ssize_t buffer_size = -1;
-static int _utils_errno = 0;
+// Status codes returned by the parts of the reader that run without the GIL.
+// They are turned into Python exceptions by raise_fill_error().
+#define FILL_OK 0
+#define FILL_ERRNO -1
+#define FILL_NOMEM -2
+#define FILL_EOF -3
+// Nothing was pending, and reading would have blocked while holding the lock.
+#define FILL_WOULD_BLOCK -4
+// The reader was closed, possibly by another thread while this one waited.
+#define FILL_CLOSED -5
 
-static int events_read = 0;
+typedef struct inotify_event inotify_event;
+
+// The kinds a filename pattern is compiled into. Patterns whose only
+// wildcard is a leading or trailing '*' avoid fnmatch(3) altogether.
+#define PATTERN_EXACT 0
+#define PATTERN_PREFIX 1
+#define PATTERN_SUFFIX 2
+#define PATTERN_GLOB 3
+
+typedef struct name_pattern {
+    int kind;
+    // The pattern for PATTERN_GLOB, otherwise the literal text to compare.
+    char *text;
+    size_t len;
+    // The number of events this pattern has dropped
+    unsigned long long dropped;
+} name_pattern;
+
+// A filter evaluated while the buffer is parsed, so that rejected events
+// never reach the queue. IN_Q_OVERFLOW is never filtered.
+typedef struct event_filter {
+    // Only events sharing a bit with allow_mask are kept, unless it is 0.
+    uint32_t allow_mask;
+    // Events sharing a bit with deny_mask are dropped.
+    uint32_t deny_mask;
+    // Sorted watch descriptors to keep, or NULL to keep all of them.
+    int *wds;
+    Py_ssize_t wds_len;
+    // Events whose name matches any of these are dropped.
+    name_pattern *patterns;
+    Py_ssize_t patterns_len;
+    // The number of events dropped by each of the rules above
+    unsigned long long dropped_allow_mask;
+    unsigned long long dropped_deny_mask;
+    unsigned long long dropped_wd;
+} event_filter;
+
+// Markers for slots of a watch_tree that hold no watch descriptor
+#define TREE_EMPTY -1
+#define TREE_DELETED -2
+// The events that walking and rescanning a tree cause on its own
+// directories, once on the directory and once on its parent. They are never
+// watched on the directories of a tree: a walk of a large idle tree would
+// overflow the kernel queue with them alone.
+#define TREE_SELF_EVENTS (IN_OPEN | IN_ACCESS | IN_CLOSE_NOWRITE)
+// The events a tree needs to see to follow its directories, whatever mask
+// they are watched with. IN_CREATE and IN_MOVED_TO are delivered either way;
+// the others only if they were asked for.
+#define TREE_EVENTS (IN_CREATE | IN_MOVED_FROM | IN_MOVED_TO | IN_MOVE_SELF)
+
+// What a snapshot records about one entry of a directory.
+typedef struct snap_entry {
+    // FNV-1a of the name. The slot is empty if name is NULL.
+    uint64_t hash;
+    char *name;
+    size_t name_len;
+    // The inode, or 0 if the entry was learnt from an event and has not
+    // been looked at since.
+    uint64_t ino;
+    int64_t mtime_ns;
+    int64_t size;
+    uint32_t flags;
+} snap_entry;
+
+// Flags of a snap_entry
+#define SNAP_DIR 1
+// Set while a rescan looks for the entry on disk.
+#define SNAP_SEEN 2
+
+// The entries of one directory, in an open-addressing hash table keyed by
+// name.
+typedef struct snap_dir {
+    snap_entry *entries;
+    // A power of two.
+    size_t capacity;
+    size_t count;
+} snap_dir;
+
+typedef struct wd_entry {
+    int wd;
+    // The path of the watched directory, without a trailing slash.
+    char *path;
+    size_t len;
+    // What the directory held when it was last scanned, kept up to date by
+    // the creations, deletions and renames seen since. NULL unless the
+    // reader keeps snapshots.
+    snap_dir *snap;
+    // The tick of the watch_tree when the directory last had an event.
+    unsigned long long active;
+    // Set once the watch was removed to stay within the watch budget, or
+    // because the directory left the tree. The entry lives on until its
+    // IN_IGNORED event arrives.
+    int evicted;
+    // Set once the directory was moved out of the tree. Its events are
+    // dropped until then.
+    int detached;
+} wd_entry;
+
+// A directory whose watch was given up to stay within the watch budget,
+// and which is polled with stat(2) instead.
+typedef struct polled_dir {
+    char *path;
+    size_t len;
+    // The inode and mtime of the directory when it was last looked at
+    uint64_t ino;
+    int64_t mtime_ns;
+    // What it held then, or NULL if it could not be read.
+    snap_dir *snap;
+} polled_dir;
+
+// Caps the number of watches a watch_tree holds. Past the limit, the least
+// recently active directories are polled instead, and they are watched
+// again as soon as they change.
+typedef struct watch_budget {
+    // The most watches the tree may hold, lowered to what the tree held
+    // when inotify_add_watch() first failed with ENOSPC.
+    size_t limit;
+    // /proc/sys/fs/inotify/max_user_watches when the budget was set
+    size_t max_user_watches;
+    // Polled directories are looked at every interval nanoseconds by the
+    // reads that come along, and by poll_watches().
+    uint64_t interval;
+    uint64_t last_poll;
+    polled_dir *polled;
+    size_t polled_len;
+    size_t polled_capacity;
+    unsigned long long evicted;
+    unsigned long long rearmed;
+    unsigned long long polls;
+    unsigned long long enospc;
+} watch_budget;
+
+// A watched directory, ordered by when it last had an event for eviction.
+typedef struct lru_entry {
+    unsigned long long active;
+    int wd;
+} lru_entry;
+
+// A directory of the tree renamed by an IN_MOVED_FROM whose IN_MOVED_TO
+// has not been seen. If its IN_MOVE_SELF, or the end of the next read,
+// comes first, it has left the tree.
+typedef struct tree_move {
+    uint32_t cookie;
+    char *path;
+    size_t len;
+    // Set once a read ended with the move still pending.
+    int stale;
+} tree_move;
+
+// The directories watched through add_tree(), in an open-addressing hash
+// table keyed by watch descriptor. Events on them have their name replaced
+// by the full path while the buffer is parsed.
+typedef struct watch_tree {
+    wd_entry *slots;
+    // A power of two, or 0 until the first directory is added.
+    size_t capacity;
+    size_t count;
+    size_t tombstones;
+    // The mask new subdirectories are watched with.
+    uint32_t mask;
+    // The bits of mask that only the tree asked for, whose events are not
+    // delivered.
+    uint32_t quiet;
+    // The number of watches added, and the number of directories that could
+    // not be watched, since the reader was created.
+    unsigned long long added;
+    unsigned long long failed;
+    // Non-zero if every directory has a snapshot, so that what was lost to
+    // an IN_Q_OVERFLOW can be found again by rescanning them.
+    int snapshots;
+    // Set by an IN_Q_OVERFLOW until the rescan it calls for has run.
+    int rescan_due;
+    // The number of rescans, and of events they have queued.
+    unsigned long long rescans;
+    unsigned long long synthesized;
+    // Bumped for every event on the tree, to order directories by activity.
+    unsigned long long ticks;
+    // The number of entries that are evicted
+    size_t evicting;
+    // The watch budget, or NULL to watch every directory.
+    watch_budget *budget;
+    // Directories created in, or moved into, the tree while parsing. They
+    // are walked by reader_unlock(), once the reader lock is released.
+    // follow_created is set for the ones that were created, whose entries
+    // are reported as created once they are walked.
+    char **follow;
+    size_t *follow_lens;
+    int *follow_created;
+    size_t follow_len;
+    size_t follow_capacity;
+    // The descriptor they are watched through.
+    int follow_fd;
+    // Renames of directories of the tree waiting for their IN_MOVED_TO.
+    tree_move *moves;
+    size_t moves_len;
+    size_t moves_capacity;
+} watch_tree;
+
+// The directories found by one walk, collected without holding the reader
+// lock and merged into the watch_tree afterwards.
+typedef struct tree_walk {
+    int *wds;
+    char **paths;
+    size_t *lens;
+    size_t len;
+    size_t capacity;
+    unsigned long long failed;
+    // The errno of the first failure, or 0.
+    int error;
+    // The watches the walk may still add. Without a watch budget, this is
+    // SIZE_MAX.
+    size_t room;
+    // With a watch budget, directories that get no watch are collected
+    // with a wd of -1 to be polled, and the walk goes on.
+    int poll;
+    size_t polled;
+    // Set if inotify_add_watch() failed with ENOSPC.
+    int enospc;
+    // Set to take a snapshot of every directory watched, kept in snaps
+    // next to its path until it is merged.
+    int snapshots;
+    snap_dir **snaps;
+} tree_walk;
+
+// The event queue. Events are copied out of the read buffer back to back, in
+// their kernel layout, into one growable arena. Consumed events are reclaimed
+// in bulk: once the queue runs empty, head and tail simply rewind to 0.
+typedef struct iel_arena {
+    char *data;
+    // The offset of the oldest event in the queue
+    size_t head;
+    // The offset one past the newest event in the queue
+    size_t tail;
+    // The number of bytes allocated for data
+    size_t capacity;
+    // The offset of the newest event in the queue
+    size_t last;
+    // The number of consumed events still in data, which is also the
+    // ordinal of the oldest event.
+    size_t first;
+    // Bumped whenever records move or are released, so that offsets and
+    // ordinals taken earlier can be told apart from current ones.
+    unsigned long long generation;
+    // While coalescing, the number of raw events every record stands for,
+    // indexed by ordinal. NULL otherwise.
+    uint32_t *counts;
+    size_t counts_capacity;
+} iel_arena;
+
+// Markers for the generation of coalesce_entry slots that hold no record.
+// Queue generations start above them.
+#define COALESCE_EMPTY 0
+#define COALESCE_FORGOTTEN 1
+#define COALESCE_FIRST_GENERATION 2
+
+// The classes of events that are coalesced. Everything else, such as
+// IN_CREATE, IN_DELETE and the IN_MOVED_* pair, is delivered as-is.
+#define COALESCE_NONE 0
+#define COALESCE_CONTENT 1
+#define COALESCE_METADATA 2
+#define COALESCE_ACCESS 3
+
+// A record in the queue that later events of the same class on the same
+// (wd, name) are merged into.
+typedef struct coalesce_entry {
+    uint64_t hash;
+    // The queue generation the record was queued in, or a marker.
+    unsigned long long generation;
+    // The offset and ordinal of the record in the queue
+    size_t offset;
+    size_t ordinal;
+    // When the record was queued, in CLOCK_MONOTONIC nanoseconds
+    uint64_t stamp;
+    int wd;
+    uint32_t cls;
+} coalesce_entry;
+
+// The coalescing stage, an open-addressing hash set keyed on (wd, name,
+// class) that points at records which are still queued.
+typedef struct coalescer {
+    coalesce_entry *slots;
+    // A power of two
+    size_t capacity;
+    // The number of slots that are not COALESCE_EMPTY
+    size_t used;
+    // Events are merged into records queued at most this many nanoseconds
+    // earlier, or into any queued record if it is 0.
+    uint64_t window;
+    // The number of events seen, and how many of those were merged.
+    unsigned long long raw;
+    unsigned long long merged;
+} coalescer;
+
+// Markers for slots of a move_pairer index that hold no position
+#define PAIR_EMPTY ((size_t) -1)
+#define PAIR_DELETED ((size_t) -2)
+
+// An IN_MOVED_FROM event waiting for the IN_MOVED_TO with the same cookie.
+typedef struct pending_move {
+    // A copy of the event as it was read, or NULL once it has been paired.
+    inotify_event *event;
+    // The path of its directory if it was added with add_tree(), or NULL.
+    char *dir;
+    size_t dir_len;
+    // The read it arrived in, and when, in CLOCK_MONOTONIC nanoseconds.
+    unsigned long long read;
+    uint64_t stamp;
+} pending_move;
+
+// The rename pairing stage. Pending halves are kept in arrival order, which
+// is also the order they expire in, and indexed by cookie in an
+// open-addressing hash table of positions in that list.
+typedef struct move_pairer {
+    pending_move *moves;
+    // The halves still pending are moves[head] to moves[len - 1].
+    size_t head;
+    size_t len;
+    size_t capacity;
+    size_t *index;
+    // A power of two
+    size_t index_capacity;
+    // The number of index slots that are not PAIR_EMPTY
+    size_t index_used;
+    // Unpaired halves are queued as they are once this many more reads
+    // have gone by, or once they have waited timeout nanoseconds (unless
+    // timeout is 0).
+    int max_reads;
+    uint64_t timeout;
+    // The number of reads parsed so far
+    unsigned long long reads;
+    unsigned long long paired;
+    unsigned long long flushed;
+} move_pairer;
+
+// What the drain thread does with events that do not fit in the ring
+#define RING_BLOCK 0
+#define RING_DROP 1
+// The smallest ring, which still holds a few of the largest events.
+#define MIN_RING_CAPACITY 4096
+
+// A single-producer, single-consumer ring of raw events in their kernel
+// layout. The drain thread reads the inotify descriptor into it without
+// touching the GIL or the reader lock, and whoever holds the reader lock
+// moves its contents into the queue. head and tail only ever grow; they
+// are reduced modulo capacity to index data.
+typedef struct drain_ring {
+    char *data;
+    // A power of two
+    size_t capacity;
+    // The bytes written by the thread, and consumed by the reader.
+    _Atomic size_t head;
+    _Atomic size_t tail;
+    int policy;
+    // The inotify descriptor, an eventfd that stops the thread and one
+    // the reader signals after making room while the thread waits for it.
+    int fd;
+    int stop_fd;
+    int space_fd;
+    // The eventfd the thread signals after queueing events, owned by the
+    // reader.
+    int wake_fd;
+    pthread_t thread;
+    // The buffer the thread reads into
+    char *chunk;
+    size_t chunk_size;
+    // Set when the thread is asked to stop.
+    _Atomic int stopping;
+    // Set while the thread waits for room, so the reader signals space_fd.
+    _Atomic int waiting;
+    // Set when events were dropped, until the reader reports it.
+    _Atomic int overflowed;
+    // The errno that made the thread exit, or 0 while it runs.
+    _Atomic int error;
+    // Written by the thread only: the largest number of bytes the ring
+    // has held, and the number of records, bytes and read(2) calls it has
+    // handled, of records dropped and of waits for room.
+    _Atomic size_t high_water;
+    _Atomic unsigned long long records;
+    _Atomic unsigned long long bytes;
+    _Atomic unsigned long long reads;
+    _Atomic unsigned long long dropped;
+    _Atomic unsigned long long stalls;
+} drain_ring;
+
+// The file a shared ring lives in starts with a shared_header, followed by
+// one shared_cursor per subscriber slot and, at data_offset, the records in
+// their kernel layout. It is only ever mapped on the machine that made it,
+// so everything is in native byte order.
+#define SHARED_MAGIC "inotipy\x02"
+#define SHARED_VERSION 1
+#define MAX_SHARED_SUBSCRIBERS 1024
+// The longest a subscriber sleeps before it looks whether the publisher
+// is still alive.
+#define SHARED_CHECK_NS 1000000000L
+
+typedef struct shared_header {
+    char magic[8];
+    uint32_t version;
+    // The number of shared_cursor slots.
+    uint32_t subscribers;
+    // The bytes of records the ring holds, a power of two, and where they
+    // start in the file.
+    uint64_t capacity;
+    uint64_t data_offset;
+    // RING_BLOCK or RING_DROP
+    uint32_t policy;
+    // The publishing process, or 0 once it has stopped.
+    _Atomic int32_t publisher;
+    // The bytes published so far. reserved runs ahead of head while records
+    // are copied in, so that a subscriber can tell whether what it copied
+    // out was overwritten meanwhile.
+    _Atomic uint64_t head;
+    _Atomic uint64_t reserved;
+    _Atomic uint64_t records;
+    // Bumped after every publish. Subscribers sleep on it with futex(2),
+    // and sleepers tells the publisher whether anybody needs waking.
+    _Atomic uint32_t wake_seq;
+    _Atomic uint32_t sleepers;
+} shared_header;
+
+// The read position of one subscriber, on a cache line of its own.
+typedef struct shared_cursor {
+    // The subscribing process, or 0 if the slot is free.
+    _Atomic int32_t pid;
+    uint32_t unused;
+    _Atomic uint64_t position;
+    // The number of times the subscriber fell a whole ring behind.
+    _Atomic uint64_t overruns;
+    char padding[40];
+} shared_cursor;
+
+// The publishing side of a shared ring.
+typedef struct shared_ring {
+    shared_header *header;
+    shared_cursor *cursors;
+    char *data;
+    size_t map_size;
+    // The file the ring lives in, removed when publishing stops.
+    char *path;
+    unsigned long long published;
+    // The number of publish() calls that left records queued because a
+    // subscriber had not read far enough ('block' policy only).
+    unsigned long long held_back;
+} shared_ring;
+
+// A journal is a directory of segment files, each named after the sequence
+// number of its first event in 16 hex digits with ".seg" appended, and
+// each with a sparse index next to it in a file ending in ".idx". A segment
+// is a journal_segment header followed by blocks: a journal_block header,
+// then up to index_every records in their kernel layout, all delivered at
+// the time of the block. The index holds a journal_index entry for the
+// first block starting at least index_every events after the previous
+// entry. Everything is in native byte order.
+#define JOURNAL_MAGIC "inotipyj"
+#define JOURNAL_VERSION 1
+// The smallest segment, which holds the largest record with room to spare.
+#define MIN_JOURNAL_SEGMENT (64 * 1024)
+// Records appended within this long of the start of the last block join
+// it instead of starting a new one.
+#define JOURNAL_BLOCK_NS 1000000L
+
+typedef struct journal_segment {
+    char magic[8];
+    uint32_t version;
+    uint32_t index_every;
+    uint64_t first_seq;
+    // The time of the first block, or 0 while there is none.
+    int64_t first_time;
+    // The events in the segment and the bytes in use, header included.
+    // The writer stores them after the records they cover.
+    _Atomic uint64_t count;
+    _Atomic uint64_t end;
+    // Set once the writer has moved on to the next segment.
+    _Atomic uint32_t sealed;
+    uint32_t unused;
+} journal_segment;
+
+typedef struct journal_block {
+    uint64_t first_seq;
+    // CLOCK_REALTIME, in nanoseconds
+    int64_t time_ns;
+    uint32_t count;
+    uint32_t bytes;
+} journal_block;
+
+typedef struct journal_index {
+    uint64_t seq;
+    int64_t time_ns;
+    // The offset of the block in the segment
+    uint64_t offset;
+} journal_index;
+
+// The writing side of a journal.
+typedef struct event_journal {
+    char *directory;
+    size_t segment_size;
+    uint32_t index_every;
+    // The segment being written, mapped whole, its descriptor and the
+    // descriptor of its index.
+    journal_segment *segment;
+    int segment_fd;
+    int index_fd;
+    // The offset of the block records are added to, or 0 for none.
+    uint64_t block;
+    // The sequence number of the next event, and of the last block put in
+    // the index of the segment, if there is one.
+    uint64_t next_seq;
+    uint64_t indexed_seq;
+    int indexed;
+    unsigned long long events;
+    unsigned long long bytes;
+    unsigned long long segments;
+    unsigned long long index_entries;
+    // The errno that stopped the journal, or 0, and the number of events
+    // delivered since that were not journaled.
+    int error;
+    unsigned long long dropped;
+} event_journal;
+
+// The number of buckets in the delivery latency histogram. Bucket 0 counts
+// deliveries under a microsecond and bucket i those under 2**i microseconds
+// that did not fit in bucket i - 1; the last one takes everything longer.
+#define LATENCY_BUCKETS 32
+
+// What a reader has done so far. These are plain counters, updated with the
+// reader lock held, so keeping them costs next to nothing.
+typedef struct reader_stats {
+    // read(2) calls on the descriptor and the bytes they returned. The
+    // drain thread's reads are reported by ring_stats() instead.
+    unsigned long long reads;
+    unsigned long long bytes;
+    // Events parsed, of which filtered ones were dropped by the filter and
+    // overflows were IN_Q_OVERFLOW.
+    unsigned long long events;
+    unsigned long long filtered;
+    unsigned long long overflows;
+    // The number of times the buffer and the queue had to be grown.
+    unsigned long long buffer_regrowths;
+    unsigned long long queue_regrowths;
+    // The longest the queue has been.
+    ssize_t peak_queue;
+    // When the oldest events still queued were read (monotonic
+    // nanoseconds), or 0 if the queue is empty.
+    uint64_t queued_at;
+    // How long events waited between read(2) and being handed to Python.
+    unsigned long long latency[LATENCY_BUCKETS];
+} reader_stats;
+
+// The number of slots in the name cache of a reader.
+#define NAME_CACHE_SLOTS 256
+
+// A name decoded for a given watch descriptor.
+typedef struct name_slot {
+    uint64_t hash;
+    int wd;
+    // A copy of the raw name, to tell names whose hashes collide apart.
+    char *raw;
+    size_t len;
+    size_t raw_capacity;
+    // The decoded, interned str, or NULL if the slot is empty.
+    PyObject *name;
+} name_slot;
+
+// A direct-mapped cache of decoded names keyed by (wd, hash of the raw
+// name), so that a storm on the same few files decodes each name once and
+// every event shares one str object. It is only used while Python objects
+// are built, so it is guarded by the GIL rather than the reader lock.
+typedef struct name_cache {
+    name_slot slots[NAME_CACHE_SLOTS];
+    unsigned long long hits;
+    unsigned long long misses;
+} name_cache;
+
+// The number of slots in the path cache of a Fanotify reader.
+#define FAN_PATH_SLOTS 4096
+// The smallest read(2) on a fanotify descriptor. A read too short for the
+// next event fails with EINVAL, and events that carry a file handle and a
+// name run longer than MIN_READ_SIZE.
+#define FAN_READ_SIZE 4096
+
+// The path of a directory, looked up by the file handle the kernel reports
+// for it.
+typedef struct fan_path {
+    uint64_t hash;
+    // The fsid followed by the struct file_handle, or NULL if the slot is
+    // empty.
+    char *key;
+    size_t key_len;
+    char *path;
+    size_t len;
+} fan_path;
+
+// A filesystem marked by a Fanotify reader. Its events carry the position
+// of this entry plus one as their watch descriptor.
+typedef struct fan_mount {
+    // The fsid events on it are reported with
+    char fsid[8];
+    // A descriptor of the marked path, for open_by_handle_at(2)
+    int fd;
+} fan_mount;
+
+// What turns the events of a fanotify descriptor into inotify records.
+typedef struct fan_state {
+    fan_mount *mounts;
+    size_t mounts_len;
+    // A direct-mapped cache of resolved directories, keyed by handle.
+    fan_path paths[FAN_PATH_SLOTS];
+    // The events of the last read, as the kernel wrote them.
+    char *raw;
+    size_t raw_capacity;
+    // The cookie of the last FAN_RENAME split into a pair of records
+    uint32_t cookie;
+    unsigned long long hits;
+    unsigned long long misses;
+    // Handles that could not be turned into a path, and the number of
+    // times cached paths were dropped after a directory moved.
+    unsigned long long unresolved;
+    unsigned long long flushes;
+} fan_state;
+
+// An inotify reader. Every reader owns its own buffer, queue and counters, so
+// any number of inotify file descriptors can be in flight at once.
+typedef struct {
+    PyObject_HEAD
+    // The inotify file descriptor, or -1 once it has been closed.
+    int fd;
+    // Non-zero if fd was created by this reader and is closed along with it.
+    int owns_fd;
+    // Set by close(), under lock, so that threads that were waiting on fd
+    // give up instead of reading whatever now has its number.
+    int closed;
+    // The number of add_tree() and follow walks adding watches through fd
+    // without the lock. close() waits for them before it closes fd.
+    _Atomic uint32_t walkers;
+    // The buffer which stores the events read by the last read() or drain().
+    // It is only ever grown, never freed between calls, so that a burst of
+    // events does not turn into a burst of allocations.
+    char *buffer;
+    // The number of bytes allocated for buffer
+    size_t buffer_capacity;
+    // The index of a pointer to the buffer
+    ssize_t buffer_pos;
+    // The number of bytes in buffer that hold events
+    ssize_t buffer_size;
+    int _utils_errno;
+    int events_read;
+    iel_arena queue;
+    ssize_t iel_length;
+    // Guards the buffer and the queue. read() and drain() hold it without the
+    // GIL while they call read(2) and parse, so every other method that
+    // touches them must hold it too. It is never held while waiting for
+    // events to arrive.
+    PyThread_type_lock lock;
+    // The filter applied while parsing, or NULL. Guarded by lock.
+    event_filter *filter;
+    // The directories added with add_tree(). Guarded by lock.
+    watch_tree tree;
+    // The coalescing stage, or NULL. Guarded by lock.
+    coalescer *coalesce;
+    // The rename pairing stage, or NULL. Guarded by lock.
+    move_pairer *pairer;
+    // The ring filled by the drain thread, or NULL if it is not running.
+    // Guarded by lock.
+    drain_ring *ring;
+    // The eventfd the drain thread signals, and close() signals to wake the
+    // threads waiting on fd, or -1 until one of them first needs it.
+    int wake_fd;
+    // The Stream waiting on the event loop for this reader, or NULL. The
+    // loop keeps it alive while it waits.
+    PyObject *waiting_stream;
+    // Guarded by lock.
+    reader_stats stats;
+    // Allocated on first use. Guarded by the GIL.
+    name_cache *names;
+    // The ring events are published into, or NULL. Guarded by lock.
+    shared_ring *shared;
+    // The journal delivered events are appended to, or NULL. Guarded by
+    // lock.
+    event_journal *journal;
+    // Set for Fanotify readers only. Guarded by lock.
+    fan_state *fan;
+} InotifyObject;
+
+typedef struct {
+    PyTypeObject *inotify_type;
+    PyTypeObject *poller_type;
+    PyTypeObject *batch_type;
+    PyTypeObject *event_type;
+    PyTypeObject *columns_type;
+    PyTypeObject *column_type;
+    PyTypeObject *stream_type;
+    PyTypeObject *subscriber_type;
+    PyTypeObject *replay_type;
+    PyTypeObject *fanotify_type;
+    // asyncio.get_running_loop, imported on first use by a Stream.
+    PyObject *get_running_loop;
+    // The reader behind the module-level read(), get_event() etc.
+    InotifyObject *default_reader;
+} utils_state;
+
+static PyModuleDef inotipy_utils;
+
+static inline utils_state * get_utils_state(PyObject *module) {
+    return (utils_state *) PyModule_GetState(module);
+}
+
+static int buffer_reserve(InotifyObject *reader, size_t bytes);
+static void buffer_reset(InotifyObject *reader);
+static ssize_t pending_bytes(int fd);
+static ssize_t _inotify_read(InotifyObject *reader, int fd, size_t offset,
+                             size_t bytes);
+static int parse_buffer(InotifyObject *reader, int fd);
+static int filter_rejects(event_filter *filter, inotify_event *event);
+static void filter_free(event_filter *filter);
+static inotify_event * extract_event_data(InotifyObject *reader);
+static int queue_reserve(InotifyObject *reader, size_t bytes);
+static int add_event_to_queue(InotifyObject *reader, inotify_event *event);
+static int add_event_with_path(InotifyObject *reader, inotify_event *event,
+                               const char *dir, size_t dir_len);
+static wd_entry * tree_find(watch_tree *tree, int wd);
+static void tree_remove(watch_tree *tree, int wd);
+static void tree_follow(InotifyObject *reader, int fd, const char *dir,
+                        size_t dir_len, const char *name, size_t name_len,
+                        int created);
+static int snap_queue(InotifyObject *reader, int wd, const char *dir,
+                      size_t dir_len, snap_entry *entry, uint32_t mask);
+static void tree_note(InotifyObject *reader, int fd, wd_entry *dir,
+                      inotify_event *event);
+static void tree_settle_moves(InotifyObject *reader, int fd);
+static void tree_free(watch_tree *tree);
+static void snap_free(snap_dir *snap);
+static int snap_scan(const char *path, snap_dir **snap);
+static void snap_note(InotifyObject *reader, wd_entry *dir,
+                      inotify_event *event);
+static long tree_rescan(InotifyObject *reader, int fd);
+static void walk_budget(watch_tree *tree, tree_walk *walk);
+static int budget_add(watch_budget *budget, char *path, size_t len,
+                      snap_dir *snap);
+static void budget_settle(InotifyObject *reader, int fd, int enospc);
+static int budget_due(watch_budget *budget);
+static long budget_poll(InotifyObject *reader, int fd);
+static void budget_free(watch_budget *budget);
+static void polled_free(polled_dir *dir);
+static void tree_follow_pending(InotifyObject *reader);
+static uint64_t monotonic_ns(void);
+static int coalesce_merge(InotifyObject *reader, inotify_event *event,
+                          wd_entry *dir, uint32_t cls, uint64_t hash,
+                          uint64_t now);
+static void coalesce_note(InotifyObject *reader, inotify_event *event,
+                          uint32_t cls, uint64_t hash, uint64_t now);
+static uint32_t coalesce_class(uint32_t mask);
+static uint64_t coalesce_hash(int wd, uint32_t cls, inotify_event *event);
+static void coalesce_free(coalescer *coalesce);
+static inotify_event * queue_peek(InotifyObject *reader);
+static void queue_consume(InotifyObject *reader, inotify_event *event);
+static void queue_rewind(iel_arena *queue);
+static uint32_t queue_head_count(InotifyObject *reader);
+static PyObject * decode_name(InotifyObject *reader, int wd, const char *raw,
+                              size_t len);
+static PyObject * event_name(InotifyObject *reader, inotify_event *event);
+static PyObject * build_tuple(InotifyObject *reader, inotify_event *event);
+static PyObject * build_record_tuple(InotifyObject *reader,
+                                     inotify_event *event, uint32_t count);
+static int pair_move(InotifyObject *reader, inotify_event *event,
+                     wd_entry *dir, uint64_t now);
+static int pairer_flush(InotifyObject *reader, int all, uint64_t now);
+static void pairer_settle(InotifyObject *reader);
+static void reader_settle(InotifyObject *reader);
+static void stats_queued(InotifyObject *reader);
+static void stats_delivered(InotifyObject *reader);
+static int ring_fill(InotifyObject *reader, long *syscalls, size_t *bytes);
+static int reader_check_open(InotifyObject *reader);
+static void pairer_free(move_pairer *pairer);
+static int moved_destination(inotify_event *record, int *wd,
+                             const char **name, size_t *len);
+static PyObject * get_event_tuple(InotifyObject *reader);
+static PyObject * reader_get_batch(InotifyObject *reader);
+static PyObject * reader_get_columns(InotifyObject *reader);
+static PyObject * reader_events(InotifyObject *reader, Py_ssize_t capacity);
+static void stream_abort(PyObject *stream);
+static void journal_append(event_journal *journal, const char *data,
+                           Py_ssize_t count);
+static int fan_translate(InotifyObject *reader, size_t *size,
+                         long *syscalls);
+static int futex_wake(_Atomic uint32_t *word);
+static int futex_wait(_Atomic uint32_t *word, uint32_t value,
+                      const struct timespec *timeout);
+
+static void reader_lock(InotifyObject *reader) {
+    // Acquire the reader lock, dropping the GIL if another thread holds it.
+    if (!PyThread_acquire_lock(reader->lock, NOWAIT_LOCK)) {
+        Py_BEGIN_ALLOW_THREADS
+        PyThread_acquire_lock(reader->lock, WAIT_LOCK);
+        Py_END_ALLOW_THREADS
+    }
+}
+
+static void reader_unlock(InotifyObject *reader) {
+    // Release the reader lock, then watch the directories the tree found
+    // meanwhile, without the GIL. The caller must hold the GIL.
+    int follow = reader->tree.follow_len > 0 && !reader->closed;
+    PyThread_release_lock(reader->lock);
+    if (follow) {
+        Py_BEGIN_ALLOW_THREADS
+        tree_follow_pending(reader);
+        Py_END_ALLOW_THREADS
+    }
+}
+
+static int reader_fill(InotifyObject *reader, int fd, size_t capacity,
+                       int max_reads, long *syscalls, size_t *bytes) {
+    // Fill the buffer with up to capacity bytes of pending events, using at
+    // most max_reads read(2) calls (0 for as many as it takes), and queue
+    // them. Returns one of the FILL_* status codes.
+    // Runs without the GIL; the caller must hold the reader lock.
+    // WARNING: Any previous contents of the buffer will be overwritten!
+    buffer_reset(reader);
+    size_t size = 0;
+    int reads = 0;
+    while (size < capacity && (max_reads == 0 || reads < max_reads)) {
+        // Size every read from the number of bytes the kernel has queued, so
+        // that everything that is pending is picked up in one read(2).
+        ssize_t pending = pending_bytes(fd);
+        (*syscalls)++;
+        // Stop once the kernel queue is empty. If nothing has been read yet,
+        // a blocking descriptor must be waited on without holding the lock.
+        if (pending == 0) {
+            if (size > 0) break;
+            int flags = fcntl(fd, F_GETFL);
+            (*syscalls)++;
+            if (flags != -1 && !(flags & O_NONBLOCK)) return FILL_WOULD_BLOCK;
+        }
+        size_t want = (pending > 0) ? (size_t) pending : 0;
+        if (want < MIN_READ_SIZE) want = MIN_READ_SIZE;
+        if (want > capacity - size) {
+            // Whatever does not fit is left for the next call.
+            if (size > 0) break;
+            want = capacity;
+        }
+        if (reader->fan && want < FAN_READ_SIZE) want = FAN_READ_SIZE;
+        if (buffer_reserve(reader, size + want) == -1) return FILL_NOMEM;
+        ssize_t bytes_read = _inotify_read(reader, fd, size, want);
+        (*syscalls)++;
+        reads++;
+        if (bytes_read == -1) {
+            // Events that were already read must not be lost to an error
+            // reported by a later read.
+            if (size > 0) break;
+            return FILL_ERRNO;
+        }
+        if (bytes_read == 0) break;
+        size += (size_t) bytes_read;
+    }
+    *bytes = size;
+    if (size == 0) return FILL_EOF;
+    // fanotify events are rewritten as inotify records before parsing.
+    if (reader->fan && fan_translate(reader, &size, syscalls) == -1)
+        return FILL_NOMEM;
+    reader->buffer_size = (ssize_t) size;
+    reader->buffer_pos = 0;
+    // One or more events have been read, now add them to the event queue
+    if (parse_buffer(reader, fd) == -1) return FILL_NOMEM;
+    return FILL_OK;
+}
+
+static int wait_readable(int fd, int wake_fd,
+                         const struct timespec *deadline) {
+    // Block until fd or wake_fd (unless it is -1) is readable or the
+    // monotonic deadline passes. A NULL deadline waits forever. Returns 1
+    // if readable, 0 on timeout and -1 with errno set on failure, including
+    // EINTR.
+    // Runs without the GIL.
+    struct pollfd pfd[2] = {
+        { .fd = fd, .events = POLLIN, .revents = 0 },
+        { .fd = wake_fd, .events = POLLIN, .revents = 0 }
+    };
+    struct timespec remaining;
+    struct timespec *timeout = NULL;
+    if (deadline) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        remaining.tv_sec = deadline->tv_sec - now.tv_sec;
+        remaining.tv_nsec = deadline->tv_nsec - now.tv_nsec;
+        if (remaining.tv_nsec < 0) {
+            remaining.tv_sec--;
+            remaining.tv_nsec += 1000000000L;
+        }
+        if (remaining.tv_sec < 0) remaining.tv_sec = remaining.tv_nsec = 0;
+        timeout = &remaining;
+    }
+    int ready = ppoll(pfd, wake_fd >= 0 ? 2 : 1, timeout, NULL);
+    // fd may have been closed by the time wake_fd is signalled.
+    if (ready > 0 && pfd[1].revents) return 1;
+    if (ready > 0 && (pfd[0].revents & POLLNVAL)) {
+        errno = EBADF;
+        return -1;
+    }
+    return ready;
+}
+
+static int parse_timeout(PyObject *timeout, struct timespec *deadline) {
+    // Turn a timeout in seconds (None for forever) into a monotonic
+    // deadline. Returns 1 if a deadline was set, 0 for None and -1 on error.
+    if (timeout == Py_None) return 0;
+    double seconds = PyFloat_AsDouble(timeout);
+    if (seconds == -1.0 && PyErr_Occurred()) return -1;
+    if (seconds < 0) seconds = 0;
+    if (seconds > (double) INT_MAX) {
+        PyErr_SetString(PyExc_OverflowError, "timeout is too large");
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    time_t whole = (time_t) seconds;
+    deadline->tv_sec += whole;
+    deadline->tv_nsec += (long) ((seconds - (double) whole) * 1e9);
+    if (deadline->tv_nsec >= 1000000000L) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000L;
+    }
+    return 1;
+}
+
+static int wait_with_signals(int fd, int wake_fd,
+                             const struct timespec *deadline) {
+    // wait_readable() with the GIL released, retrying on EINTR unless a
+    // signal handler raised. Returns 1, 0 or -1 with an exception set.
+    int ready;
+    for (;;) {
+        Py_BEGIN_ALLOW_THREADS
+        ready = wait_readable(fd, wake_fd, deadline);
+        Py_END_ALLOW_THREADS
+        if (ready != -1) return ready;
+        if (errno != EINTR) {
+            PyErr_SetFromErrno(PyExc_OSError);
+            return -1;
+        }
+        if (PyErr_CheckSignals() == -1) return -1;
+    }
+}
+
+static PyObject * raise_fill_error(InotifyObject *reader, int status) {
+    // Raise the exception that corresponds to a FILL_* status code.
+    switch (status) {
+        case FILL_NOMEM:
+            return PyErr_NoMemory();
+        case FILL_EOF:
+            PyErr_SetString(PyExc_EOFError, "No new events were found!");
+            return NULL;
+        case FILL_CLOSED:
+            PyErr_SetString(PyExc_ValueError,
+                            "I/O operation on closed inotify instance");
+            return NULL;
+        default:
+            errno = reader->_utils_errno;
+            return PyErr_SetFromErrno(PyExc_OSError);
+    }
+}
+
+static int reader_wake_fd(InotifyObject *reader) {
+    // Return wake_fd, creating it on first use, for a thread that is about
+    // to wait on the descriptor itself. A wakeup left over from a drain
+    // thread is cleared, so that only close() can signal it from now on.
+    // Returns -1 with errno set on failure. The caller must hold the reader
+    // lock.
+    if (reader->wake_fd == -1) {
+        reader->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        return reader->wake_fd;
+    }
+    uint64_t wakeups;
+    if (read(reader->wake_fd, &wakeups, sizeof wakeups) == -1) {}
+    return reader->wake_fd;
+}
+
+static int reader_fill_blocking(InotifyObject *reader, int fd,
+                                size_t capacity, int max_reads,
+                                long *syscalls, size_t *bytes) {
+    // reader_fill() with the GIL released. On a blocking descriptor with
+    // nothing pending, the wait happens outside the reader lock so that
+    // other threads can keep consuming the queue meanwhile.
+    // Returns a FILL_* status, or FILL_ERRNO with an exception already set
+    // if the wait was interrupted.
+    int status;
+    for (;;) {
+        reader_lock(reader);
+        if (reader->closed) {
+            reader_unlock(reader);
+            return FILL_CLOSED;
+        }
+        if (reader->ring) {
+            // The drain thread does the reading; wait for it instead.
+            status = ring_fill(reader, syscalls, bytes);
+            int wake_fd = reader->wake_fd;
+            reader_unlock(reader);
+            if (status != FILL_WOULD_BLOCK) return status;
+            if (wait_with_signals(wake_fd, -1, NULL) == -1)
+                return FILL_ERRNO;
+            continue;
+        }
+        Py_BEGIN_ALLOW_THREADS
+        status = reader_fill(reader, fd, capacity, max_reads, syscalls,
+                             bytes);
+        Py_END_ALLOW_THREADS
+        int wake_fd = -1;
+        if (status == FILL_WOULD_BLOCK) {
+            wake_fd = reader_wake_fd(reader);
+            if (wake_fd == -1) {
+                reader->_utils_errno = errno;
+                status = FILL_ERRNO;
+            }
+        }
+        reader_unlock(reader);
+        if (status == FILL_ERRNO && reader->_utils_errno == EINTR) {
+            if (PyErr_CheckSignals() == -1) return FILL_ERRNO;
+            continue;
+        }
+        if (status != FILL_WOULD_BLOCK) return status;
+        if (wait_with_signals(fd, wake_fd, NULL) == -1) return FILL_ERRNO;
+    }
+}
+
+static PyObject * reader_read(InotifyObject *reader, int fd) {
+    // Read the file descriptor and return the number of events queued.
+    long syscalls = 0;
+    size_t bytes = 0;
+    int status = reader_fill_blocking(reader, fd, DEFAULT_DRAIN_CAPACITY, 1,
+                                      &syscalls, &bytes);
+    // If the read raised an error, raise it to the interpreter.
+    if (status != FILL_OK) {
+        if (PyErr_Occurred()) return NULL;
+        return raise_fill_error(reader, status);
+    }
+    return PyLong_FromLong(reader->events_read);
+}
+
+static PyObject * reader_drain(InotifyObject *reader, int fd,
+                               Py_ssize_t capacity) {
+    // Pull every pending event from the file descriptor into the buffer,
+    // using as few read(2) calls as the kernel allows, and queue them.
+    // Returns a tuple of (events queued, syscalls made, bytes read).
+    if (capacity < (Py_ssize_t) MIN_READ_SIZE ||
+        capacity > MAX_READABLE_BYTES) {
+        return PyErr_Format(PyExc_ValueError,
+                            "capacity must be between %zu and %d bytes",
+                            MIN_READ_SIZE, MAX_READABLE_BYTES);
+    }
+    long syscalls = 0;
+    size_t bytes = 0;
+    int status = reader_fill_blocking(reader, fd, (size_t) capacity, 0,
+                                      &syscalls, &bytes);
+    if (status != FILL_OK) {
+        if (PyErr_Occurred()) return NULL;
+        return raise_fill_error(reader, status);
+    }
+    return Py_BuildValue("(iln)", reader->events_read, syscalls,
+                         (Py_ssize_t) bytes);
+}
+
+static PyObject * reader_wait(int fd, int wake_fd, PyObject *timeout) {
+    // Block, without the GIL, until fd has events to read, wake_fd (unless
+    // it is -1) is signalled or the timeout expires. Returns True if either
+    // is readable and False on timeout.
+    struct timespec deadline;
+    int has_deadline = parse_timeout(timeout, &deadline);
+    if (has_deadline == -1) return NULL;
+    int ready = wait_with_signals(fd, wake_fd,
+                                  has_deadline ? &deadline : NULL);
+    if (ready == -1) return NULL;
+    return PyBool_FromLong(ready);
+}
+
+static ssize_t pending_bytes(int fd) {
+    // Return the number of bytes the kernel has queued on fd, or -1 if the
+    // descriptor cannot tell us.
+    int pending = 0;
+    if (ioctl(fd, FIONREAD, &pending) == -1) return -1;
+    return (ssize_t) pending;
+}
+
+static int reader_backlogged(InotifyObject *reader, int fd) {
+    // Non-zero if events are still waiting to be parsed, in the kernel queue
+    // of fd or in the drain ring.
+    drain_ring *ring = reader->ring;
+    if (ring && atomic_load(&ring->head) != atomic_load(&ring->tail))
+        return 1;
+    return pending_bytes(fd) > 0;
+}
+
+static ssize_t _inotify_read(InotifyObject *reader, int fd, size_t offset,
+                             size_t bytes) {
+    // Call read(2), adding one or more events to the buffer at offset.
+    // The caller must have reserved at least offset + bytes bytes.
+    // Return the number of bytes read.
+    ssize_t bytes_read = read(fd, reader->buffer + offset, bytes);
+    reader->_utils_errno = (bytes_read == -1) ? errno : 0;
+    reader->stats.reads++;
+    if (bytes_read > 0) reader->stats.bytes += (unsigned long long) bytes_read;
+    return bytes_read;
+}
+
+static int parse_buffer(InotifyObject *reader, int fd) {
+    // Copy every event in the buffer into the event queue. Events on
+    // directories added with add_tree() carry their full path, new
+    // subdirectories of those are queued to be watched, directories moved
+    // out of the tree are no longer watched and watches the kernel dropped
+    // are forgotten. While coalescing, repeated events are
+    // merged into the record already queued for them.
+    // Returns -1 if the queue could not be grown to hold them. Runs without
+    // the GIL, with the reader lock held: a rescan or a budget poll may
+    // read every directory of the tree from here.
+    if (queue_reserve(reader, (size_t) reader->buffer_size) == -1) return -1;
+    coalescer *coalesce = reader->coalesce;
+    move_pairer *pairer = reader->pairer;
+    // One timestamp covers every event of the read.
+    uint64_t now = ((coalesce && coalesce->window) ||
+                    (pairer && pairer->timeout)) ? monotonic_ns() : 0;
+    if (pairer) pairer->reads++;
+    inotify_event *read_event;
+    while ((read_event = extract_event_data(reader)) != NULL) {
+        reader->stats.events++;
+        if (read_event->mask & IN_Q_OVERFLOW) {
+            reader->stats.overflows++;
+            reader->tree.rescan_due = reader->tree.snapshots;
+        }
+        wd_entry *dir = tree_find(&reader->tree, read_event->wd);
+        if (dir && dir->evicted) {
+            // A watch given up for the watch budget was not lost, and a
+            // directory that left the tree has nothing more to say.
+            if (read_event->mask & IN_IGNORED) {
+                tree_remove(&reader->tree, read_event->wd);
+                continue;
+            }
+            if (dir->detached) continue;
+        }
+        // The tree may watch for more than it delivers.
+        uint32_t kind = read_event->mask & IN_ALL_EVENTS;
+        int quiet = dir && kind && !(kind & ~reader->tree.quiet);
+        if (quiet ||
+            (reader->filter && filter_rejects(reader->filter, read_event))) {
+            if (!quiet) reader->stats.filtered++;
+            // Snapshots and the tree follow the directory, whatever is
+            // delivered.
+            if (reader->tree.snapshots) snap_note(reader, dir, read_event);
+            if (dir) tree_note(reader, fd, dir, read_event);
+            continue;
+        }
+        if (dir) dir->active = ++reader->tree.ticks;
+        if (dir && dir->snap) snap_note(reader, dir, read_event);
+        uint32_t cls = COALESCE_NONE;
+        uint64_t hash = 0;
+        if (coalesce) {
+            cls = coalesce_class(read_event->mask);
+            if (cls != COALESCE_NONE)
+                hash = coalesce_hash(read_event->wd, cls, read_event);
+            if (coalesce_merge(reader, read_event, dir, cls, hash, now))
+                continue;
+        }
+        // A rename half is either held back for its partner or queued
+        // together with it.
+        int held = 0;
+        if (pairer && (read_event->mask & IN_MOVE)) {
+            held = pair_move(reader, read_event, dir, now);
+            if (held == -1) return -1;
+        }
+        if (!held) {
+            int status = dir ? add_event_with_path(reader, read_event,
+                                                   dir->path, dir->len)
+                             : add_event_to_queue(reader, read_event);
+            if (status == -1) return -1;
+            if (cls != COALESCE_NONE)
+                coalesce_note(reader, read_event, cls, hash, now);
+        }
+        if (dir) tree_note(reader, fd, dir, read_event);
+    }
+    if (reader->tree.moves_len) tree_settle_moves(reader, fd);
+    if (pairer && pairer_flush(reader, 0, now) == -1) return -1;
+    // What an IN_Q_OVERFLOW lost is found again once the backlog has been
+    // read. Rescanning while the kernel still holds events would only let
+    // them overflow again, and every overflow until then is covered by the
+    // same rescan.
+    if (reader->tree.rescan_due && reader->tree.snapshots &&
+        !reader_backlogged(reader, fd) && tree_rescan(reader, fd) == -1)
+        return -1;
+    if (reader->tree.budget && budget_due(reader->tree.budget) &&
+        budget_poll(reader, fd) == -1)
+        return -1;
+    stats_queued(reader);
+    return 0;
+}
+
+static PyObject * reader_get_raw_buffer(InotifyObject *reader) {
+    // Return a bytes object containing the raw buffer
+    PyObject *buf = NULL;
+    reader_lock(reader);
+    if(reader->buffer_size <= 0)
+        PyErr_SetString(PyExc_BufferError, "The buffer is empty!");
+    else
+        buf = PyBytes_FromStringAndSize(reader->buffer, reader->buffer_size);
+    reader_unlock(reader);
+    return buf;
+}
+
+static inotify_event * extract_event_data(InotifyObject *reader) {
+    // Return the next inotify event in the buffer, or NULL once it has been
+    // exhausted. The event is not copied; it points into the buffer.
+    ssize_t pos = reader->buffer_pos;
+    if(pos < 0) return NULL;
+    if(pos + (ssize_t) sizeof (inotify_event) > reader->buffer_size)
+        return NULL;
+    inotify_event *read_event = (inotify_event *) (reader->buffer + pos);
+    ssize_t event_size = sizeof (inotify_event) + read_event->len;
+    if(pos + event_size > reader->buffer_size) return NULL;
+    reader->buffer_pos += event_size;
+    return read_event;
+}
+
+static int queue_reserve(InotifyObject *reader, size_t bytes) {
+    // Make room for at least the given number of bytes after the tail of the
+    // queue, first by reclaiming consumed events and then by growing it.
+    iel_arena *queue = &reader->queue;
+    if (queue->capacity - queue->tail >= bytes) return 0;
+    if (queue->head > 0) {
+        memmove(queue->data, queue->data + queue->head,
+                queue->tail - queue->head);
+        queue->tail -= queue->head;
+        queue->last -= queue->head;
+        queue->head = 0;
+        if (queue->counts)
+            memmove(queue->counts, queue->counts + queue->first,
+                    (size_t) reader->iel_length * sizeof (uint32_t));
+        queue->first = 0;
+        queue->generation++;
+        if (queue->capacity - queue->tail >= bytes) return 0;
+    }
+    size_t capacity = queue->capacity ? queue->capacity : MIN_READ_SIZE;
+    while (capacity - queue->tail < bytes) capacity *= 2;
+    char *grown = PyMem_RawRealloc(queue->data, capacity);
+    if (!grown) return -1;
+    // The first allocation after a Batch took the arena is not a regrowth.
+    if (queue->capacity) reader->stats.queue_regrowths++;
+    queue->data = grown;
+    queue->capacity = capacity;
+    return 0;
+}
+
+static int queue_count_new(InotifyObject *reader) {
+    // While coalescing, start the count of the record about to be queued
+    // at 1. Returns -1 if the counts could not be grown.
+    iel_arena *queue = &reader->queue;
+    if (!reader->coalesce) return 0;
+    size_t ordinal = queue->first + (size_t) reader->iel_length;
+    if (ordinal >= queue->counts_capacity) {
+        size_t capacity = queue->counts_capacity ? queue->counts_capacity
+                                                 : 64;
+        while (capacity <= ordinal) capacity *= 2;
+        uint32_t *grown = PyMem_RawRealloc(queue->counts,
+                                           capacity * sizeof (uint32_t));
+        if (!grown) return -1;
+        queue->counts = grown;
+        queue->counts_capacity = capacity;
+    }
+    queue->counts[ordinal] = 1;
+    return 0;
+}
+
+static int add_event_to_queue(InotifyObject *reader, inotify_event *event) {
+    // Copy event, including its name, to the tail of the queue.
+    size_t event_size = sizeof (inotify_event) + event->len;
+    if (queue_reserve(reader, event_size) == -1) return -1;
+    if (queue_count_new(reader) == -1) return -1;
+    memcpy(reader->queue.data + reader->queue.tail, event, event_size);
+    reader->queue.last = reader->queue.tail;
+    reader->queue.tail += event_size;
+    reader->events_read++;
+    reader->iel_length++;
+    return 0;
+}
+
+static int add_event_with_path(InotifyObject *reader, inotify_event *event,
+                               const char *dir, size_t dir_len) {
+    // Copy event to the tail of the queue with its name replaced by dir
+    // joined with the name, or by dir alone if the event has no name. The
+    // name is padded like the kernel pads it, so records stay aligned.
+    size_t name_len = (event->len > 0) ? strnlen(event->name, event->len)
+                                       : 0;
+    size_t path_len = dir_len + (name_len ? 1 + name_len : 0);
+    size_t padded = (path_len + sizeof (inotify_event)) &
+                    ~(sizeof (inotify_event) - 1);
+    if (queue_reserve(reader, sizeof (inotify_event) + padded) == -1)
+        return -1;
+    if (queue_count_new(reader) == -1) return -1;
+    inotify_event *copy = (inotify_event *)
+        (reader->queue.data + reader->queue.tail);
+    copy->wd = event->wd;
+    copy->mask = event->mask;
+    copy->cookie = event->cookie;
+    copy->len = (uint32_t) padded;
+    memcpy(copy->name, dir, dir_len);
+    if (name_len) {
+        copy->name[dir_len] = '/';
+        memcpy(copy->name + dir_len + 1, event->name, name_len);
+    }
+    memset(copy->name + path_len, 0, padded - path_len);
+    reader->queue.last = reader->queue.tail;
+    reader->queue.tail += sizeof (inotify_event) + padded;
+    reader->events_read++;
+    reader->iel_length++;
+    return 0;
+}
+
+static size_t write_path(char *out, inotify_event *event, const char *dir,
+                         size_t dir_len) {
+    // Write the name of event to out, behind dir and a slash unless dir is
+    // NULL, and return its length. Nothing is written if out is NULL.
+    size_t name_len = (event->len > 0) ? strnlen(event->name, event->len)
+                                       : 0;
+    if (!dir) {
+        if (out) memcpy(out, event->name, name_len);
+        return name_len;
+    }
+    if (out) {
+        memcpy(out, dir, dir_len);
+        if (name_len) {
+            out[dir_len] = '/';
+            memcpy(out + dir_len + 1, event->name, name_len);
+        }
+    }
+    return dir_len + (name_len ? 1 + name_len : 0);
+}
+
+static int add_moved_record(InotifyObject *reader, pending_move *from,
+                            inotify_event *to, wd_entry *to_dir) {
+    // Queue a paired rename as a single record. It keeps the wd and cookie
+    // of the IN_MOVED_FROM half and has both IN_MOVED_FROM and IN_MOVED_TO
+    // set. Its name holds the source name, a NUL, the destination name, a
+    // NUL and, at the next multiple of four, the destination wd, padded
+    // like the kernel pads names. See moved_destination().
+    const char *dst_dir = to_dir ? to_dir->path : NULL;
+    size_t dst_dir_len = to_dir ? to_dir->len : 0;
+    size_t src_len = write_path(NULL, from->event, from->dir, from->dir_len);
+    size_t dst_len = write_path(NULL, to, dst_dir, dst_dir_len);
+    size_t wd_offset = (src_len + dst_len + 2 + INT_SIZE - 1) &
+                       ~(INT_SIZE - 1);
+    size_t used = wd_offset + INT_SIZE;
+    size_t padded = (used + sizeof (inotify_event) - 1) &
+                    ~(sizeof (inotify_event) - 1);
+    if (queue_reserve(reader, sizeof (inotify_event) + padded) == -1)
+        return -1;
+    if (queue_count_new(reader) == -1) return -1;
+    inotify_event *copy = (inotify_event *)
+        (reader->queue.data + reader->queue.tail);
+    copy->wd = from->event->wd;
+    copy->mask = from->event->mask | to->mask;
+    copy->cookie = from->event->cookie;
+    copy->len = (uint32_t) padded;
+    memset(copy->name, 0, padded);
+    write_path(copy->name, from->event, from->dir, from->dir_len);
+    write_path(copy->name + src_len + 1, to, dst_dir, dst_dir_len);
+    memcpy(copy->name + wd_offset, &to->wd, INT_SIZE);
+    // The record stands for both halves.
+    if (reader->coalesce)
+        reader->queue.counts[reader->queue.first +
+                             (size_t) reader->iel_length] = 2;
+    reader->queue.last = reader->queue.tail;
+    reader->queue.tail += sizeof (inotify_event) + padded;
+    reader->events_read++;
+    reader->iel_length++;
+    return 0;
+}
+
+static int moved_destination(inotify_event *record, int *wd,
+                             const char **name, size_t *len) {
+    // If record is a paired rename, store its destination wd and name and
+    // return 1. Return 0 for any other record.
+    if ((record->mask & IN_MOVE) != IN_MOVE || record->len == 0) return 0;
+    size_t src_len = strnlen(record->name, record->len);
+    if (src_len + 1 >= record->len) return 0;
+    const char *dst = record->name + src_len + 1;
+    size_t dst_len = strnlen(dst, record->len - src_len - 1);
+    size_t wd_offset = (src_len + dst_len + 2 + INT_SIZE - 1) &
+                       ~(INT_SIZE - 1);
+    if (wd_offset + INT_SIZE > record->len) return 0;
+    memcpy(wd, record->name + wd_offset, INT_SIZE);
+    *name = dst;
+    *len = dst_len;
+    return 1;
+}
+
+static inotify_event * queue_peek(InotifyObject *reader) {
+    // Return the oldest event in the queue without removing it, or NULL if
+    // the queue is empty. The caller must hold the reader lock.
+    if (reader->iel_length == 0) return NULL;
+    return (inotify_event *) (reader->queue.data + reader->queue.head);
+}
+
+static void queue_consume(InotifyObject *reader, inotify_event *event) {
+    // Remove the oldest event, as returned by queue_peek(), from the queue.
+    iel_arena *queue = &reader->queue;
+    if (reader->journal) journal_append(reader->journal, (char *) event, 1);
+    queue->head += sizeof (inotify_event) + event->len;
+    queue->first++;
+    // Reclaim the whole arena at once when the last event is consumed.
+    if (queue->head == queue->tail) queue_rewind(queue);
+    reader->iel_length--;
+    reader->events_read--;
+}
+
+static void queue_rewind(iel_arena *queue) {
+    // Forget every record in the queue, keeping its memory.
+    queue->head = queue->tail = queue->last = queue->first = 0;
+    queue->generation++;
+}
+
+static uint32_t queue_head_count(InotifyObject *reader) {
+    // Return the number of raw events the oldest record stands for, or 0
+    // if the reader is not coalescing. The caller must hold the lock.
+    iel_arena *queue = &reader->queue;
+    if (!reader->coalesce || !queue->counts) return 0;
+    return queue->counts[queue->first];
+}
+
+static PyObject * queue_pop_tuple(InotifyObject *reader) {
+    // Remove the oldest event from the queue and return it as a tuple.
+    // The caller must hold the reader lock.
+    if (reader->iel_length == 0) {
+        PyErr_SetString(PyExc_IndexError,
+                        "There are no more events in the queue!");
+        return NULL;
+    }
+    inotify_event *event = queue_peek(reader);
+    PyObject *read_event_tuple = build_record_tuple(
+        reader, event, queue_head_count(reader));
+    if(!read_event_tuple) return NULL;
+    queue_consume(reader, event);
+    return read_event_tuple;
+}
+
+static PyObject * get_event_tuple(InotifyObject *reader) {
+    reader_lock(reader);
+    reader_settle(reader);
+    PyObject *read_event_tuple = queue_pop_tuple(reader);
+    if (read_event_tuple) stats_delivered(reader);
+    reader_unlock(reader);
+    return read_event_tuple;
+}
+
+static PyObject * reader_get_event_list(InotifyObject *reader) {
+    PyObject *event_list = PyList_New(0);
+    if (!event_list) {
+        PyErr_SetString(PyExc_ValueError, "Unable to create new list!");
+        return NULL;
+    }
+    reader_lock(reader);
+    reader_settle(reader);
+    while (reader->iel_length > 0) {
+        PyObject *event_tuple = queue_pop_tuple(reader);
+        if (!event_tuple) {
+            reader_unlock(reader);
+            Py_DECREF(event_list);
+            return NULL;
+        }
+        int status = PyList_Append(event_list, event_tuple);
+        Py_DECREF(event_tuple);
+        if (status == -1) {
+            reader_unlock(reader);
+            Py_DECREF(event_list);
+            PyErr_SetString(PyExc_ValueError,
+                            "Unable to add item to list!");
+            return NULL;
+        }
+    }
+    stats_delivered(reader);
+    reader_unlock(reader);
+    return event_list;
+}
+
+static uint64_t name_hash(int wd, const char *raw, size_t len) {
+    // FNV-1a over the watch descriptor and the raw name.
+    uint64_t hash = 14695981039346656037ULL;
+    for (int i = 0; i < 4; i++) {
+        hash ^= ((uint32_t) wd >> (i * 8)) & 0xff;
+        hash *= 1099511628211ULL;
+    }
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char) raw[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static PyObject * decode_name(InotifyObject *reader, int wd, const char *raw,
+                              size_t len) {
+    // Decode a raw name the way os.fsdecode() does, so that names which are
+    // not valid in the filesystem encoding come back with surrogates rather
+    // than failing. With a reader, names are taken from and added to its
+    // cache. Returns a new reference. The GIL must be held.
+    if (len == 0) return PyUnicode_FromStringAndSize(NULL, 0);
+    if (!reader)
+        return PyUnicode_DecodeFSDefaultAndSize(raw, (Py_ssize_t) len);
+    if (!reader->names) {
+        reader->names = PyMem_Calloc(1, sizeof (name_cache));
+        if (!reader->names)
+            return PyUnicode_DecodeFSDefaultAndSize(raw, (Py_ssize_t) len);
+    }
+    name_cache *cache = reader->names;
+    uint64_t hash = name_hash(wd, raw, len);
+    name_slot *slot = &cache->slots[hash & (NAME_CACHE_SLOTS - 1)];
+    if (slot->name && slot->hash == hash && slot->wd == wd &&
+        slot->len == len && memcmp(slot->raw, raw, len) == 0) {
+        cache->hits++;
+        return Py_NewRef(slot->name);
+    }
+    cache->misses++;
+    PyObject *name = PyUnicode_DecodeFSDefaultAndSize(raw, (Py_ssize_t) len);
+    if (!name) return NULL;
+    PyUnicode_InternInPlace(&name);
+    // The name is still good if it cannot be cached.
+    if (slot->raw_capacity < len) {
+        char *grown = PyMem_Realloc(slot->raw, len);
+        if (!grown) return name;
+        slot->raw = grown;
+        slot->raw_capacity = len;
+    }
+    memcpy(slot->raw, raw, len);
+    slot->len = len;
+    slot->hash = hash;
+    slot->wd = wd;
+    Py_XSETREF(slot->name, Py_NewRef(name));
+    return name;
+}
+
+static void name_cache_free(name_cache *cache) {
+    if (!cache) return;
+    for (size_t i = 0; i < NAME_CACHE_SLOTS; i++) {
+        Py_XDECREF(cache->slots[i].name);
+        PyMem_Free(cache->slots[i].raw);
+    }
+    PyMem_Free(cache);
+}
+
+static PyObject * event_name(InotifyObject *reader, inotify_event *event) {
+    // Events on the watched object itself (and IN_Q_OVERFLOW) carry no name,
+    // and event->name must not be touched when event->len is 0.
+    if (event->len == 0) return PyUnicode_FromStringAndSize(NULL, 0);
+    return decode_name(reader, event->wd, event->name,
+                       strnlen(event->name, event->len));
+}
+
+static PyObject * build_tuple(InotifyObject *reader, inotify_event *event) {
+    PyObject *py_name = event_name(reader, event);
+    if (!py_name) return NULL;
+    Py_ssize_t len = PyUnicode_GetLength(py_name);
+    PyObject *read_event_tuple = Py_BuildValue("(ikknN)", event->wd,
+                                               (unsigned long) event->mask,
+                                               (unsigned long) event->cookie,
+                                               len, py_name);
+    return read_event_tuple;
+}
+
+static PyObject * build_record_tuple(InotifyObject *reader,
+                                     inotify_event *event, uint32_t count) {
+    // build_tuple(), followed by the destination wd and name of a paired
+    // rename and by the number of raw events the record stands for, unless
+    // count is 0.
+    int dst_wd = -1;
+    const char *dst = NULL;
+    size_t dst_len = 0;
+    int moved = moved_destination(event, &dst_wd, &dst, &dst_len);
+    if (!moved && count == 0) return build_tuple(reader, event);
+    PyObject *base = build_tuple(reader, event);
+    if (!base) return NULL;
+    Py_ssize_t size = PyTuple_GET_SIZE(base) + (moved ? 2 : 0) +
+                      (count ? 1 : 0);
+    PyObject *record = PyTuple_New(size);
+    if (!record) {
+        Py_DECREF(base);
+        return NULL;
+    }
+    Py_ssize_t i = 0;
+    for (; i < PyTuple_GET_SIZE(base); i++)
+        PyTuple_SET_ITEM(record, i, Py_NewRef(PyTuple_GET_ITEM(base, i)));
+    Py_DECREF(base);
+    if (moved) {
+        PyObject *item = PyLong_FromLong(dst_wd);
+        if (!item) goto error;
+        PyTuple_SET_ITEM(record, i++, item);
+        item = decode_name(reader, dst_wd, dst, dst_len);
+        if (!item) goto error;
+        PyTuple_SET_ITEM(record, i++, item);
+    }
+    if (count) {
+        PyObject *item = PyLong_FromUnsignedLong(count);
+        if (!item) goto error;
+        PyTuple_SET_ITEM(record, i++, item);
+    }
+    return record;
+error:
+    Py_DECREF(record);
+    return NULL;
+}
+
+static int buffer_reserve(InotifyObject *reader, size_t bytes) {
+    // Grow buffer so that it can hold at least the given number of bytes.
+    // The buffer is never shrunk, so steady-state reads do not allocate.
+    if (bytes <= reader->buffer_capacity) return 0;
+    char *grown = PyMem_RawRealloc(reader->buffer, bytes);
+    if (!grown) return -1;
+    if (reader->buffer_capacity) reader->stats.buffer_regrowths++;
+    reader->buffer = grown;
+    reader->buffer_capacity = bytes;
+    return 0;
+}
+
+static void buffer_reset(InotifyObject *reader) {
+    // Mark the contents of buffer as consumed without releasing its memory.
+    reader->buffer_size = -1;
+    reader->buffer_pos = -1;
+}
+
+
+// Event filters
+
+static int filter_matches_name(name_pattern *pattern, const char *name,
+                               size_t len) {
+    switch (pattern->kind) {
+        case PATTERN_EXACT:
+            return len == pattern->len &&
+                   memcmp(name, pattern->text, len) == 0;
+        case PATTERN_PREFIX:
+            return len >= pattern->len &&
+                   memcmp(name, pattern->text, pattern->len) == 0;
+        case PATTERN_SUFFIX:
+            return len >= pattern->len &&
+                   memcmp(name + len - pattern->len, pattern->text,
+                          pattern->len) == 0;
+        default:
+            return fnmatch(pattern->text, name, 0) == 0;
+    }
+}
+
+static int compare_wds(const void *a, const void *b) {
+    int left = *(const int *) a, right = *(const int *) b;
+    return (left > right) - (left < right);
+}
+
+static int filter_rejects(event_filter *filter, inotify_event *event) {
+    // Return 1, and count the rule responsible, if event must be dropped.
+    // Runs without the GIL, with the reader lock held.
+    if (event->mask & IN_Q_OVERFLOW) return 0;
+    if (filter->allow_mask && !(event->mask & filter->allow_mask)) {
+        filter->dropped_allow_mask++;
+        return 1;
+    }
+    if (event->mask & filter->deny_mask) {
+        filter->dropped_deny_mask++;
+        return 1;
+    }
+    if (filter->wds && !bsearch(&event->wd, filter->wds,
+                                (size_t) filter->wds_len, sizeof (int),
+                                compare_wds)) {
+        filter->dropped_wd++;
+        return 1;
+    }
+    if (filter->patterns_len == 0 || event->len == 0) return 0;
+    size_t len = strnlen(event->name, event->len);
+    for (Py_ssize_t i = 0; i < filter->patterns_len; i++) {
+        if (filter_matches_name(&filter->patterns[i], event->name, len)) {
+            filter->patterns[i].dropped++;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void filter_free(event_filter *filter) {
+    if (!filter) return;
+    for (Py_ssize_t i = 0; i < filter->patterns_len; i++)
+        PyMem_RawFree(filter->patterns[i].text);
+    PyMem_RawFree(filter->patterns);
+    PyMem_RawFree(filter->wds);
+    PyMem_RawFree(filter);
+}
+
+static int compile_pattern(PyObject *source, name_pattern *pattern) {
+    // Compile a str or bytes pattern. '*.swp' and '*~' become suffix
+    // matches, '.#*' a prefix match and a pattern without wildcards an exact
+    // match; anything else is handed to fnmatch(3).
+    PyObject *encoded;
+    if (!PyUnicode_FSConverter(source, &encoded)) return -1;
+    const char *text = PyBytes_AS_STRING(encoded);
+    size_t len = (size_t) PyBytes_GET_SIZE(encoded);
+    size_t wildcards = 0;
+    for (size_t i = 0; i < len; i++)
+        if (strchr("*?[\\", text[i])) wildcards++;
+    size_t start = 0, stop = len;
+    pattern->kind = PATTERN_GLOB;
+    if (wildcards == 0) {
+        pattern->kind = PATTERN_EXACT;
+    }
+    else if (wildcards == 1 && len > 1 && text[0] == '*') {
+        pattern->kind = PATTERN_SUFFIX;
+        start = 1;
+    }
+    else if (wildcards == 1 && len > 1 && text[len - 1] == '*') {
+        pattern->kind = PATTERN_PREFIX;
+        stop = len - 1;
+    }
+    pattern->len = stop - start;
+    pattern->dropped = 0;
+    pattern->text = PyMem_RawMalloc(pattern->len + 1);
+    if (!pattern->text) {
+        Py_DECREF(encoded);
+        PyErr_NoMemory();
+        return -1;
+    }
+    memcpy(pattern->text, text + start, pattern->len);
+    pattern->text[pattern->len] = '\0';
+    Py_DECREF(encoded);
+    return 0;
+}
+
+static event_filter * filter_new(unsigned long allow_mask,
+                                 unsigned long deny_mask, PyObject *wds,
+                                 PyObject *patterns) {
+    // Compile a filter. Returns NULL with an exception set on failure.
+    event_filter *filter = PyMem_RawCalloc(1, sizeof (event_filter));
+    if (!filter) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+    filter->allow_mask = (uint32_t) allow_mask;
+    filter->deny_mask = (uint32_t) deny_mask;
+    if (wds != Py_None) {
+        PyObject *seq = PySequence_Fast(wds, "wds must be iterable");
+        if (!seq) goto error;
+        Py_ssize_t len = PySequence_Fast_GET_SIZE(seq);
+        filter->wds = PyMem_RawMalloc((size_t) (len ? len : 1) *
+                                      sizeof (int));
+        if (!filter->wds) {
+            Py_DECREF(seq);
+            PyErr_NoMemory();
+            goto error;
+        }
+        for (Py_ssize_t i = 0; i < len; i++) {
+            long wd = PyLong_AsLong(PySequence_Fast_GET_ITEM(seq, i));
+            if (wd == -1 && PyErr_Occurred()) {
+                Py_DECREF(seq);
+                goto error;
+            }
+            filter->wds[i] = (int) wd;
+        }
+        filter->wds_len = len;
+        Py_DECREF(seq);
+        qsort(filter->wds, (size_t) len, sizeof (int), compare_wds);
+    }
+    if (patterns != Py_None) {
+        if (PyUnicode_Check(patterns) || PyBytes_Check(patterns)) {
+            PyErr_SetString(PyExc_TypeError,
+                            "patterns must be a sequence of patterns");
+            goto error;
+        }
+        PyObject *seq = PySequence_Fast(patterns,
+                                        "patterns must be iterable");
+        if (!seq) goto error;
+        Py_ssize_t len = PySequence_Fast_GET_SIZE(seq);
+        filter->patterns = PyMem_RawCalloc((size_t) (len ? len : 1),
+                                           sizeof (name_pattern));
+        if (!filter->patterns) {
+            Py_DECREF(seq);
+            PyErr_NoMemory();
+            goto error;
+        }
+        for (Py_ssize_t i = 0; i < len; i++) {
+            PyObject *item = PySequence_Fast_GET_ITEM(seq, i);
+            if (compile_pattern(item, &filter->patterns[i]) == -1) {
+                Py_DECREF(seq);
+                goto error;
+            }
+            filter->patterns_len++;
+        }
+        Py_DECREF(seq);
+    }
+    return filter;
+error:
+    filter_free(filter);
+    return NULL;
+}
+
+static PyObject * reader_set_filter(InotifyObject *reader, PyObject *args,
+                                    PyObject *kwargs) {
+    // Replace the filter of reader, resetting its counters. Calling it
+    // without arguments removes the filter.
+    char *kwlist[] = {"allow_mask", "deny_mask", "wds", "patterns", NULL};
+    unsigned long allow_mask = 0, deny_mask = 0;
+    PyObject *wds = Py_None, *patterns = Py_None;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|kkOO", kwlist,
+                                     &allow_mask, &deny_mask, &wds,
+                                     &patterns))
+        return NULL;
+    event_filter *filter = NULL;
+    if (allow_mask || deny_mask || wds != Py_None || patterns != Py_None) {
+        filter = filter_new(allow_mask, deny_mask, wds, patterns);
+        if (!filter) return NULL;
+    }
+    reader_lock(reader);
+    event_filter *old = reader->filter;
+    reader->filter = filter;
+    reader_unlock(reader);
+    filter_free(old);
+    Py_RETURN_NONE;
+}
+
+static PyObject * reader_filter_stats(InotifyObject *reader) {
+    // Return the number of events dropped by each rule of the filter.
+    PyObject *stats = NULL, *dropped = NULL;
+    reader_lock(reader);
+    event_filter *filter = reader->filter;
+    if (!filter) {
+        reader_unlock(reader);
+        return PyDict_New();
+    }
+    dropped = PyDict_New();
+    if (!dropped) goto done;
+    for (Py_ssize_t i = 0; i < filter->patterns_len; i++) {
+        name_pattern *pattern = &filter->patterns[i];
+        // Report patterns the way they were given.
+        PyObject *key = PyUnicode_DecodeFSDefault(pattern->text);
+        if (key && pattern->kind != PATTERN_EXACT &&
+            pattern->kind != PATTERN_GLOB) {
+            Py_SETREF(key, PyUnicode_FromFormat(
+                (pattern->kind == PATTERN_SUFFIX) ? "*%U" : "%U*", key));
+        }
+        PyObject *value = PyLong_FromUnsignedLongLong(pattern->dropped);
+        int status = (key && value) ? PyDict_SetItem(dropped, key, value)
+                                    : -1;
+        Py_XDECREF(key);
+        Py_XDECREF(value);
+        if (status == -1) goto done;
+    }
+    stats = Py_BuildValue("{sKsKsKsO}",
+                          "allow_mask", filter->dropped_allow_mask,
+                          "deny_mask", filter->dropped_deny_mask,
+                          "wds", filter->dropped_wd,
+                          "patterns", dropped);
+done:
+    reader_unlock(reader);
+    Py_XDECREF(dropped);
+    return stats;
+}
+
+
+// Coalescing
+
+static uint64_t monotonic_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000ULL + (uint64_t) now.tv_nsec;
+}
+
+static uint32_t coalesce_class(uint32_t mask) {
+    // Return the class an event is coalesced in, or COALESCE_NONE.
+    if (mask & ~(IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_ACCESS |
+                 IN_OPEN | IN_CLOSE_NOWRITE | IN_ISDIR))
+        return COALESCE_NONE;
+    if (mask & (IN_MODIFY | IN_CLOSE_WRITE)) return COALESCE_CONTENT;
+    if (mask & IN_ATTRIB) return COALESCE_METADATA;
+    if (mask & (IN_ACCESS | IN_OPEN | IN_CLOSE_NOWRITE))
+        return COALESCE_ACCESS;
+    return COALESCE_NONE;
+}
+
+static uint64_t coalesce_hash(int wd, uint32_t cls, inotify_event *event) {
+    // FNV-1a over the watch descriptor, the class and the raw name.
+    uint64_t hash = 14695981039346656037ULL;
+    uint64_t key = ((uint64_t) (uint32_t) wd << 8) | cls;
+    for (int i = 0; i < 8; i++) {
+        hash ^= (key >> (i * 8)) & 0xff;
+        hash *= 1099511628211ULL;
+    }
+    size_t len = (event->len > 0) ? strnlen(event->name, event->len) : 0;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char) event->name[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static int coalesce_live(InotifyObject *reader, coalesce_entry *entry) {
+    // Whether the record behind entry is still queued, where it was.
+    return entry->generation == reader->queue.generation &&
+           entry->ordinal >= reader->queue.first;
+}
+
+static coalesce_entry * coalesce_find(coalescer *coalesce, uint64_t hash,
+                                      int wd, uint32_t cls) {
+    // Return the first slot holding the key, live or not, or NULL.
+    size_t mask = coalesce->capacity - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        coalesce_entry *entry = &coalesce->slots[i];
+        if (entry->generation == COALESCE_EMPTY) return NULL;
+        if (entry->hash == hash && entry->wd == wd && entry->cls == cls)
+            return entry;
+    }
+}
+
+static int record_has_name(inotify_event *record, inotify_event *event,
+                           wd_entry *dir) {
+    // Whether record was queued for the raw name of event, with the path
+    // of dir in front of it if the watch was added with add_tree().
+    size_t len = (event->len > 0) ? strnlen(event->name, event->len) : 0;
+    size_t record_len = (record->len > 0)
+                        ? strnlen(record->name, record->len) : 0;
+    size_t expected = dir ? dir->len + (len ? 1 + len : 0) : len;
+    return record_len == expected &&
+           memcmp(record->name + record_len - len, event->name, len) == 0;
+}
+
+static void coalesce_forget(InotifyObject *reader, inotify_event *event) {
+    // Stop merging into any record queued for the name of event, so that
+    // nothing is merged across its creation, deletion or renaming.
+    coalescer *coalesce = reader->coalesce;
+    size_t mask = coalesce->capacity - 1;
+    for (uint32_t cls = COALESCE_CONTENT; cls <= COALESCE_ACCESS; cls++) {
+        uint64_t hash = coalesce_hash(event->wd, cls, event);
+        for (size_t i = hash & mask;; i = (i + 1) & mask) {
+            coalesce_entry *entry = &coalesce->slots[i];
+            if (entry->generation == COALESCE_EMPTY) break;
+            if (entry->hash == hash && entry->wd == event->wd &&
+                entry->cls == cls)
+                entry->generation = COALESCE_FORGOTTEN;
+        }
+    }
+}
+
+static int coalesce_merge(InotifyObject *reader, inotify_event *event,
+                          wd_entry *dir, uint32_t cls, uint64_t hash,
+                          uint64_t now) {
+    // Merge event into the record queued for the same (wd, name, class),
+    // if there is one. Returns 1 if it was merged and 0 if it must be
+    // queued. The caller must hold the reader lock.
+    coalescer *coalesce = reader->coalesce;
+    coalesce->raw++;
+    if (cls == COALESCE_NONE) {
+        if (event->len > 0) coalesce_forget(reader, event);
+        return 0;
+    }
+    coalesce_entry *entry = coalesce_find(coalesce, hash, event->wd, cls);
+    if (!entry || !coalesce_live(reader, entry)) return 0;
+    if (coalesce->window && now - entry->stamp > coalesce->window) return 0;
+    iel_arena *queue = &reader->queue;
+    inotify_event *record = (inotify_event *) (queue->data + entry->offset);
+    if (!record_has_name(record, event, dir)) return 0;
+    record->mask |= event->mask;
+    if (queue->counts[entry->ordinal] < UINT32_MAX)
+        queue->counts[entry->ordinal]++;
+    coalesce->merged++;
+    return 1;
+}
+
+static int coalesce_rebuild(InotifyObject *reader) {
+    // Rehash the live entries into a table at most a quarter full,
+    // dropping everything else. Returns -1 if it could not be allocated.
+    coalescer *coalesce = reader->coalesce;
+    size_t live = 0;
+    for (size_t i = 0; i < coalesce->capacity; i++)
+        live += coalesce_live(reader, &coalesce->slots[i]);
+    size_t capacity = 64;
+    while (capacity < 4 * (live + 1)) capacity *= 2;
+    coalesce_entry *slots = PyMem_RawCalloc(capacity,
+                                            sizeof (coalesce_entry));
+    if (!slots) return -1;
+    for (size_t i = 0; i < coalesce->capacity; i++) {
+        coalesce_entry *entry = &coalesce->slots[i];
+        if (!coalesce_live(reader, entry)) continue;
+        size_t j = entry->hash & (capacity - 1);
+        while (slots[j].generation != COALESCE_EMPTY)
+            j = (j + 1) & (capacity - 1);
+        slots[j] = *entry;
+    }
+    PyMem_RawFree(coalesce->slots);
+    coalesce->slots = slots;
+    coalesce->capacity = capacity;
+    coalesce->used = live;
+    return 0;
+}
+
+static void coalesce_note(InotifyObject *reader, inotify_event *event,
+                          uint32_t cls, uint64_t hash, uint64_t now) {
+    // Remember the record just queued for event, so that later events of
+    // the same class on the same name are merged into it. If the table
+    // cannot grow, the event is simply not remembered.
+    coalescer *coalesce = reader->coalesce;
+    if (4 * (coalesce->used + 1) > 3 * coalesce->capacity &&
+        coalesce_rebuild(reader) == -1)
+        return;
+    size_t mask = coalesce->capacity - 1;
+    coalesce_entry *target = NULL;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        coalesce_entry *entry = &coalesce->slots[i];
+        if (entry->generation == COALESCE_EMPTY) {
+            if (!target) {
+                target = entry;
+                coalesce->used++;
+            }
+            break;
+        }
+        int same = entry->hash == hash && entry->wd == event->wd &&
+                   entry->cls == cls;
+        // Reuse the first slot that no longer points at a queued record,
+        // ahead of any older entry for the same key.
+        if (!target && (same || !coalesce_live(reader, entry)))
+            target = entry;
+        if (same) break;
+    }
+    iel_arena *queue = &reader->queue;
+    *target = (coalesce_entry) {
+        .hash = hash, .generation = queue->generation,
+        .offset = queue->last,
+        .ordinal = queue->first + (size_t) reader->iel_length - 1,
+        .stamp = now, .wd = event->wd, .cls = cls
+    };
+}
+
+static void coalesce_free(coalescer *coalesce) {
+    if (!coalesce) return;
+    PyMem_RawFree(coalesce->slots);
+    PyMem_RawFree(coalesce);
+}
+
+static PyObject * reader_set_coalesce(InotifyObject *reader, PyObject *args,
+                                      PyObject *kwargs) {
+    // Turn the coalescing stage on, with fresh counters, or off.
+    char *kwlist[] = {"enabled", "window", NULL};
+    int enabled = 1;
+    double window = 0.0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|pd", kwlist, &enabled,
+                                     &window))
+        return NULL;
+    if (window < 0 || window > (double) INT_MAX) {
+        PyErr_SetString(PyExc_ValueError,
+                        "window must be a positive number of seconds");
+        return NULL;
+    }
+    coalescer *coalesce = NULL;
+    if (enabled) {
+        coalesce = PyMem_RawCalloc(1, sizeof (coalescer));
+        if (!coalesce) return PyErr_NoMemory();
+        coalesce->capacity = 64;
+        coalesce->slots = PyMem_RawCalloc(coalesce->capacity,
+                                          sizeof (coalesce_entry));
+        if (!coalesce->slots) {
+            coalesce_free(coalesce);
+            return PyErr_NoMemory();
+        }
+        coalesce->window = (uint64_t) (window * 1e9);
+    }
+    reader_lock(reader);
+    iel_arena *queue = &reader->queue;
+    coalescer *old = reader->coalesce;
+    if (coalesce && !old) {
+        // The records queued so far stand for one event each.
+        size_t needed = queue->first + (size_t) reader->iel_length;
+        if (needed > queue->counts_capacity) {
+            uint32_t *counts = PyMem_RawRealloc(queue->counts,
+                                                needed * sizeof (uint32_t));
+            if (!counts) {
+                reader_unlock(reader);
+                coalesce_free(coalesce);
+                return PyErr_NoMemory();
+            }
+            queue->counts = counts;
+            queue->counts_capacity = needed;
+        }
+        for (size_t i = 0; i < needed; i++) queue->counts[i] = 1;
+    }
+    else if (!coalesce) {
+        PyMem_RawFree(queue->counts);
+        queue->counts = NULL;
+        queue->counts_capacity = 0;
+    }
+    reader->coalesce = coalesce;
+    reader_unlock(reader);
+    coalesce_free(old);
+    Py_RETURN_NONE;
+}
+
+static PyObject * reader_coalesce_stats(InotifyObject *reader) {
+    // Return the number of events seen and merged by the coalescing stage.
+    reader_lock(reader);
+    coalescer *coalesce = reader->coalesce;
+    unsigned long long raw = coalesce ? coalesce->raw : 0;
+    unsigned long long merged = coalesce ? coalesce->merged : 0;
+    reader_unlock(reader);
+    return Py_BuildValue("{sKsKsK}", "raw", raw, "merged", merged,
+                         "delivered", raw - merged);
+}
+
+
+// Rename pairing
+
+static size_t pairer_slot(move_pairer *pairer, uint32_t cookie) {
+    return (cookie * 2654435761u) & (pairer->index_capacity - 1);
+}
+
+static size_t * pairer_lookup(move_pairer *pairer, uint32_t cookie) {
+    // Return the index slot of the pending half with cookie, or NULL.
+    if (pairer->index_capacity == 0) return NULL;
+    size_t mask = pairer->index_capacity - 1;
+    for (size_t i = pairer_slot(pairer, cookie);; i = (i + 1) & mask) {
+        size_t position = pairer->index[i];
+        if (position == PAIR_EMPTY) return NULL;
+        if (position != PAIR_DELETED &&
+            pairer->moves[position].event->cookie == cookie)
+            return &pairer->index[i];
+    }
+}
+
+static void pairer_insert(move_pairer *pairer, size_t position) {
+    // Index the pending half at position. The index must have room.
+    uint32_t cookie = pairer->moves[position].event->cookie;
+    size_t mask = pairer->index_capacity - 1;
+    size_t i = pairer_slot(pairer, cookie);
+    while (pairer->index[i] != PAIR_EMPTY && pairer->index[i] != PAIR_DELETED)
+        i = (i + 1) & mask;
+    if (pairer->index[i] == PAIR_EMPTY) pairer->index_used++;
+    pairer->index[i] = position;
+}
+
+static int pairer_reindex(move_pairer *pairer) {
+    // Rebuild the index at most a quarter full, dropping its tombstones.
+    // Returns -1 if it could not be allocated.
+    size_t live = 0;
+    for (size_t i = pairer->head; i < pairer->len; i++)
+        live += pairer->moves[i].event != NULL;
+    size_t capacity = 16;
+    while (capacity < 4 * (live + 1)) capacity *= 2;
+    size_t *index = PyMem_RawMalloc(capacity * sizeof (size_t));
+    if (!index) return -1;
+    for (size_t i = 0; i < capacity; i++) index[i] = PAIR_EMPTY;
+    PyMem_RawFree(pairer->index);
+    pairer->index = index;
+    pairer->index_capacity = capacity;
+    pairer->index_used = 0;
+    for (size_t i = pairer->head; i < pairer->len; i++)
+        if (pairer->moves[i].event) pairer_insert(pairer, i);
+    return 0;
+}
+
+static void pending_clear(pending_move *move) {
+    PyMem_RawFree(move->event);
+    PyMem_RawFree(move->dir);
+    move->event = NULL;
+    move->dir = NULL;
+}
+
+static int pairer_push(move_pairer *pairer, inotify_event *event,
+                       wd_entry *dir, uint64_t now) {
+    // Hold an IN_MOVED_FROM event back until its partner arrives.
+    // Returns -1 if there was no memory for it.
+    if (pairer->len == pairer->capacity) {
+        if (pairer->head > 0) {
+            // Positions move, so the index is rebuilt.
+            memmove(pairer->moves, pairer->moves + pairer->head,
+                    (pairer->len - pairer->head) * sizeof (pending_move));
+            pairer->len -= pairer->head;
+            pairer->head = 0;
+            if (pairer_reindex(pairer) == -1) return -1;
+        }
+        else {
+            size_t capacity = pairer->capacity ? 2 * pairer->capacity : 8;
+            pending_move *grown = PyMem_RawRealloc(
+                pairer->moves, capacity * sizeof (pending_move));
+            if (!grown) return -1;
+            pairer->moves = grown;
+            pairer->capacity = capacity;
+        }
+    }
+    if (4 * (pairer->index_used + 1) > 3 * pairer->index_capacity &&
+        pairer_reindex(pairer) == -1)
+        return -1;
+    size_t event_size = sizeof (inotify_event) + event->len;
+    pending_move *move = &pairer->moves[pairer->len];
+    *move = (pending_move) {
+        .event = PyMem_RawMalloc(event_size), .dir = NULL, .dir_len = 0,
+        .read = pairer->reads, .stamp = now
+    };
+    if (!move->event) return -1;
+    memcpy(move->event, event, event_size);
+    if (dir) {
+        move->dir = PyMem_RawMalloc(dir->len + 1);
+        if (!move->dir) {
+            pending_clear(move);
+            return -1;
+        }
+        memcpy(move->dir, dir->path, dir->len + 1);
+        move->dir_len = dir->len;
+    }
+    pairer_insert(pairer, pairer->len++);
+    return 0;
+}
+
+static int pair_move(InotifyObject *reader, inotify_event *event,
+                     wd_entry *dir, uint64_t now) {
+    // Hold back an IN_MOVED_FROM event, or queue an IN_MOVED_TO event
+    // together with its pending partner as one record. Returns 1 if the
+    // event was taken care of, 0 if it must be queued as it is and -1 if
+    // there was no memory. The caller must hold the reader lock.
+    move_pairer *pairer = reader->pairer;
+    if (event->cookie == 0) return 0;
+    if (event->mask & IN_MOVED_FROM) {
+        if (pairer_push(pairer, event, dir, now) == -1) return -1;
+        return 1;
+    }
+    size_t *slot = pairer_lookup(pairer, event->cookie);
+    if (!slot) return 0;
+    pending_move *from = &pairer->moves[*slot];
+    if (add_moved_record(reader, from, event, dir) == -1) return -1;
+    *slot = PAIR_DELETED;
+    pending_clear(from);
+    pairer->paired++;
+    return 1;
+}
+
+static int pairer_flush(InotifyObject *reader, int all, uint64_t now) {
+    // Queue the pending halves that have waited long enough, or all of
+    // them, as plain events. Returns how many were queued, or -1 if there
+    // was no memory. The caller must hold the reader lock.
+    move_pairer *pairer = reader->pairer;
+    int flushed = 0;
+    while (pairer->head < pairer->len) {
+        pending_move *move = &pairer->moves[pairer->head];
+        if (move->event) {
+            int expired = all ||
+                pairer->reads - move->read >= (unsigned) pairer->max_reads ||
+                (pairer->timeout && now - move->stamp >= pairer->timeout);
+            if (!expired) break;
+            int status = move->dir
+                ? add_event_with_path(reader, move->event, move->dir,
+                                      move->dir_len)
+                : add_event_to_queue(reader, move->event);
+            if (status == -1) return -1;
+            *pairer_lookup(pairer, move->event->cookie) = PAIR_DELETED;
+            pending_clear(move);
+            pairer->flushed++;
+            flushed++;
+        }
+        pairer->head++;
+    }
+    if (flushed) stats_queued(reader);
+    if (pairer->head == pairer->len && pairer->len > 0) {
+        pairer->head = pairer->len = 0;
+        for (size_t i = 0; i < pairer->index_capacity; i++)
+            pairer->index[i] = PAIR_EMPTY;
+        pairer->index_used = 0;
+    }
+    return flushed;
+}
+
+static void pairer_settle(InotifyObject *reader) {
+    // Queue the pending halves whose time is up before events are handed
+    // out, so they do not wait for another read. The caller must hold the
+    // reader lock.
+    move_pairer *pairer = reader->pairer;
+    if (!pairer || !pairer->timeout || pairer->head == pairer->len) return;
+    // Halves that cannot be queued for lack of memory stay pending.
+    pairer_flush(reader, 0, monotonic_ns());
+}
+
+static void pairer_free(move_pairer *pairer) {
+    if (!pairer) return;
+    for (size_t i = pairer->head; i < pairer->len; i++)
+        pending_clear(&pairer->moves[i]);
+    PyMem_RawFree(pairer->moves);
+    PyMem_RawFree(pairer->index);
+    PyMem_RawFree(pairer);
+}
+
+static PyObject * reader_set_pair_moves(InotifyObject *reader,
+                                        PyObject *args, PyObject *kwargs) {
+    // Turn rename pairing on or change its limits, or turn it off after
+    // queueing every pending half.
+    char *kwlist[] = {"enabled", "max_reads", "timeout", NULL};
+    int enabled = 1;
+    int max_reads = 1;
+    double timeout = 0.5;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|pid", kwlist, &enabled,
+                                     &max_reads, &timeout))
+        return NULL;
+    if (max_reads < 0) {
+        PyErr_SetString(PyExc_ValueError, "max_reads must not be negative");
+        return NULL;
+    }
+    if (timeout < 0 || timeout > (double) INT_MAX) {
+        PyErr_SetString(PyExc_ValueError,
+                        "timeout must be a positive number of seconds");
+        return NULL;
+    }
+    move_pairer *pairer = NULL;
+    if (enabled) {
+        pairer = PyMem_RawCalloc(1, sizeof (move_pairer));
+        if (!pairer) return PyErr_NoMemory();
+    }
+    reader_lock(reader);
+    move_pairer *old = reader->pairer;
+    if (old && pairer) {
+        // Keep what is pending and the counters.
+        PyMem_RawFree(pairer);
+        pairer = old;
+        old = NULL;
+    }
+    else if (old && pairer_flush(reader, 1, 0) == -1) {
+        reader_unlock(reader);
+        PyMem_RawFree(pairer);
+        return PyErr_NoMemory();
+    }
+    if (pairer) {
+        pairer->max_reads = max_reads;
+        pairer->timeout = (uint64_t) (timeout * 1e9);
+    }
+    reader->pairer = pairer;
+    reader_unlock(reader);
+    pairer_free(old);
+    Py_RETURN_NONE;
+}
+
+static PyObject * reader_flush_moves(InotifyObject *reader) {
+    // Queue every pending half as a plain event and return how many there
+    // were.
+    reader_lock(reader);
+    int flushed = reader->pairer ? pairer_flush(reader, 1, 0) : 0;
+    reader_unlock(reader);
+    if (flushed == -1) return PyErr_NoMemory();
+    return PyLong_FromLong(flushed);
+}
+
+static PyObject * reader_move_stats(InotifyObject *reader) {
+    // Return the number of halves pending, and of renames paired and
+    // halves queued unpaired so far.
+    reader_lock(reader);
+    move_pairer *pairer = reader->pairer;
+    size_t pending = 0;
+    unsigned long long paired = 0, flushed = 0;
+    if (pairer) {
+        for (size_t i = pairer->head; i < pairer->len; i++)
+            pending += pairer->moves[i].event != NULL;
+        paired = pairer->paired;
+        flushed = pairer->flushed;
+    }
+    reader_unlock(reader);
+    return Py_BuildValue("{snsKsK}", "pending", (Py_ssize_t) pending,
+                         "paired", paired, "flushed", flushed);
+}
+
+
+// The drain thread
+
+static void ring_add(_Atomic unsigned long long *counter,
+                     unsigned long long amount) {
+    // Counters have a single writer, so a relaxed load and store will do.
+    atomic_store_explicit(counter, atomic_load_explicit(
+        counter, memory_order_relaxed) + amount, memory_order_relaxed);
+}
+
+static int ring_wait_space(drain_ring *ring) {
+    // Wake the reader and block until it has taken records out of the
+    // ring. Returns -1 if the thread was asked to stop meanwhile.
+    struct pollfd fds[2] = {
+        { .fd = ring->space_fd, .events = POLLIN, .revents = 0 },
+        { .fd = ring->stop_fd, .events = POLLIN, .revents = 0 }
+    };
+    uint64_t count = 1;
+    if (write(ring->wake_fd, &count, sizeof count) == -1) {}
+    while (poll(fds, 2, -1) == -1) {
+        if (errno != EINTR) return -1;
+    }
+    if (fds[1].revents) return -1;
+    if (read(ring->space_fd, &count, sizeof count) == -1) {}
+    return 0;
+}
+
+static int ring_push(drain_ring *ring, const char *chunk, size_t size) {
+    // Copy the records in chunk into the ring, waiting for room or dropping
+    // them according to the policy. Returns -1 if the thread was asked to
+    // stop while it waited.
+    size_t mask = ring->capacity - 1;
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t pos = 0;
+    int stalled = 0;
+    while (pos + sizeof (inotify_event) <= size) {
+        const inotify_event *event = (const inotify_event *) (chunk + pos);
+        size_t record = sizeof (inotify_event) + event->len;
+        if (pos + record > size) break;
+        size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+        if (ring->capacity - (head - tail) < record) {
+            if (ring->policy == RING_DROP) {
+                ring_add(&ring->dropped, 1);
+                atomic_store_explicit(&ring->overflowed, 1,
+                                      memory_order_release);
+                pos += record;
+                continue;
+            }
+            // Publish what is there so the reader can make room.
+            atomic_store_explicit(&ring->head, head, memory_order_release);
+            if (!stalled) ring_add(&ring->stalls, 1);
+            stalled = 1;
+            if (atomic_load_explicit(&ring->stopping, memory_order_acquire))
+                return -1;
+            // Announce the wait before looking at tail again, so a reader
+            // that moves it afterwards sees the flag and signals space_fd.
+            atomic_store(&ring->waiting, 1);
+            if (ring->capacity - (head - atomic_load(&ring->tail)) < record
+                && ring_wait_space(ring) == -1)
+                return -1;
+            atomic_store(&ring->waiting, 0);
+            continue;
+        }
+        stalled = 0;
+        size_t offset = head & mask;
+        size_t first = ring->capacity - offset;
+        if (first >= record) memcpy(ring->data + offset, event, record);
+        else {
+            memcpy(ring->data + offset, event, first);
+            memcpy(ring->data, (const char *) event + first, record - first);
+        }
+        head += record;
+        pos += record;
+        ring_add(&ring->records, 1);
+        ring_add(&ring->bytes, record);
+        if (head - tail > atomic_load_explicit(&ring->high_water,
+                                               memory_order_relaxed))
+            atomic_store_explicit(&ring->high_water, head - tail,
+                                  memory_order_relaxed);
+    }
+    atomic_store_explicit(&ring->head, head, memory_order_release);
+    return 0;
+}
+
+static void * ring_thread(void *arg) {
+    // Block on the inotify descriptor and move everything it returns into
+    // the ring, until stop_fd is signalled or reading fails.
+    drain_ring *ring = arg;
+    // Signals are left to the threads Python runs on.
+    sigset_t signals;
+    sigfillset(&signals);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+    struct pollfd fds[2] = {
+        { .fd = ring->fd, .events = POLLIN, .revents = 0 },
+        { .fd = ring->stop_fd, .events = POLLIN, .revents = 0 }
+    };
+    int error = 0;
+    uint64_t one = 1;
+    for (;;) {
+        if (poll(fds, 2, -1) == -1) {
+            if (errno == EINTR) continue;
+            error = errno;
+            break;
+        }
+        if (fds[1].revents) break;
+        if (fds[0].revents & POLLNVAL) {
+            error = EBADF;
+            break;
+        }
+        ssize_t bytes_read = read(ring->fd, ring->chunk, ring->chunk_size);
+        if (bytes_read == -1) {
+            if (errno == EAGAIN || errno == EINTR) continue;
+            error = errno;
+            break;
+        }
+        ring_add(&ring->reads, 1);
+        if (bytes_read == 0) continue;
+        // Stopping while waiting for room is reported like any stop.
+        if (ring_push(ring, ring->chunk, (size_t) bytes_read) == -1) break;
+        if (write(ring->wake_fd, &one, sizeof one) == -1) {}
+    }
+    // ECANCELED marks a thread that exited because it was asked to.
+    atomic_store_explicit(&ring->error, error ? error : ECANCELED,
+                          memory_order_release);
+    if (write(ring->wake_fd, &one, sizeof one) == -1) {}
+    return NULL;
+}
+
+static int ring_collect(InotifyObject *reader, size_t *bytes) {
+    // Move every record in the ring into the queue, through the buffer so
+    // that they are filtered, paired and coalesced like events read
+    // directly. Dropped events are reported with an IN_Q_OVERFLOW record.
+    // Returns -1 if the queue could not be grown. Runs without the GIL; the
+    // caller must hold the reader lock.
+    drain_ring *ring = reader->ring;
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t available = head - tail;
+    int overflowed = atomic_exchange_explicit(&ring->overflowed, 0,
+                                              memory_order_acquire);
+    *bytes = available;
+    if (available == 0 && !overflowed) return 0;
+    size_t size = available + (overflowed ? sizeof (inotify_event) : 0);
+    if (buffer_reserve(reader, size) == -1) {
+        if (overflowed) atomic_store(&ring->overflowed, 1);
+        return -1;
+    }
+    size_t offset = tail & (ring->capacity - 1);
+    size_t first = ring->capacity - offset;
+    if (first >= available)
+        memcpy(reader->buffer, ring->data + offset, available);
+    else {
+        memcpy(reader->buffer, ring->data + offset, first);
+        memcpy(reader->buffer + first, ring->data, available - first);
+    }
+    atomic_store(&ring->tail, head);
+    if (available && atomic_load(&ring->waiting)) {
+        uint64_t one = 1;
+        if (write(ring->space_fd, &one, sizeof one) == -1) {}
+    }
+    if (overflowed) {
+        inotify_event *marker = (inotify_event *)
+            (reader->buffer + available);
+        *marker = (inotify_event) { .wd = -1, .mask = IN_Q_OVERFLOW,
+                                    .cookie = 0, .len = 0 };
+    }
+    reader->buffer_size = (ssize_t) size;
+    reader->buffer_pos = 0;
+    return parse_buffer(reader, reader->fd);
+}
+
+static int ring_take(InotifyObject *reader, size_t *bytes) {
+    // ring_collect() with the GIL released, so that parsing, following new
+    // directories and a rescan after an overflow do not hold up other
+    // threads. An empty ring is not worth releasing it for. The caller must
+    // hold the GIL and the reader lock.
+    drain_ring *ring = reader->ring;
+    *bytes = 0;
+    if (atomic_load(&ring->head) == atomic_load(&ring->tail) &&
+        !atomic_load(&ring->overflowed))
+        return 0;
+    int status;
+    Py_BEGIN_ALLOW_THREADS
+    status = ring_collect(reader, bytes);
+    Py_END_ALLOW_THREADS
+    return status;
+}
+
+static int ring_fill(InotifyObject *reader, long *syscalls, size_t *bytes) {
+    // reader_fill() for a reader whose drain thread is running: queue what
+    // the thread has put in the ring. Returns FILL_WOULD_BLOCK if the ring
+    // is empty and the descriptor is blocking, so that the caller waits on
+    // wake_fd. The caller must hold the GIL and the reader lock.
+    drain_ring *ring = reader->ring;
+    // Clear the wakeup before looking, so none is missed afterwards.
+    uint64_t wakeups;
+    if (read(reader->wake_fd, &wakeups, sizeof wakeups) == -1) {}
+    (*syscalls)++;
+    if (ring_take(reader, bytes) == -1) return FILL_NOMEM;
+    if (*bytes > 0) return FILL_OK;
+    int error = atomic_load_explicit(&ring->error, memory_order_acquire);
+    if (error) {
+        reader->_utils_errno = error;
+        return FILL_ERRNO;
+    }
+    int flags = fcntl(reader->fd, F_GETFL);
+    (*syscalls)++;
+    if (flags != -1 && (flags & O_NONBLOCK)) {
+        reader->_utils_errno = EAGAIN;
+        return FILL_ERRNO;
+    }
+    return FILL_WOULD_BLOCK;
+}
+
+static void ring_stop(InotifyObject *reader) {
+    // Stop the drain thread, queue whatever it left in the ring and free
+    // it. The caller must hold the reader lock.
+    drain_ring *ring = reader->ring;
+    if (!ring) return;
+    uint64_t one = 1;
+    atomic_store_explicit(&ring->stopping, 1, memory_order_release);
+    if (write(ring->stop_fd, &one, sizeof one) == -1) {}
+    pthread_join(ring->thread, NULL);
+    size_t bytes;
+    // Anything that cannot be queued for lack of memory is lost.
+    ring_collect(reader, &bytes);
+    reader->ring = NULL;
+    close(ring->stop_fd);
+    close(ring->space_fd);
+    PyMem_RawFree(ring->chunk);
+    PyMem_RawFree(ring->data);
+    PyMem_RawFree(ring);
+}
+
+static void reader_settle(InotifyObject *reader) {
+    // Bring the queue up to date before events are handed out: take in
+    // what the drain thread has read, and the rename halves whose time is
+    // up. The caller must hold the GIL and the reader lock.
+    if (reader->ring) {
+        size_t bytes;
+        // Events that cannot be queued for lack of memory stay in the
+        // ring for the next call.
+        ring_take(reader, &bytes);
+    }
+    pairer_settle(reader);
+}
+
+static PyObject * reader_start_thread(InotifyObject *reader, PyObject *args,
+                                      PyObject *kwargs) {
+    // Start a native thread that drains the inotify descriptor into a ring
+    // as soon as events arrive, so that the kernel queue does not overflow
+    // while Python is busy.
+    char *kwlist[] = {"capacity", "policy", NULL};
+    Py_ssize_t capacity = 1024 * 1024;
+    const char *policy_name = "block";
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|ns", kwlist, &capacity,
+                                     &policy_name))
+        return NULL;
+    if (reader->fan) {
+        // The ring holds raw events, which only parse as inotify ones.
+        PyErr_SetString(PyExc_ValueError,
+                        "fanotify readers have no drain thread");
+        return NULL;
+    }
+    int policy;
+    if (strcmp(policy_name, "block") == 0) policy = RING_BLOCK;
+    else if (strcmp(policy_name, "drop") == 0) policy = RING_DROP;
+    else {
+        PyErr_SetString(PyExc_ValueError,
+                        "policy must be 'block' or 'drop'");
+        return NULL;
+    }
+    if (capacity < MIN_RING_CAPACITY || capacity > MAX_READABLE_BYTES) {
+        return PyErr_Format(PyExc_ValueError,
+                            "capacity must be between %d and %d bytes",
+                            MIN_RING_CAPACITY, MAX_READABLE_BYTES);
+    }
+    if (reader_check_open(reader) == -1) return NULL;
+    // Round up to a power of two, so positions are reduced with a mask.
+    size_t size = MIN_RING_CAPACITY;
+    while (size < (size_t) capacity) size *= 2;
+    drain_ring *ring = PyMem_RawCalloc(1, sizeof (drain_ring));
+    if (!ring) return PyErr_NoMemory();
+    ring->capacity = size;
+    ring->policy = policy;
+    ring->chunk_size = DEFAULT_DRAIN_CAPACITY;
+    ring->data = PyMem_RawMalloc(size);
+    ring->chunk = PyMem_RawMalloc(ring->chunk_size);
+    ring->stop_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    ring->space_fd = ring->stop_fd == -1 ? -1
+        : eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (!ring->data || !ring->chunk || ring->space_fd == -1) {
+        int error = ring->space_fd == -1 ? errno : ENOMEM;
+        if (ring->stop_fd != -1) close(ring->stop_fd);
+        if (ring->space_fd != -1) close(ring->space_fd);
+        PyMem_RawFree(ring->chunk);
+        PyMem_RawFree(ring->data);
+        PyMem_RawFree(ring);
+        errno = error;
+        return PyErr_SetFromErrno(PyExc_OSError);
+    }
+    reader_lock(reader);
+    int error = 0;
+    if (reader->ring) {
+        reader_unlock(reader);
+        close(ring->stop_fd);
+        close(ring->space_fd);
+        PyMem_RawFree(ring->chunk);
+        PyMem_RawFree(ring->data);
+        PyMem_RawFree(ring);
+        PyErr_SetString(PyExc_RuntimeError,
+                        "The drain thread is already running");
+        return NULL;
+    }
+    if (reader->wake_fd == -1) {
+        reader->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (reader->wake_fd == -1) error = errno;
+    }
+    if (!error) {
+        ring->fd = reader->fd;
+        ring->wake_fd = reader->wake_fd;
+        error = pthread_create(&ring->thread, NULL, ring_thread, ring);
+    }
+    if (!error) reader->ring = ring;
+    reader_unlock(reader);
+    if (error) {
+        close(ring->stop_fd);
+        close(ring->space_fd);
+        PyMem_RawFree(ring->chunk);
+        PyMem_RawFree(ring->data);
+        PyMem_RawFree(ring);
+        errno = error;
+        return PyErr_SetFromErrno(PyExc_OSError);
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject * reader_stop_thread(InotifyObject *reader) {
+    // Stop the drain thread, keeping the events it has read.
+    reader_lock(reader);
+    Py_BEGIN_ALLOW_THREADS
+    ring_stop(reader);
+    Py_END_ALLOW_THREADS
+    reader_unlock(reader);
+    Py_RETURN_NONE;
+}
+
+static PyObject * reader_ring_stats(InotifyObject *reader) {
+    // Return the state of the ring and what the drain thread has done so
+    // far, or None if it is not running.
+    reader_lock(reader);
+    drain_ring *ring = reader->ring;
+    if (!ring) {
+        reader_unlock(reader);
+        Py_RETURN_NONE;
+    }
+    size_t head = atomic_load(&ring->head), tail = atomic_load(&ring->tail);
+    int error = atomic_load(&ring->error);
+    PyObject *stats = Py_BuildValue(
+        "{snsnsnsKsKsKsKsKsssO}",
+        "capacity", (Py_ssize_t) ring->capacity,
+        "used", (Py_ssize_t) (head - tail),
+        "high_water", (Py_ssize_t) atomic_load(&ring->high_water),
+        "records", (unsigned long long) atomic_load(&ring->records),
+        "bytes", (unsigned long long) atomic_load(&ring->bytes),
+        "reads", (unsigned long long) atomic_load(&ring->reads),
+        "dropped", (unsigned long long) atomic_load(&ring->dropped),
+        "stalls", (unsigned long long) atomic_load(&ring->stalls),
+        "policy", ring->policy == RING_DROP ? "drop" : "block",
+        "running", error ? Py_False : Py_True);
+    reader_unlock(reader);
+    return stats;
+}
+
+
+// Statistics
+
+static void stats_queued(InotifyObject *reader) {
+    // Note the length of the queue after events were added to it, and when
+    // the first of them were read if it was empty. The caller must hold
+    // the reader lock.
+    reader_stats *stats = &reader->stats;
+    if (reader->iel_length > stats->peak_queue)
+        stats->peak_queue = reader->iel_length;
+    if (!stats->queued_at && reader->iel_length > 0)
+        stats->queued_at = monotonic_ns();
+}
+
+static void stats_delivered(InotifyObject *reader) {
+    // Count how long the oldest events handed to Python waited since they
+    // were read. If some are left in the queue, the next delivery is
+    // measured from the same read. The caller must hold the reader lock.
+    reader_stats *stats = &reader->stats;
+    if (!stats->queued_at) return;
+    uint64_t waited = (monotonic_ns() - stats->queued_at) / 1000;
+    int bucket = 0;
+    while (waited && bucket < LATENCY_BUCKETS - 1) {
+        waited >>= 1;
+        bucket++;
+    }
+    stats->latency[bucket]++;
+    if (reader->iel_length == 0) stats->queued_at = 0;
+}
+
+static PyObject * reader_get_stats(InotifyObject *reader) {
+    // Return the counters of reader and its latency histogram.
+    reader_lock(reader);
+    reader_stats copy = reader->stats;
+    Py_ssize_t length = reader->iel_length;
+    reader_unlock(reader);
+    // The name cache is guarded by the GIL, not the lock.
+    name_cache *names = reader->names;
+    PyObject *latency = PyTuple_New(LATENCY_BUCKETS);
+    if (!latency) return NULL;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        PyObject *count = PyLong_FromUnsignedLongLong(copy.latency[i]);
+        if (!count) {
+            Py_DECREF(latency);
+            return NULL;
+        }
+        PyTuple_SET_ITEM(latency, i, count);
+    }
+    return Py_BuildValue("{sKsKsKsKsKsnsnsKsKsKsKsN}",
+                         "reads", copy.reads,
+                         "bytes", copy.bytes,
+                         "events", copy.events,
+                         "filtered", copy.filtered,
+                         "overflows", copy.overflows,
+                         "queue_length", length,
+                         "peak_queue_length", (Py_ssize_t) copy.peak_queue,
+                         "buffer_regrowths", copy.buffer_regrowths,
+                         "queue_regrowths", copy.queue_regrowths,
+                         "name_cache_hits", names ? names->hits : 0ULL,
+                         "name_cache_misses", names ? names->misses : 0ULL,
+                         "latency", latency);
+}
+
+
+// Recursive watches
+
+static size_t tree_slot(watch_tree *tree, int wd) {
+    return ((uint32_t) wd * 2654435761u) & (tree->capacity - 1);
+}
+
+static wd_entry * tree_find(watch_tree *tree, int wd) {
+    // Return the entry for wd, or NULL if it is not part of the tree.
+    if (tree->count == 0 || wd < 0) return NULL;
+    size_t i = tree_slot(tree, wd);
+    for (;;) {
+        wd_entry *entry = &tree->slots[i];
+        if (entry->wd == wd) return entry;
+        if (entry->wd == TREE_EMPTY) return NULL;
+        i = (i + 1) & (tree->capacity - 1);
+    }
+}
+
+static int tree_resize(watch_tree *tree, size_t count) {
+    // Rehash into a table that keeps count entries below 3/4 load.
+    size_t capacity = 64;
+    while (count * 4 >= capacity * 3) capacity *= 2;
+    wd_entry *slots = PyMem_RawMalloc(capacity * sizeof (wd_entry));
+    if (!slots) return -1;
+    for (size_t i = 0; i < capacity; i++) {
+        slots[i].wd = TREE_EMPTY;
+        slots[i].path = NULL;
+        slots[i].len = 0;
+        slots[i].snap = NULL;
+        slots[i].active = 0;
+        slots[i].evicted = 0;
+        slots[i].detached = 0;
+    }
+    wd_entry *old = tree->slots;
+    size_t old_capacity = tree->capacity;
+    tree->slots = slots;
+    tree->capacity = capacity;
+    tree->tombstones = 0;
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (old[i].wd < 0) continue;
+        size_t j = tree_slot(tree, old[i].wd);
+        while (slots[j].wd != TREE_EMPTY) j = (j + 1) & (capacity - 1);
+        slots[j] = old[i];
+    }
+    PyMem_RawFree(old);
+    return 0;
+}
+
+static int tree_put(watch_tree *tree, int wd, char *path, size_t len) {
+    // Map wd to path, taking ownership of path. The kernel hands back the
+    // same wd for a directory that is already watched, so a moved directory
+    // simply has its path replaced.
+    wd_entry *entry = tree_find(tree, wd);
+    if (entry) {
+        PyMem_RawFree(entry->path);
+        entry->path = path;
+        entry->len = len;
+        if (entry->evicted) tree->evicting--;
+        entry->evicted = 0;
+        entry->detached = 0;
+        return 0;
+    }
+    if ((tree->count + tree->tombstones + 1) * 4 >= tree->capacity * 3 &&
+        tree_resize(tree, tree->count + 1) == -1)
+        return -1;
+    size_t i = tree_slot(tree, wd);
+    while (tree->slots[i].wd >= 0) i = (i + 1) & (tree->capacity - 1);
+    if (tree->slots[i].wd == TREE_DELETED) tree->tombstones--;
+    tree->slots[i].wd = wd;
+    tree->slots[i].path = path;
+    tree->slots[i].len = len;
+    tree->slots[i].snap = NULL;
+    tree->slots[i].active = tree->ticks;
+    tree->slots[i].evicted = 0;
+    tree->slots[i].detached = 0;
+    tree->count++;
+    return 0;
+}
+
+static void tree_remove(watch_tree *tree, int wd) {
+    wd_entry *entry = tree_find(tree, wd);
+    if (!entry) return;
+    PyMem_RawFree(entry->path);
+    entry->path = NULL;
+    snap_free(entry->snap);
+    entry->snap = NULL;
+    if (entry->evicted) tree->evicting--;
+    entry->evicted = 0;
+    entry->detached = 0;
+    entry->wd = TREE_DELETED;
+    tree->count--;
+    tree->tombstones++;
+}
+
+static void tree_free(watch_tree *tree) {
+    for (size_t i = 0; i < tree->capacity; i++) {
+        PyMem_RawFree(tree->slots[i].path);
+        snap_free(tree->slots[i].snap);
+    }
+    PyMem_RawFree(tree->slots);
+    tree->slots = NULL;
+    tree->capacity = tree->count = tree->tombstones = tree->evicting = 0;
+    budget_free(tree->budget);
+    tree->budget = NULL;
+    for (size_t i = 0; i < tree->follow_len; i++)
+        PyMem_RawFree(tree->follow[i]);
+    PyMem_RawFree(tree->follow);
+    PyMem_RawFree(tree->follow_lens);
+    PyMem_RawFree(tree->follow_created);
+    tree->follow = NULL;
+    tree->follow_lens = NULL;
+    tree->follow_created = NULL;
+    tree->follow_len = tree->follow_capacity = 0;
+    for (size_t i = 0; i < tree->moves_len; i++)
+        PyMem_RawFree(tree->moves[i].path);
+    PyMem_RawFree(tree->moves);
+    tree->moves = NULL;
+    tree->moves_len = tree->moves_capacity = 0;
+}
+
+static char * join_path(const char *dir, size_t dir_len, const char *name,
+                        size_t name_len, size_t *len) {
+    // Return dir/name in a new allocation, or NULL if out of memory.
+    int root = (dir_len == 1 && dir[0] == '/');
+    *len = dir_len + (root ? 0 : 1) + name_len;
+    char *path = PyMem_RawMalloc(*len + 1);
+    if (!path) return NULL;
+    memcpy(path, dir, dir_len);
+    if (!root) path[dir_len] = '/';
+    memcpy(path + *len - name_len, name, name_len);
+    path[*len] = '\0';
+    return path;
+}
+
+static int walk_push(tree_walk *walk, int wd, char *path, size_t len) {
+    if (walk->len == walk->capacity) {
+        size_t capacity = walk->capacity ? walk->capacity * 2 : 64;
+        int *wds = PyMem_RawRealloc(walk->wds, capacity * sizeof (int));
+        if (wds) walk->wds = wds;
+        char **paths = PyMem_RawRealloc(walk->paths,
+                                        capacity * sizeof (char *));
+        if (paths) walk->paths = paths;
+        size_t *lens = PyMem_RawRealloc(walk->lens,
+                                        capacity * sizeof (size_t));
+        if (lens) walk->lens = lens;
+        snap_dir **snaps = PyMem_RawRealloc(walk->snaps,
+                                            capacity * sizeof (snap_dir *));
+        if (snaps) walk->snaps = snaps;
+        if (!wds || !paths || !lens || !snaps) return -1;
+        walk->capacity = capacity;
+    }
+    walk->wds[walk->len] = wd;
+    walk->paths[walk->len] = path;
+    walk->lens[walk->len] = len;
+    walk->snaps[walk->len] = NULL;
+    walk->len++;
+    return 0;
+}
+
+static void walk_free(tree_walk *walk) {
+    // Release whatever paths were not merged into a tree.
+    for (size_t i = 0; i < walk->len; i++) {
+        PyMem_RawFree(walk->paths[i]);
+        snap_free(walk->snaps[i]);
+    }
+    PyMem_RawFree(walk->wds);
+    PyMem_RawFree(walk->paths);
+    PyMem_RawFree(walk->lens);
+    PyMem_RawFree(walk->snaps);
+}
+
+static void tree_walk_dir(int fd, char *root, size_t root_len, uint32_t mask,
+                          tree_walk *walk) {
+    // Watch root and every directory below it, without following symbolic
+    // links, and collect the watch descriptors in walk. Takes ownership of
+    // root. The walk is iterative and reads each directory once with
+    // readdir(3), relying on d_type to skip everything but directories.
+    // Runs without the GIL and without the reader lock.
+    size_t stack_len = 0, stack_capacity = 64;
+    char **stack = PyMem_RawMalloc(stack_capacity * sizeof (char *));
+    size_t *stack_lens = PyMem_RawMalloc(stack_capacity * sizeof (size_t));
+    if (!stack || !stack_lens) {
+        PyMem_RawFree(stack);
+        PyMem_RawFree(stack_lens);
+        PyMem_RawFree(root);
+        walk->error = ENOMEM;
+        return;
+    }
+    stack[stack_len] = root;
+    stack_lens[stack_len++] = root_len;
+    while (stack_len > 0) {
+        char *path = stack[--stack_len];
+        size_t len = stack_lens[stack_len];
+        int wd = -1;
+        int error = 0;
+        if (walk->room > 0) {
+            wd = inotify_add_watch(fd, path, mask);
+            if (wd == -1) error = errno;
+            else walk->room--;
+        }
+        if (error == ENOSPC) {
+            // Every further watch would fail the same way.
+            walk->enospc = 1;
+            walk->room = 0;
+        }
+        // With a watch budget, a directory left without a watch for want
+        // of one is polled instead.
+        if (wd == -1 && !(walk->poll && (error == 0 || error == ENOSPC))) {
+            walk->failed++;
+            if (!walk->error) walk->error = error;
+            PyMem_RawFree(path);
+            if (error == ENOSPC) break;
+            continue;
+        }
+        if (wd == -1) walk->polled++;
+        DIR *dir = opendir(path);
+        if (walk_push(walk, wd, path, len) == -1) {
+            PyMem_RawFree(path);
+            if (dir) closedir(dir);
+            walk->error = ENOMEM;
+            break;
+        }
+        if (!dir) continue;
+        // Without memory, the directory gets its snapshot at the next
+        // rescan.
+        if (walk->snapshots && wd != -1)
+            snap_scan(path, &walk->snaps[walk->len - 1]);
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL) {
+            const char *name = entry->d_name;
+            if (name[0] == '.' && (name[1] == '\0' ||
+                (name[1] == '.' && name[2] == '\0')))
+                continue;
+            if (entry->d_type != DT_DIR) {
+                if (entry->d_type != DT_UNKNOWN) continue;
+                struct stat info;
+                if (fstatat(dirfd(dir), name, &info,
+                            AT_SYMLINK_NOFOLLOW) == -1 ||
+                    !S_ISDIR(info.st_mode))
+                    continue;
+            }
+            if (stack_len == stack_capacity) {
+                size_t capacity = stack_capacity * 2;
+                char **grown = PyMem_RawRealloc(stack,
+                                                capacity * sizeof (char *));
+                if (grown) stack = grown;
+                size_t *grown_lens = PyMem_RawRealloc(
+                    stack_lens, capacity * sizeof (size_t));
+                if (grown_lens) stack_lens = grown_lens;
+                if (!grown || !grown_lens) {
+                    walk->error = ENOMEM;
+                    break;
+                }
+                stack_capacity = capacity;
+            }
+            size_t child_len;
+            char *child = join_path(path, len, name, strlen(name),
+                                    &child_len);
+            if (!child) {
+                walk->error = ENOMEM;
+                break;
+            }
+            stack[stack_len] = child;
+            stack_lens[stack_len++] = child_len;
+        }
+        closedir(dir);
+        if (walk->error == ENOMEM) break;
+    }
+    while (stack_len > 0) PyMem_RawFree(stack[--stack_len]);
+    PyMem_RawFree(stack);
+    PyMem_RawFree(stack_lens);
+}
+
+static int tree_merge(watch_tree *tree, tree_walk *walk) {
+    // Move the directories found by walk into tree. Returns -1 if the table
+    // could not be grown; the remaining paths are left in walk.
+    if ((tree->count + walk->len) * 4 >= tree->capacity * 3 &&
+        tree_resize(tree, tree->count + walk->len) == -1)
+        return -1;
+    size_t merged = 0, watched = 0;
+    for (; merged < walk->len; merged++) {
+        if (walk->wds[merged] == -1) {
+            // Polled from the start, the directory takes no slot.
+            if (budget_add(tree->budget, walk->paths[merged],
+                           walk->lens[merged], NULL) == -1)
+                break;
+            continue;
+        }
+        if (tree_put(tree, walk->wds[merged], walk->paths[merged],
+                     walk->lens[merged]) == -1)
+            break;
+        watched++;
+        // A directory that cannot be scanned gets its snapshot at the next
+        // rescan. The walk took one already, unless snapshots were turned
+        // on while it ran.
+        wd_entry *entry = tree_find(tree, walk->wds[merged]);
+        snap_dir *snap = walk->snaps[merged];
+        walk->snaps[merged] = NULL;
+        if (!tree->snapshots || entry->snap) snap_free(snap);
+        else if (snap) entry->snap = snap;
+        else snap_scan(entry->path, &entry->snap);
+    }
+    tree->added += watched;
+    tree->failed += walk->failed;
+    // Whatever is left is freed by walk_free()
+    size_t left = walk->len - merged;
+    memmove(walk->wds, walk->wds + merged, left * sizeof (int));
+    memmove(walk->paths, walk->paths + merged, left * sizeof (char *));
+    memmove(walk->lens, walk->lens + merged, left * sizeof (size_t));
+    memmove(walk->snaps, walk->snaps + merged, left * sizeof (snap_dir *));
+    walk->len = left;
+    return walk->len ? -1 : 0;
+}
+
+static void tree_follow(InotifyObject *reader, int fd, const char *dir,
+                        size_t dir_len, const char *name, size_t name_len,
+                        int created) {
+    // Watch the directory name of dir, which was created in, or moved into,
+    // the tree. It is only queued here, and walked through fd by
+    // reader_unlock(). Runs while parsing, without the GIL and with the
+    // reader lock held.
+    watch_tree *tree = &reader->tree;
+    tree->follow_fd = fd;
+    if (tree->follow_len == tree->follow_capacity) {
+        size_t capacity = tree->follow_capacity
+                          ? 2 * tree->follow_capacity : 16;
+        char **follow = PyMem_RawRealloc(tree->follow,
+                                         capacity * sizeof (char *));
+        if (follow) tree->follow = follow;
+        size_t *lens = PyMem_RawRealloc(tree->follow_lens,
+                                        capacity * sizeof (size_t));
+        if (lens) tree->follow_lens = lens;
+        int *flags = PyMem_RawRealloc(tree->follow_created,
+                                      capacity * sizeof (int));
+        if (flags) tree->follow_created = flags;
+        if (!follow || !lens || !flags) {
+            tree->failed++;
+            return;
+        }
+        tree->follow_capacity = capacity;
+    }
+    size_t len;
+    char *path = join_path(dir, dir_len, name, name_len, &len);
+    if (!path) {
+        tree->failed++;
+        return;
+    }
+    tree->follow[tree->follow_len] = path;
+    tree->follow_created[tree->follow_len] = created;
+    tree->follow_lens[tree->follow_len++] = len;
+}
+
+static void walk_start(InotifyObject *reader) {
+    // Note a walk about to add watches through fd without the reader lock,
+    // so that close() keeps fd open until it is done. The caller must hold
+    // the reader lock and have checked that the reader is open.
+    atomic_fetch_add(&reader->walkers, 1);
+}
+
+static void walk_done(InotifyObject *reader) {
+    // End a walk, waking a close() that waits for the last one.
+    if (atomic_fetch_sub(&reader->walkers, 1) == 1)
+        futex_wake(&reader->walkers);
+}
+
+static void follow_report(InotifyObject *reader, tree_walk *walk,
+                          size_t start, size_t end) {
+    // Queue an IN_CREATE for every entry of the directories walk found
+    // from start to end, below a directory created in the tree. They may
+    // also be reported by the kernel, if they were created after the
+    // watch. Without memory, the rest goes unreported. Runs without the
+    // GIL, with the reader lock held.
+    for (size_t i = start; i < end && i < walk->len; i++) {
+        snap_dir *snap = walk->snaps[i];
+        if (!snap) continue;
+        for (size_t j = 0; j < snap->capacity; j++) {
+            snap_entry *entry = &snap->entries[j];
+            if (entry->name &&
+                snap_queue(reader, walk->wds[i], walk->paths[i],
+                           walk->lens[i], entry, IN_CREATE) == -1)
+                return;
+        }
+    }
+}
+
+static void tree_follow_pending(InotifyObject *reader) {
+    // Watch the directories tree_follow() queued. The walk runs without
+    // the reader lock, like add_tree(), so that a large directory moved
+    // into the tree does not hold up everyone else reading the queue.
+    // Runs without the GIL and without the reader lock.
+    watch_tree *tree = &reader->tree;
+    PyThread_acquire_lock(reader->lock, WAIT_LOCK);
+    if (tree->follow_len == 0 || reader->closed) {
+        PyThread_release_lock(reader->lock);
+        return;
+    }
+    int fd = tree->follow_fd;
+    char **follow = tree->follow;
+    size_t *lens = tree->follow_lens;
+    int *created = tree->follow_created;
+    size_t count = tree->follow_len;
+    tree->follow = NULL;
+    tree->follow_lens = NULL;
+    tree->follow_created = NULL;
+    tree->follow_len = tree->follow_capacity = 0;
+    tree_walk walk = {0};
+    walk_budget(tree, &walk);
+    int snapshots = tree->snapshots;
+    uint32_t mask = tree->mask;
+    walk_start(reader);
+    PyThread_release_lock(reader->lock);
+    // Whatever was created in a new directory before its watch was added
+    // raised no event, so the walk scans the directories below the created
+    // ones. ends[i] is where those of follow[i] end in walk.
+    size_t *ends = PyMem_RawCalloc(count, sizeof (size_t));
+    size_t i = 0;
+    for (; i < count && walk.error != ENOMEM; i++) {
+        walk.snapshots = snapshots || (ends && created[i]);
+        tree_walk_dir(fd, follow[i], lens[i], mask, &walk);
+        if (ends) ends[i] = walk.len;
+    }
+    for (; i < count; i++) PyMem_RawFree(follow[i]);
+    PyMem_RawFree(follow);
+    PyMem_RawFree(lens);
+    PyThread_acquire_lock(reader->lock, WAIT_LOCK);
+    // The watches of a reader closed meanwhile went away with fd.
+    if (!reader->closed) {
+        for (size_t j = 0, start = 0; ends && j < count; j++) {
+            if (created[j]) follow_report(reader, &walk, start, ends[j]);
+            start = ends[j];
+        }
+        stats_queued(reader);
+        if (tree_merge(tree, &walk) == -1) tree->failed += walk.len;
+        budget_settle(reader, fd, walk.enospc);
+    }
+    PyThread_release_lock(reader->lock);
+    walk_done(reader);
+    walk_free(&walk);
+    PyMem_RawFree(created);
+    PyMem_RawFree(ends);
+}
+
+static int path_under(const char *path, size_t len, const char *top,
+                      size_t top_len) {
+    // Return 1 if path is top or lies below it.
+    return len >= top_len && memcmp(path, top, top_len) == 0 &&
+           (len == top_len || path[top_len] == '/');
+}
+
+static char * path_rebase(const char *path, size_t len, size_t from_len,
+                          const char *to, size_t to_len, size_t *out_len) {
+    // Return path with its first from_len bytes replaced by to, in a new
+    // allocation, or NULL if out of memory.
+    *out_len = to_len + (len - from_len);
+    char *moved = PyMem_RawMalloc(*out_len + 1);
+    if (!moved) return NULL;
+    memcpy(moved, to, to_len);
+    memcpy(moved + to_len, path + from_len, len - from_len + 1);
+    return moved;
+}
+
+static void tree_move_from(watch_tree *tree, inotify_event *event,
+                           wd_entry *dir) {
+    // Remember that a directory of the tree was renamed, until its
+    // IN_MOVED_TO tells where to. Without memory, the directory keeps its
+    // watches, as if it had stayed in the tree.
+    if (tree->moves_len == tree->moves_capacity) {
+        size_t capacity = tree->moves_capacity
+                          ? 2 * tree->moves_capacity : 8;
+        tree_move *moves = PyMem_RawRealloc(tree->moves,
+                                            capacity * sizeof (tree_move));
+        if (!moves) return;
+        tree->moves = moves;
+        tree->moves_capacity = capacity;
+    }
+    size_t len;
+    char *path = join_path(dir->path, dir->len, event->name,
+                           strnlen(event->name, event->len), &len);
+    if (!path) return;
+    tree->moves[tree->moves_len++] = (tree_move) {
+        .cookie = event->cookie, .path = path, .len = len, .stale = 0 };
+}
+
+static void tree_move_drop(watch_tree *tree, size_t i) {
+    PyMem_RawFree(tree->moves[i].path);
+    tree->moves[i] = tree->moves[--tree->moves_len];
+}
+
+static size_t tree_rename(watch_tree *tree, tree_move *move,
+                          const char *to, size_t to_len) {
+    // Give every directory below the path move renamed its new path, and
+    // return how many were watched or polled. Without memory, a directory
+    // keeps its old path.
+    size_t renamed = 0;
+    for (size_t i = 0; i < tree->capacity; i++) {
+        wd_entry *entry = &tree->slots[i];
+        if (entry->wd < 0 || entry->detached ||
+            !path_under(entry->path, entry->len, move->path, move->len))
+            continue;
+        size_t len;
+        char *path = path_rebase(entry->path, entry->len, move->len, to,
+                                 to_len, &len);
+        renamed++;
+        if (!path) continue;
+        PyMem_RawFree(entry->path);
+        entry->path = path;
+        entry->len = len;
+    }
+    watch_budget *budget = tree->budget;
+    for (size_t i = 0; budget && i < budget->polled_len; i++) {
+        polled_dir *dir = &budget->polled[i];
+        if (!path_under(dir->path, dir->len, move->path, move->len))
+            continue;
+        size_t len;
+        char *path = path_rebase(dir->path, dir->len, move->len, to, to_len,
+                                 &len);
+        renamed++;
+        if (!path) continue;
+        PyMem_RawFree(dir->path);
+        dir->path = path;
+        dir->len = len;
+    }
+    return renamed;
+}
+
+static void tree_detach(InotifyObject *reader, int fd, const char *top,
+                        size_t top_len) {
+    // Stop watching, or polling, the directories at and below top, which
+    // were moved out of the tree.
+    watch_tree *tree = &reader->tree;
+    for (size_t i = 0; i < tree->capacity; i++) {
+        wd_entry *entry = &tree->slots[i];
+        if (entry->wd < 0 || entry->detached ||
+            !path_under(entry->path, entry->len, top, top_len))
+            continue;
+        if (!entry->evicted && inotify_rm_watch(fd, entry->wd) == -1) {
+            // The kernel dropped the watch already.
+            tree_remove(tree, entry->wd);
+            continue;
+        }
+        if (!entry->evicted) tree->evicting++;
+        entry->evicted = 1;
+        entry->detached = 1;
+    }
+    watch_budget *budget = tree->budget;
+    for (size_t i = 0; budget && i < budget->polled_len;) {
+        polled_dir *dir = &budget->polled[i];
+        if (!path_under(dir->path, dir->len, top, top_len)) {
+            i++;
+            continue;
+        }
+        polled_free(dir);
+        budget->polled[i] = budget->polled[--budget->polled_len];
+    }
+}
+
+static void tree_note(InotifyObject *reader, int fd, wd_entry *dir,
+                      inotify_event *event) {
+    // Keep the tree in step with an event on its directory dir, whether or
+    // not the event is delivered. Runs while parsing, without the GIL and
+    // with the reader lock held.
+    watch_tree *tree = &reader->tree;
+    uint32_t mask = event->mask;
+    if (mask & IN_IGNORED) {
+        tree_remove(tree, event->wd);
+        return;
+    }
+    if (mask & IN_MOVE_SELF) {
+        // A directory renamed without an IN_MOVED_TO in the tree left it.
+        for (size_t i = 0; i < tree->moves_len; i++) {
+            tree_move *move = &tree->moves[i];
+            if (move->len == dir->len &&
+                memcmp(move->path, dir->path, dir->len) == 0) {
+                tree_detach(reader, fd, move->path, move->len);
+                tree_move_drop(tree, i);
+                break;
+            }
+        }
+        return;
+    }
+    if (!(mask & IN_ISDIR) || event->len == 0) return;
+    if (mask & IN_MOVED_FROM) {
+        tree_move_from(tree, event, dir);
+        return;
+    }
+    if (mask & IN_MOVED_TO) {
+        // Renamed within the tree, the directory keeps its watches.
+        for (size_t i = 0; i < tree->moves_len; i++) {
+            tree_move *move = &tree->moves[i];
+            if (move->cookie != event->cookie) continue;
+            size_t len;
+            char *to = join_path(dir->path, dir->len, event->name,
+                                 strnlen(event->name, event->len), &len);
+            size_t renamed = to ? tree_rename(tree, move, to, len) : 0;
+            PyMem_RawFree(to);
+            tree_move_drop(tree, i);
+            if (renamed) return;
+            break;
+        }
+    }
+    if (mask & (IN_CREATE | IN_MOVED_TO))
+        tree_follow(reader, fd, dir->path, dir->len, event->name,
+                    strnlen(event->name, event->len), (mask & IN_CREATE) != 0);
+}
+
+static void tree_settle_moves(InotifyObject *reader, int fd) {
+    // At the end of a read, a rename still pending from the read before
+    // has no IN_MOVED_TO coming: its directory left the tree.
+    watch_tree *tree = &reader->tree;
+    for (size_t i = 0; i < tree->moves_len;) {
+        tree_move *move = &tree->moves[i];
+        if (!move->stale) {
+            move->stale = 1;
+            i++;
+            continue;
+        }
+        tree_detach(reader, fd, move->path, move->len);
+        tree_move_drop(tree, i);
+    }
+}
+
+static PyObject * reader_add_tree(InotifyObject *reader, int fd,
+                                  PyObject *path, unsigned long mask) {
+    // Watch path and every directory below it. The walk and the
+    // inotify_add_watch() calls run without the GIL.
+    PyObject *encoded;
+    if (!PyUnicode_FSConverter(path, &encoded)) return NULL;
+    size_t len = (size_t) PyBytes_GET_SIZE(encoded);
+    const char *text = PyBytes_AS_STRING(encoded);
+    while (len > 1 && text[len - 1] == '/') len--;
+    char *root = PyMem_RawMalloc(len + 1);
+    if (!root) {
+        Py_DECREF(encoded);
+        return PyErr_NoMemory();
+    }
+    memcpy(root, text, len);
+    root[len] = '\0';
+    Py_DECREF(encoded);
+    // New subdirectories can only be followed if their creation is seen,
+    // and directories moved out of the tree only dropped if their rename is.
+    uint32_t watch_mask = ((uint32_t) mask & ~TREE_SELF_EVENTS) | TREE_EVENTS |
+                          IN_ONLYDIR;
+    tree_walk walk = {0};
+    int status = 0, closed;
+    size_t added;
+    reader_lock(reader);
+    if (reader->closed) {
+        reader_unlock(reader);
+        PyMem_RawFree(root);
+        PyErr_SetString(PyExc_ValueError,
+                        "I/O operation on closed inotify instance");
+        return NULL;
+    }
+    walk_budget(&reader->tree, &walk);
+    walk.snapshots = reader->tree.snapshots;
+    walk_start(reader);
+    reader_unlock(reader);
+    Py_BEGIN_ALLOW_THREADS
+    tree_walk_dir(fd, root, len, watch_mask, &walk);
+    added = walk.len - walk.polled;
+    PyThread_acquire_lock(reader->lock, WAIT_LOCK);
+    watch_tree *tree = &reader->tree;
+    // The watches of a reader closed meanwhile went away with fd.
+    closed = reader->closed;
+    if (!closed) {
+        // What no add_tree() asked for stays quiet.
+        tree->quiet = (tree->mask ? tree->quiet
+                                  : IN_MOVED_FROM | IN_MOVE_SELF) &
+                      ~(uint32_t) mask;
+        tree->mask |= watch_mask;
+        status = tree_merge(tree, &walk);
+        budget_settle(reader, fd, walk.enospc);
+    }
+    PyThread_release_lock(reader->lock);
+    walk_done(reader);
+    Py_END_ALLOW_THREADS
+    unsigned long long failed = walk.failed;
+    int error = walk.error;
+    size_t polled = walk.polled;
+    walk_free(&walk);
+    if (closed) {
+        PyErr_SetString(PyExc_ValueError,
+                        "I/O operation on closed inotify instance");
+        return NULL;
+    }
+    if (status == -1 || error == ENOMEM) return PyErr_NoMemory();
+    if (added == 0 && polled == 0 && error) {
+        errno = error;
+        return PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, path);
+    }
+    return Py_BuildValue("(nK)", (Py_ssize_t) added, failed);
+}
+
+static PyObject * reader_wd_path(InotifyObject *reader, int wd) {
+    // Return the path of a directory watched through add_tree(), or None.
+    PyObject *path = Py_None;
+    reader_lock(reader);
+    wd_entry *entry = tree_find(&reader->tree, wd);
+    if (entry)
+        path = PyUnicode_DecodeFSDefaultAndSize(entry->path,
+                                                (Py_ssize_t) entry->len);
+    else
+        Py_INCREF(path);
+    reader_unlock(reader);
+    return path;
+}
+
+static PyObject * reader_tree_stats(InotifyObject *reader) {
+    reader_lock(reader);
+    PyObject *stats = Py_BuildValue("{snsKsKsOsKsK}",
+                                    "watches",
+                                    (Py_ssize_t) reader->tree.count,
+                                    "added", reader->tree.added,
+                                    "failed", reader->tree.failed,
+                                    "snapshots",
+                                    reader->tree.snapshots ? Py_True
+                                                           : Py_False,
+                                    "rescans", reader->tree.rescans,
+                                    "synthesized",
+                                    reader->tree.synthesized);
+    reader_unlock(reader);
+    return stats;
+}
+
+
+// Snapshots
+
+// With snapshots, every directory watched through add_tree() keeps the inode,
+// mtime and size of its entries. Creations, deletions and renames seen while
+// parsing keep them current without touching the disk. After an
+// IN_Q_OVERFLOW every directory is read again and compared with its
+// snapshot, and the differences are queued as IN_CREATE, IN_DELETE and
+// IN_MODIFY events right after the IN_Q_OVERFLOW. Modifications are reported
+// at least once: a file changed since the last scan is reported again even
+// if its IN_MODIFY was delivered before the overflow.
+//
+// Snapshots can be saved to a file and loaded by a later process, whose
+// first rescan then reports what changed while nobody was watching. The
+// file holds, in native byte order, the magic SNAP_MAGIC and SNAP_VERSION
+// (uint32), then for every directory its path length (uint32), path and
+// entry count (uint64), and for every entry its inode (uint64), mtime in
+// nanoseconds and size (int64), flags and name length (uint32) and name.
+#define SNAP_MAGIC "inotipy\x01"
+#define SNAP_VERSION 1
+
+static snap_entry * snap_find(snap_dir *snap, const char *name, size_t len,
+                              uint64_t hash) {
+    size_t i = hash & (snap->capacity - 1);
+    for (;;) {
+        snap_entry *entry = &snap->entries[i];
+        if (!entry->name) return NULL;
+        if (entry->hash == hash && entry->name_len == len &&
+            memcmp(entry->name, name, len) == 0)
+            return entry;
+        i = (i + 1) & (snap->capacity - 1);
+    }
+}
+
+static snap_dir * snap_new(size_t count) {
+    // Return an empty snapshot with room for count entries, or NULL.
+    size_t capacity = 16;
+    while (count * 4 >= capacity * 3) capacity *= 2;
+    snap_dir *snap = PyMem_RawMalloc(sizeof (snap_dir));
+    if (!snap) return NULL;
+    snap->entries = PyMem_RawCalloc(capacity, sizeof (snap_entry));
+    if (!snap->entries) {
+        PyMem_RawFree(snap);
+        return NULL;
+    }
+    snap->capacity = capacity;
+    snap->count = 0;
+    return snap;
+}
+
+static int snap_grow(snap_dir *snap) {
+    size_t capacity = snap->capacity * 2;
+    snap_entry *entries = PyMem_RawCalloc(capacity, sizeof (snap_entry));
+    if (!entries) return -1;
+    for (size_t i = 0; i < snap->capacity; i++) {
+        snap_entry *entry = &snap->entries[i];
+        if (!entry->name) continue;
+        size_t j = entry->hash & (capacity - 1);
+        while (entries[j].name) j = (j + 1) & (capacity - 1);
+        entries[j] = *entry;
+    }
+    PyMem_RawFree(snap->entries);
+    snap->entries = entries;
+    snap->capacity = capacity;
+    return 0;
+}
+
+static snap_entry * snap_insert(snap_dir *snap, const char *name, size_t len,
+                                uint64_t hash) {
+    // Add an entry for name, which must not be in snap yet, with nothing
+    // known about it. Returns NULL if out of memory.
+    if ((snap->count + 1) * 4 >= snap->capacity * 3 && snap_grow(snap) == -1)
+        return NULL;
+    char *copy = PyMem_RawMalloc(len + 1);
+    if (!copy) return NULL;
+    memcpy(copy, name, len);
+    copy[len] = '\0';
+    size_t i = hash & (snap->capacity - 1);
+    while (snap->entries[i].name) i = (i + 1) & (snap->capacity - 1);
+    snap->entries[i] = (snap_entry) { .hash = hash, .name = copy,
+                                      .name_len = len };
+    snap->count++;
+    return &snap->entries[i];
+}
+
+static void snap_remove(snap_dir *snap, snap_entry *entry) {
+    // Delete entry, shifting back the entries that probed past it so that
+    // the table needs no tombstones.
+    size_t mask = snap->capacity - 1;
+    size_t hole = (size_t) (entry - snap->entries);
+    PyMem_RawFree(entry->name);
+    for (size_t i = (hole + 1) & mask; snap->entries[i].name;
+         i = (i + 1) & mask) {
+        // An entry may only move back if the hole is not before its home.
+        size_t home = snap->entries[i].hash & mask;
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            snap->entries[hole] = snap->entries[i];
+            hole = i;
+        }
+    }
+    snap->entries[hole].name = NULL;
+    snap->count--;
+}
+
+static void snap_free(snap_dir *snap) {
+    if (!snap) return;
+    for (size_t i = 0; i < snap->capacity; i++)
+        PyMem_RawFree(snap->entries[i].name);
+    PyMem_RawFree(snap->entries);
+    PyMem_RawFree(snap);
+}
+
+static int snap_scan(const char *path, snap_dir **snap) {
+    // Read the directory at path into a new snapshot stored in *snap,
+    // without following symbolic links. Returns -1 with errno set on
+    // failure. Runs without the GIL.
+    DIR *dir = opendir(path);
+    if (!dir) return -1;
+    snap_dir *fresh = snap_new(0);
+    if (!fresh) {
+        closedir(dir);
+        errno = ENOMEM;
+        return -1;
+    }
+    struct dirent *item;
+    while ((item = readdir(dir)) != NULL) {
+        const char *name = item->d_name;
+        if (name[0] == '.' && (name[1] == '\0' ||
+            (name[1] == '.' && name[2] == '\0')))
+            continue;
+        struct stat info;
+        // An entry that is gone already is left out.
+        if (fstatat(dirfd(dir), name, &info, AT_SYMLINK_NOFOLLOW) == -1)
+            continue;
+        size_t len = strlen(name);
+        snap_entry *entry = snap_insert(fresh, name, len,
+                                        name_hash(0, name, len));
+        if (!entry) {
+            snap_free(fresh);
+            closedir(dir);
+            errno = ENOMEM;
+            return -1;
+        }
+        entry->ino = (uint64_t) info.st_ino;
+        entry->mtime_ns = (int64_t) info.st_mtim.tv_sec * 1000000000 +
+                          info.st_mtim.tv_nsec;
+        entry->size = (int64_t) info.st_size;
+        entry->flags = S_ISDIR(info.st_mode) ? SNAP_DIR : 0;
+    }
+    closedir(dir);
+    *snap = fresh;
+    return 0;
+}
+
+static void snap_note(InotifyObject *reader, wd_entry *dir,
+                      inotify_event *event) {
+    // Apply a creation, deletion or rename seen while parsing to the
+    // snapshot of its directory, which is looked up if dir is NULL. Nothing
+    // is read from disk; a new entry is looked at by the next rescan.
+    // Runs without the GIL, with the reader lock held.
+    if (!(event->mask & (IN_CREATE | IN_DELETE | IN_MOVE)) || event->len == 0)
+        return;
+    if (!dir) dir = tree_find(&reader->tree, event->wd);
+    if (!dir || !dir->snap) return;
+    size_t len = strnlen(event->name, event->len);
+    uint64_t hash = name_hash(0, event->name, len);
+    snap_entry *entry = snap_find(dir->snap, event->name, len, hash);
+    if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+        if (entry) snap_remove(dir->snap, entry);
+        return;
+    }
+    if (!entry) entry = snap_insert(dir->snap, event->name, len, hash);
+    // Without memory, the next rescan reports the entry once more.
+    if (!entry) return;
+    entry->ino = 0;
+    entry->mtime_ns = entry->size = 0;
+    entry->flags = (event->mask & IN_ISDIR) ? SNAP_DIR : 0;
+}
+
+static int snap_queue(InotifyObject *reader, int wd, const char *dir,
+                      size_t dir_len, snap_entry *entry, uint32_t mask) {
+    // Queue an event for entry of the directory wd that no read reported,
+    // filtered like any other. Returns -1 if out of memory.
+    union {
+        inotify_event event;
+        char bytes[sizeof (inotify_event) + NAME_MAX + 1];
+    } synthetic;
+    if (entry->name_len > NAME_MAX) return 0;
+    synthetic.event = (inotify_event) {
+        .wd = wd, .cookie = 0, .len = (uint32_t) entry->name_len + 1,
+        .mask = mask | ((entry->flags & SNAP_DIR) ? IN_ISDIR : 0) };
+    memcpy(synthetic.event.name, entry->name, entry->name_len + 1);
+    if (reader->filter && filter_rejects(reader->filter, &synthetic.event))
+        reader->stats.filtered++;
+    else {
+        if (add_event_with_path(reader, &synthetic.event, dir, dir_len) == -1)
+            return -1;
+        reader->tree.synthesized++;
+    }
+    return 0;
+}
+
+static int snap_emit(InotifyObject *reader, int fd, int wd, const char *dir,
+                     size_t dir_len, snap_entry *entry, uint32_t mask) {
+    // Queue an event found by a rescan, and watch a directory it creates.
+    // Returns -1 if out of memory.
+    if (snap_queue(reader, wd, dir, dir_len, entry, mask) == -1) return -1;
+    if ((mask & IN_CREATE) && (entry->flags & SNAP_DIR))
+        tree_follow(reader, fd, dir, dir_len, entry->name, entry->name_len,
+                    1);
+    return 0;
+}
+
+static int snap_diff(InotifyObject *reader, int fd, int wd, const char *dir,
+                     size_t dir_len, snap_dir *old, snap_dir *fresh) {
+    // Queue what turned up, went away or changed between old and fresh
+    // scans of the directory wd. Returns -1 if out of memory.
+    for (size_t i = 0; i < fresh->capacity; i++) {
+        snap_entry *now = &fresh->entries[i];
+        if (!now->name) continue;
+        snap_entry *then = snap_find(old, now->name, now->name_len,
+                                     now->hash);
+        int status = 0;
+        if (!then)
+            status = snap_emit(reader, fd, wd, dir, dir_len, now, IN_CREATE);
+        else {
+            then->flags |= SNAP_SEEN;
+            uint32_t is_dir = now->flags & SNAP_DIR;
+            if ((then->flags & SNAP_DIR) != is_dir ||
+                (then->ino && then->ino != now->ino)) {
+                // Replaced by another file or directory of the same name.
+                status = snap_emit(reader, fd, wd, dir, dir_len, then,
+                                   IN_DELETE);
+                if (status == 0)
+                    status = snap_emit(reader, fd, wd, dir, dir_len, now,
+                                       IN_CREATE);
+            }
+            else if (!is_dir && (!then->ino ||
+                                 then->mtime_ns != now->mtime_ns ||
+                                 then->size != now->size))
+                status = snap_emit(reader, fd, wd, dir, dir_len, now,
+                                   IN_MODIFY);
+        }
+        if (status == -1) return -1;
+    }
+    for (size_t i = 0; i < old->capacity; i++) {
+        snap_entry *then = &old->entries[i];
+        if (!then->name || (then->flags & SNAP_SEEN)) continue;
+        if (snap_emit(reader, fd, wd, dir, dir_len, then, IN_DELETE) == -1)
+            return -1;
+    }
+    return 0;
+}
+
+static long tree_rescan(InotifyObject *reader, int fd) {
+    // Read every directory of the tree again, queue how each differs from
+    // its snapshot and keep the new one. A directory without a snapshot
+    // just gets one. Returns the number of events queued, or -1 if out of
+    // memory. Runs without the GIL, with the reader lock held.
+    watch_tree *tree = &reader->tree;
+    unsigned long long before = tree->synthesized;
+    // New directories are added to the tree as they are found, so the
+    // directories to read are fixed up front.
+    size_t count = 0;
+    int *wds = PyMem_RawMalloc((tree->count ? tree->count : 1) *
+                               sizeof (int));
+    if (!wds) return -1;
+    for (size_t i = 0; i < tree->capacity; i++) {
+        if (tree->slots[i].wd >= 0 && !tree->slots[i].evicted)
+            wds[count++] = tree->slots[i].wd;
+    }
+    tree->rescans++;
+    tree->rescan_due = 0;
+    int status = 0;
+    for (size_t i = 0; i < count && status == 0; i++) {
+        wd_entry *entry = tree_find(tree, wds[i]);
+        if (!entry) continue;
+        snap_dir *fresh;
+        if (snap_scan(entry->path, &fresh) == -1) {
+            if (errno == ENOMEM) status = -1;
+            // The directory is gone; its parent reports it.
+            else if (errno == ENOENT || errno == ENOTDIR)
+                tree_remove(tree, wds[i]);
+            continue;
+        }
+        snap_dir *old = entry->snap;
+        entry->snap = fresh;
+        if (!old) continue;
+        // Watching new subdirectories can move entry, so its path is
+        // copied first.
+        size_t dir_len = entry->len;
+        char *dir = PyMem_RawMalloc(dir_len + 1);
+        if (!dir) status = -1;
+        else {
+            memcpy(dir, entry->path, dir_len + 1);
+            status = snap_diff(reader, fd, wds[i], dir, dir_len, old, fresh);
+            PyMem_RawFree(dir);
+        }
+        snap_free(old);
+    }
+    PyMem_RawFree(wds);
+    if (status == -1) return -1;
+    return (long) (tree->synthesized - before);
+}
+
+static PyObject * reader_set_rescan(InotifyObject *reader, PyObject *args,
+                                    PyObject *kwargs) {
+    // Start keeping snapshots of the tree, reading every directory without
+    // the GIL, or drop them.
+    char *kwlist[] = {"enabled", NULL};
+    int enabled = 1;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|p", kwlist, &enabled))
+        return NULL;
+    int status = 0;
+    reader_lock(reader);
+    watch_tree *tree = &reader->tree;
+    Py_BEGIN_ALLOW_THREADS
+    tree->snapshots = enabled;
+    for (size_t i = 0; i < tree->capacity; i++) {
+        wd_entry *entry = &tree->slots[i];
+        if (entry->wd < 0 || entry->evicted) continue;
+        if (!enabled) {
+            snap_free(entry->snap);
+            entry->snap = NULL;
+        }
+        // A directory that cannot be read gets its snapshot at the next
+        // rescan.
+        else if (!entry->snap && snap_scan(entry->path, &entry->snap) == -1 &&
+                 errno == ENOMEM) {
+            status = -1;
+            break;
+        }
+    }
+    Py_END_ALLOW_THREADS
+    reader_unlock(reader);
+    if (status == -1) return PyErr_NoMemory();
+    Py_RETURN_NONE;
+}
+
+static PyObject * reader_rescan(InotifyObject *reader, int fd) {
+    // Rescan the tree now and return the number of events queued. New
+    // subdirectories are watched through fd.
+    long queued = 0;
+    reader_lock(reader);
+    if (reader->tree.snapshots) {
+        Py_BEGIN_ALLOW_THREADS
+        queued = tree_rescan(reader, fd);
+        stats_queued(reader);
+        Py_END_ALLOW_THREADS
+    }
+    reader_unlock(reader);
+    if (queued == -1) return PyErr_NoMemory();
+    return PyLong_FromLong(queued);
+}
+
+static int snap_write(FILE *out, const void *data, size_t size) {
+    return fwrite(data, 1, size, out) == size ? 0 : -1;
+}
+
+static int snap_save(watch_tree *tree, FILE *out, size_t *saved) {
+    // Write every snapshot of tree to out. Returns -1 with errno set on
+    // failure. Runs without the GIL, with the reader lock held.
+    uint32_t version = SNAP_VERSION;
+    if (snap_write(out, SNAP_MAGIC, 8) == -1 ||
+        snap_write(out, &version, sizeof version) == -1)
+        return -1;
+    for (size_t i = 0; i < tree->capacity; i++) {
+        wd_entry *dir = &tree->slots[i];
+        if (dir->wd < 0 || !dir->snap) continue;
+        uint32_t path_len = (uint32_t) dir->len;
+        uint64_t count = dir->snap->count;
+        if (snap_write(out, &path_len, sizeof path_len) == -1 ||
+            snap_write(out, dir->path, dir->len) == -1 ||
+            snap_write(out, &count, sizeof count) == -1)
+            return -1;
+        for (size_t j = 0; j < dir->snap->capacity; j++) {
+            snap_entry *entry = &dir->snap->entries[j];
+            if (!entry->name) continue;
+            uint32_t fields[2] = { entry->flags & SNAP_DIR,
+                                   (uint32_t) entry->name_len };
+            if (snap_write(out, &entry->ino, sizeof entry->ino) == -1 ||
+                snap_write(out, &entry->mtime_ns,
+                           sizeof entry->mtime_ns) == -1 ||
+                snap_write(out, &entry->size, sizeof entry->size) == -1 ||
+                snap_write(out, fields, sizeof fields) == -1 ||
+                snap_write(out, entry->name, entry->name_len) == -1)
+                return -1;
+        }
+        (*saved)++;
+    }
+    return 0;
+}
+
+static int snap_save_file(watch_tree *tree, const char *path,
+                          size_t *saved) {
+    // Write the snapshots of tree to a new file next to path, and rename
+    // it over path once it has reached the disk, so that a crash or a full
+    // disk leaves the old file in place rather than a truncated one.
+    // Returns -1 with errno set on failure. Runs without the GIL, with the
+    // reader lock held.
+    static _Atomic unsigned long serial;
+    size_t size = strlen(path) + 48;
+    char *temp = PyMem_RawMalloc(size);
+    if (!temp) {
+        errno = ENOMEM;
+        return -1;
+    }
+    // Created like fopen() would, so the umask applies to the mode.
+    int fd;
+    do {
+        snprintf(temp, size, "%s.%ld.%lu.tmp", path, (long) getpid(),
+                 atomic_fetch_add(&serial, 1));
+        fd = open(temp, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+    } while (fd == -1 && errno == EEXIST);
+    if (fd == -1) {
+        int error = errno;
+        PyMem_RawFree(temp);
+        errno = error;
+        return -1;
+    }
+    FILE *out = fdopen(fd, "wb");
+    int status = out ? snap_save(tree, out, saved) : -1;
+    if (status == 0 && fflush(out) == EOF) status = -1;
+    if (status == 0 && fsync(fd) == -1) status = -1;
+    int error = errno;
+    if ((out ? fclose(out) : close(fd)) != 0 && status == 0) {
+        status = -1;
+        error = errno;
+    }
+    if (status == 0 && rename(temp, path) == -1) {
+        status = -1;
+        error = errno;
+    }
+    if (status == -1) unlink(temp);
+    PyMem_RawFree(temp);
+    errno = error;
+    return status;
+}
+
+static PyObject * reader_save_snapshot(InotifyObject *reader,
+                                       PyObject *path) {
+    // Write the snapshots to the file at path and return how many
+    // directories it holds.
+    PyObject *encoded;
+    if (!PyUnicode_FSConverter(path, &encoded)) return NULL;
+    size_t saved = 0;
+    int status;
+    reader_lock(reader);
+    Py_BEGIN_ALLOW_THREADS
+    status = snap_save_file(&reader->tree, PyBytes_AS_STRING(encoded),
+                            &saved);
+    Py_END_ALLOW_THREADS
+    reader_unlock(reader);
+    Py_DECREF(encoded);
+    if (status == -1)
+        return PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, path);
+    return PyLong_FromSize_t(saved);
+}
+
+static int compare_paths(const void *a, const void *b) {
+    const wd_entry *x = *(wd_entry * const *) a;
+    const wd_entry *y = *(wd_entry * const *) b;
+    return strcmp(x->path, y->path);
+}
+
+static int snap_read(FILE *in, void *data, size_t size) {
+    return fread(data, 1, size, in) == size ? 0 : -1;
+}
+
+// Results of snap_load() besides a count of directories
+#define SNAP_LOAD_ERRNO -1
+#define SNAP_LOAD_INVALID -2
+
+static long snap_load(watch_tree *tree, FILE *in) {
+    // Replace the snapshots of the directories of tree found in the file
+    // in. Directories that are not in the tree are skipped. Returns the
+    // number of snapshots replaced, SNAP_LOAD_ERRNO with errno set or
+    // SNAP_LOAD_INVALID if the file is not a snapshot or is cut short.
+    // Runs without the GIL, with the reader lock held.
+    char magic[8];
+    uint32_t version;
+    if (snap_read(in, magic, sizeof magic) == -1 ||
+        memcmp(magic, SNAP_MAGIC, sizeof magic) != 0 ||
+        snap_read(in, &version, sizeof version) == -1 ||
+        version != SNAP_VERSION)
+        return ferror(in) ? SNAP_LOAD_ERRNO : SNAP_LOAD_INVALID;
+    // Directories are matched by path, the only thing that outlives a
+    // process; wds are handed out anew by every inotify instance.
+    wd_entry **dirs = PyMem_RawMalloc((tree->count ? tree->count : 1) *
+                                      sizeof (wd_entry *));
+    char *path = PyMem_RawMalloc(PATH_MAX + 1);
+    if (!dirs || !path) {
+        PyMem_RawFree(dirs);
+        PyMem_RawFree(path);
+        errno = ENOMEM;
+        return SNAP_LOAD_ERRNO;
+    }
+    size_t count = 0;
+    for (size_t i = 0; i < tree->capacity; i++) {
+        if (tree->slots[i].wd >= 0) dirs[count++] = &tree->slots[i];
+    }
+    qsort(dirs, count, sizeof (wd_entry *), compare_paths);
+    long loaded = 0;
+    snap_dir *snap = NULL;
+    char name[NAME_MAX + 1];
+    for (;;) {
+        uint32_t path_len;
+        uint64_t entries;
+        if (snap_read(in, &path_len, sizeof path_len) == -1) {
+            // The file may only end between two directories.
+            if (!feof(in) || ferror(in)) loaded = SNAP_LOAD_ERRNO;
+            break;
+        }
+        if (path_len > PATH_MAX ||
+            snap_read(in, path, path_len) == -1 ||
+            snap_read(in, &entries, sizeof entries) == -1) {
+            loaded = SNAP_LOAD_INVALID;
+            break;
+        }
+        path[path_len] = '\0';
+        snap = snap_new((size_t) entries);
+        if (!snap) {
+            errno = ENOMEM;
+            loaded = SNAP_LOAD_ERRNO;
+            break;
+        }
+        for (uint64_t j = 0; j < entries && loaded >= 0; j++) {
+            uint64_t ino;
+            int64_t mtime_ns, size;
+            uint32_t fields[2];
+            if (snap_read(in, &ino, sizeof ino) == -1 ||
+                snap_read(in, &mtime_ns, sizeof mtime_ns) == -1 ||
+                snap_read(in, &size, sizeof size) == -1 ||
+                snap_read(in, fields, sizeof fields) == -1 ||
+                fields[1] > NAME_MAX ||
+                snap_read(in, name, fields[1]) == -1) {
+                loaded = SNAP_LOAD_INVALID;
+                break;
+            }
+            uint64_t hash = name_hash(0, name, fields[1]);
+            if (snap_find(snap, name, fields[1], hash)) continue;
+            snap_entry *entry = snap_insert(snap, name, fields[1], hash);
+            if (!entry) {
+                errno = ENOMEM;
+                loaded = SNAP_LOAD_ERRNO;
+                break;
+            }
+            entry->ino = ino;
+            entry->mtime_ns = mtime_ns;
+            entry->size = size;
+            entry->flags = fields[0] & SNAP_DIR;
+        }
+        if (loaded < 0) break;
+        wd_entry key = { .path = path };
+        wd_entry *key_ptr = &key;
+        wd_entry **found = bsearch(&key_ptr, dirs, count,
+                                   sizeof (wd_entry *), compare_paths);
+        if (found) {
+            snap_free((*found)->snap);
+            (*found)->snap = snap;
+            loaded++;
+        }
+        else
+            snap_free(snap);
+        snap = NULL;
+    }
+    snap_free(snap);
+    PyMem_RawFree(dirs);
+    PyMem_RawFree(path);
+    return loaded;
+}
+
+static PyObject * reader_load_snapshot(InotifyObject *reader,
+                                       PyObject *path) {
+    // Load the snapshots saved to the file at path for the directories of
+    // the tree, keep snapshots from now on, and return how many directories
+    // were found.
+    PyObject *encoded;
+    if (!PyUnicode_FSConverter(path, &encoded)) return NULL;
+    long loaded;
+    reader_lock(reader);
+    Py_BEGIN_ALLOW_THREADS
+    FILE *in = fopen(PyBytes_AS_STRING(encoded), "rb");
+    loaded = in ? snap_load(&reader->tree, in) : SNAP_LOAD_ERRNO;
+    if (in) fclose(in);
+    if (loaded >= 0) reader->tree.snapshots = 1;
+    Py_END_ALLOW_THREADS
+    reader_unlock(reader);
+    Py_DECREF(encoded);
+    if (loaded == SNAP_LOAD_INVALID) {
+        PyErr_Format(PyExc_ValueError, "%R is not a valid snapshot file",
+                     path);
+        return NULL;
+    }
+    if (loaded == SNAP_LOAD_ERRNO)
+        return PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, path);
+    return PyLong_FromLong(loaded);
+}
+
+
+// The watch budget
+
+// With a watch budget, a tree holds no more watches than its limit, which
+// is at most max_user_watches. Once the budget is spent, the directories
+// that have gone longest without an event give up their watch and are
+// polled instead: every poll_interval, the reads that come along stat(2)
+// each of them, and one whose inode or mtime changed is watched again, at
+// the expense of the least recently active watched directories, with how
+// it differs from its snapshot queued as IN_CREATE, IN_DELETE and
+// IN_MODIFY events. Writes to files that leave the directory itself
+// untouched go unseen while it is polled.
+
+static int read_max_user_watches(size_t *max) {
+    // Returns -1 with errno set if the limit cannot be read.
+    FILE *in = fopen("/proc/sys/fs/inotify/max_user_watches", "re");
+    if (!in) return -1;
+    unsigned long long value;
+    int found = fscanf(in, "%llu", &value);
+    fclose(in);
+    if (found != 1) {
+        errno = EINVAL;
+        return -1;
+    }
+    *max = (size_t) value;
+    return 0;
+}
+
+static void polled_free(polled_dir *dir) {
+    PyMem_RawFree(dir->path);
+    snap_free(dir->snap);
+}
+
+static void budget_free(watch_budget *budget) {
+    if (!budget) return;
+    for (size_t i = 0; i < budget->polled_len; i++)
+        polled_free(&budget->polled[i]);
+    PyMem_RawFree(budget->polled);
+    PyMem_RawFree(budget);
+}
+
+static int budget_push(watch_budget *budget, polled_dir *dir) {
+    // Append a copy of dir to the polled directories. Returns -1 if out of
+    // memory.
+    if (budget->polled_len == budget->polled_capacity) {
+        size_t capacity = budget->polled_capacity
+                          ? 2 * budget->polled_capacity : 64;
+        polled_dir *grown = PyMem_RawRealloc(budget->polled,
+                                             capacity * sizeof (polled_dir));
+        if (!grown) return -1;
+        budget->polled = grown;
+        budget->polled_capacity = capacity;
+    }
+    budget->polled[budget->polled_len++] = *dir;
+    return 0;
+}
+
+static int budget_add(watch_budget *budget, char *path, size_t len,
+                      snap_dir *snap) {
+    // Poll the directory at path from now on, taking ownership of path and
+    // snap. Without snap, the directory is read now. A directory that is
+    // gone is dropped. Returns -1, owning nothing, if out of memory.
+    // Runs without the GIL.
+    struct stat info;
+    if (stat(path, &info) == -1 || !S_ISDIR(info.st_mode)) {
+        PyMem_RawFree(path);
+        snap_free(snap);
+        return 0;
+    }
+    snap_dir *scanned = NULL;
+    if (!snap && snap_scan(path, &scanned) == -1 && errno == ENOMEM)
+        return -1;
+    polled_dir dir = {
+        .path = path, .len = len, .ino = (uint64_t) info.st_ino,
+        .mtime_ns = (int64_t) info.st_mtim.tv_sec * 1000000000 +
+                    info.st_mtim.tv_nsec,
+        .snap = snap ? snap : scanned
+    };
+    if (budget_push(budget, &dir) == -1) {
+        snap_free(scanned);
+        return -1;
+    }
+    return 0;
+}
+
+static void walk_budget(watch_tree *tree, tree_walk *walk) {
+    // Set how many watches walk may add. The first directory of a walk is
+    // always watched, and budget_settle() makes room for it afterwards.
+    watch_budget *budget = tree->budget;
+    walk->room = SIZE_MAX;
+    if (!budget) return;
+    size_t active = tree->count - tree->evicting;
+    walk->room = (active < budget->limit) ? budget->limit - active : 1;
+    walk->poll = 1;
+}
+
+static int compare_lru(const void *a, const void *b) {
+    unsigned long long left = ((const lru_entry *) a)->active;
+    unsigned long long right = ((const lru_entry *) b)->active;
+    return (left > right) - (left < right);
+}
+
+static void budget_unwatch(InotifyObject *reader, int fd, int wd) {
+    // Remove the watch on the directory wd and poll it instead. Its entry
+    // stays in the tree, so that the events already queued for it still
+    // get its path, until its IN_IGNORED event arrives.
+    watch_tree *tree = &reader->tree;
+    wd_entry *entry = tree_find(tree, wd);
+    if (!entry) return;
+    char *path = PyMem_RawMalloc(entry->len + 1);
+    if (!path) return;
+    memcpy(path, entry->path, entry->len + 1);
+    // The snapshot is taken while the watch still reports what changes.
+    snap_dir *snap = entry->snap;
+    entry->snap = NULL;
+    if (budget_add(tree->budget, path, entry->len, snap) == -1) {
+        PyMem_RawFree(path);
+        entry->snap = snap;
+        return;
+    }
+    tree->budget->evicted++;
+    if (inotify_rm_watch(fd, wd) == -1) {
+        // The kernel dropped the watch already.
+        tree_remove(tree, wd);
+        return;
+    }
+    entry->evicted = 1;
+    tree->evicting++;
+}
+
+static void budget_evict(InotifyObject *reader, int fd, size_t count) {
+    // Poll at least count of the least recently active directories instead
+    // of watching them. A few more go at once, so that re-arming does not
+    // sort the whole tree every time.
+    watch_tree *tree = &reader->tree;
+    size_t active = tree->count - tree->evicting;
+    size_t batch = tree->budget->limit / 64;
+    if (count < batch) count = batch;
+    if (count > active) count = active;
+    if (count == 0) return;
+    lru_entry *order = PyMem_RawMalloc(active * sizeof (lru_entry));
+    // Without memory, the tree stays over budget until the next walk.
+    if (!order) return;
+    size_t len = 0;
+    for (size_t i = 0; i < tree->capacity; i++) {
+        wd_entry *entry = &tree->slots[i];
+        if (entry->wd < 0 || entry->evicted) continue;
+        order[len++] = (lru_entry) { .active = entry->active,
+                                     .wd = entry->wd };
+    }
+    qsort(order, len, sizeof (lru_entry), compare_lru);
+    for (size_t i = 0; i < count && i < len; i++)
+        budget_unwatch(reader, fd, order[i].wd);
+    PyMem_RawFree(order);
+}
+
+static void budget_settle(InotifyObject *reader, int fd, int enospc) {
+    // Bring the tree back within its budget after a walk. If the walk ran
+    // out of watches, the limit comes down to the watches the tree holds.
+    // Runs without the GIL, with the reader lock held.
+    watch_tree *tree = &reader->tree;
+    watch_budget *budget = tree->budget;
+    if (!budget) return;
+    size_t active = tree->count - tree->evicting;
+    if (enospc) {
+        budget->enospc++;
+        if (active < budget->limit) budget->limit = active ? active : 1;
+    }
+    if (active > budget->limit)
+        budget_evict(reader, fd, active - budget->limit);
+}
+
+static int budget_rearm(InotifyObject *reader, int fd, watch_budget *budget,
+                        polled_dir *dir, int evict) {
+    // Watch a polled directory that changed again, taking ownership of
+    // dir, and queue how it differs from its snapshot. With evict, room is
+    // made for it; without, a directory that cannot be watched is given
+    // up. Returns 1 once it is watched, 0 if it is not and -1 if out of
+    // memory. Runs without the GIL, with the reader lock held.
+    watch_tree *tree = &reader->tree;
+    size_t active = tree->count - tree->evicting;
+    if (evict && active >= budget->limit)
+        budget_evict(reader, fd, active - budget->limit + 1);
+    int wd = inotify_add_watch(fd, dir->path, tree->mask);
+    if (evict && wd == -1 && errno == ENOSPC) {
+        // Other instances hold the rest of max_user_watches.
+        budget->enospc++;
+        active = tree->count - tree->evicting;
+        budget->limit = active ? active : 1;
+        if (active) {
+            budget_evict(reader, fd, 1);
+            wd = inotify_add_watch(fd, dir->path, tree->mask);
+        }
+    }
+    if (wd == -1) {
+        // Polled on if watches are short, dropped if it is gone.
+        if (evict && errno == ENOSPC && budget_push(budget, dir) == 0)
+            return 0;
+        if (!evict) tree->failed++;
+        polled_free(dir);
+        return 0;
+    }
+    snap_dir *fresh = NULL;
+    char *copy = PyMem_RawMalloc(dir->len + 1);
+    if (!copy || (snap_scan(dir->path, &fresh) == -1 && errno == ENOMEM) ||
+        tree_put(tree, wd, dir->path, dir->len) == -1) {
+        PyMem_RawFree(copy);
+        snap_free(fresh);
+        polled_free(dir);
+        return -1;
+    }
+    // The path belongs to the tree now.
+    memcpy(copy, dir->path, dir->len + 1);
+    tree->added++;
+    budget->rearmed++;
+    tree_find(tree, wd)->active = ++tree->ticks;
+    int status = 0;
+    if (dir->snap && fresh)
+        status = snap_diff(reader, fd, wd, copy, dir->len, dir->snap, fresh);
+    PyMem_RawFree(copy);
+    snap_free(dir->snap);
+    // Watching new subdirectories can move the entry.
+    wd_entry *entry = tree_find(tree, wd);
+    if (entry && tree->snapshots) {
+        snap_free(entry->snap);
+        entry->snap = fresh;
+    }
+    else snap_free(fresh);
+    return (status == -1) ? -1 : 1;
+}
+
+static int budget_due(watch_budget *budget) {
+    return budget->polled_len > 0 &&
+           monotonic_ns() - budget->last_poll >= budget->interval;
+}
+
+static long budget_poll(InotifyObject *reader, int fd) {
+    // stat(2) every polled directory and watch those that changed again.
+    // Returns the number of directories watched again, or -1 if out of
+    // memory. Runs without the GIL, with the reader lock held.
+    watch_budget *budget = reader->tree.budget;
+    budget->polls++;
+    budget->last_poll = monotonic_ns();
+    long rearmed = 0;
+    size_t i = 0;
+    // Re-arming can evict more directories, which are appended and looked
+    // at too; they have not changed.
+    while (i < budget->polled_len) {
+        polled_dir *dir = &budget->polled[i];
+        struct stat info;
+        if (stat(dir->path, &info) == -1 || !S_ISDIR(info.st_mode)) {
+            // Gone; the directory above it reports that.
+            polled_free(dir);
+            budget->polled[i] = budget->polled[--budget->polled_len];
+            continue;
+        }
+        int64_t mtime_ns = (int64_t) info.st_mtim.tv_sec * 1000000000 +
+                           info.st_mtim.tv_nsec;
+        if ((uint64_t) info.st_ino == dir->ino && mtime_ns == dir->mtime_ns) {
+            i++;
+            continue;
+        }
+        polled_dir changed = *dir;
+        budget->polled[i] = budget->polled[--budget->polled_len];
+        int status = budget_rearm(reader, fd, budget, &changed, 1);
+        if (status == -1) return -1;
+        rearmed += status;
+    }
+    return rearmed;
+}
+
+static PyObject * reader_set_watch_budget(InotifyObject *reader, int fd,
+                                          int enabled, PyObject *limit,
+                                          double interval) {
+    // Cap the watches of the tree, evicting directories now if it holds
+    // more, or watch every polled directory again and drop the budget.
+    size_t max = 0, cap = 0;
+    if (enabled) {
+        if (interval < 0) {
+            PyErr_SetString(PyExc_ValueError,
+                            "poll_interval must not be negative");
+            return NULL;
+        }
+        if (read_max_user_watches(&max) == -1) {
+            return PyErr_SetFromErrnoWithFilename(
+                PyExc_OSError, "/proc/sys/fs/inotify/max_user_watches");
+        }
+        cap = max;
+        if (limit != Py_None) {
+            Py_ssize_t value = PyLong_AsSsize_t(limit);
+            if (value == -1 && PyErr_Occurred()) return NULL;
+            if (value < 1) {
+                PyErr_SetString(PyExc_ValueError,
+                                "limit must be at least 1");
+                return NULL;
+            }
+            if ((size_t) value < cap) cap = (size_t) value;
+        }
+        if (cap < 1) cap = 1;
+    }
+    int status = 0;
+    reader_lock(reader);
+    watch_tree *tree = &reader->tree;
+    watch_budget *budget = tree->budget;
+    if (enabled && !budget) {
+        budget = PyMem_RawCalloc(1, sizeof (watch_budget));
+        if (!budget) {
+            reader_unlock(reader);
+            return PyErr_NoMemory();
+        }
+        budget->last_poll = monotonic_ns();
+        tree->budget = budget;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    if (enabled) {
+        budget->limit = cap;
+        budget->max_user_watches = max;
+        budget->interval = (uint64_t) (interval * 1e9);
+        budget_settle(reader, fd, 0);
+    }
+    else if (budget) {
+        // New subdirectories found meanwhile are watched without a budget.
+        tree->budget = NULL;
+        while (budget->polled_len > 0 && status != -1) {
+            polled_dir dir = budget->polled[--budget->polled_len];
+            status = budget_rearm(reader, fd, budget, &dir, 0);
+        }
+        budget_free(budget);
+        stats_queued(reader);
+    }
+    Py_END_ALLOW_THREADS
+    reader_unlock(reader);
+    if (status == -1) return PyErr_NoMemory();
+    Py_RETURN_NONE;
+}
+
+static PyObject * reader_poll_watches(InotifyObject *reader, int fd) {
+    // Poll the evicted directories now and return how many are watched
+    // again.
+    long rearmed = 0;
+    reader_lock(reader);
+    if (reader->tree.budget) {
+        Py_BEGIN_ALLOW_THREADS
+        rearmed = budget_poll(reader, fd);
+        stats_queued(reader);
+        Py_END_ALLOW_THREADS
+    }
+    reader_unlock(reader);
+    if (rearmed == -1) return PyErr_NoMemory();
+    return PyLong_FromLong(rearmed);
+}
+
+static PyObject * reader_watch_budget_stats(InotifyObject *reader) {
+    // Return how the watch budget is spent, or None if there is none.
+    reader_lock(reader);
+    watch_tree *tree = &reader->tree;
+    watch_budget *budget = tree->budget;
+    if (!budget) {
+        reader_unlock(reader);
+        Py_RETURN_NONE;
+    }
+    PyObject *stats = Py_BuildValue(
+        "{snsnsnsnsKsKsKsK}",
+        "limit", (Py_ssize_t) budget->limit,
+        "max_user_watches", (Py_ssize_t) budget->max_user_watches,
+        "active", (Py_ssize_t) (tree->count - tree->evicting),
+        "polled", (Py_ssize_t) budget->polled_len,
+        "evicted", budget->evicted,
+        "rearmed", budget->rearmed,
+        "polls", budget->polls,
+        "enospc", budget->enospc);
+    reader_unlock(reader);
+    return stats;
+}
+
+
+// Shared rings
+
+// A publisher copies the records of its queue into a ring in a file on
+// tmpfs, which any number of processes map with Subscriber. The head only
+// ever grows and is reduced modulo capacity, as in the drain ring. Every
+// subscriber keeps its own position in a slot of the file and copies out
+// what lies between it and the head, so the publisher never waits for a
+// subscriber unless the policy is 'block'. Records are copied in only
+// after reserved has moved past them; a subscriber that finds reserved
+// more than a ring ahead of its position once it has copied knows that it
+// was overtaken, throws the copy away and skips to the head.
+
+static int futex_wake(_Atomic uint32_t *word) {
+    return (int) syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+static int futex_wait(_Atomic uint32_t *word, uint32_t value,
+                      const struct timespec *timeout) {
+    // Sleep while *word holds value, for at most timeout. The word is in a
+    // shared mapping, so this is not a FUTEX_PRIVATE_FLAG operation.
+    return (int) syscall(SYS_futex, word, FUTEX_WAIT, value, timeout, NULL,
+                         0);
+}
+
+static int process_alive(int32_t pid) {
+    return kill(pid, 0) == 0 || errno == EPERM;
+}
+
+static uint64_t shared_floor(shared_ring *ring, uint64_t head,
+                             size_t record) {
+    // Return the lowest position of a live subscriber, or head if there is
+    // none. Slots that stand in the way of the next record and whose
+    // process is gone are freed on the way.
+    shared_header *header = ring->header;
+    uint64_t floor = head;
+    for (uint32_t i = 0; i < header->subscribers; i++) {
+        shared_cursor *cursor = &ring->cursors[i];
+        int32_t pid = atomic_load_explicit(&cursor->pid,
+                                           memory_order_acquire);
+        if (!pid) continue;
+        uint64_t position = atomic_load_explicit(&cursor->position,
+                                                 memory_order_acquire);
+        if (head + record - position > header->capacity &&
+            !process_alive(pid)) {
+            atomic_compare_exchange_strong(&cursor->pid, &pid, 0);
+            continue;
+        }
+        if (position < floor) floor = position;
+    }
+    return floor;
+}
+
+static Py_ssize_t shared_publish(InotifyObject *reader) {
+    // Copy every queued record into the shared ring, oldest first, and
+    // remove it from the queue. With the 'block' policy, records that would
+    // overwrite what a live subscriber has not read yet stay queued.
+    // Returns the number of records published. The caller must hold the
+    // reader lock.
+    shared_ring *ring = reader->shared;
+    shared_header *header = ring->header;
+    uint64_t capacity = header->capacity;
+    uint64_t mask = capacity - 1;
+    uint64_t head = atomic_load_explicit(&header->head, memory_order_relaxed);
+    uint64_t floor = 0;
+    int floor_known = 0;
+    Py_ssize_t published = 0;
+    inotify_event *event;
+    while ((event = queue_peek(reader))) {
+        size_t record = sizeof (inotify_event) + event->len;
+        if (header->policy == RING_BLOCK &&
+            (!floor_known || head + record - floor > capacity)) {
+            // Subscribers may have moved on since the floor was taken.
+            floor = shared_floor(ring, head, record);
+            floor_known = 1;
+            if (head + record - floor > capacity) {
+                ring->held_back++;
+                break;
+            }
+        }
+        atomic_store_explicit(&header->reserved, head + record,
+                              memory_order_relaxed);
+        // Order the store above before the copy below.
+        atomic_thread_fence(memory_order_release);
+        size_t offset = head & mask;
+        size_t first = capacity - offset;
+        if (first >= record) memcpy(ring->data + offset, event, record);
+        else {
+            memcpy(ring->data + offset, event, first);
+            memcpy(ring->data, (const char *) event + first, record - first);
+        }
+        head += record;
+        queue_consume(reader, event);
+        published++;
+    }
+    if (published == 0) return 0;
+    atomic_store_explicit(&header->head, head, memory_order_release);
+    atomic_fetch_add(&header->records, (uint64_t) published);
+    atomic_fetch_add(&header->wake_seq, 1);
+    if (atomic_load(&header->sleepers)) futex_wake(&header->wake_seq);
+    ring->published += (unsigned long long) published;
+    stats_delivered(reader);
+    return published;
+}
+
+static void shared_stop(InotifyObject *reader) {
+    // Stop publishing: tell subscribers, wake them, unmap the ring and
+    // remove its file. The caller must hold the reader lock.
+    shared_ring *ring = reader->shared;
+    if (!ring) return;
+    shared_header *header = ring->header;
+    atomic_store(&header->publisher, 0);
+    atomic_fetch_add(&header->wake_seq, 1);
+    futex_wake(&header->wake_seq);
+    munmap(header, ring->map_size);
+    unlink(ring->path);
+    reader->shared = NULL;
+    PyMem_RawFree(ring->path);
+    PyMem_RawFree(ring);
+}
+
+static PyObject * reader_share(InotifyObject *reader, PyObject *args,
+                               PyObject *kwargs) {
+    // Create a shared ring in a new file at path and publish into it from
+    // now on.
+    char *kwlist[] = {"path", "capacity", "subscribers", "policy", "mode",
+                      NULL};
+    PyObject *path_object;
+    Py_ssize_t capacity = 1024 * 1024;
+    int subscribers = 16;
+    const char *policy_name = "drop";
+    int mode = 0600;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|nisi", kwlist,
+                                     &path_object, &capacity, &subscribers,
+                                     &policy_name, &mode))
+        return NULL;
+    int policy = -1;
+    if (strcmp(policy_name, "block") == 0) policy = RING_BLOCK;
+    else if (strcmp(policy_name, "drop") == 0) policy = RING_DROP;
+    if (policy == -1) {
+        PyErr_SetString(PyExc_ValueError,
+                        "policy must be 'block' or 'drop'");
+    }
+    else if (capacity < MIN_RING_CAPACITY || capacity > MAX_READABLE_BYTES) {
+        PyErr_Format(PyExc_ValueError,
+                     "capacity must be between %d and %d bytes",
+                     MIN_RING_CAPACITY, MAX_READABLE_BYTES);
+    }
+    else if (subscribers < 1 || subscribers > MAX_SHARED_SUBSCRIBERS) {
+        PyErr_Format(PyExc_ValueError,
+                     "subscribers must be between 1 and %d",
+                     MAX_SHARED_SUBSCRIBERS);
+    }
+    if (PyErr_Occurred()) return NULL;
+    reader_lock(reader);
+    int sharing = reader->shared != NULL;
+    reader_unlock(reader);
+    if (sharing) {
+        PyErr_SetString(PyExc_RuntimeError, "The reader is already shared");
+        return NULL;
+    }
+    PyObject *encoded;
+    if (!PyUnicode_FSConverter(path_object, &encoded)) return NULL;
+    shared_ring *ring = PyMem_RawCalloc(1, sizeof (shared_ring));
+    const char *path = PyBytes_AS_STRING(encoded);
+    if (ring) ring->path = PyMem_RawMalloc(strlen(path) + 1);
+    if (!ring || !ring->path) {
+        if (ring) PyMem_RawFree(ring);
+        Py_DECREF(encoded);
+        return PyErr_NoMemory();
+    }
+    strcpy(ring->path, path);
+    // Round up to a power of two, so positions are reduced with a mask.
+    size_t size = MIN_RING_CAPACITY;
+    while (size < (size_t) capacity) size *= 2;
+    long page = sysconf(_SC_PAGESIZE);
+    size_t data_offset = sizeof (shared_header) +
+                         (size_t) subscribers * sizeof (shared_cursor);
+    data_offset = (data_offset + (size_t) page - 1) / (size_t) page *
+                  (size_t) page;
+    ring->map_size = data_offset + size;
+    int error = 0;
+    Py_BEGIN_ALLOW_THREADS
+    int fd = open(ring->path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, mode);
+    if (fd == -1) error = errno;
+    else {
+        // A new file reads as zeroes, which is an empty ring with every
+        // slot free.
+        void *map = MAP_FAILED;
+        if (ftruncate(fd, (off_t) ring->map_size) == 0)
+            map = mmap(NULL, ring->map_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+            error = errno;
+            unlink(ring->path);
+        }
+        else ring->header = map;
+        close(fd);
+    }
+    Py_END_ALLOW_THREADS
+    if (error) {
+        PyMem_RawFree(ring->path);
+        PyMem_RawFree(ring);
+        errno = error;
+        Py_DECREF(encoded);
+        return PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError,
+                                                    path_object);
+    }
+    Py_DECREF(encoded);
+    shared_header *header = ring->header;
+    ring->cursors = (shared_cursor *) (header + 1);
+    ring->data = (char *) header + data_offset;
+    header->version = SHARED_VERSION;
+    header->subscribers = (uint32_t) subscribers;
+    header->capacity = size;
+    header->data_offset = data_offset;
+    header->policy = (uint32_t) policy;
+    atomic_store(&header->publisher, (int32_t) getpid());
+    // Subscribers accept the file once the magic is there.
+    atomic_thread_fence(memory_order_release);
+    memcpy(header->magic, SHARED_MAGIC, sizeof header->magic);
+    reader_lock(reader);
+    // Another thread may have shared the reader meanwhile; the last one
+    // wins, and the ring it replaces is stopped.
+    shared_stop(reader);
+    reader->shared = ring;
+    reader_unlock(reader);
+    Py_RETURN_NONE;
+}
+
+static int reader_check_shared(InotifyObject *reader) {
+    // The caller must hold the reader lock.
+    if (!reader->shared) {
+        PyErr_SetString(PyExc_RuntimeError, "The reader is not shared");
+        return -1;
+    }
+    return 0;
+}
+
+static PyObject * reader_publish(InotifyObject *reader) {
+    // Publish the queue and return the number of records published.
+    reader_lock(reader);
+    if (reader_check_shared(reader) == -1) {
+        reader_unlock(reader);
+        return NULL;
+    }
+    reader_settle(reader);
+    Py_ssize_t published = shared_publish(reader);
+    reader_unlock(reader);
+    return PyLong_FromSsize_t(published);
+}
+
+static PyObject * reader_unshare(InotifyObject *reader) {
+    // Stop publishing. Subscribers still get what was published so far.
+    reader_lock(reader);
+    shared_stop(reader);
+    reader_unlock(reader);
+    Py_RETURN_NONE;
+}
+
+static PyObject * reader_share_stats(InotifyObject *reader) {
+    // Return the state of the shared ring and of every subscriber, or None
+    // if the reader is not shared.
+    reader_lock(reader);
+    shared_ring *ring = reader->shared;
+    if (!ring) {
+        reader_unlock(reader);
+        Py_RETURN_NONE;
+    }
+    shared_header *header = ring->header;
+    uint64_t head = atomic_load(&header->head);
+    PyObject *subscribers = PyList_New(0);
+    for (uint32_t i = 0; subscribers && i < header->subscribers; i++) {
+        shared_cursor *cursor = &ring->cursors[i];
+        int32_t pid = atomic_load(&cursor->pid);
+        if (!pid) continue;
+        uint64_t lag = head - atomic_load(&cursor->position);
+        PyObject *item = Py_BuildValue(
+            "{sisKsK}", "pid", (int) pid, "lag", (unsigned long long) lag,
+            "overruns", (unsigned long long) atomic_load(&cursor->overruns));
+        if (!item || PyList_Append(subscribers, item) == -1)
+            Py_CLEAR(subscribers);
+        Py_XDECREF(item);
+    }
+    PyObject *path = subscribers ? PyUnicode_DecodeFSDefault(ring->path)
+                                 : NULL;
+    PyObject *stats = NULL;
+    if (path) {
+        stats = Py_BuildValue(
+            "{sOsKsKsKsKsssO}",
+            "path", path,
+            "capacity", (unsigned long long) header->capacity,
+            "head", (unsigned long long) head,
+            "published", ring->published,
+            "held_back", ring->held_back,
+            "policy", header->policy == RING_DROP ? "drop" : "block",
+            "subscribers", subscribers);
+    }
+    reader_unlock(reader);
+    Py_XDECREF(path);
+    Py_XDECREF(subscribers);
+    return stats;
+}
+
+
+// The journal
+
+// With a journal, every event handed out by get_event(), get_event_list(),
+// get_batch(), get_columns(), a Poller or publish() is also appended to
+// the segment being written, which is mapped into memory, together with
+// its sequence number and the time it was delivered. Segments are
+// allocated up front, so that a full disk stops the journal instead of
+// faulting on a store to the mapping, and are cut down to what they hold
+// once the next one is started. Replay reads them back as Batch objects.
+
+static int64_t realtime_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (int64_t) now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static char * journal_path(const char *directory, uint64_t seq,
+                           const char *suffix) {
+    // Return the name of a file of the segment starting at seq, to be
+    // freed with PyMem_RawFree(), or NULL with errno set.
+    size_t size = strlen(directory) + 1 + 16 + strlen(suffix) + 1;
+    char *path = PyMem_RawMalloc(size);
+    if (!path) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    snprintf(path, size, "%s/%016llx%s", directory, (unsigned long long) seq,
+             suffix);
+    return path;
+}
+
+static int compare_seqs(const void *a, const void *b) {
+    uint64_t left = *(const uint64_t *) a, right = *(const uint64_t *) b;
+    return (left > right) - (left < right);
+}
+
+static int journal_list(const char *directory, uint64_t **seqs,
+                        size_t *len) {
+    // Collect the first sequence numbers of the segments in directory,
+    // sorted, into a new array. Returns -1 with errno set on failure.
+    // Runs without the GIL.
+    DIR *dir = opendir(directory);
+    if (!dir) return -1;
+    uint64_t *found = NULL;
+    size_t count = 0, capacity = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir))) {
+        const char *name = entry->d_name;
+        if (strlen(name) != 20 || strcmp(name + 16, ".seg") != 0) continue;
+        char *end;
+        uint64_t seq = strtoull(name, &end, 16);
+        if (end != name + 16) continue;
+        if (count == capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            uint64_t *grown = PyMem_RawRealloc(found, capacity *
+                                               sizeof (uint64_t));
+            if (!grown) {
+                PyMem_RawFree(found);
+                closedir(dir);
+                errno = ENOMEM;
+                return -1;
+            }
+            found = grown;
+        }
+        found[count++] = seq;
+    }
+    closedir(dir);
+    if (count) qsort(found, count, sizeof (uint64_t), compare_seqs);
+    *seqs = found;
+    *len = count;
+    return 0;
+}
+
+static int journal_read_header(const char *directory, uint64_t seq,
+                               journal_segment *header) {
+    // Read the header of the segment starting at seq. Returns 1 if it is
+    // valid, 0 if not and -1 with errno set if it cannot be read.
+    char *path = journal_path(directory, seq, ".seg");
+    if (!path) return -1;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    PyMem_RawFree(path);
+    if (fd == -1) return -1;
+    ssize_t got = pread(fd, header, sizeof *header, 0);
+    int error = errno;
+    close(fd);
+    if (got == -1) {
+        errno = error;
+        return -1;
+    }
+    return got == (ssize_t) sizeof *header &&
+           memcmp(header->magic, JOURNAL_MAGIC, sizeof header->magic) == 0 &&
+           header->version == JOURNAL_VERSION && header->first_seq == seq;
+}
+
+static void journal_seal(event_journal *journal) {
+    // Finish the segment being written and cut its file down to what it
+    // holds.
+    journal_segment *segment = journal->segment;
+    if (!segment) return;
+    uint64_t end = atomic_load(&segment->end);
+    atomic_store(&segment->sealed, 1);
+    munmap(segment, journal->segment_size);
+    if (ftruncate(journal->segment_fd, (off_t) end) == -1) {}
+    close(journal->segment_fd);
+    close(journal->index_fd);
+    journal->segment = NULL;
+    journal->segment_fd = journal->index_fd = -1;
+}
+
+static int journal_start_segment(event_journal *journal) {
+    // Seal the current segment and start a new one at next_seq. Returns
+    // -1 with errno set on failure.
+    journal_seal(journal);
+    char *path = journal_path(journal->directory, journal->next_seq, ".seg");
+    char *index_path = journal_path(journal->directory, journal->next_seq,
+                                    ".idx");
+    int error = 0, fd = -1, index_fd = -1;
+    void *map = MAP_FAILED;
+    if (!path || !index_path) error = ENOMEM;
+    if (!error) {
+        // A segment left empty by an earlier writer starts at the same
+        // sequence number, and is replaced.
+        fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd == -1) error = errno;
+    }
+    if (!error) error = posix_fallocate(fd, 0, (off_t) journal->segment_size);
+    if (!error) {
+        map = mmap(NULL, journal->segment_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) error = errno;
+    }
+    if (!error) {
+        index_fd = open(index_path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND |
+                        O_CLOEXEC, 0644);
+        if (index_fd == -1) error = errno;
+    }
+    if (error) {
+        if (map != MAP_FAILED) munmap(map, journal->segment_size);
+        if (fd != -1) {
+            close(fd);
+            unlink(path);
+        }
+    }
+    PyMem_RawFree(path);
+    PyMem_RawFree(index_path);
+    if (error) {
+        errno = error;
+        return -1;
+    }
+    journal_segment *segment = map;
+    segment->version = JOURNAL_VERSION;
+    segment->index_every = journal->index_every;
+    segment->first_seq = journal->next_seq;
+    segment->first_time = 0;
+    atomic_store(&segment->count, 0);
+    atomic_store(&segment->end, sizeof (journal_segment));
+    atomic_store(&segment->sealed, 0);
+    // Readers accept the segment once the magic is there.
+    atomic_thread_fence(memory_order_release);
+    memcpy(segment->magic, JOURNAL_MAGIC, sizeof segment->magic);
+    journal->segment = segment;
+    journal->segment_fd = fd;
+    journal->index_fd = index_fd;
+    journal->block = 0;
+    journal->indexed = 0;
+    journal->segments++;
+    return 0;
+}
+
+static void journal_append(event_journal *journal, const char *data,
+                           Py_ssize_t count) {
+    // Append count back-to-back records, delivered now, to the journal.
+    // A failure stops the journal; it is reported by journal_stats().
+    // The caller must hold the reader lock.
+    if (journal->error) {
+        journal->dropped += (unsigned long long) count;
+        return;
+    }
+    int64_t now = realtime_ns();
+    journal_segment *segment = journal->segment;
+    uint64_t end = atomic_load_explicit(&segment->end, memory_order_relaxed);
+    uint64_t appended = 0;
+    size_t pos = 0;
+    for (Py_ssize_t i = 0; i < count; i++) {
+        const inotify_event *event = (const inotify_event *) (data + pos);
+        size_t record = sizeof (inotify_event) + event->len;
+        journal_block *block = journal->block ?
+            (journal_block *) ((char *) segment + journal->block) : NULL;
+        if (block && (block->count >= journal->index_every ||
+                      now - block->time_ns >= JOURNAL_BLOCK_NS))
+            block = NULL;
+        size_t need = record + (block ? 0 : sizeof (journal_block));
+        if (end + need > journal->segment_size) {
+            atomic_store_explicit(&segment->count, atomic_load_explicit(
+                &segment->count, memory_order_relaxed) + appended,
+                memory_order_relaxed);
+            atomic_store_explicit(&segment->end, end, memory_order_release);
+            appended = 0;
+            if (journal_start_segment(journal) == -1) {
+                journal->error = errno;
+                journal->dropped += (unsigned long long) (count - i);
+                return;
+            }
+            segment = journal->segment;
+            end = atomic_load_explicit(&segment->end, memory_order_relaxed);
+            block = NULL;
+        }
+        if (!block) {
+            block = (journal_block *) ((char *) segment + end);
+            *block = (journal_block) { .first_seq = journal->next_seq,
+                                       .time_ns = now, .count = 0,
+                                       .bytes = 0 };
+            if (!segment->first_time) segment->first_time = now;
+            if (!journal->indexed ||
+                journal->next_seq - journal->indexed_seq >=
+                    journal->index_every) {
+                journal_index entry = { .seq = journal->next_seq,
+                                        .time_ns = now, .offset = end };
+                // The index only speeds up seeking; Replay walks the
+                // blocks where it has no entry.
+                if (write(journal->index_fd, &entry, sizeof entry) ==
+                        (ssize_t) sizeof entry) {
+                    journal->indexed_seq = journal->next_seq;
+                    journal->indexed = 1;
+                    journal->index_entries++;
+                }
+            }
+            journal->block = end;
+            end += sizeof (journal_block);
+        }
+        memcpy((char *) segment + end, event, record);
+        end += record;
+        block->count++;
+        block->bytes += (uint32_t) record;
+        journal->next_seq++;
+        journal->events++;
+        journal->bytes += record;
+        appended++;
+        pos += record;
+    }
+    atomic_store_explicit(&segment->count, atomic_load_explicit(
+        &segment->count, memory_order_relaxed) + appended,
+        memory_order_relaxed);
+    atomic_store_explicit(&segment->end, end, memory_order_release);
+}
+
+static void journal_free(event_journal *journal) {
+    if (!journal) return;
+    journal_seal(journal);
+    PyMem_RawFree(journal->directory);
+    PyMem_RawFree(journal);
+}
+
+static PyObject * reader_start_journal(InotifyObject *reader, PyObject *args,
+                                       PyObject *kwargs) {
+    // Append every event delivered from now on to the journal in
+    // directory, after the segments already there.
+    char *kwlist[] = {"directory", "segment_size", "index_every", NULL};
+    PyObject *directory;
+    Py_ssize_t segment_size = 64 * 1024 * 1024;
+    unsigned int index_every = 256;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|nI", kwlist,
+                                     &directory, &segment_size,
+                                     &index_every))
+        return NULL;
+    if (segment_size < MIN_JOURNAL_SEGMENT) {
+        return PyErr_Format(PyExc_ValueError,
+                            "segment_size must be at least %d bytes",
+                            MIN_JOURNAL_SEGMENT);
+    }
+    if (index_every < 1 || index_every > 65536) {
+        PyErr_SetString(PyExc_ValueError,
+                        "index_every must be between 1 and 65536");
+        return NULL;
+    }
+    reader_lock(reader);
+    int journaling = reader->journal != NULL;
+    reader_unlock(reader);
+    if (journaling) {
+        PyErr_SetString(PyExc_RuntimeError, "The journal is already open");
+        return NULL;
+    }
+    PyObject *encoded;
+    if (!PyUnicode_FSConverter(directory, &encoded)) return NULL;
+    event_journal *journal = PyMem_RawCalloc(1, sizeof (event_journal));
+    const char *name = PyBytes_AS_STRING(encoded);
+    if (journal) journal->directory = PyMem_RawMalloc(strlen(name) + 1);
+    if (!journal || !journal->directory) {
+        PyMem_RawFree(journal);
+        Py_DECREF(encoded);
+        return PyErr_NoMemory();
+    }
+    strcpy(journal->directory, name);
+    Py_DECREF(encoded);
+    journal->segment_size = (size_t) segment_size;
+    journal->index_every = index_every;
+    journal->segment_fd = journal->index_fd = -1;
+    int error = 0;
+    Py_BEGIN_ALLOW_THREADS
+    if (mkdir(journal->directory, 0755) == -1 && errno != EEXIST)
+        error = errno;
+    uint64_t *seqs = NULL;
+    size_t len = 0;
+    if (!error && journal_list(journal->directory, &seqs, &len) == -1)
+        error = errno;
+    if (!error && len > 0) {
+        // Carry on from the last segment, or take its place if it was
+        // left without a valid header.
+        journal_segment header;
+        int valid = journal_read_header(journal->directory, seqs[len - 1],
+                                        &header);
+        if (valid == -1) error = errno;
+        journal->next_seq = seqs[len - 1] +
+                            (valid == 1 ? atomic_load(&header.count) : 0);
+    }
+    PyMem_RawFree(seqs);
+    if (!error && journal_start_segment(journal) == -1) error = errno;
+    Py_END_ALLOW_THREADS
+    if (error) {
+        journal_free(journal);
+        errno = error;
+        return PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError,
+                                                    directory);
+    }
+    reader_lock(reader);
+    event_journal *previous = reader->journal;
+    if (!previous) reader->journal = journal;
+    reader_unlock(reader);
+    if (previous) {
+        journal_free(journal);
+        PyErr_SetString(PyExc_RuntimeError, "The journal is already open");
+        return NULL;
+    }
+    return PyLong_FromUnsignedLongLong(journal->next_seq);
+}
+
+static PyObject * reader_stop_journal(InotifyObject *reader) {
+    reader_lock(reader);
+    event_journal *journal = reader->journal;
+    reader->journal = NULL;
+    reader_unlock(reader);
+    Py_BEGIN_ALLOW_THREADS
+    journal_free(journal);
+    Py_END_ALLOW_THREADS
+    Py_RETURN_NONE;
+}
+
+static PyObject * reader_journal_stats(InotifyObject *reader) {
+    // Return what the journal has written so far, or None if there is
+    // none.
+    reader_lock(reader);
+    event_journal *journal = reader->journal;
+    if (!journal) {
+        reader_unlock(reader);
+        Py_RETURN_NONE;
+    }
+    event_journal copy = *journal;
+    PyObject *directory = PyUnicode_DecodeFSDefault(journal->directory);
+    reader_unlock(reader);
+    if (!directory) return NULL;
+    PyObject *error = copy.error ? PyLong_FromLong(copy.error)
+                                 : Py_NewRef(Py_None);
+    if (!error) {
+        Py_DECREF(directory);
+        return NULL;
+    }
+    return Py_BuildValue("{sNsKsKsKsKsKsKsN}",
+                         "directory", directory,
+                         "next_seq", (unsigned long long) copy.next_seq,
+                         "events", copy.events,
+                         "bytes", copy.bytes,
+                         "segments", copy.segments,
+                         "index_entries", copy.index_entries,
+                         "dropped", copy.dropped,
+                         "error", error);
+}
+
+
+// fanotify
+
+// A Fanotify reader marks whole filesystems, so it never runs into the
+// limit on inotify watches. Its descriptor reports the file handle of the
+// directory and the name of every event (FAN_REPORT_DFID_NAME) instead of
+// a watch descriptor. Right after each read, fan_translate() rewrites the
+// events as records in the kernel layout of inotify, named by their full
+// path, so that filters, coalescing, rename pairing, batches, shared rings
+// and journals take them as they are. Handles are resolved with
+// open_by_handle_at(2), which needs CAP_DAC_READ_SEARCH, and the paths are
+// cached until the directory or one above it is renamed. A deleted
+// directory's handle never resolves again, so it needs no invalidation.
+
+static void fan_flush(fan_state *fan) {
+    // Forget every cached path.
+    for (size_t i = 0; i < FAN_PATH_SLOTS; i++) {
+        PyMem_RawFree(fan->paths[i].key);
+        PyMem_RawFree(fan->paths[i].path);
+        fan->paths[i] = (fan_path) {0};
+    }
+    fan->flushes++;
+}
+
+static void fan_forget(fan_state *fan, const char *top, size_t top_len) {
+    // Forget the cached paths of the directory top and those below it, or
+    // every cached path if top is not a full path.
+    if (top_len == 0 || top[0] != '/') {
+        fan_flush(fan);
+        return;
+    }
+    for (size_t i = 0; i < FAN_PATH_SLOTS; i++) {
+        fan_path *slot = &fan->paths[i];
+        if (!slot->key || !path_under(slot->path, slot->len, top, top_len))
+            continue;
+        PyMem_RawFree(slot->key);
+        PyMem_RawFree(slot->path);
+        *slot = (fan_path) {0};
+    }
+    fan->flushes++;
+}
+
+static void fan_free(fan_state *fan) {
+    if (!fan) return;
+    for (size_t i = 0; i < fan->mounts_len; i++) close(fan->mounts[i].fd);
+    PyMem_RawFree(fan->mounts);
+    for (size_t i = 0; i < FAN_PATH_SLOTS; i++) {
+        PyMem_RawFree(fan->paths[i].key);
+        PyMem_RawFree(fan->paths[i].path);
+    }
+    PyMem_RawFree(fan->raw);
+    PyMem_RawFree(fan);
+}
+
+static int fan_mount_index(fan_state *fan, const void *fsid) {
+    // Return the position of the mount events with fsid come from, or -1.
+    for (size_t i = 0; i < fan->mounts_len; i++) {
+        if (memcmp(fan->mounts[i].fsid, fsid, sizeof fan->mounts[i].fsid)
+            == 0)
+            return (int) i;
+    }
+    return -1;
+}
+
+static int fan_resolve(InotifyObject *reader,
+                       const struct fanotify_event_info_fid *fid,
+                       size_t handle_bytes, const char **path, size_t *len,
+                       long *syscalls) {
+    // Look up the path of the object fid stands for, first in the cache.
+    // Returns 1 if it was found, 0 if it could not be and -1 if there was
+    // no memory to cache it. Runs without the GIL; the caller must hold
+    // the reader lock.
+    fan_state *fan = reader->fan;
+    const char *key = (const char *) &fid->fsid;
+    size_t key_len = sizeof fid->fsid + sizeof (struct file_handle) +
+                     handle_bytes;
+    uint64_t hash = name_hash(0, key, key_len);
+    fan_path *slot = &fan->paths[hash & (FAN_PATH_SLOTS - 1)];
+    if (slot->key && slot->hash == hash && slot->key_len == key_len &&
+        memcmp(slot->key, key, key_len) == 0) {
+        fan->hits++;
+        *path = slot->path;
+        *len = slot->len;
+        return 1;
+    }
+    fan->misses++;
+    int mount = fan_mount_index(fan, &fid->fsid);
+    if (mount == -1) return 0;
+    int fd = open_by_handle_at(fan->mounts[mount].fd,
+                               (struct file_handle *) fid->handle,
+                               O_PATH | O_CLOEXEC);
+    (*syscalls)++;
+    if (fd == -1) return 0;
+    char link[32];
+    char target[PATH_MAX];
+    snprintf(link, sizeof link, "/proc/self/fd/%d", fd);
+    ssize_t target_len = readlink(link, target, sizeof target);
+    *syscalls += 2;
+    // The kernel names an unlinked directory by its last path with
+    // " (deleted)" appended, which must not be cached as its path.
+    static const char deleted[] = " (deleted)";
+    size_t suffix = sizeof deleted - 1;
+    struct stat st;
+    if (target_len > (ssize_t) suffix &&
+        memcmp(target + target_len - suffix, deleted, suffix) == 0 &&
+        (fstat(fd, &st) == -1 || st.st_nlink == 0))
+        target_len = 0;
+    close(fd);
+    if (target_len <= 0 || (size_t) target_len == sizeof target) return 0;
+    char *copy_key = PyMem_RawMalloc(key_len);
+    char *copy_path = PyMem_RawMalloc((size_t) target_len + 1);
+    if (!copy_key || !copy_path) {
+        PyMem_RawFree(copy_key);
+        PyMem_RawFree(copy_path);
+        return -1;
+    }
+    memcpy(copy_key, key, key_len);
+    memcpy(copy_path, target, (size_t) target_len);
+    copy_path[target_len] = '\0';
+    PyMem_RawFree(slot->key);
+    PyMem_RawFree(slot->path);
+    *slot = (fan_path) {
+        .hash = hash, .key = copy_key, .key_len = key_len,
+        .path = copy_path, .len = (size_t) target_len
+    };
+    *path = slot->path;
+    *len = slot->len;
+    return 1;
+}
+
+static int fan_emit(InotifyObject *reader, size_t *out, int wd,
+                    uint32_t mask, uint32_t cookie, const char *dir,
+                    size_t dir_len, const char *name, size_t name_len) {
+    // Write a record at offset out of the buffer, named dir joined with
+    // name, and move out past it. The name is padded like
+    // add_event_with_path() pads it. Returns -1 if the buffer could not
+    // be grown.
+    size_t path_len = dir_len + ((dir_len && name_len) ? 1 : 0) + name_len;
+    size_t padded = path_len ? (path_len + sizeof (inotify_event)) &
+                               ~(sizeof (inotify_event) - 1)
+                             : 0;
+    size_t needed = *out + sizeof (inotify_event) + padded;
+    if (needed > reader->buffer_capacity &&
+        buffer_reserve(reader, needed > 2 * reader->buffer_capacity
+                               ? needed : 2 * reader->buffer_capacity) == -1)
+        return -1;
+    inotify_event *record = (inotify_event *) (reader->buffer + *out);
+    record->wd = wd;
+    record->mask = mask;
+    record->cookie = cookie;
+    record->len = (uint32_t) padded;
+    memcpy(record->name, dir, dir_len);
+    if (dir_len && name_len) record->name[dir_len] = '/';
+    memcpy(record->name + path_len - name_len, name, name_len);
+    memset(record->name + path_len, 0, padded - path_len);
+    *out = needed;
+    return 0;
+}
+
+static int fan_emit_fid(InotifyObject *reader, size_t *out, uint32_t mask,
+                        uint32_t cookie,
+                        const struct fanotify_event_info_fid *fid,
+                        long *syscalls) {
+    // Write a record for an event reported with fid, named by the path of
+    // its directory and its name, or by its name alone if the directory
+    // could not be found.
+    fan_state *fan = reader->fan;
+    const struct file_handle *handle = (const struct file_handle *)
+        fid->handle;
+    size_t handle_bytes = handle->handle_bytes;
+    const char *end = (const char *) fid + fid->hdr.len;
+    const char *name = (const char *) handle->f_handle + handle_bytes;
+    size_t name_len = 0;
+    if (fid->hdr.info_type != FAN_EVENT_INFO_TYPE_FID &&
+        fid->hdr.info_type != FAN_EVENT_INFO_TYPE_DFID && name < end) {
+        name_len = strnlen(name, (size_t) (end - name));
+        // Events on the directory itself are named ".".
+        if (name_len == 1 && name[0] == '.') name_len = 0;
+    }
+    const char *dir = NULL;
+    size_t dir_len = 0;
+    int found = fan_resolve(reader, fid, handle_bytes, &dir, &dir_len,
+                            syscalls);
+    if (found == -1) return -1;
+    if (!found) fan->unresolved++;
+    int mount = fan_mount_index(fan, &fid->fsid);
+    return fan_emit(reader, out, mount + 1, mask, cookie, dir, dir_len,
+                    name, name_len);
+}
+
+static int fan_translate(InotifyObject *reader, size_t *size,
+                         long *syscalls) {
+    // Rewrite the size bytes of fanotify events in the buffer as inotify
+    // records, and set size to the number of bytes those take. Returns -1
+    // if there was no memory for them. Runs without the GIL; the caller
+    // must hold the reader lock.
+    fan_state *fan = reader->fan;
+    if (*size > fan->raw_capacity) {
+        char *grown = PyMem_RawRealloc(fan->raw, *size);
+        if (!grown) return -1;
+        fan->raw = grown;
+        fan->raw_capacity = *size;
+    }
+    memcpy(fan->raw, reader->buffer, *size);
+    size_t pos = 0, out = 0;
+    int status = 0;
+    while (pos + FAN_EVENT_METADATA_LEN <= *size) {
+        struct fanotify_event_metadata *meta =
+            (struct fanotify_event_metadata *) (fan->raw + pos);
+        if (meta->event_len < FAN_EVENT_METADATA_LEN ||
+            pos + meta->event_len > *size)
+            break;
+        pos += meta->event_len;
+        // Descriptors only come with groups that do not report handles,
+        // but must never leak.
+        if (meta->fd >= 0) close(meta->fd);
+        if (status == -1 || meta->vers != FANOTIFY_METADATA_VERSION)
+            continue;
+        if (meta->mask & FAN_Q_OVERFLOW) {
+            status = fan_emit(reader, &out, -1, IN_Q_OVERFLOW, 0, NULL, 0,
+                              NULL, 0);
+            continue;
+        }
+        const struct fanotify_event_info_fid *fid = NULL, *from = NULL,
+                                             *to = NULL;
+        const char *info = (const char *) meta + meta->metadata_len;
+        const char *end = (const char *) meta + meta->event_len;
+        while (info + sizeof (struct fanotify_event_info_header) <= end) {
+            const struct fanotify_event_info_fid *record =
+                (const struct fanotify_event_info_fid *) info;
+            size_t len = record->hdr.len;
+            if (len < sizeof (struct fanotify_event_info_header) ||
+                info + len > end)
+                break;
+            info += len;
+            // The handle must lie within the record.
+            if (len < sizeof *record + sizeof (struct file_handle) ||
+                len < sizeof *record + sizeof (struct file_handle) +
+                ((const struct file_handle *) record->handle)->handle_bytes)
+                continue;
+            switch (record->hdr.info_type) {
+                case FAN_EVENT_INFO_TYPE_DFID_NAME:
+                    fid = record;
+                    break;
+                case FAN_EVENT_INFO_TYPE_DFID:
+                case FAN_EVENT_INFO_TYPE_FID:
+                    if (!fid) fid = record;
+                    break;
+#ifdef FAN_RENAME
+                case FAN_EVENT_INFO_TYPE_OLD_DFID_NAME:
+                    from = record;
+                    break;
+                case FAN_EVENT_INFO_TYPE_NEW_DFID_NAME:
+                    to = record;
+                    break;
+#endif
+            }
+        }
+        // The event bits fanotify shares with inotify have the same values,
+        // and FAN_ONDIR is IN_ISDIR.
+        uint32_t isdir = (meta->mask & FAN_ONDIR) ? IN_ISDIR : 0;
+        // Renames only come from FAN_RENAME, whose records name both ends.
+        // FAN_MOVED_FROM and FAN_MOVED_TO carry no cookie, and the kernel
+        // merges them into other events on the same directory, so they
+        // would repeat the rename as records no cookie pairs.
+        uint32_t mask = (uint32_t) meta->mask & IN_ALL_EVENTS & ~IN_MOVE;
+        if (meta->mask & FAN_OPEN_EXEC) mask |= IN_OPEN;
+        if (from && to) {
+            // A FAN_RENAME carries both ends, which become a pair of
+            // records with a cookie of their own.
+            if (++fan->cookie == 0) fan->cookie = 1;
+            status = fan_emit_fid(reader, &out, IN_MOVED_FROM | isdir,
+                                  fan->cookie, from, syscalls);
+            if (status == 0)
+                status = fan_emit_fid(reader, &out, IN_MOVED_TO | isdir,
+                                      fan->cookie, to, syscalls);
+        }
+        if (status == 0 && mask && fid)
+            status = fan_emit_fid(reader, &out, mask | isdir, 0, fid,
+                                  syscalls);
+        // The cached paths of a directory that moved, and of those below
+        // it, are stale. Its old path is written past the records as a
+        // scratch record, which the next record overwrites.
+        const struct fanotify_event_info_fid *moved =
+            !isdir ? NULL
+            : (from && to) ? from
+            : (meta->mask & (IN_MOVED_FROM | IN_MOVE_SELF)) ? fid : NULL;
+        size_t scratch = out;
+        if (status == 0 && moved &&
+            (status = fan_emit_fid(reader, &scratch, 0, 0, moved,
+                                   syscalls)) == 0) {
+            const inotify_event *record = (const inotify_event *)
+                (reader->buffer + out);
+            fan_forget(fan, record->name, strnlen(record->name, record->len));
+        }
+    }
+    *size = out;
+    return status;
+}
+
+static PyObject * reader_fan_mark(InotifyObject *reader, PyObject *path,
+                                  unsigned long long mask,
+                                  unsigned int flags) {
+    // Call fanotify_mark() on path. When a mark is added, keep a
+    // descriptor of its filesystem to resolve handles against, and return
+    // the watch descriptor its events are reported with.
+    PyObject *encoded;
+    if (!PyUnicode_FSConverter(path, &encoded)) return NULL;
+    const char *name = PyBytes_AS_STRING(encoded);
+    int fd = reader->fd;
+    int mount_fd = -1;
+    int error = 0;
+    struct statfs fs;
+    Py_BEGIN_ALLOW_THREADS
+    if (fanotify_mark(fd, flags, (uint64_t) mask, AT_FDCWD, name) == -1)
+        error = errno;
+    else if (flags & FAN_MARK_ADD) {
+        // open_by_handle_at(2) takes no O_PATH descriptor here.
+        mount_fd = open(name, O_RDONLY | O_CLOEXEC);
+        if (mount_fd == -1 || fstatfs(mount_fd, &fs) == -1) error = errno;
+    }
+    Py_END_ALLOW_THREADS
+    Py_DECREF(encoded);
+    if (error) {
+        if (mount_fd >= 0) close(mount_fd);
+        errno = error;
+        return PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, path);
+    }
+    if (!(flags & FAN_MARK_ADD)) Py_RETURN_NONE;
+    reader_lock(reader);
+    fan_state *fan = reader->fan;
+    int index = fan_mount_index(fan, &fs.f_fsid);
+    if (index == -1) {
+        fan_mount *grown = PyMem_RawRealloc(
+            fan->mounts, (fan->mounts_len + 1) * sizeof (fan_mount));
+        if (!grown) {
+            reader_unlock(reader);
+            close(mount_fd);
+            return PyErr_NoMemory();
+        }
+        fan->mounts = grown;
+        index = (int) fan->mounts_len++;
+        memcpy(fan->mounts[index].fsid, &fs.f_fsid,
+               sizeof fan->mounts[index].fsid);
+        fan->mounts[index].fd = mount_fd;
+        mount_fd = -1;
+    }
+    reader_unlock(reader);
+    if (mount_fd >= 0) close(mount_fd);
+    return PyLong_FromLong(index + 1);
+}
+
+static PyObject * reader_path_stats(InotifyObject *reader) {
+    // Return how well the path cache has done so far.
+    reader_lock(reader);
+    fan_state *fan = reader->fan;
+    size_t cached = 0;
+    for (size_t i = 0; i < FAN_PATH_SLOTS; i++) cached += !!fan->paths[i].key;
+    PyObject *stats = Py_BuildValue(
+        "{snsnsnsKsKsKsK}",
+        "filesystems", (Py_ssize_t) fan->mounts_len,
+        "cached", (Py_ssize_t) cached,
+        "slots", (Py_ssize_t) FAN_PATH_SLOTS,
+        "hits", fan->hits,
+        "misses", fan->misses,
+        "unresolved", fan->unresolved,
+        "flushes", fan->flushes);
+    reader_unlock(reader);
+    return stats;
+}
+
+
+// The module-level functions. They share one reader per module, which is
+// kept for compatibility; use Inotify objects to read several descriptors.
+
+static PyObject * inotipy_utils_read(PyObject *self, PyObject *args,
+                                     PyObject *kwargs) {
+    // Accept a file descriptor and return the number of events read.
+    // WARNING: Any previous contents of the buffer will be overwritten!
+    char* kwlist[] = {"fd", NULL};
+    int fd;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "i", kwlist, &fd))
+        return NULL;
+    return reader_read(get_utils_state(self)->default_reader, fd);
+}
+
+static PyObject * inotipy_utils_drain(PyObject *self, PyObject *args,
+                                      PyObject *kwargs) {
+    char* kwlist[] = {"fd", "capacity", NULL};
+    int fd;
+    Py_ssize_t capacity = DEFAULT_DRAIN_CAPACITY;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "i|n", kwlist, &fd,
+                                     &capacity))
+        return NULL;
+    return reader_drain(get_utils_state(self)->default_reader, fd, capacity);
+}
+
+static PyObject * inotipy_utils_wait(PyObject *self, PyObject *args,
+                                     PyObject *kwargs) {
+    char* kwlist[] = {"fd", "timeout", NULL};
+    int fd;
+    PyObject *timeout = Py_None;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "i|O", kwlist, &fd,
+                                     &timeout))
+        return NULL;
+    return reader_wait(fd, -1, timeout);
+}
+
+static PyObject * get_raw_buffer(PyObject *self, PyObject *unused) {
+    return reader_get_raw_buffer(get_utils_state(self)->default_reader);
+}
+
+static PyObject * get_event(PyObject *self, PyObject *unused) {
+    // Wrapper around get_event_tuple() to allow access from the python
+    // interpreter
+    return get_event_tuple(get_utils_state(self)->default_reader);
+}
+
+static PyObject * get_event_queue(PyObject *self, PyObject *unused) {
+    return reader_get_event_list(get_utils_state(self)->default_reader);
+}
+
+static PyObject * get_batch(PyObject *self, PyObject *unused) {
+    return reader_get_batch(get_utils_state(self)->default_reader);
+}
+
+static PyObject * get_columns(PyObject *self, PyObject *unused) {
+    return reader_get_columns(get_utils_state(self)->default_reader);
+}
+
+static PyObject * set_filter(PyObject *self, PyObject *args,
+                             PyObject *kwargs) {
+    return reader_set_filter(get_utils_state(self)->default_reader, args,
+                             kwargs);
+}
+
+static PyObject * filter_stats(PyObject *self, PyObject *unused) {
+    return reader_filter_stats(get_utils_state(self)->default_reader);
+}
+
+static PyObject * set_coalesce(PyObject *self, PyObject *args,
+                               PyObject *kwargs) {
+    return reader_set_coalesce(get_utils_state(self)->default_reader, args,
+                               kwargs);
+}
+
+static PyObject * coalesce_stats(PyObject *self, PyObject *unused) {
+    return reader_coalesce_stats(get_utils_state(self)->default_reader);
+}
+
+static PyObject * set_pair_moves(PyObject *self, PyObject *args,
+                                 PyObject *kwargs) {
+    return reader_set_pair_moves(get_utils_state(self)->default_reader, args,
+                                 kwargs);
+}
+
+static PyObject * flush_moves(PyObject *self, PyObject *unused) {
+    return reader_flush_moves(get_utils_state(self)->default_reader);
+}
+
+static PyObject * move_stats(PyObject *self, PyObject *unused) {
+    return reader_move_stats(get_utils_state(self)->default_reader);
+}
+
+static PyObject * add_tree(PyObject *self, PyObject *args, PyObject *kwargs) {
+    char *kwlist[] = {"fd", "path", "mask", NULL};
+    int fd;
+    PyObject *path;
+    unsigned long mask = IN_ALL_EVENTS;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "iO|k", kwlist, &fd,
+                                     &path, &mask))
+        return NULL;
+    return reader_add_tree(get_utils_state(self)->default_reader, fd, path,
+                           mask);
+}
+
+static PyObject * wd_path(PyObject *self, PyObject *arg) {
+    int wd = PyLong_AsLong(arg);
+    if (wd == -1 && PyErr_Occurred()) return NULL;
+    return reader_wd_path(get_utils_state(self)->default_reader, wd);
+}
+
+static PyObject * tree_stats(PyObject *self, PyObject *unused) {
+    return reader_tree_stats(get_utils_state(self)->default_reader);
+}
+
+static PyObject * set_rescan(PyObject *self, PyObject *args,
+                             PyObject *kwargs) {
+    return reader_set_rescan(get_utils_state(self)->default_reader, args,
+                             kwargs);
+}
+
+static PyObject * rescan(PyObject *self, PyObject *args, PyObject *kwargs) {
+    char *kwlist[] = {"fd", NULL};
+    int fd;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "i", kwlist, &fd))
+        return NULL;
+    return reader_rescan(get_utils_state(self)->default_reader, fd);
+}
+
+static PyObject * save_snapshot(PyObject *self, PyObject *path) {
+    return reader_save_snapshot(get_utils_state(self)->default_reader, path);
+}
+
+static PyObject * load_snapshot(PyObject *self, PyObject *path) {
+    return reader_load_snapshot(get_utils_state(self)->default_reader, path);
+}
+
+static PyObject * set_watch_budget(PyObject *self, PyObject *args,
+                                   PyObject *kwargs) {
+    char *kwlist[] = {"fd", "enabled", "limit", "poll_interval", NULL};
+    int fd;
+    int enabled = 1;
+    PyObject *limit = Py_None;
+    double interval = 1.0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "i|pOd", kwlist, &fd,
+                                     &enabled, &limit, &interval))
+        return NULL;
+    return reader_set_watch_budget(get_utils_state(self)->default_reader,
+                                   fd, enabled, limit, interval);
+}
+
+static PyObject * poll_watches(PyObject *self, PyObject *args,
+                               PyObject *kwargs) {
+    char *kwlist[] = {"fd", NULL};
+    int fd;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "i", kwlist, &fd))
+        return NULL;
+    return reader_poll_watches(get_utils_state(self)->default_reader, fd);
+}
+
+static PyObject * watch_budget_stats(PyObject *self, PyObject *unused) {
+    return reader_watch_budget_stats(get_utils_state(self)->default_reader);
+}
+
+static PyObject * inotipy_utils_stats(PyObject *self, PyObject *unused) {
+    return reader_get_stats(get_utils_state(self)->default_reader);
+}
+
+
+// The Inotify type
+
+static InotifyObject * reader_new(PyTypeObject *type, int fd, int owns_fd) {
+    InotifyObject *reader = (InotifyObject *) type->tp_alloc(type, 0);
+    if (!reader) return NULL;
+    reader->fd = fd;
+    reader->owns_fd = owns_fd;
+    reader->closed = 0;
+    atomic_store(&reader->walkers, 0);
+    reader->buffer = NULL;
+    reader->buffer_capacity = 0;
+    reader->buffer_pos = -1;
+    reader->buffer_size = -1;
+    reader->_utils_errno = 0;
+    reader->events_read = 0;
+    reader->queue = (iel_arena) { .data=NULL, .head=0, .tail=0,
+                                  .capacity=0,
+                                  .generation=COALESCE_FIRST_GENERATION };
+    reader->iel_length = 0;
+    reader->filter = NULL;
+    reader->tree = (watch_tree) {0};
+    reader->coalesce = NULL;
+    reader->pairer = NULL;
+    reader->ring = NULL;
+    reader->wake_fd = -1;
+    reader->waiting_stream = NULL;
+    reader->stats = (reader_stats) {0};
+    reader->names = NULL;
+    reader->shared = NULL;
+    reader->journal = NULL;
+    reader->fan = NULL;
+    reader->lock = PyThread_allocate_lock();
+    if (!reader->lock) {
+        Py_DECREF(reader);
+        PyErr_SetString(PyExc_MemoryError, "Unable to allocate lock!");
+        return NULL;
+    }
+    return reader;
+}
+
+static PyObject * Inotify_new(PyTypeObject *type, PyObject *args,
+                              PyObject *kwargs) {
+    // Wrap an existing inotify file descriptor, or create (and own) a new
+    // one with inotify_init1(flags) when no descriptor is given.
+    char *kwlist[] = {"fd", "flags", NULL};
+    int fd = -1;
+    int flags = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|ii", kwlist, &fd,
+                                     &flags))
+        return NULL;
+    int owns_fd = 0;
+    if (fd < 0) {
+        fd = inotify_init1(flags);
+        if (fd == -1) return PyErr_SetFromErrno(PyExc_OSError);
+        owns_fd = 1;
+    }
+    InotifyObject *reader = reader_new(type, fd, owns_fd);
+    if (!reader && owns_fd) close(fd);
+    return (PyObject *) reader;
+}
+
+static void reader_close_fd(InotifyObject *reader) {
+    // A waiting Stream must give the descriptor back to its loop first.
+    if (reader->waiting_stream) stream_abort(reader->waiting_stream);
+    // Taking the lock waits out a read in progress on another thread.
+    reader_lock(reader);
+    // The drain thread must be gone before its descriptor is closed.
+    if (reader->ring) {
+        Py_BEGIN_ALLOW_THREADS
+        ring_stop(reader);
+        Py_END_ALLOW_THREADS
+    }
+    if (reader->fd >= 0) {
+        reader->closed = 1;
+        // Threads waiting on the descriptor poll wake_fd along with it; the
+        // wakeup is never cleared, so the ones about to wait see it too.
+        if (reader->wake_fd >= 0) {
+            uint64_t one = 1;
+            if (write(reader->wake_fd, &one, sizeof one) == -1) {}
+        }
+    }
+    // Walks still adding watches through fd must not reach whatever gets
+    // its number next. They need the lock to finish.
+    if (atomic_load(&reader->walkers)) {
+        Py_BEGIN_ALLOW_THREADS
+        PyThread_release_lock(reader->lock);
+        uint32_t walkers;
+        while ((walkers = atomic_load(&reader->walkers)) != 0)
+            futex_wait(&reader->walkers, walkers, NULL);
+        PyThread_acquire_lock(reader->lock, WAIT_LOCK);
+        Py_END_ALLOW_THREADS
+    }
+    // Another close() may have got there while this one waited.
+    if (reader->fd >= 0) {
+        if (reader->owns_fd) close(reader->fd);
+        reader->fd = -1;
+    }
+    reader_unlock(reader);
+}
+
+static void Inotify_dealloc(InotifyObject *reader) {
+    PyTypeObject *type = Py_TYPE(reader);
+    reader_close_fd(reader);
+    PyMem_RawFree(reader->buffer);
+    PyMem_RawFree(reader->queue.data);
+    PyMem_RawFree(reader->queue.counts);
+    filter_free(reader->filter);
+    coalesce_free(reader->coalesce);
+    pairer_free(reader->pairer);
+    name_cache_free(reader->names);
+    if (reader->shared) {
+        reader_lock(reader);
+        shared_stop(reader);
+        reader_unlock(reader);
+    }
+    journal_free(reader->journal);
+    fan_free(reader->fan);
+    if (reader->wake_fd >= 0) close(reader->wake_fd);
+    tree_free(&reader->tree);
+    if (reader->lock) PyThread_free_lock(reader->lock);
+    type->tp_free((PyObject *) reader);
+    Py_DECREF(type);
+}
+
+static int reader_check_open(InotifyObject *reader) {
+    if (reader->fd < 0) {
+        PyErr_SetString(PyExc_ValueError,
+                        "I/O operation on closed inotify instance");
+        return -1;
+    }
+    return 0;
+}
+
+static PyObject * Inotify_read(InotifyObject *self, PyObject *unused) {
+    if (reader_check_open(self) == -1) return NULL;
+    return reader_read(self, self->fd);
+}
+
+static PyObject * Inotify_drain(InotifyObject *self, PyObject *args,
+                                PyObject *kwargs) {
+    char* kwlist[] = {"capacity", NULL};
+    Py_ssize_t capacity = DEFAULT_DRAIN_CAPACITY;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|n", kwlist, &capacity))
+        return NULL;
+    if (reader_check_open(self) == -1) return NULL;
+    return reader_drain(self, self->fd, capacity);
+}
+
+static PyObject * Inotify_wait(InotifyObject *self, PyObject *args,
+                               PyObject *kwargs) {
+    char* kwlist[] = {"timeout", NULL};
+    PyObject *timeout = Py_None;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|O", kwlist, &timeout))
+        return NULL;
+    reader_lock(self);
+    if (reader_check_open(self) == -1) {
+        reader_unlock(self);
+        return NULL;
+    }
+    drain_ring *ring = self->ring;
+    int ready = 0, fd = self->fd, wake_fd;
+    if (ring) {
+        // With a drain thread, events are ready once they are in the ring.
+        uint64_t wakeups;
+        if (read(self->wake_fd, &wakeups, sizeof wakeups) == -1) {}
+        ready = self->iel_length > 0 ||
+                atomic_load(&ring->head) != atomic_load(&ring->tail) ||
+                atomic_load(&ring->error) != 0;
+        fd = self->wake_fd;
+        wake_fd = -1;
+    }
+    else wake_fd = reader_wake_fd(self);
+    reader_unlock(self);
+    if (ready) Py_RETURN_TRUE;
+    if (!ring && wake_fd == -1) return PyErr_SetFromErrno(PyExc_OSError);
+    PyObject *result = reader_wait(fd, wake_fd, timeout);
+    // Woken by close() rather than by events.
+    if (result && self->closed) {
+        Py_DECREF(result);
+        reader_check_open(self);
+        return NULL;
+    }
+    return result;
+}
+
+static PyObject * Inotify_get_event(InotifyObject *self, PyObject *unused) {
+    return get_event_tuple(self);
+}
+
+static PyObject * Inotify_get_event_list(InotifyObject *self,
+                                         PyObject *unused) {
+    return reader_get_event_list(self);
+}
+
+static PyObject * Inotify_get_batch(InotifyObject *self, PyObject *unused) {
+    return reader_get_batch(self);
+}
+
+static PyObject * Inotify_get_columns(InotifyObject *self,
+                                      PyObject *unused) {
+    return reader_get_columns(self);
+}
+
+static PyObject * Inotify_events(InotifyObject *self, PyObject *args,
+                                 PyObject *kwargs) {
+    char* kwlist[] = {"capacity", NULL};
+    Py_ssize_t capacity = DEFAULT_DRAIN_CAPACITY;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|n", kwlist, &capacity))
+        return NULL;
+    if (reader_check_open(self) == -1) return NULL;
+    return reader_events(self, capacity);
+}
+
+static PyObject * Inotify_set_filter(InotifyObject *self, PyObject *args,
+                                     PyObject *kwargs) {
+    return reader_set_filter(self, args, kwargs);
+}
+
+static PyObject * Inotify_filter_stats(InotifyObject *self,
+                                       PyObject *unused) {
+    return reader_filter_stats(self);
+}
+
+static PyObject * Inotify_set_coalesce(InotifyObject *self, PyObject *args,
+                                       PyObject *kwargs) {
+    return reader_set_coalesce(self, args, kwargs);
+}
+
+static PyObject * Inotify_coalesce_stats(InotifyObject *self,
+                                         PyObject *unused) {
+    return reader_coalesce_stats(self);
+}
+
+static PyObject * Inotify_set_pair_moves(InotifyObject *self,
+                                         PyObject *args, PyObject *kwargs) {
+    return reader_set_pair_moves(self, args, kwargs);
+}
+
+static PyObject * Inotify_flush_moves(InotifyObject *self, PyObject *unused) {
+    return reader_flush_moves(self);
+}
+
+static PyObject * Inotify_move_stats(InotifyObject *self, PyObject *unused) {
+    return reader_move_stats(self);
+}
+
+static PyObject * Inotify_start_drain_thread(InotifyObject *self,
+                                             PyObject *args,
+                                             PyObject *kwargs) {
+    return reader_start_thread(self, args, kwargs);
+}
+
+static PyObject * Inotify_stop_drain_thread(InotifyObject *self,
+                                            PyObject *unused) {
+    return reader_stop_thread(self);
+}
+
+static PyObject * Inotify_ring_stats(InotifyObject *self, PyObject *unused) {
+    return reader_ring_stats(self);
+}
+
+static PyObject * Inotify_share(InotifyObject *self, PyObject *args,
+                                PyObject *kwargs) {
+    return reader_share(self, args, kwargs);
+}
+
+static PyObject * Inotify_publish(InotifyObject *self, PyObject *unused) {
+    return reader_publish(self);
+}
+
+static PyObject * Inotify_unshare(InotifyObject *self, PyObject *unused) {
+    return reader_unshare(self);
+}
+
+static PyObject * Inotify_share_stats(InotifyObject *self,
+                                      PyObject *unused) {
+    return reader_share_stats(self);
+}
+
+static PyObject * Inotify_start_journal(InotifyObject *self, PyObject *args,
+                                        PyObject *kwargs) {
+    return reader_start_journal(self, args, kwargs);
+}
+
+static PyObject * Inotify_stop_journal(InotifyObject *self,
+                                       PyObject *unused) {
+    return reader_stop_journal(self);
+}
+
+static PyObject * Inotify_journal_stats(InotifyObject *self,
+                                        PyObject *unused) {
+    return reader_journal_stats(self);
+}
+
+static PyObject * Inotify_add_tree(InotifyObject *self, PyObject *args,
+                                   PyObject *kwargs) {
+    char *kwlist[] = {"path", "mask", NULL};
+    PyObject *path;
+    unsigned long mask = IN_ALL_EVENTS;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|k", kwlist, &path,
+                                     &mask))
+        return NULL;
+    if (reader_check_open(self) == -1) return NULL;
+    if (self->fan) {
+        PyErr_SetString(PyExc_ValueError,
+                        "fanotify readers watch through mark() instead");
+        return NULL;
+    }
+    return reader_add_tree(self, self->fd, path, mask);
+}
+
+static PyObject * Inotify_wd_path(InotifyObject *self, PyObject *arg) {
+    int wd = PyLong_AsLong(arg);
+    if (wd == -1 && PyErr_Occurred()) return NULL;
+    return reader_wd_path(self, wd);
+}
+
+static PyObject * Inotify_tree_stats(InotifyObject *self, PyObject *unused) {
+    return reader_tree_stats(self);
+}
+
+static PyObject * Inotify_set_rescan(InotifyObject *self, PyObject *args,
+                                     PyObject *kwargs) {
+    return reader_set_rescan(self, args, kwargs);
+}
+
+static PyObject * Inotify_rescan(InotifyObject *self, PyObject *unused) {
+    if (reader_check_open(self) == -1) return NULL;
+    return reader_rescan(self, self->fd);
+}
+
+static PyObject * Inotify_save_snapshot(InotifyObject *self, PyObject *path) {
+    return reader_save_snapshot(self, path);
+}
+
+static PyObject * Inotify_load_snapshot(InotifyObject *self, PyObject *path) {
+    return reader_load_snapshot(self, path);
+}
+
+static PyObject * Inotify_set_watch_budget(InotifyObject *self,
+                                           PyObject *args,
+                                           PyObject *kwargs) {
+    char *kwlist[] = {"enabled", "limit", "poll_interval", NULL};
+    int enabled = 1;
+    PyObject *limit = Py_None;
+    double interval = 1.0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|pOd", kwlist, &enabled,
+                                     &limit, &interval))
+        return NULL;
+    if (reader_check_open(self) == -1) return NULL;
+    return reader_set_watch_budget(self, self->fd, enabled, limit, interval);
+}
+
+static PyObject * Inotify_poll_watches(InotifyObject *self,
+                                       PyObject *unused) {
+    if (reader_check_open(self) == -1) return NULL;
+    return reader_poll_watches(self, self->fd);
+}
+
+static PyObject * Inotify_watch_budget_stats(InotifyObject *self,
+                                             PyObject *unused) {
+    return reader_watch_budget_stats(self);
+}
+
+static PyObject * Inotify_stats(InotifyObject *self, PyObject *unused) {
+    return reader_get_stats(self);
+}
+
+static PyObject * Inotify_get_raw_buffer(InotifyObject *self,
+                                         PyObject *unused) {
+    return reader_get_raw_buffer(self);
+}
+
+static PyObject * Inotify_fileno(InotifyObject *self, PyObject *unused) {
+    if (reader_check_open(self) == -1) return NULL;
+    return PyLong_FromLong(self->fd);
+}
+
+static PyObject * Inotify_close(InotifyObject *self, PyObject *unused) {
+    reader_close_fd(self);
+    Py_RETURN_NONE;
+}
+
+static PyObject * Inotify_enter(InotifyObject *self, PyObject *unused) {
+    return Py_NewRef(self);
+}
+
+static PyObject * Inotify_exit(InotifyObject *self, PyObject *args) {
+    reader_close_fd(self);
+    Py_RETURN_NONE;
+}
+
+static PyObject * Inotify_get_closed(InotifyObject *self, void *closure) {
+    return PyBool_FromLong(self->fd < 0);
+}
+
+static PyObject * Inotify_get_pending(InotifyObject *self, void *closure) {
+    return PyLong_FromSsize_t(self->iel_length);
+}
+
+static PyMethodDef Inotify_methods[] = {
+    {
+        "read", (PyCFunction) Inotify_read, METH_NOARGS,
+        "Read from the inotify file descriptor and return the number of "
+        "events read."
+    },
+    {
+        "drain", (PyCFunction) Inotify_drain, METH_VARARGS | METH_KEYWORDS,
+        "Read every pending event, up to capacity bytes, in as few read(2) "
+        "calls as possible. Returns a tuple of (events queued, syscalls "
+        "made, bytes read)."
+    },
+    {
+        "wait", (PyCFunction) Inotify_wait, METH_VARARGS | METH_KEYWORDS,
+        "Block, without holding the GIL, until events are ready to be read "
+        "or timeout seconds have passed (forever if timeout is None). "
+        "Returns True if events are ready and False on timeout."
+    },
+    {
+        "get_event", (PyCFunction) Inotify_get_event, METH_NOARGS,
+        "Return the oldest inotify_event struct in the form of a tuple. "
+        "Removes the returned event from the queue."
+    },
+    {
+        "get_event_list", (PyCFunction) Inotify_get_event_list, METH_NOARGS,
+        "Equivalent to creating a list of get_event() tuples."
+    },
+    {
+        "get_batch", (PyCFunction) Inotify_get_batch, METH_NOARGS,
+        "Remove every event from the queue and return them as a Batch, "
+        "without building any Python objects for them."
+    },
+    {
+        "get_columns", (PyCFunction) Inotify_get_columns, METH_NOARGS,
+        "Remove every event from the queue and return them as a Columns "
+        "object, with one typed array per field."
+    },
+    {
+        "events", (PyCFunction) Inotify_events, METH_VARARGS | METH_KEYWORDS,
+        "events(capacity=65536)\n\n"
+        "Return a Stream for asyncio: async for batch in reader.events(). "
+        "Each step drains every pending event, up to capacity bytes per "
+        "read, into one Batch, and only waits on the event loop when "
+        "nothing is pending. The descriptor is never read while empty, so "
+        "it need not be IN_NONBLOCK, though that is recommended."
+    },
+    {
+        "set_filter", (PyCFunction) Inotify_set_filter,
+        METH_VARARGS | METH_KEYWORDS,
+        "set_filter(allow_mask=0, deny_mask=0, wds=None, patterns=None)\n\n"
+        "Drop events while they are parsed, before they reach the queue. "
+        "Events are kept only if they share a bit with allow_mask (when it "
+        "is not 0), share none with deny_mask, belong to one of wds (when "
+        "given) and match none of the filename patterns, such as '*.swp', "
+        "'*~' or '.#*'. IN_Q_OVERFLOW is never dropped. Without arguments "
+        "the filter is removed."
+    },
+    {
+        "filter_stats", (PyCFunction) Inotify_filter_stats, METH_NOARGS,
+        "Return the number of events dropped by each rule of the filter."
+    },
+    {
+        "set_coalesce", (PyCFunction) Inotify_set_coalesce,
+        METH_VARARGS | METH_KEYWORDS,
+        "set_coalesce(enabled=True, window=0.0)\n\n"
+        "Merge repeated events while they are parsed. An IN_MODIFY or "
+        "IN_CLOSE_WRITE, IN_ATTRIB, or IN_ACCESS, IN_OPEN or "
+        "IN_CLOSE_NOWRITE event is ORed into the mask of the record still "
+        "queued for the same watch descriptor, name and class, if that was "
+        "queued at most window seconds earlier (any time if window is 0). "
+        "Creation, deletion and renaming of a name end its merging. While "
+        "enabled, event tuples carry the number of raw events they stand "
+        "for as an extra item. set_coalesce(False) turns it off."
+    },
+    {
+        "coalesce_stats", (PyCFunction) Inotify_coalesce_stats, METH_NOARGS,
+        "Return the number of events the coalescing stage has seen, merged "
+        "and delivered."
+    },
+    {
+        "set_pair_moves", (PyCFunction) Inotify_set_pair_moves,
+        METH_VARARGS | METH_KEYWORDS,
+        "set_pair_moves(enabled=True, max_reads=1, timeout=0.5)\n\n"
+        "Pair the two halves of every rename while they are parsed. An "
+        "IN_MOVED_FROM event is held back until the IN_MOVED_TO event with "
+        "the same cookie arrives, and both are queued as one record with "
+        "IN_MOVED_FROM and IN_MOVED_TO set, whose tuple carries the "
+        "destination wd and name after the source name. Halves still "
+        "unpaired after max_reads more reads, or timeout seconds (never if "
+        "0), are queued as plain events. set_pair_moves(False) queues the "
+        "pending halves and turns it off."
+    },
+    {
+        "flush_moves", (PyCFunction) Inotify_flush_moves, METH_NOARGS,
+        "Queue every pending rename half as a plain event and return how "
+        "many there were."
+    },
+    {
+        "move_stats", (PyCFunction) Inotify_move_stats, METH_NOARGS,
+        "Return the number of rename halves pending, and of renames paired "
+        "and halves queued unpaired so far."
+    },
+    {
+        "start_drain_thread", (PyCFunction) Inotify_start_drain_thread,
+        METH_VARARGS | METH_KEYWORDS,
+        "start_drain_thread(capacity=1048576, policy='block')\n\n"
+        "Start a native thread that reads events as soon as the kernel "
+        "queues them into a lock-free ring of capacity bytes (rounded up "
+        "to a power of two), so that the kernel queue does not overflow "
+        "while Python is busy. read(), drain(), wait() and the get_* "
+        "methods then take events from the ring without a read(2) call. "
+        "When the ring is full the thread either waits for room ('block') "
+        "or drops events and queues an IN_Q_OVERFLOW event ('drop')."
+    },
+    {
+        "stop_drain_thread", (PyCFunction) Inotify_stop_drain_thread,
+        METH_NOARGS,
+        "Stop the drain thread. Events it has already read stay queued."
+    },
+    {
+        "ring_stats", (PyCFunction) Inotify_ring_stats, METH_NOARGS,
+        "Return the capacity, current and highest use of the ring in "
+        "bytes, and the number of records, bytes and read(2) calls the "
+        "drain thread has handled, of events it dropped and of times it "
+        "had to wait for room. None if the thread is not running."
+    },
+    {
+        "share", (PyCFunction) Inotify_share, METH_VARARGS | METH_KEYWORDS,
+        "share(path, capacity=1048576, subscribers=16, policy='drop', "
+        "mode=0o600)\n\n"
+        "Create a shared ring of capacity bytes (rounded up to a power of "
+        "two) in a new file at path, preferably on tmpfs such as /dev/shm, "
+        "that up to subscribers processes can read with Subscriber(path). "
+        "publish() then moves queued events into it, so that one inotify "
+        "instance and one set of watches serve every process on the host. "
+        "When a subscriber falls a whole ring behind, it either skips ahead "
+        "and gets an IN_Q_OVERFLOW event ('drop'), or publish() leaves the "
+        "events that would overwrite what it has not read queued ('block'), "
+        "so that a stuck subscriber holds everybody up. The file is removed "
+        "by unshare() or when the reader is destroyed."
+    },
+    {
+        "publish", (PyCFunction) Inotify_publish, METH_NOARGS,
+        "Move every queued event into the shared ring and return how many "
+        "were published. Subscribers waiting in wait() are woken."
+    },
+    {
+        "unshare", (PyCFunction) Inotify_unshare, METH_NOARGS,
+        "Stop publishing and remove the file of the shared ring. Attached "
+        "subscribers still get what was published, then EOFError."
+    },
+    {
+        "share_stats", (PyCFunction) Inotify_share_stats, METH_NOARGS,
+        "Return the path, capacity and head of the shared ring, the number "
+        "of events published and of publish() calls that held events back, "
+        "the policy, and the pid, lag in bytes and overruns of every "
+        "subscriber. None if the reader is not shared."
+    },
+    {
+        "start_journal", (PyCFunction) Inotify_start_journal,
+        METH_VARARGS | METH_KEYWORDS,
+        "start_journal(directory, segment_size=67108864, index_every=256)\n\n"
+        "Append every event handed out from now on, by the get_* methods, "
+        "a Poller or publish(), to the journal in directory, with its "
+        "sequence number and the time it was delivered. The journal is "
+        "kept in memory-mapped segments of segment_size bytes, each with a "
+        "sparse index entry every index_every events, and can be read back "
+        "with Replay. A journal that already has segments is continued. "
+        "Returns the sequence number of the next event."
+    },
+    {
+        "stop_journal", (PyCFunction) Inotify_stop_journal, METH_NOARGS,
+        "Stop journaling and close the segment being written."
+    },
+    {
+        "journal_stats", (PyCFunction) Inotify_journal_stats, METH_NOARGS,
+        "Return the directory of the journal, the sequence number of the "
+        "next event, the events, bytes, segments and index entries written "
+        "so far, the events that could not be written and the errno that "
+        "stopped the journal, or None. None if there is no journal."
+    },
+    {
+        "add_tree", (PyCFunction) Inotify_add_tree,
+        METH_VARARGS | METH_KEYWORDS,
+        "add_tree(path, mask=IN_ALL_EVENTS)\n\n"
+        "Watch path and every directory below it, walking the tree and "
+        "adding the watches without holding the GIL. Subdirectories "
+        "created or moved in later are watched automatically, and watches "
+        "the kernel drops (IN_IGNORED) are forgotten. What was created in "
+        "a new subdirectory before its watch was added is reported with an "
+        "IN_CREATE of its own, possibly twice; the contents of a directory "
+        "moved in are not reported. The names of events "
+        "on these directories are replaced by their full path, and "
+        "directories moved out of the tree are no longer watched. The mask "
+        "always includes IN_CREATE, IN_MOVED_TO and IN_ONLYDIR, and never "
+        "IN_OPEN, IN_ACCESS or IN_CLOSE_NOWRITE, which reading the "
+        "directories to walk them would trigger. Returns a tuple of "
+        "(watches added, directories that could not be watched)."
+    },
+    {
+        "wd_path", (PyCFunction) Inotify_wd_path, METH_O,
+        "Return the path of a directory watched through add_tree(), or "
+        "None."
+    },
+    {
+        "tree_stats", (PyCFunction) Inotify_tree_stats, METH_NOARGS,
+        "Return the number of directories watched through add_tree(), how "
+        "many watches have been added and have failed so far, whether "
+        "snapshots are kept, and the number of rescans and of events they "
+        "queued."
+    },
+    {
+        "set_rescan", (PyCFunction) Inotify_set_rescan,
+        METH_VARARGS | METH_KEYWORDS,
+        "set_rescan(enabled=True)\n\n"
+        "Keep a snapshot of the entries of every directory watched through "
+        "add_tree(), reading them all now without holding the GIL. After an "
+        "IN_Q_OVERFLOW, every directory is read again and what was created, "
+        "deleted or modified meanwhile is queued as IN_CREATE, IN_DELETE "
+        "and IN_MODIFY events right after it. A file modified since the "
+        "last scan may be reported twice. With enabled=False the snapshots "
+        "are dropped."
+    },
+    {
+        "rescan", (PyCFunction) Inotify_rescan,
+        METH_NOARGS,
+        "Read every directory watched through add_tree() again and queue "
+        "how it differs from its snapshot, like after an IN_Q_OVERFLOW. "
+        "Returns the number of events queued, 0 without snapshots."
+    },
+    {
+        "save_snapshot", (PyCFunction) Inotify_save_snapshot,
+        METH_O,
+        "save_snapshot(path)\n\n"
+        "Write the snapshots to the file at path, and return the number of "
+        "directories saved. The file is written under a temporary name and "
+        "renamed over path once complete, so path is never left half "
+        "written. The file is meant for this machine only."
+    },
+    {
+        "load_snapshot", (PyCFunction) Inotify_load_snapshot,
+        METH_O,
+        "load_snapshot(path)\n\n"
+        "Replace the snapshots of the directories watched through "
+        "add_tree() with those saved to the file at path, matched by path, "
+        "and keep snapshots from now on. Returns the number of directories "
+        "found. A rescan() then reports what changed since they were "
+        "saved:\n\n"
+        "    reader.add_tree(root)\n"
+        "    reader.load_snapshot(saved)\n"
+        "    reader.rescan()"
+    },
+    {
+        "set_watch_budget", (PyCFunction) Inotify_set_watch_budget,
+        METH_VARARGS | METH_KEYWORDS,
+        "set_watch_budget(enabled=True, limit=None, poll_interval=1.0)\n\n"
+        "Cap the watches of the directories watched through add_tree() at "
+        "limit, or at /proc/sys/fs/inotify/max_user_watches if that is "
+        "lower. Once the cap is reached, or inotify_add_watch() fails with "
+        "ENOSPC, the directories that have gone longest without an event "
+        "lose their watch and are polled with stat(2) every poll_interval "
+        "seconds instead, by the reads that come along or by "
+        "poll_watches(). A polled directory that changes is watched again, "
+        "and what it gained, lost or had modified since it was evicted is "
+        "queued as IN_CREATE, IN_DELETE and IN_MODIFY events. Writes to "
+        "files that leave their directory untouched go unseen while it is "
+        "polled. With enabled=False every polled directory is watched "
+        "again and the cap is lifted."
+    },
+    {
+        "poll_watches", (PyCFunction) Inotify_poll_watches, METH_NOARGS,
+        "Look at the polled directories now and return how many were "
+        "watched again."
+    },
+    {
+        "watch_budget_stats", (PyCFunction) Inotify_watch_budget_stats,
+        METH_NOARGS,
+        "Return the limit of the watch budget and max_user_watches, the "
+        "watches held, the directories polled, and the number of "
+        "evictions, re-armed watches, polls and ENOSPC failures so far, or "
+        "None without a budget."
+    },
+    {
+        "stats", (PyCFunction) Inotify_stats, METH_NOARGS,
+        "Return what the reader has done so far: read(2) calls and bytes "
+        "read, events parsed, dropped by the filter and IN_Q_OVERFLOW events, "
+        "the current and longest queue length and the number of times the "
+        "buffer and queue were grown, how often decoded names were reused "
+        "from the name cache and how often they were not. latency is a "
+        "histogram of how long events waited between read(2) and being "
+        "handed out: item 0 counts waits under 1 microsecond, item i those "
+        "under 2**i microseconds and the last item everything longer."
+    },
+    {
+        "get_raw_buffer", (PyCFunction) Inotify_get_raw_buffer, METH_NOARGS,
+        "Return the raw buffer as a python bytes object."
+    },
+    {
+        "fileno", (PyCFunction) Inotify_fileno, METH_NOARGS,
+        "Return the inotify file descriptor."
+    },
+    {
+        "close", (PyCFunction) Inotify_close, METH_NOARGS,
+        "Close the file descriptor if it was created by this object. "
+        "Queued events can still be retrieved."
+    },
+    {
+        "__enter__", (PyCFunction) Inotify_enter, METH_NOARGS, NULL
+    },
+    {
+        "__exit__", (PyCFunction) Inotify_exit, METH_VARARGS, NULL
+    },
+    {
+        NULL, NULL, 0, NULL
+    }
+};
+
+static PyGetSetDef Inotify_getset[] = {
+    {
+        "closed", (getter) Inotify_get_closed, NULL,
+        "True once the reader has been closed.", NULL
+    },
+    {
+        "pending", (getter) Inotify_get_pending, NULL,
+        "The number of events waiting in the queue.", NULL
+    },
+    {
+        NULL, NULL, NULL, NULL, NULL
+    }
+};
+
+static PyType_Slot Inotify_slots[] = {
+    {Py_tp_doc, "Inotify(fd=-1, flags=0)\n\n"
+                "An inotify reader with its own buffer and event queue.\n"
+                "Wraps fd if it is given, otherwise creates a new inotify "
+                "instance with inotify_init1(flags) and closes it when the "
+                "reader is closed."},
+    {Py_tp_new, Inotify_new},
+    {Py_tp_dealloc, Inotify_dealloc},
+    {Py_tp_methods, Inotify_methods},
+    {Py_tp_getset, Inotify_getset},
+    {0, NULL}
+};
+
+static PyType_Spec Inotify_spec = {
+    .name = "inotipyutils.Inotify",
+    .basicsize = sizeof (InotifyObject),
+    .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+    .slots = Inotify_slots
+};
+
+
+// The Poller type
+
+// A Poller multiplexes any number of readers behind one epoll descriptor, so
+// that a single wakeup drains every inotify instance that has events.
+typedef struct {
+    PyObject_HEAD
+    // The epoll file descriptor, or -1 once it has been closed.
+    int epfd;
+    // Maps each registered file descriptor to its reader. This keeps the
+    // readers alive; epoll hands back raw pointers to them.
+    PyObject *readers;
+    // Readers unregistered while a poll() was running without the GIL. They
+    // are released once no poll() is running any more.
+    PyObject *retired;
+    // The number of poll() calls currently running.
+    int polling;
+    // An error that came up after events were taken from the queues of
+    // other readers, raised by the next poll() once those are returned.
+    PyObject *error_type;
+    PyObject *error_value;
+    PyObject *error_traceback;
+    // Room for one epoll_event per registered reader.
+    struct epoll_event *events;
+    int events_len;
+} PollerObject;
+
+static PyObject * Poller_new(PyTypeObject *type, PyObject *args,
+                             PyObject *kwargs) {
+    char *kwlist[] = {NULL};
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "", kwlist))
+        return NULL;
+    PollerObject *poller = (PollerObject *) type->tp_alloc(type, 0);
+    if (!poller) return NULL;
+    poller->events = NULL;
+    poller->events_len = 0;
+    poller->polling = 0;
+    poller->error_type = NULL;
+    poller->error_value = NULL;
+    poller->error_traceback = NULL;
+    poller->readers = PyDict_New();
+    poller->retired = PyList_New(0);
+    poller->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (!poller->readers || !poller->retired || poller->epfd == -1) {
+        if (poller->epfd == -1 && !PyErr_Occurred())
+            PyErr_SetFromErrno(PyExc_OSError);
+        Py_DECREF(poller);
+        return NULL;
+    }
+    return (PyObject *) poller;
+}
+
+static void Poller_dealloc(PollerObject *poller) {
+    PyTypeObject *type = Py_TYPE(poller);
+    if (poller->epfd >= 0) close(poller->epfd);
+    Py_XDECREF(poller->readers);
+    Py_XDECREF(poller->retired);
+    Py_XDECREF(poller->error_type);
+    Py_XDECREF(poller->error_value);
+    Py_XDECREF(poller->error_traceback);
+    PyMem_RawFree(poller->events);
+    type->tp_free((PyObject *) poller);
+    Py_DECREF(type);
+}
+
+static int poller_check_open(PollerObject *poller) {
+    if (poller->epfd < 0) {
+        PyErr_SetString(PyExc_ValueError,
+                        "I/O operation on closed poller");
+        return -1;
+    }
+    return 0;
+}
+
+static InotifyObject * poller_reader_for(PollerObject *poller,
+                                         PyObject *source, int *fd) {
+    // Return a new reference to the reader for source, which is either an
+    // Inotify object or anything with a file descriptor. Plain descriptors
+    // get a reader of their own, which does not close them.
+    utils_state *state = PyType_GetModuleState(Py_TYPE(poller));
+    if (PyObject_TypeCheck(source, state->inotify_type)) {
+        InotifyObject *reader = (InotifyObject *) source;
+        if (reader_check_open(reader) == -1) return NULL;
+        *fd = reader->fd;
+        return (InotifyObject *) Py_NewRef(reader);
+    }
+    *fd = PyObject_AsFileDescriptor(source);
+    if (*fd == -1) return NULL;
+    return reader_new(state->inotify_type, *fd, 0);
+}
+
+static PyObject * Poller_register(PollerObject *self, PyObject *source) {
+    if (poller_check_open(self) == -1) return NULL;
+    int fd;
+    InotifyObject *reader = poller_reader_for(self, source, &fd);
+    if (!reader) return NULL;
+    PyObject *key = PyLong_FromLong(fd);
+    if (!key) goto error;
+    int registered = PyDict_Contains(self->readers, key);
+    if (registered == -1) goto error;
+    if (registered) {
+        PyErr_Format(PyExc_KeyError, "%d is already registered", fd);
+        goto error;
+    }
+    Py_ssize_t count = PyDict_GET_SIZE(self->readers) + 1;
+    if (count > self->events_len) {
+        struct epoll_event *events = PyMem_RawRealloc(
+            self->events, (size_t) count * sizeof (struct epoll_event));
+        if (!events) {
+            PyErr_NoMemory();
+            goto error;
+        }
+        self->events = events;
+        self->events_len = (int) count;
+    }
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = reader };
+    if (epoll_ctl(self->epfd, EPOLL_CTL_ADD, fd, &event) == -1) {
+        PyErr_SetFromErrno(PyExc_OSError);
+        goto error;
+    }
+    if (PyDict_SetItem(self->readers, key, (PyObject *) reader) == -1) {
+        epoll_ctl(self->epfd, EPOLL_CTL_DEL, fd, NULL);
+        goto error;
+    }
+    Py_DECREF(key);
+    return (PyObject *) reader;
+error:
+    Py_XDECREF(key);
+    Py_DECREF(reader);
+    return NULL;
+}
+
+static PyObject * Poller_unregister(PollerObject *self, PyObject *source) {
+    if (poller_check_open(self) == -1) return NULL;
+    utils_state *state = PyType_GetModuleState(Py_TYPE(self));
+    int fd;
+    if (PyObject_TypeCheck(source, state->inotify_type))
+        fd = ((InotifyObject *) source)->fd;
+    else
+        fd = PyObject_AsFileDescriptor(source);
+    if (fd == -1) {
+        if (!PyErr_Occurred())
+            PyErr_SetString(PyExc_ValueError, "The reader is closed!");
+        return NULL;
+    }
+    PyObject *key = PyLong_FromLong(fd);
+    if (!key) return NULL;
+    PyObject *reader = PyDict_GetItemWithError(self->readers, key);
+    if (!reader) {
+        if (!PyErr_Occurred())
+            PyErr_Format(PyExc_KeyError, "%d is not registered", fd);
+        Py_DECREF(key);
+        return NULL;
+    }
+    // A poll() running without the GIL may still be using the reader.
+    if (self->polling > 0 && PyList_Append(self->retired, reader) == -1) {
+        Py_DECREF(key);
+        return NULL;
+    }
+    epoll_ctl(self->epfd, EPOLL_CTL_DEL, fd, NULL);
+    int status = PyDict_DelItem(self->readers, key);
+    Py_DECREF(key);
+    if (status == -1) return NULL;
+    Py_RETURN_NONE;
+}
+
+static int poller_drain_ready(struct epoll_event *events, int ready,
+                              size_t capacity) {
+    // Drain every reader epoll reported as ready into its own queue.
+    // Returns 0, or the errno of the first reader that failed. Readers that
+    // turned out to have nothing pending are skipped.
+    // Runs without the GIL.
+    int error = 0;
+    for (int i = 0; i < ready; i++) {
+        InotifyObject *reader = events[i].data.ptr;
+        long syscalls = 0;
+        size_t bytes = 0;
+        PyThread_acquire_lock(reader->lock, WAIT_LOCK);
+        // Readers with a drain thread are taken in by poller_collect(), and
+        // closed ones have nothing left to read.
+        int status = reader->ring || reader->closed
+                     ? FILL_OK
+                     : reader_fill(reader, reader->fd, capacity, 0,
+                                   &syscalls, &bytes);
+        PyThread_release_lock(reader->lock);
+        if (status == FILL_NOMEM) {
+            if (!error) error = ENOMEM;
+        }
+        else if (status == FILL_ERRNO) {
+            int err = reader->_utils_errno;
+            if (!error && err != EAGAIN && err != EINTR) error = err;
+        }
+    }
+    return error;
+}
+
+static int poller_collect(InotifyObject *reader, PyObject *event_list) {
+    // Move every queued event of reader into event_list as a tuple of
+    // (fd, wd, mask, cookie, len, name), followed by the count of raw events
+    // if the reader is coalescing. Returns -1 on failure.
+    reader_lock(reader);
+    reader_settle(reader);
+    inotify_event *event;
+    while ((event = queue_peek(reader)) != NULL) {
+        PyObject *event_tuple = build_record_tuple(
+            reader, event, queue_head_count(reader));
+        if (!event_tuple) goto error;
+        PyObject *tagged = PyTuple_New(PyTuple_GET_SIZE(event_tuple) + 1);
+        if (!tagged) {
+            Py_DECREF(event_tuple);
+            goto error;
+        }
+        PyObject *fd = PyLong_FromLong(reader->fd);
+        if (!fd) {
+            Py_DECREF(tagged);
+            Py_DECREF(event_tuple);
+            goto error;
+        }
+        PyTuple_SET_ITEM(tagged, 0, fd);
+        for (Py_ssize_t i = 0; i < PyTuple_GET_SIZE(event_tuple); i++) {
+            PyObject *item = PyTuple_GET_ITEM(event_tuple, i);
+            PyTuple_SET_ITEM(tagged, i + 1, Py_NewRef(item));
+        }
+        Py_DECREF(event_tuple);
+        int status = PyList_Append(event_list, tagged);
+        Py_DECREF(tagged);
+        if (status == -1) goto error;
+        queue_consume(reader, event);
+    }
+    stats_delivered(reader);
+    reader_unlock(reader);
+    return 0;
+error:
+    reader_unlock(reader);
+    return -1;
+}
+
+static PyObject * Poller_poll(PollerObject *self, PyObject *args,
+                              PyObject *kwargs) {
+    // Wait for any registered reader to become ready, drain all of them in
+    // one pass without the GIL, and return their events tagged with the
+    // file descriptor they came from.
+    char* kwlist[] = {"timeout", "capacity", NULL};
+    PyObject *timeout = Py_None;
+    Py_ssize_t capacity = DEFAULT_DRAIN_CAPACITY;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|On", kwlist, &timeout,
+                                     &capacity))
+        return NULL;
+    if (poller_check_open(self) == -1) return NULL;
+    if (self->error_type) {
+        PyErr_Restore(self->error_type, self->error_value,
+                      self->error_traceback);
+        self->error_type = self->error_value = self->error_traceback = NULL;
+        return NULL;
+    }
+    if (capacity < (Py_ssize_t) MIN_READ_SIZE ||
+        capacity > MAX_READABLE_BYTES) {
+        return PyErr_Format(PyExc_ValueError,
+                            "capacity must be between %zu and %d bytes",
+                            MIN_READ_SIZE, MAX_READABLE_BYTES);
+    }
+    struct timespec deadline;
+    int has_deadline = parse_timeout(timeout, &deadline);
+    if (has_deadline == -1) return NULL;
+    PyObject *event_list = PyList_New(0);
+    if (!event_list) return NULL;
+    if (self->events_len == 0) return event_list;
+    // Each concurrent poll() needs its own copy of the ready list.
+    int maxevents = self->events_len;
+    struct epoll_event *events = PyMem_RawMalloc(
+        (size_t) maxevents * sizeof (struct epoll_event));
+    if (!events) {
+        Py_DECREF(event_list);
+        return PyErr_NoMemory();
+    }
+    int ready, error = 0;
+    self->polling++;
+    for (;;) {
+        Py_BEGIN_ALLOW_THREADS
+        int timeout_ms = -1;
+        if (has_deadline) {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            long long ms = (deadline.tv_sec - now.tv_sec) * 1000LL +
+                           (deadline.tv_nsec - now.tv_nsec + 999999L) /
+                           1000000L;
+            timeout_ms = (ms < 0) ? 0 : (ms > INT_MAX) ? INT_MAX : (int) ms;
+        }
+        ready = epoll_wait(self->epfd, events, maxevents, timeout_ms);
+        if (ready > 0)
+            error = poller_drain_ready(events, ready, (size_t) capacity);
+        Py_END_ALLOW_THREADS
+        if (ready != -1 || errno != EINTR) break;
+        if (PyErr_CheckSignals() == -1) break;
+    }
+    int saved_errno = errno;
+    // Collect while the readers are still guaranteed to be alive.
+    int status = 0;
+    for (int i = 0; i < ready && status == 0; i++)
+        status = poller_collect(events[i].data.ptr, event_list);
+    PyMem_RawFree(events);
+    if (--self->polling == 0 && PyList_GET_SIZE(self->retired) > 0)
+        PyList_SetSlice(self->retired, 0, PyList_GET_SIZE(self->retired),
+                        NULL);
+    if (ready == -1) {
+        Py_DECREF(event_list);
+        if (PyErr_Occurred()) return NULL;
+        errno = saved_errno;
+        return PyErr_SetFromErrno(PyExc_OSError);
+    }
+    if (status == 0 && error) {
+        errno = error;
+        PyErr_SetFromErrno(PyExc_OSError);
+        status = -1;
+    }
+    if (status == -1) {
+        // The events in event_list have left their queues, so they are
+        // returned and the error is kept for the next call.
+        if (PyList_GET_SIZE(event_list) == 0) {
+            Py_DECREF(event_list);
+            return NULL;
+        }
+        PyErr_Fetch(&self->error_type, &self->error_value,
+                    &self->error_traceback);
+    }
+    return event_list;
+}
+
+static PyObject * Poller_fileno(PollerObject *self, PyObject *unused) {
+    if (poller_check_open(self) == -1) return NULL;
+    return PyLong_FromLong(self->epfd);
+}
+
+static PyObject * Poller_close(PollerObject *self, PyObject *unused) {
+    if (self->epfd >= 0) close(self->epfd);
+    self->epfd = -1;
+    if (self->polling == 0) PyDict_Clear(self->readers);
+    Py_RETURN_NONE;
+}
+
+static PyObject * Poller_enter(PollerObject *self, PyObject *unused) {
+    return Py_NewRef(self);
+}
+
+static PyObject * Poller_exit(PollerObject *self, PyObject *args) {
+    return Poller_close(self, NULL);
+}
+
+static Py_ssize_t Poller_len(PollerObject *self) {
+    return PyDict_GET_SIZE(self->readers);
+}
+
+static PyMethodDef Poller_methods[] = {
+    {
+        "register", (PyCFunction) Poller_register, METH_O,
+        "Register an Inotify reader, or an inotify file descriptor, and "
+        "return the reader that will queue its events."
+    },
+    {
+        "unregister", (PyCFunction) Poller_unregister, METH_O,
+        "Stop polling a reader or file descriptor."
+    },
+    {
+        "poll", (PyCFunction) Poller_poll, METH_VARARGS | METH_KEYWORDS,
+        "Wait, without holding the GIL, until any registered reader has "
+        "events or timeout seconds have passed (forever if timeout is "
+        "None). Every ready reader is drained, up to capacity bytes each, "
+        "in the same call. Returns a list of (fd, wd, mask, cookie, len, "
+        "name) tuples, which is empty on timeout. If a reader fails after "
+        "events were taken from the others, those events are returned and "
+        "the error is raised by the next call."
+    },
+    {
+        "fileno", (PyCFunction) Poller_fileno, METH_NOARGS,
+        "Return the epoll file descriptor."
+    },
+    {
+        "close", (PyCFunction) Poller_close, METH_NOARGS,
+        "Close the epoll file descriptor. Registered readers are not "
+        "closed."
+    },
+    {
+        "__enter__", (PyCFunction) Poller_enter, METH_NOARGS, NULL
+    },
+    {
+        "__exit__", (PyCFunction) Poller_exit, METH_VARARGS, NULL
+    },
+    {
+        NULL, NULL, 0, NULL
+    }
+};
+
+static PyType_Slot Poller_slots[] = {
+    {Py_tp_doc, "Poller()\n\n"
+                "Waits on many inotify readers with a single epoll "
+                "descriptor and drains every ready one per wakeup."},
+    {Py_tp_new, Poller_new},
+    {Py_tp_dealloc, Poller_dealloc},
+    {Py_tp_methods, Poller_methods},
+    {Py_sq_length, Poller_len},
+    {0, NULL}
+};
+
+static PyType_Spec Poller_spec = {
+    .name = "inotipyutils.Poller",
+    .basicsize = sizeof (PollerObject),
+    .flags = Py_TPFLAGS_DEFAULT,
+    .slots = Poller_slots
+};
+
+
+// The Batch and Event types
+
+// A Batch takes over the queue of a reader without copying it. Its records
+// stay in their kernel layout, are exposed as-is through the buffer protocol,
+// and Python objects are only created for the fields that are asked for.
+typedef struct {
+    PyObject_HEAD
+    // The memory owned by the batch, and the first record inside it.
+    char *memory;
+    char *data;
+    Py_ssize_t nbytes;
+    Py_ssize_t count;
+    // The offset of every record in data, built on first random access.
+    size_t *offsets;
+    // The number of raw events each record stands for, if the reader was
+    // coalescing, and the memory owned for them. NULL otherwise.
+    uint32_t *counts_memory;
+    uint32_t *counts;
+    // The reader the batch came from, whose name cache decodes its names.
+    InotifyObject *reader;
+} BatchObject;
+
+// A view of a single record in a Batch.
+typedef struct {
+    PyObject_HEAD
+    BatchObject *batch;
+    inotify_event *event;
+    // The number of raw events the record stands for, or 0 if unknown.
+    uint32_t count;
+} EventObject;
+
+#define BATCH_EVENT(data, offset) ((inotify_event *) ((data) + (offset)))
+#define BATCH_NEXT(event) (sizeof (inotify_event) + (event)->len)
+
+static PyObject * reader_get_batch(InotifyObject *reader) {
+    // Move every queued event into a new Batch, handing the arena itself
+    // over instead of copying it. The reader allocates a fresh one on its
+    // next read.
+    utils_state *state = PyType_GetModuleState(Py_TYPE(reader));
+    BatchObject *batch = (BatchObject *)
+        state->batch_type->tp_alloc(state->batch_type, 0);
+    if (!batch) return NULL;
+    batch->offsets = NULL;
+    batch->reader = (InotifyObject *) Py_NewRef(reader);
+    reader_lock(reader);
+    reader_settle(reader);
+    iel_arena *queue = &reader->queue;
+    if (reader->journal) {
+        journal_append(reader->journal, queue->data + queue->head,
+                       reader->iel_length);
+    }
+    batch->memory = queue->data;
+    batch->data = queue->data + queue->head;
+    batch->nbytes = (Py_ssize_t) (queue->tail - queue->head);
+    batch->count = reader->iel_length;
+    batch->counts_memory = queue->counts;
+    batch->counts = reader->coalesce ? queue->counts + queue->first : NULL;
+    *queue = (iel_arena) { .data=NULL, .head=0, .tail=0, .capacity=0,
+                           .generation=queue->generation + 1 };
+    reader->events_read -= (int) reader->iel_length;
+    reader->iel_length = 0;
+    stats_delivered(reader);
+    reader_unlock(reader);
+    return (PyObject *) batch;
+}
+
+static void Batch_dealloc(BatchObject *batch) {
+    PyTypeObject *type = Py_TYPE(batch);
+    PyMem_RawFree(batch->memory);
+    PyMem_RawFree(batch->offsets);
+    PyMem_RawFree(batch->counts_memory);
+    Py_XDECREF(batch->reader);
+    type->tp_free((PyObject *) batch);
+    Py_DECREF(type);
+}
+
+static int batch_index(BatchObject *batch) {
+    // Build the table of record offsets used for random access.
+    if (batch->offsets || batch->count == 0) return 0;
+    batch->offsets = PyMem_RawMalloc((size_t) batch->count *
+                                     sizeof (size_t));
+    if (!batch->offsets) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    size_t offset = 0;
+    for (Py_ssize_t i = 0; i < batch->count; i++) {
+        batch->offsets[i] = offset;
+        offset += BATCH_NEXT(BATCH_EVENT(batch->data, offset));
+    }
+    return 0;
+}
+
+static Py_ssize_t Batch_len(BatchObject *batch) {
+    return batch->count;
+}
+
+static PyObject * Batch_item(BatchObject *batch, Py_ssize_t i) {
+    if (i < 0 || i >= batch->count) {
+        PyErr_SetString(PyExc_IndexError, "batch index out of range");
+        return NULL;
+    }
+    if (batch_index(batch) == -1) return NULL;
+    utils_state *state = PyType_GetModuleState(Py_TYPE(batch));
+    EventObject *view = (EventObject *)
+        state->event_type->tp_alloc(state->event_type, 0);
+    if (!view) return NULL;
+    view->batch = (BatchObject *) Py_NewRef(batch);
+    view->event = BATCH_EVENT(batch->data, batch->offsets[i]);
+    view->count = batch->counts ? batch->counts[i] : 0;
+    return (PyObject *) view;
+}
+
+static int Batch_getbuffer(BatchObject *batch, Py_buffer *view, int flags) {
+    // The records are exposed read-only, exactly as the kernel wrote them.
+    static char empty[1];
+    return PyBuffer_FillInfo(view, (PyObject *) batch,
+                             batch->data ? batch->data : empty,
+                             batch->nbytes, 1, flags);
+}
+
+// Field selectors used by batch_column()
+#define FIELD_WD 0
+#define FIELD_MASK 1
+#define FIELD_COOKIE 2
+#define FIELD_NAME 3
+#define FIELD_TUPLE 4
+#define FIELD_COUNT 5
+
+static PyObject * batch_column(BatchObject *batch, int field) {
+    // Return a list holding one field of every record, in order.
+    PyObject *column = PyList_New(batch->count);
+    if (!column) return NULL;
+    size_t offset = 0;
+    for (Py_ssize_t i = 0; i < batch->count; i++) {
+        inotify_event *event = BATCH_EVENT(batch->data, offset);
+        PyObject *item;
+        switch (field) {
+            case FIELD_WD:
+                item = PyLong_FromLong(event->wd);
+                break;
+            case FIELD_MASK:
+                item = PyLong_FromUnsignedLong(event->mask);
+                break;
+            case FIELD_COOKIE:
+                item = PyLong_FromUnsignedLong(event->cookie);
+                break;
+            case FIELD_NAME:
+                item = event_name(batch->reader, event);
+                break;
+            case FIELD_COUNT:
+                item = PyLong_FromUnsignedLong(
+                    batch->counts ? batch->counts[i] : 1);
+                break;
+            default:
+                item = build_record_tuple(
+                    batch->reader, event, batch->counts ? batch->counts[i] : 0);
+        }
+        if (!item) {
+            Py_DECREF(column);
+            return NULL;
+        }
+        PyList_SET_ITEM(column, i, item);
+        offset += BATCH_NEXT(event);
+    }
+    return column;
+}
+
+static PyObject * Batch_wds(BatchObject *self, PyObject *unused) {
+    return batch_column(self, FIELD_WD);
+}
+
+static PyObject * Batch_masks(BatchObject *self, PyObject *unused) {
+    return batch_column(self, FIELD_MASK);
+}
+
+static PyObject * Batch_cookies(BatchObject *self, PyObject *unused) {
+    return batch_column(self, FIELD_COOKIE);
+}
+
+static PyObject * Batch_names(BatchObject *self, PyObject *unused) {
+    return batch_column(self, FIELD_NAME);
+}
+
+static PyObject * Batch_tuples(BatchObject *self, PyObject *unused) {
+    return batch_column(self, FIELD_TUPLE);
+}
+
+static PyObject * Batch_counts(BatchObject *self, PyObject *unused) {
+    return batch_column(self, FIELD_COUNT);
+}
+
+static PyObject * Batch_find(BatchObject *self, PyObject *args,
+                             PyObject *kwargs) {
+    // Return the indices of the records whose mask has any bit of mask set,
+    // and, if wd is given, that belong to that watch.
+    char *kwlist[] = {"mask", "wd", NULL};
+    unsigned long _mask;
+    int wd = -1;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "k|i", kwlist, &_mask,
+                                     &wd))
+        return NULL;
+    uint32_t mask = (uint32_t) _mask;
+    PyObject *indices = PyList_New(0);
+    if (!indices) return NULL;
+    size_t offset = 0;
+    for (Py_ssize_t i = 0; i < self->count; i++) {
+        inotify_event *event = BATCH_EVENT(self->data, offset);
+        offset += BATCH_NEXT(event);
+        if (!(event->mask & mask) || (wd >= 0 && event->wd != wd)) continue;
+        PyObject *index = PyLong_FromSsize_t(i);
+        if (!index || PyList_Append(indices, index) == -1) {
+            Py_XDECREF(index);
+            Py_DECREF(indices);
+            return NULL;
+        }
+        Py_DECREF(index);
+    }
+    return indices;
+}
+
+static PyObject * Batch_columns(BatchObject *self, PyObject *unused);
+
+static PyMethodDef Batch_methods[] = {
+    {
+        "wds", (PyCFunction) Batch_wds, METH_NOARGS,
+        "Return the watch descriptor of every event as a list."
+    },
+    {
+        "masks", (PyCFunction) Batch_masks, METH_NOARGS,
+        "Return the mask of every event as a list."
+    },
+    {
+        "cookies", (PyCFunction) Batch_cookies, METH_NOARGS,
+        "Return the cookie of every event as a list."
+    },
+    {
+        "names", (PyCFunction) Batch_names, METH_NOARGS,
+        "Return the name of every event as a list."
+    },
+    {
+        "tuples", (PyCFunction) Batch_tuples, METH_NOARGS,
+        "Equivalent to the list get_event_list() would have returned."
+    },
+    {
+        "counts", (PyCFunction) Batch_counts, METH_NOARGS,
+        "Return the number of raw events every event stands for as a list. "
+        "These are all 1 unless the reader was coalescing."
+    },
+    {
+        "find", (PyCFunction) Batch_find, METH_VARARGS | METH_KEYWORDS,
+        "find(mask, wd=-1)\n\nReturn the indices of the events whose mask "
+        "shares a bit with mask, optionally only for one watch descriptor."
+    },
+    {
+        "columns", (PyCFunction) Batch_columns, METH_NOARGS,
+        "Copy the events into a Columns object, one typed array per field."
+    },
+    {
+        NULL, NULL, 0, NULL
+    }
+};
+
+static PyType_Slot Batch_slots[] = {
+    {Py_tp_doc, "A batch of events taken from a reader with get_batch().\n\n"
+                "The raw inotify_event records are available through the "
+                "buffer protocol, e.g. memoryview(batch). Indexing returns "
+                "Event views that decode fields on access."},
+    {Py_tp_dealloc, Batch_dealloc},
+    {Py_tp_methods, Batch_methods},
+    {Py_sq_length, Batch_len},
+    {Py_sq_item, Batch_item},
+    {Py_bf_getbuffer, Batch_getbuffer},
+    {0, NULL}
+};
+
+static PyType_Spec Batch_spec = {
+    .name = "inotipyutils.Batch",
+    .basicsize = sizeof (BatchObject),
+    .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_DISALLOW_INSTANTIATION,
+    .slots = Batch_slots
+};
+
+static void Event_dealloc(EventObject *view) {
+    PyTypeObject *type = Py_TYPE(view);
+    Py_DECREF(view->batch);
+    type->tp_free((PyObject *) view);
+    Py_DECREF(type);
+}
+
+static PyObject * Event_get_wd(EventObject *self, void *closure) {
+    return PyLong_FromLong(self->event->wd);
+}
+
+static PyObject * Event_get_mask(EventObject *self, void *closure) {
+    return PyLong_FromUnsignedLong(self->event->mask);
+}
+
+static PyObject * Event_get_cookie(EventObject *self, void *closure) {
+    return PyLong_FromUnsignedLong(self->event->cookie);
+}
+
+static PyObject * Event_get_name(EventObject *self, void *closure) {
+    return event_name(self->batch->reader, self->event);
+}
+
+static PyObject * Event_get_raw_name(EventObject *self, void *closure) {
+    if (self->event->len == 0) return PyBytes_FromStringAndSize(NULL, 0);
+    return PyBytes_FromString(self->event->name);
+}
+
+static PyObject * Event_get_count(EventObject *self, void *closure) {
+    return PyLong_FromUnsignedLong(self->count ? self->count : 1);
+}
+
+static PyObject * Event_get_moved_to(EventObject *self, void *closure) {
+    int wd;
+    const char *name;
+    size_t len;
+    if (!moved_destination(self->event, &wd, &name, &len)) Py_RETURN_NONE;
+    return Py_BuildValue("(iN)", wd,
+                         decode_name(self->batch->reader, wd, name, len));
+}
+
+static PyObject * Event_tuple(EventObject *self, PyObject *unused) {
+    return build_record_tuple(self->batch->reader, self->event,
+                              self->count);
+}
+
+static PyObject * Event_repr(EventObject *self) {
+    PyObject *name = event_name(self->batch->reader, self->event);
+    if (!name) return NULL;
+    PyObject *repr = PyUnicode_FromFormat(
+        "Event(wd=%d, mask=%lu, cookie=%lu, name=%R)", self->event->wd,
+        (unsigned long) self->event->mask,
+        (unsigned long) self->event->cookie, name);
+    Py_DECREF(name);
+    return repr;
+}
+
+static PyMethodDef Event_methods[] = {
+    {
+        "tuple", (PyCFunction) Event_tuple, METH_NOARGS,
+        "Return the event as the tuple get_event() would have returned."
+    },
+    {
+        NULL, NULL, 0, NULL
+    }
+};
+
+static PyGetSetDef Event_getset[] = {
+    {"wd", (getter) Event_get_wd, NULL, "The watch descriptor.", NULL},
+    {"mask", (getter) Event_get_mask, NULL, "The event mask.", NULL},
+    {"cookie", (getter) Event_get_cookie, NULL, "The rename cookie.", NULL},
+    {"name", (getter) Event_get_name, NULL, "The decoded file name.", NULL},
+    {
+        "raw_name", (getter) Event_get_raw_name, NULL,
+        "The file name as bytes, without decoding.", NULL
+    },
+    {
+        "count", (getter) Event_get_count, NULL,
+        "The number of raw events merged into this one.", NULL
+    },
+    {
+        "moved_to", (getter) Event_get_moved_to, NULL,
+        "The destination (wd, name) of a paired rename, or None.", NULL
+    },
+    {NULL, NULL, NULL, NULL, NULL}
+};
+
+static PyType_Slot Event_slots[] = {
+    {Py_tp_doc, "A view of one event in a Batch."},
+    {Py_tp_dealloc, Event_dealloc},
+    {Py_tp_repr, Event_repr},
+    {Py_tp_methods, Event_methods},
+    {Py_tp_getset, Event_getset},
+    {0, NULL}
+};
+
+static PyType_Spec Event_spec = {
+    .name = "inotipyutils.Event",
+    .basicsize = sizeof (EventObject),
+    .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_DISALLOW_INSTANTIATION,
+    .slots = Event_slots
+};
+
+
+// The Columns and Column types
+
+// Columns is a struct-of-arrays copy of a run of records, filled in a single
+// pass: wd (int32), mask, cookie, name offset and name length (uint32) and
+// one blob of all the names packed back to back. Every array is exported
+// through the buffer protocol by a Column, so array and numpy can wrap it
+// without copying.
+typedef struct {
+    PyObject_HEAD
+    // One allocation holding every array, followed by the names blob.
+    char *memory;
+    Py_ssize_t count;
+    int32_t *wd;
+    uint32_t *mask;
+    uint32_t *cookie;
+    uint32_t *name_offset;
+    uint32_t *name_length;
+    uint32_t *raw_count;
+    char *names;
+    Py_ssize_t names_len;
+} ColumnsObject;
+
+typedef struct {
+    PyObject_HEAD
+    ColumnsObject *owner;
+    char *data;
+    // shape and strides of the exported buffer
+    Py_ssize_t len;
+    Py_ssize_t itemsize;
+    const char *format;
+} ColumnObject;
+
+// Column selectors used by Columns_get_column()
+#define COLUMN_WD 0
+#define COLUMN_MASK 1
+#define COLUMN_COOKIE 2
+#define COLUMN_NAME_OFFSET 3
+#define COLUMN_NAME_LENGTH 4
+#define COLUMN_NAMES 5
+#define COLUMN_COUNT 6
+
+static ColumnsObject * columns_fill(PyTypeObject *type, char *data,
+                                    Py_ssize_t nbytes, Py_ssize_t count,
+                                    const uint32_t *counts) {
+    // Build a Columns object from count back-to-back records in data, and
+    // the number of raw events each stands for, if counts is not NULL.
+    ColumnsObject *columns = (ColumnsObject *) type->tp_alloc(type, 0);
+    if (!columns) return NULL;
+    // Names never take more room than the records they came from.
+    size_t arrays = (size_t) count * 6 * FOUR_BYTES;
+    columns->memory = PyMem_RawMalloc(arrays + (size_t) nbytes + 1);
+    if (!columns->memory) {
+        Py_DECREF(columns);
+        PyErr_NoMemory();
+        return NULL;
+    }
+    columns->count = count;
+    columns->wd = (int32_t *) columns->memory;
+    columns->mask = (uint32_t *) (columns->wd + count);
+    columns->cookie = columns->mask + count;
+    columns->name_offset = columns->cookie + count;
+    columns->name_length = columns->name_offset + count;
+    columns->raw_count = columns->name_length + count;
+    columns->names = (char *) (columns->raw_count + count);
+    size_t offset = 0, names_len = 0;
+    for (Py_ssize_t i = 0; i < count; i++) {
+        inotify_event *event = (inotify_event *) (data + offset);
+        size_t name_len = (event->len > 0) ? strnlen(event->name, event->len)
+                                           : 0;
+        columns->wd[i] = event->wd;
+        columns->mask[i] = event->mask;
+        columns->cookie[i] = event->cookie;
+        columns->name_offset[i] = (uint32_t) names_len;
+        columns->name_length[i] = (uint32_t) name_len;
+        columns->raw_count[i] = counts ? counts[i] : 1;
+        memcpy(columns->names + names_len, event->name, name_len);
+        names_len += name_len;
+        offset += sizeof (inotify_event) + event->len;
+    }
+    columns->names_len = (Py_ssize_t) names_len;
+    return columns;
+}
+
+static PyObject * reader_get_columns(InotifyObject *reader) {
+    // Remove every queued event and return them as Columns.
+    utils_state *state = PyType_GetModuleState(Py_TYPE(reader));
+    reader_lock(reader);
+    reader_settle(reader);
+    iel_arena *queue = &reader->queue;
+    ColumnsObject *columns = columns_fill(
+        state->columns_type, queue->data + queue->head,
+        (Py_ssize_t) (queue->tail - queue->head), reader->iel_length,
+        reader->coalesce ? queue->counts + queue->first : NULL);
+    if (columns) {
+        if (reader->journal) {
+            journal_append(reader->journal, queue->data + queue->head,
+                           reader->iel_length);
+        }
+        queue_rewind(queue);
+        reader->events_read -= (int) reader->iel_length;
+        reader->iel_length = 0;
+        stats_delivered(reader);
+    }
+    reader_unlock(reader);
+    return (PyObject *) columns;
+}
+
+static PyObject * Batch_columns(BatchObject *self, PyObject *unused) {
+    utils_state *state = PyType_GetModuleState(Py_TYPE(self));
+    return (PyObject *) columns_fill(state->columns_type, self->data,
+                                     self->nbytes, self->count,
+                                     self->counts);
+}
+
+static void Columns_dealloc(ColumnsObject *columns) {
+    PyTypeObject *type = Py_TYPE(columns);
+    PyMem_RawFree(columns->memory);
+    type->tp_free((PyObject *) columns);
+    Py_DECREF(type);
+}
+
+static Py_ssize_t Columns_len(ColumnsObject *columns) {
+    return columns->count;
+}
+
+static PyObject * Columns_get_column(ColumnsObject *self, void *closure) {
+    utils_state *state = PyType_GetModuleState(Py_TYPE(self));
+    ColumnObject *column = (ColumnObject *)
+        state->column_type->tp_alloc(state->column_type, 0);
+    if (!column) return NULL;
+    column->owner = (ColumnsObject *) Py_NewRef(self);
+    column->len = self->count;
+    column->itemsize = FOUR_BYTES;
+    column->format = "I";
+    switch ((int) (intptr_t) closure) {
+        case COLUMN_WD:
+            column->data = (char *) self->wd;
+            column->format = "i";
+            break;
+        case COLUMN_MASK:
+            column->data = (char *) self->mask;
+            break;
+        case COLUMN_COOKIE:
+            column->data = (char *) self->cookie;
+            break;
+        case COLUMN_NAME_OFFSET:
+            column->data = (char *) self->name_offset;
+            break;
+        case COLUMN_NAME_LENGTH:
+            column->data = (char *) self->name_length;
+            break;
+        case COLUMN_COUNT:
+            column->data = (char *) self->raw_count;
+            break;
+        default:
+            column->data = self->names;
+            column->len = self->names_len;
+            column->itemsize = 1;
+            column->format = "B";
+    }
+    return (PyObject *) column;
+}
+
+static PyObject * Columns_name(ColumnsObject *self, PyObject *arg) {
+    // Decode the name of a single event.
+    Py_ssize_t i = PyLong_AsSsize_t(arg);
+    if (i == -1 && PyErr_Occurred()) return NULL;
+    if (i < 0) i += self->count;
+    if (i < 0 || i >= self->count) {
+        PyErr_SetString(PyExc_IndexError, "column index out of range");
+        return NULL;
+    }
+    return decode_name(NULL, 0, self->names + self->name_offset[i],
+                       self->name_length[i]);
+}
+
+static PyMethodDef Columns_methods[] = {
+    {
+        "name", (PyCFunction) Columns_name, METH_O,
+        "Return the decoded name of the event at the given index."
+    },
+    {
+        NULL, NULL, 0, NULL
+    }
+};
+
+static PyGetSetDef Columns_getset[] = {
+    {
+        "wd", (getter) Columns_get_column, NULL,
+        "The watch descriptors, as int32.", (void *) COLUMN_WD
+    },
+    {
+        "mask", (getter) Columns_get_column, NULL,
+        "The event masks, as uint32.", (void *) COLUMN_MASK
+    },
+    {
+        "cookie", (getter) Columns_get_column, NULL,
+        "The rename cookies, as uint32.", (void *) COLUMN_COOKIE
+    },
+    {
+        "name_offset", (getter) Columns_get_column, NULL,
+        "The offset of every name in names, as uint32.",
+        (void *) COLUMN_NAME_OFFSET
+    },
+    {
+        "name_length", (getter) Columns_get_column, NULL,
+        "The length in bytes of every name, as uint32.",
+        (void *) COLUMN_NAME_LENGTH
+    },
+    {
+        "count", (getter) Columns_get_column, NULL,
+        "The number of raw events every event stands for, as uint32.",
+        (void *) COLUMN_COUNT
+    },
+    {
+        "names", (getter) Columns_get_column, NULL,
+        "Every name, undecoded and packed back to back.",
+        (void *) COLUMN_NAMES
+    },
+    {
+        NULL, NULL, NULL, NULL, NULL
+    }
+};
+
+static PyType_Slot Columns_slots[] = {
+    {Py_tp_doc, "Events as one typed array per field.\n\n"
+                "Each attribute is a Column that exports its array through "
+                "the buffer protocol, e.g. numpy.asarray(columns.mask)."},
+    {Py_tp_dealloc, Columns_dealloc},
+    {Py_tp_methods, Columns_methods},
+    {Py_tp_getset, Columns_getset},
+    {Py_sq_length, Columns_len},
+    {0, NULL}
+};
+
+static PyType_Spec Columns_spec = {
+    .name = "inotipyutils.Columns",
+    .basicsize = sizeof (ColumnsObject),
+    .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_DISALLOW_INSTANTIATION,
+    .slots = Columns_slots
+};
+
+static void Column_dealloc(ColumnObject *column) {
+    PyTypeObject *type = Py_TYPE(column);
+    Py_DECREF(column->owner);
+    type->tp_free((PyObject *) column);
+    Py_DECREF(type);
+}
+
+static Py_ssize_t Column_len(ColumnObject *column) {
+    return column->len;
+}
+
+static int Column_getbuffer(ColumnObject *self, Py_buffer *view, int flags) {
+    static char empty[1];
+    if (flags & PyBUF_WRITABLE) {
+        PyErr_SetString(PyExc_BufferError, "Columns are read-only!");
+        view->obj = NULL;
+        return -1;
+    }
+    view->obj = Py_NewRef(self);
+    view->buf = self->len ? self->data : empty;
+    view->len = self->len * self->itemsize;
+    view->readonly = 1;
+    view->itemsize = self->itemsize;
+    view->format = (flags & PyBUF_FORMAT) ? (char *) self->format : NULL;
+    view->ndim = 1;
+    view->shape = (flags & PyBUF_ND) ? &self->len : NULL;
+    view->strides = ((flags & PyBUF_STRIDES) == PyBUF_STRIDES)
+                    ? &self->itemsize : NULL;
+    view->suboffsets = NULL;
+    view->internal = NULL;
+    return 0;
+}
+
+static PyType_Slot Column_slots[] = {
+    {Py_tp_doc, "One typed array of a Columns object."},
+    {Py_tp_dealloc, Column_dealloc},
+    {Py_sq_length, Column_len},
+    {Py_bf_getbuffer, Column_getbuffer},
+    {0, NULL}
+};
+
+static PyType_Spec Column_spec = {
+    .name = "inotipyutils.Column",
+    .basicsize = sizeof (ColumnObject),
+    .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_DISALLOW_INSTANTIATION,
+    .slots = Column_slots
+};
+
+
+// The Stream type
+
+// A Stream is an asynchronous iterator over the batches of a reader for
+// asyncio. Each step first drains whatever is pending without waiting;
+// only when nothing is, it waits for the descriptor through
+// loop.add_reader(). One Future is created per batch, never per event.
+// The descriptor stays with the loop while steps keep coming, and is given
+// back once it turns readable with no step waiting, so that an abandoned
+// Stream does not stay registered.
+typedef struct {
+    PyObject_HEAD
+    InotifyObject *reader;
+    Py_ssize_t capacity;
+    // The Future of the step that is waiting, or NULL.
+    PyObject *waiter;
+    // The loop the descriptor is registered with, and that descriptor.
+    // NULL and -1 if it is not registered.
+    PyObject *loop;
+    int wait_fd;
+} StreamObject;
+
+static PyObject * reader_events(InotifyObject *reader, Py_ssize_t capacity) {
+    if (capacity < (Py_ssize_t) MIN_READ_SIZE ||
+        capacity > MAX_READABLE_BYTES) {
+        return PyErr_Format(PyExc_ValueError,
+                            "capacity must be between %zu and %d bytes",
+                            MIN_READ_SIZE, MAX_READABLE_BYTES);
+    }
+    utils_state *state = PyType_GetModuleState(Py_TYPE(reader));
+    StreamObject *stream = (StreamObject *)
+        state->stream_type->tp_alloc(state->stream_type, 0);
+    if (!stream) return NULL;
+    stream->reader = (InotifyObject *) Py_NewRef(reader);
+    stream->capacity = capacity;
+    stream->waiter = NULL;
+    stream->loop = NULL;
+    stream->wait_fd = -1;
+    return (PyObject *) stream;
+}
+
+static int stream_fill(StreamObject *stream) {
+    // Queue every pending event without ever waiting: the descriptor is
+    // only read once the kernel reports bytes on it, and an empty ring is
+    // not waited on either. Returns -1 with an exception set on failure.
+    InotifyObject *reader = stream->reader;
+    long syscalls = 0;
+    size_t bytes = 0;
+    int status;
+    reader_lock(reader);
+    if (reader->closed) status = FILL_CLOSED;
+    else if (reader->ring) status = ring_fill(reader, &syscalls, &bytes);
+    else {
+        Py_BEGIN_ALLOW_THREADS
+        status = reader_fill(reader, reader->fd, (size_t) stream->capacity,
+                             0, &syscalls, &bytes);
+        Py_END_ALLOW_THREADS
+    }
+    reader_unlock(reader);
+    if (status == FILL_OK || status == FILL_WOULD_BLOCK ||
+        status == FILL_EOF)
+        return 0;
+    if (status == FILL_ERRNO && (reader->_utils_errno == EAGAIN ||
+                                 reader->_utils_errno == EINTR))
+        return 0;
+    raise_fill_error(reader, status);
+    return -1;
+}
+
+static int stream_forget(StreamObject *stream) {
+    // Take the descriptor back from the loop. Returns -1 on failure.
+    if (!stream->loop) return 0;
+    PyObject *loop = stream->loop;
+    stream->loop = NULL;
+    PyObject *removed = PyObject_CallMethod(loop, "remove_reader", "i",
+                                            stream->wait_fd);
+    stream->wait_fd = -1;
+    Py_DECREF(loop);
+    stream->reader->waiting_stream = NULL;
+    if (!removed) return -1;
+    Py_DECREF(removed);
+    return 0;
+}
+
+static PyObject * stream_loop(StreamObject *stream) {
+    // Return a new reference to the running event loop.
+    utils_state *state = PyType_GetModuleState(Py_TYPE(stream));
+    if (!state->get_running_loop) {
+        PyObject *asyncio = PyImport_ImportModule("asyncio");
+        if (!asyncio) return NULL;
+        state->get_running_loop = PyObject_GetAttrString(asyncio,
+                                                         "get_running_loop");
+        Py_DECREF(asyncio);
+        if (!state->get_running_loop) return NULL;
+    }
+    return PyObject_CallNoArgs(state->get_running_loop);
+}
+
+static PyObject * stream_resolve(PyObject *future, PyObject *result) {
+    // Complete future with result, or with the current exception if
+    // result is NULL. Steals the reference to result.
+    PyObject *outcome;
+    if (result) {
+        outcome = PyObject_CallMethod(future, "set_result", "O", result);
+        Py_DECREF(result);
+    }
+    else {
+        PyObject *type, *value, *traceback;
+        PyErr_Fetch(&type, &value, &traceback);
+        PyErr_NormalizeException(&type, &value, &traceback);
+        if (traceback) PyException_SetTraceback(value, traceback);
+        outcome = PyObject_CallMethod(future, "set_exception", "O", value);
+        Py_XDECREF(type);
+        Py_XDECREF(value);
+        Py_XDECREF(traceback);
+    }
+    return outcome;
+}
+
+static PyObject * Stream_anext(StreamObject *self) {
+    InotifyObject *reader = self->reader;
+    if (reader->fd < 0) {
+        PyErr_SetNone(PyExc_StopAsyncIteration);
+        return NULL;
+    }
+    if (self->waiter) {
+        // A step that was cancelled, e.g. by a timeout, is dropped.
+        PyObject *done = PyObject_CallMethod(self->waiter, "done", NULL);
+        if (!done) return NULL;
+        int finished = PyObject_IsTrue(done);
+        Py_DECREF(done);
+        if (!finished) {
+            PyErr_SetString(PyExc_RuntimeError,
+                            "anext() is already waiting for events");
+            return NULL;
+        }
+        Py_CLEAR(self->waiter);
+    }
+    if (stream_fill(self) == -1) return NULL;
+    PyObject *loop = stream_loop(self);
+    if (!loop) return NULL;
+    PyObject *future = PyObject_CallMethod(loop, "create_future", NULL);
+    if (!future) {
+        Py_DECREF(loop);
+        return NULL;
+    }
+    reader_lock(reader);
+    reader_settle(reader);
+    Py_ssize_t pending = reader->iel_length;
+    reader_unlock(reader);
+    if (pending > 0) {
+        // Events are ready, so the batch is handed over without waiting.
+        Py_DECREF(loop);
+        PyObject *done = stream_resolve(future, reader_get_batch(reader));
+        if (!done) {
+            Py_DECREF(future);
+            return NULL;
+        }
+        Py_DECREF(done);
+        return future;
+    }
+    // A drain thread signals its eventfd instead of the descriptor.
+    int wait_fd = reader->ring ? reader->wake_fd : reader->fd;
+    if (self->loop == loop && self->wait_fd == wait_fd) {
+        // Still registered from the previous step.
+        Py_DECREF(loop);
+        self->waiter = Py_NewRef(future);
+        return future;
+    }
+    if (stream_forget(self) == -1) {
+        Py_DECREF(loop);
+        Py_DECREF(future);
+        return NULL;
+    }
+    PyObject *callback = PyObject_GetAttrString((PyObject *) self,
+                                                "_on_ready");
+    PyObject *added = callback
+        ? PyObject_CallMethod(loop, "add_reader", "iO", wait_fd, callback)
+        : NULL;
+    Py_XDECREF(callback);
+    if (!added) {
+        Py_DECREF(loop);
+        Py_DECREF(future);
+        return NULL;
+    }
+    Py_DECREF(added);
+    self->loop = loop;
+    self->wait_fd = wait_fd;
+    self->waiter = Py_NewRef(future);
+    reader->waiting_stream = (PyObject *) self;
+    return future;
+}
+
+static PyObject * Stream_on_ready(StreamObject *self, PyObject *unused) {
+    // The add_reader() callback: drain the descriptor and hand the batch to
+    // the waiting step. With no step waiting, the events stay queued and
+    // the descriptor is given back to the loop.
+    InotifyObject *reader = self->reader;
+    PyObject *waiter = self->waiter;
+    int cancelled = 1;
+    if (waiter) {
+        PyObject *done = PyObject_CallMethod(waiter, "done", NULL);
+        if (!done) return NULL;
+        cancelled = PyObject_IsTrue(done);
+        Py_DECREF(done);
+    }
+    if (cancelled) {
+        Py_CLEAR(self->waiter);
+        if (reader->fd >= 0 && stream_fill(self) == -1) return NULL;
+        if (stream_forget(self) == -1) return NULL;
+        Py_RETURN_NONE;
+    }
+    PyObject *result = NULL;
+    if (reader->fd < 0) PyErr_SetNone(PyExc_StopAsyncIteration);
+    else if (stream_fill(self) == 0) {
+        reader_lock(reader);
+        reader_settle(reader);
+        Py_ssize_t pending = reader->iel_length;
+        reader_unlock(reader);
+        // Nothing was pending after all: keep waiting.
+        if (pending == 0) Py_RETURN_NONE;
+        result = reader_get_batch(reader);
+    }
+    self->waiter = NULL;
+    PyObject *outcome = stream_resolve(waiter, result);
+    Py_DECREF(waiter);
+    return outcome;
+}
+
+static void stream_abort(PyObject *object) {
+    // End the waiting step of a Stream whose reader is being closed, while
+    // its descriptor can still be removed from the loop.
+    StreamObject *stream = (StreamObject *) object;
+    PyObject *waiter = stream->waiter;
+    stream->waiter = NULL;
+    PyObject *type, *value, *traceback;
+    PyErr_Fetch(&type, &value, &traceback);
+    if (stream_forget(stream) == -1) PyErr_WriteUnraisable(object);
+    if (waiter) {
+        PyErr_SetNone(PyExc_StopAsyncIteration);
+        PyObject *outcome = stream_resolve(waiter, NULL);
+        if (!outcome) PyErr_WriteUnraisable(object);
+        Py_XDECREF(outcome);
+        Py_DECREF(waiter);
+    }
+    PyErr_Restore(type, value, traceback);
+}
+
+static PyObject * Stream_aiter(StreamObject *self) {
+    return Py_NewRef(self);
+}
+
+static PyObject * Stream_close(StreamObject *self, PyObject *unused) {
+    // Stop waiting: the descriptor is taken back from the loop and a
+    // pending step is cancelled.
+    PyObject *waiter = self->waiter;
+    self->waiter = NULL;
+    int status = stream_forget(self);
+    if (waiter) {
+        PyObject *cancelled = PyObject_CallMethod(waiter, "cancel", NULL);
+        Py_DECREF(waiter);
+        if (!cancelled) return NULL;
+        Py_DECREF(cancelled);
+    }
+    if (status == -1) return NULL;
+    Py_RETURN_NONE;
+}
+
+static int Stream_traverse(StreamObject *self, visitproc visit, void *arg) {
+    Py_VISIT(Py_TYPE(self));
+    Py_VISIT(self->reader);
+    Py_VISIT(self->waiter);
+    Py_VISIT(self->loop);
+    return 0;
+}
+
+static int Stream_clear(StreamObject *self) {
+    if (self->reader && self->reader->waiting_stream == (PyObject *) self)
+        self->reader->waiting_stream = NULL;
+    Py_CLEAR(self->reader);
+    Py_CLEAR(self->waiter);
+    Py_CLEAR(self->loop);
+    return 0;
+}
+
+static void Stream_dealloc(StreamObject *self) {
+    PyTypeObject *type = Py_TYPE(self);
+    PyObject_GC_UnTrack(self);
+    Stream_clear(self);
+    type->tp_free((PyObject *) self);
+    Py_DECREF(type);
+}
+
+static PyMethodDef Stream_methods[] = {
+    {
+        "_on_ready", (PyCFunction) Stream_on_ready, METH_NOARGS,
+        "Called by the event loop once the descriptor is readable."
+    },
+    {
+        "close", (PyCFunction) Stream_close, METH_NOARGS,
+        "Stop waiting for events, cancelling a pending step."
+    },
+    {
+        NULL, NULL, 0, NULL
+    }
+};
+
+static PyType_Slot Stream_slots[] = {
+    {Py_tp_doc, "An asynchronous iterator over the batches of a reader, "
+                "returned by Inotify.events().\n\n"
+                "    async for batch in reader.events():\n"
+                "        ...\n\n"
+                "Every step drains all pending events into one Batch. The "
+                "iteration ends once the reader is closed."},
+    {Py_tp_dealloc, Stream_dealloc},
+    {Py_tp_traverse, Stream_traverse},
+    {Py_tp_clear, Stream_clear},
+    {Py_tp_methods, Stream_methods},
+    {Py_am_aiter, Stream_aiter},
+    {Py_am_anext, Stream_anext},
+    {0, NULL}
+};
+
+static PyType_Spec Stream_spec = {
+    .name = "inotipyutils.Stream",
+    .basicsize = sizeof (StreamObject),
+    .flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_HAVE_GC |
+             Py_TPFLAGS_DISALLOW_INSTANTIATION,
+    .slots = Stream_slots
+};
+
+
+// The Subscriber type
+
+// A Subscriber maps the shared ring of a publisher, usually in another
+// process, and takes its own copy of the records published since it last
+// looked. The copy is made with memcpy and handed out as a Batch, so no
+// record is parsed or turned into Python objects until it is asked for.
+typedef struct {
+    PyObject_HEAD
+    // The mapping, or NULL once the subscriber has been closed.
+    shared_header *header;
+    size_t map_size;
+    char *data;
+    shared_cursor *cursor;
+    // The same as cursor->position, which only this subscriber writes.
+    uint64_t position;
+    // The number of wait() calls currently running.
+    int waiting;
+} SubscriberObject;
+
+// Results of subscriber_map() besides 0
+#define SHARED_MAP_ERRNO -1
+#define SHARED_MAP_INVALID -2
+
+static int subscriber_map(SubscriberObject *self, const char *path) {
+    // Map the ring at path and check that it is one. Runs without the GIL.
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd == -1) return SHARED_MAP_ERRNO;
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        int error = errno;
+        close(fd);
+        errno = error;
+        return SHARED_MAP_ERRNO;
+    }
+    if ((size_t) st.st_size < sizeof (shared_header)) {
+        close(fd);
+        return SHARED_MAP_INVALID;
+    }
+    size_t size = (size_t) st.st_size;
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    int error = errno;
+    close(fd);
+    if (map == MAP_FAILED) {
+        errno = error;
+        return SHARED_MAP_ERRNO;
+    }
+    shared_header *header = map;
+    int valid = memcmp(header->magic, SHARED_MAGIC,
+                       sizeof header->magic) == 0;
+    // Pairs with the fence the publisher puts before the magic.
+    atomic_thread_fence(memory_order_acquire);
+    valid = valid && header->version == SHARED_VERSION &&
+            header->subscribers >= 1 &&
+            header->subscribers <= MAX_SHARED_SUBSCRIBERS &&
+            header->capacity >= MIN_RING_CAPACITY &&
+            (header->capacity & (header->capacity - 1)) == 0 &&
+            header->data_offset >= sizeof (shared_header) +
+                header->subscribers * sizeof (shared_cursor) &&
+            header->data_offset + header->capacity == size;
+    if (!valid) {
+        munmap(map, size);
+        return SHARED_MAP_INVALID;
+    }
+    self->header = header;
+    self->map_size = size;
+    self->data = (char *) header + header->data_offset;
+    return 0;
+}
 
-typedef struct inotify_event inotify_event;
+static shared_cursor * subscriber_claim(shared_header *header) {
+    // Take a free slot, or failing that one whose process is gone, and
+    // start reading at the head. Returns NULL if every slot is taken.
+    shared_cursor *cursors = (shared_cursor *) (header + 1);
+    int32_t pid = (int32_t) getpid();
+    for (int pass = 0; pass < 2; pass++) {
+        for (uint32_t i = 0; i < header->subscribers; i++) {
+            int32_t owner = atomic_load(&cursors[i].pid);
+            if (pass == 0 ? owner != 0 : owner == 0 || process_alive(owner))
+                continue;
+            if (!atomic_compare_exchange_strong(&cursors[i].pid, &owner,
+                                                pid))
+                continue;
+            atomic_store(&cursors[i].overruns, 0);
+            atomic_store(&cursors[i].position, atomic_load(&header->head));
+            return &cursors[i];
+        }
+    }
+    return NULL;
+}
 
-typedef struct inotify_event_list {
-    inotify_event *event;
-    struct inotify_event_list *next_event;
-} inotify_event_list;
+static int shared_publisher_gone(shared_header *header) {
+    int32_t pid = atomic_load(&header->publisher);
+    return !pid || !process_alive(pid);
+}
 
-typedef struct iel_sentinels {
-    inotify_event_list *head;
-    inotify_event_list *tail;
-} iel_head_tail;
+static PyObject * Subscriber_new(PyTypeObject *type, PyObject *args,
+                                 PyObject *kwargs) {
+    char *kwlist[] = {"path", NULL};
+    PyObject *path;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O", kwlist, &path))
+        return NULL;
+    PyObject *encoded;
+    if (!PyUnicode_FSConverter(path, &encoded)) return NULL;
+    SubscriberObject *self = (SubscriberObject *) type->tp_alloc(type, 0);
+    if (!self) {
+        Py_DECREF(encoded);
+        return NULL;
+    }
+    self->header = NULL;
+    self->cursor = NULL;
+    self->waiting = 0;
+    int status;
+    Py_BEGIN_ALLOW_THREADS
+    status = subscriber_map(self, PyBytes_AS_STRING(encoded));
+    if (status == 0) self->cursor = subscriber_claim(self->header);
+    Py_END_ALLOW_THREADS
+    Py_DECREF(encoded);
+    if (status == SHARED_MAP_ERRNO) {
+        PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, path);
+    }
+    else if (status == SHARED_MAP_INVALID) {
+        PyErr_Format(PyExc_ValueError, "%R is not a shared ring", path);
+    }
+    else if (!self->cursor) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "Every subscriber slot of the ring is taken");
+    }
+    if (PyErr_Occurred()) {
+        Py_DECREF(self);
+        return NULL;
+    }
+    self->position = atomic_load(&self->cursor->position);
+    return (PyObject *) self;
+}
 
-static iel_head_tail sentinel = { .head=NULL, .tail=NULL};
+static void subscriber_close(SubscriberObject *self) {
+    if (!self->header) return;
+    if (self->cursor) atomic_store(&self->cursor->pid, 0);
+    munmap(self->header, self->map_size);
+    self->header = NULL;
+    self->cursor = NULL;
+}
 
-static ssize_t iel_length = 0;
+static void Subscriber_dealloc(SubscriberObject *self) {
+    PyTypeObject *type = Py_TYPE(self);
+    subscriber_close(self);
+    type->tp_free((PyObject *) self);
+    Py_DECREF(type);
+}
 
-static void buffer_init(void);
-static void buffer_cleanup(void);
-static void buffer_resize(ssize_t bytes);
-static ssize_t _inotify_read(int fd);
-static inotify_event * extract_event_data(void);
-static void add_event_to_queue(inotify_event *event);
-static PyObject * build_tuple(inotify_event *event);
-static PyObject * get_event_tuple(void);
+static int subscriber_check_open(SubscriberObject *self) {
+    if (!self->header) {
+        PyErr_SetString(PyExc_ValueError,
+                        "I/O operation on closed subscriber");
+        return -1;
+    }
+    return 0;
+}
 
-static PyObject * inotipy_utils_read(PyObject *self, PyObject *args,
-                                     PyObject *kwargs) {
-    // Accept a file descriptor and return the number of events read.
-    // WARNING: Any previous contents of the buffer will be overwritten!
-    char* kwlist[] = {"fd", NULL};
-    int fd;
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "i", kwlist, &fd))
-        return NULL;
-    buffer_cleanup();
-    buffer_init();
-    // Read the file descriptor
-    ssize_t bytes_read = _inotify_read(fd);
-    // If the read raised an error, raise it to the interpreter.
-    if (bytes_read <= 0) {
-        if (bytes_read == -1)
-            PyErr_SetFromErrno(PyExc_OSError);
-        else if (bytes_read == 0)
-            PyErr_SetString(PyExc_EOFError, "No new events were found!");
-        buffer_cleanup();
+static PyObject * Subscriber_get_batch(SubscriberObject *self,
+                                       PyObject *unused) {
+    // Copy out every record published since the last call into a new
+    // Batch. A subscriber that fell a whole ring behind skips to the head
+    // and gets a single IN_Q_OVERFLOW record instead.
+    if (subscriber_check_open(self) == -1) return NULL;
+    shared_header *header = self->header;
+    uint64_t capacity = header->capacity;
+    uint64_t position = self->position;
+    uint64_t head = atomic_load_explicit(&header->head, memory_order_acquire);
+    if (head == position && shared_publisher_gone(header)) {
+        PyErr_SetString(PyExc_EOFError, "The publisher has stopped");
         return NULL;
     }
-//     else buffer_resize(bytes_read);
-//     return PyLong_FromLong(bytes_read);
-    // One or more events have been read, now add them to the event queue
-    while (bytes_read > 0) {
-        inotify_event *read_event = extract_event_data();
-//         if(read_event->cookie > 0) {
-//             PyErr_SetString(PyExc_ValueError,
-//                             "This line right here, officer!");
-//             return NULL;
-//         }
-        if(read_event){
-            add_event_to_queue(read_event);
+    uint64_t available = head - position;
+    int overrun = available > capacity;
+    size_t size = overrun ? sizeof (inotify_event)
+                          : (size_t) available + sizeof (inotify_event);
+    char *memory = PyMem_RawMalloc(size);
+    if (!memory) return PyErr_NoMemory();
+    if (!overrun) {
+        size_t offset = position & (capacity - 1);
+        size_t first = capacity - offset;
+        if (first >= available)
+            memcpy(memory, self->data + offset, available);
+        else {
+            memcpy(memory, self->data + offset, first);
+            memcpy(memory + first, self->data, available - first);
+        }
+        // Anything the publisher began to overwrite before the copy ended
+        // shows in reserved.
+        atomic_thread_fence(memory_order_acquire);
+        uint64_t reserved = atomic_load_explicit(&header->reserved,
+                                                 memory_order_relaxed);
+        overrun = reserved - position > capacity;
+    }
+    size_t nbytes = 0;
+    Py_ssize_t count = 0;
+    if (overrun) {
+        head = atomic_load_explicit(&header->head, memory_order_acquire);
+        *(inotify_event *) memory = (inotify_event) {
+            .wd = -1, .mask = IN_Q_OVERFLOW, .cookie = 0, .len = 0 };
+        nbytes = sizeof (inotify_event);
+        count = 1;
+        atomic_fetch_add(&self->cursor->overruns, 1);
+    }
+    else {
+        // The ring is writable by every process that maps it, so a record
+        // running past the end is cut off rather than trusted.
+        while (nbytes + sizeof (inotify_event) <= available) {
+            size_t next = nbytes + BATCH_NEXT(BATCH_EVENT(memory, nbytes));
+            if (next > available) break;
+            nbytes = next;
+            count++;
         }
-        else break;
     }
-//     buffer_cleanup();
-    return PyLong_FromLong(events_read);
+    self->position = head;
+    atomic_store_explicit(&self->cursor->position, head,
+                          memory_order_release);
+    utils_state *state = PyType_GetModuleState(Py_TYPE(self));
+    BatchObject *batch = (BatchObject *)
+        state->batch_type->tp_alloc(state->batch_type, 0);
+    if (!batch) {
+        PyMem_RawFree(memory);
+        return NULL;
+    }
+    batch->memory = memory;
+    batch->data = memory;
+    batch->nbytes = (Py_ssize_t) nbytes;
+    batch->count = count;
+    batch->offsets = NULL;
+    batch->counts_memory = NULL;
+    batch->counts = NULL;
+    batch->reader = NULL;
+    return (PyObject *) batch;
 }
 
-ssize_t _inotify_read(int fd) {
-    // Call read(2), adding one or more events to the buffer.
-    // Shrink buffer to avoid access to illegal bytes.
-    // Return the number of bytes read.
-    ssize_t bytes_read = read(fd, buffer, buffer_size);
-    _utils_errno = errno;
-    switch (_utils_errno) {
-        case 0:
+static PyObject * Subscriber_wait(SubscriberObject *self, PyObject *args,
+                                  PyObject *kwargs) {
+    // Sleep on the ring until something is published or the publisher
+    // stops, waking up every SHARED_CHECK_NS to see whether it died.
+    char *kwlist[] = {"timeout", NULL};
+    PyObject *timeout = Py_None;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|O", kwlist, &timeout))
+        return NULL;
+    if (subscriber_check_open(self) == -1) return NULL;
+    struct timespec deadline;
+    int has_deadline = parse_timeout(timeout, &deadline);
+    if (has_deadline == -1) return NULL;
+    shared_header *header = self->header;
+    self->waiting++;
+    PyObject *result = NULL;
+    for (;;) {
+        // Load the sequence first, so a publish after the check below
+        // makes the futex return at once.
+        uint32_t seq = atomic_load(&header->wake_seq);
+        if (atomic_load(&header->head) != self->position ||
+            shared_publisher_gone(header)) {
+            result = Py_NewRef(Py_True);
             break;
-        case EINVAL:
-            if ((buffer_size + 128) <= MAX_BUFFER_SIZE)
-                buffer_resize(buffer_size + 128);
-            else if (buffer_size >= MAX_BUFFER_SIZE)
+        }
+        struct timespec slice = { .tv_sec = SHARED_CHECK_NS / 1000000000L,
+                                  .tv_nsec = SHARED_CHECK_NS % 1000000000L };
+        if (has_deadline) {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            int64_t left =
+                (int64_t) (deadline.tv_sec - now.tv_sec) * 1000000000L +
+                (deadline.tv_nsec - now.tv_nsec);
+            if (left <= 0) {
+                result = Py_NewRef(Py_False);
                 break;
-            return _inotify_read(fd);
+            }
+            if (left < SHARED_CHECK_NS) {
+                slice.tv_sec = (time_t) (left / 1000000000L);
+                slice.tv_nsec = (long) (left % 1000000000L);
+            }
+        }
+        atomic_fetch_add(&header->sleepers, 1);
+        int slept, error;
+        Py_BEGIN_ALLOW_THREADS
+        slept = futex_wait(&header->wake_seq, seq, &slice);
+        error = errno;
+        Py_END_ALLOW_THREADS
+        atomic_fetch_sub(&header->sleepers, 1);
+        if (slept == -1 && error == EINTR && PyErr_CheckSignals() == -1)
+            break;
     }
-    (bytes_read >= 0) ? buffer_resize(bytes_read) : buffer_cleanup();
-    return bytes_read;
+    self->waiting--;
+    return result;
 }
 
-static PyObject *get_raw_buffer(PyObject *self) {
-    // Return a bytes object containing the raw buffer
-    if(!buffer) {
-        PyErr_SetString(PyExc_BufferError, "The buffer is empty!");
+static PyObject * Subscriber_stats(SubscriberObject *self,
+                                   PyObject *unused) {
+    if (subscriber_check_open(self) == -1) return NULL;
+    shared_header *header = self->header;
+    uint64_t head = atomic_load(&header->head);
+    int32_t publisher = atomic_load(&header->publisher);
+    if (publisher && !process_alive(publisher)) publisher = 0;
+    PyObject *pid = publisher ? PyLong_FromLong(publisher)
+                              : Py_NewRef(Py_None);
+    if (!pid) return NULL;
+    return Py_BuildValue(
+        "{sKsKsKsKsKsKsN}",
+        "capacity", (unsigned long long) header->capacity,
+        "head", (unsigned long long) head,
+        "position", (unsigned long long) self->position,
+        "lag", (unsigned long long) (head - self->position),
+        "overruns", (unsigned long long) atomic_load(&self->cursor->overruns),
+        "published", (unsigned long long) atomic_load(&header->records),
+        "publisher", pid);
+}
+
+static PyObject * Subscriber_close(SubscriberObject *self,
+                                   PyObject *unused) {
+    if (self->waiting) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "Cannot close a subscriber while it is waited on");
         return NULL;
     }
-    PyObject *buf = PyBytes_FromStringAndSize(buffer, buffer_size);
-    return buf;
+    subscriber_close(self);
+    Py_RETURN_NONE;
 }
 
-static inotify_event * extract_event_data(void) {
-    // TODO: Read an inotify event from buffer and send it back
-    if(buffer_pos >= buffer_size) return NULL;
-    if(buffer_pos < 0) return NULL;
-    int start = buffer_pos;
-//     if(start < 0 || start > buffer_size) return NULL;
-    buffer_pos += sizeof (inotify_event);
-    inotify_event *read_event = PyMem_RawMalloc(sizeof (inotify_event));
-    memcpy(read_event, (buffer+start), (size_t) (buffer_pos - start));
-    buffer_pos += read_event->len;
-    read_event = PyMem_RawRealloc(read_event,
-                                  sizeof (inotify_event) + read_event->len);
-    memcpy(read_event, (buffer+start), (size_t) (buffer_pos - start));
-    return read_event;
+static PyObject * Subscriber_enter(SubscriberObject *self,
+                                   PyObject *unused) {
+    if (subscriber_check_open(self) == -1) return NULL;
+    return Py_NewRef(self);
 }
 
-static void add_event_to_queue(inotify_event *event) {
-    inotify_event_list *new_event = \
-        PyMem_RawMalloc(sizeof (inotify_event_list));
-    new_event->event = event;
-    new_event->next_event = NULL;
-    if(!(sentinel.head)) sentinel.head = new_event;
-    if(!(sentinel.tail)) sentinel.tail = new_event;
-    else {
-        sentinel.tail->next_event = new_event;
-        sentinel.tail = sentinel.tail->next_event;
+static PyObject * Subscriber_exit(SubscriberObject *self, PyObject *args) {
+    return Subscriber_close(self, NULL);
+}
+
+static PyObject * Subscriber_get_closed(SubscriberObject *self,
+                                        void *closure) {
+    return PyBool_FromLong(self->header == NULL);
+}
+
+static PyMethodDef Subscriber_methods[] = {
+    {
+        "get_batch", (PyCFunction) Subscriber_get_batch, METH_NOARGS,
+        "Return a Batch of the events published since the last call, "
+        "which is empty if there are none. A subscriber that fell a whole "
+        "ring behind skips what it missed and gets a single IN_Q_OVERFLOW "
+        "event. Raises EOFError once the publisher has stopped and "
+        "everything it published has been read."
+    },
+    {
+        "wait", (PyCFunction) Subscriber_wait,
+        METH_VARARGS | METH_KEYWORDS,
+        "wait(timeout=None)\n\n"
+        "Wait without holding the GIL until events are published or the "
+        "publisher stops, or for at most timeout seconds. Returns True if "
+        "get_batch() has something to return, False on timeout."
+    },
+    {
+        "stats", (PyCFunction) Subscriber_stats, METH_NOARGS,
+        "Return the capacity and head of the ring, the position and lag of "
+        "this subscriber in bytes, how many times it fell a whole ring "
+        "behind, the number of events published and the pid of the "
+        "publisher, or None if it has stopped."
+    },
+    {
+        "close", (PyCFunction) Subscriber_close, METH_NOARGS,
+        "Give the subscriber slot back and unmap the ring."
+    },
+    {
+        "__enter__", (PyCFunction) Subscriber_enter, METH_NOARGS, NULL
+    },
+    {
+        "__exit__", (PyCFunction) Subscriber_exit, METH_VARARGS, NULL
+    },
+    {
+        NULL, NULL, 0, NULL
     }
-    events_read++;
-    iel_length++;
+};
+
+static PyGetSetDef Subscriber_getset[] = {
+    {
+        "closed", (getter) Subscriber_get_closed, NULL,
+        "True once the subscriber has been closed.", NULL
+    },
+    {
+        NULL, NULL, NULL, NULL, NULL
+    }
+};
+
+static PyType_Slot Subscriber_slots[] = {
+    {Py_tp_doc, "Subscriber(path)\n\n"
+                "Reads the events an Inotify reader publishes into the "
+                "shared ring at path, see Inotify.share(). Every subscriber "
+                "takes a slot of the ring and gets every event published "
+                "after it attached."},
+    {Py_tp_new, Subscriber_new},
+    {Py_tp_dealloc, Subscriber_dealloc},
+    {Py_tp_methods, Subscriber_methods},
+    {Py_tp_getset, Subscriber_getset},
+    {0, NULL}
+};
+
+static PyType_Spec Subscriber_spec = {
+    .name = "inotipyutils.Subscriber",
+    .basicsize = sizeof (SubscriberObject),
+    .flags = Py_TPFLAGS_DEFAULT,
+    .slots = Subscriber_slots
+};
+
+
+// The Replay type
+
+// A Replay walks a journal from the position asked for and hands its
+// records back as Batch objects. One segment is mapped at a time; the
+// sparse index of the first one is searched for the last block that starts
+// before the position, and blocks wholly before it are skipped by their
+// header alone. Time ranges assume the clock did not step back while the
+// journal was written.
+typedef struct {
+    PyObject_HEAD
+    char *directory;
+    // The first sequence numbers of the segments, and the next to map.
+    uint64_t *segments;
+    size_t segments_len;
+    size_t next_segment;
+    // The segment being read and the size of its mapping, or NULL.
+    journal_segment *segment;
+    size_t map_size;
+    // The offset of the next block header, and of the next record and the
+    // end of the block being read, which are equal between blocks.
+    uint64_t block_next;
+    uint64_t record;
+    uint64_t block_end;
+    // The sequence number of the next record, and the time of its block.
+    uint64_t seq;
+    int64_t block_time;
+    // The range asked for: [start, stop) and [since, until).
+    uint64_t start;
+    uint64_t stop;
+    int64_t since;
+    int64_t until;
+    Py_ssize_t batch_size;
+    // Set until the index of the first segment has been searched.
+    int seek;
+    int finished;
+    // Set while a batch is being filled without the GIL.
+    int busy;
+} ReplayObject;
+
+// Results of replay_fill() besides 0
+#define REPLAY_ERRNO -1
+#define REPLAY_NOMEM -2
+
+static void replay_unmap(ReplayObject *self) {
+    if (!self->segment) return;
+    munmap(self->segment, self->map_size);
+    self->segment = NULL;
 }
 
-static PyObject * get_event(PyObject *self) {
-    // Wrapper around get_event_tuple() to allow access from the python
-    // interpreter
-    return get_event_tuple();
+static void replay_seek(ReplayObject *self, uint64_t end) {
+    // Move to the last indexed block of the segment that starts before the
+    // range, if there is one. Failing to read the index is not an error;
+    // the blocks are walked from the start instead.
+    char *path = journal_path(self->directory, self->segment->first_seq,
+                              ".idx");
+    if (!path) return;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    PyMem_RawFree(path);
+    if (fd == -1) return;
+    struct stat st;
+    journal_index *entries = NULL;
+    size_t count = 0;
+    if (fstat(fd, &st) == 0 && st.st_size >= (off_t) sizeof (journal_index)) {
+        count = (size_t) st.st_size / sizeof (journal_index);
+        entries = PyMem_RawMalloc(count * sizeof (journal_index));
+        if (entries && pread(fd, entries, count * sizeof (journal_index), 0)
+                != (ssize_t) (count * sizeof (journal_index)))
+            count = 0;
+    }
+    close(fd);
+    // Both keys only grow, so the entries before the range come first.
+    size_t low = 0, high = entries ? count : 0;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        journal_index *entry = &entries[middle];
+        if (entry->seq <= self->start &&
+            (self->since == INT64_MIN || entry->time_ns < self->since))
+            low = middle + 1;
+        else high = middle;
+    }
+    if (low > 0) {
+        journal_index *entry = &entries[low - 1];
+        if (entry->offset >= sizeof (journal_segment) &&
+            entry->offset + sizeof (journal_block) <= end) {
+            self->block_next = entry->offset;
+            self->seq = entry->seq;
+        }
+    }
+    PyMem_RawFree(entries);
 }
 
-static PyObject * get_event_tuple(void) {
-    if (!sentinel.head) {
-        PyErr_SetString(PyExc_IndexError,
-                        "There are no more events in the queue!");
-        return NULL;
+static int replay_open(ReplayObject *self) {
+    // Map the next segment. Returns 1 if it was mapped, 0 if it is not a
+    // valid segment and -1 with errno set on failure.
+    uint64_t first_seq = self->segments[self->next_segment++];
+    char *path = journal_path(self->directory, first_seq, ".seg");
+    if (!path) return -1;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    PyMem_RawFree(path);
+    if (fd == -1) return errno == ENOENT ? 0 : -1;
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        int error = errno;
+        close(fd);
+        errno = error;
+        return -1;
     }
-    inotify_event *event = sentinel.head->event;
-    inotify_event_list *next_event = sentinel.head->next_event;
-    PyMem_RawFree(sentinel.head);
-    sentinel.head = next_event;
-    if (!sentinel.head) sentinel.tail = NULL;
-    PyObject *read_event_tuple = build_tuple(event);
-    if(!read_event_tuple) return NULL;
-    PyMem_RawFree(event);
-    iel_length--;
-    events_read--;
-    return read_event_tuple;
+    if (st.st_size < (off_t) sizeof (journal_segment)) {
+        close(fd);
+        return 0;
+    }
+    size_t size = (size_t) st.st_size;
+    void *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+    int error = errno;
+    close(fd);
+    if (map == MAP_FAILED) {
+        errno = error;
+        return -1;
+    }
+    journal_segment *segment = map;
+    int valid = memcmp(segment->magic, JOURNAL_MAGIC,
+                       sizeof segment->magic) == 0;
+    // Pairs with the fence the writer puts before the magic.
+    atomic_thread_fence(memory_order_acquire);
+    if (!valid || segment->version != JOURNAL_VERSION ||
+        segment->first_seq != first_seq) {
+        munmap(map, size);
+        return 0;
+    }
+    self->segment = segment;
+    self->map_size = size;
+    self->block_next = sizeof (journal_segment);
+    self->record = self->block_end = 0;
+    self->seq = first_seq;
+    if (self->seek) {
+        uint64_t end = atomic_load_explicit(&segment->end,
+                                            memory_order_acquire);
+        replay_seek(self, end < size ? end : size);
+        self->seek = 0;
+    }
+    return 1;
 }
 
-static PyObject * get_event_queue(PyObject *self) {
-    PyObject *event_list = PyList_New(0);
-    if (!event_list) {
-        PyErr_SetString(PyExc_ValueError, "Unable to create new list!");
-        return NULL;
+static int replay_more_segments(ReplayObject *self) {
+    // Look for segments started since the journal was listed. Returns 1 if
+    // there are some, 0 if not and -1 with errno set on failure.
+    uint64_t last = self->segments_len ?
+                    self->segments[self->segments_len - 1] : 0;
+    uint64_t *seqs;
+    size_t len;
+    if (journal_list(self->directory, &seqs, &len) == -1) return -1;
+    size_t first = 0;
+    while (first < len && self->segments_len && seqs[first] <= last)
+        first++;
+    if (first == len) {
+        PyMem_RawFree(seqs);
+        return 0;
     }
-    while (iel_length > 0) {
-        PyObject *event_tuple = get_event_tuple();
-        int status = 0;
-        if (event_tuple) {
-            status = PyList_Append(event_list, event_tuple);
+    memmove(seqs, seqs + first, (len - first) * sizeof (uint64_t));
+    PyMem_RawFree(self->segments);
+    self->segments = seqs;
+    self->segments_len = len - first;
+    self->next_segment = 0;
+    return 1;
+}
+
+static int replay_fill(ReplayObject *self, char **memory, size_t *used,
+                       Py_ssize_t *count) {
+    // Copy up to batch_size records of the range into *memory, growing
+    // it as needed. Returns 0 or a REPLAY_* code. Runs without the GIL.
+    size_t capacity = 0;
+    while (*count < self->batch_size) {
+        if (!self->segment) {
+            if (self->next_segment == self->segments_len) {
+                int more = replay_more_segments(self);
+                if (more == -1) return REPLAY_ERRNO;
+                if (!more) {
+                    self->finished = 1;
+                    break;
+                }
+            }
+            if (replay_open(self) == -1) return REPLAY_ERRNO;
+            continue;
         }
-        if (status == -1) {
-            PyErr_SetString(PyExc_ValueError,
-                            "Unable to add item to list!");
+        char *base = (char *) self->segment;
+        uint64_t end = atomic_load_explicit(&self->segment->end,
+                                            memory_order_acquire);
+        if (end > self->map_size) end = self->map_size;
+        if (self->record < self->block_end) {
+            inotify_event *event = (inotify_event *) (base + self->record);
+            size_t record = sizeof (inotify_event);
+            if (self->record + record <= self->block_end)
+                record += event->len;
+            if (self->record + record > self->block_end) {
+                // A damaged block; go on with the next one.
+                self->record = self->block_end;
+                continue;
+            }
+            if (self->seq >= self->stop || self->block_time >= self->until) {
+                self->finished = 1;
+                break;
+            }
+            self->record += record;
+            self->seq++;
+            if (self->seq <= self->start || self->block_time < self->since)
+                continue;
+            if (*used + record > capacity) {
+                size_t grown = capacity ? capacity * 2 : 64 * 1024;
+                while (grown < *used + record) grown *= 2;
+                char *larger = PyMem_RawRealloc(*memory, grown);
+                if (!larger) return REPLAY_NOMEM;
+                *memory = larger;
+                capacity = grown;
+            }
+            memcpy(*memory + *used, event, record);
+            *used += record;
+            (*count)++;
+            continue;
+        }
+        if (self->block_next + sizeof (journal_block) <= end) {
+            journal_block *block = (journal_block *) (base + self->block_next);
+            uint64_t first = self->block_next + sizeof (journal_block);
+            uint64_t last = first + block->bytes;
+            self->seq = block->first_seq;
+            self->block_time = block->time_ns;
+            self->block_next = last;
+            self->record = first;
+            self->block_end = last <= end ? last : end;
+            // Skip blocks before the range by their header alone, unless
+            // the writer is still adding to them.
+            if (last <= end && (block->first_seq + block->count <=
+                                    self->start ||
+                                block->time_ns < self->since)) {
+                self->seq = block->first_seq + block->count;
+                self->record = self->block_end;
+            }
+            continue;
+        }
+        if (!atomic_load(&self->segment->sealed)) {
+            // The writer has not got any further yet.
+            self->finished = 1;
+            break;
+        }
+        replay_unmap(self);
+    }
+    return 0;
+}
+
+static PyObject * Replay_new(PyTypeObject *type, PyObject *args,
+                             PyObject *kwargs) {
+    char *kwlist[] = {"directory", "start", "stop", "since", "until",
+                      "batch_size", NULL};
+    PyObject *directory;
+    unsigned long long start = 0;
+    PyObject *stop = Py_None, *since = Py_None, *until = Py_None;
+    Py_ssize_t batch_size = 4096;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|KOOOn", kwlist,
+                                     &directory, &start, &stop, &since,
+                                     &until, &batch_size))
+        return NULL;
+    if (batch_size < 1) {
+        PyErr_SetString(PyExc_ValueError, "batch_size must be positive");
+        return NULL;
+    }
+    uint64_t stop_seq = UINT64_MAX;
+    if (stop != Py_None) {
+        stop_seq = PyLong_AsUnsignedLongLong(stop);
+        if (PyErr_Occurred()) return NULL;
+    }
+    // Times are in seconds since the epoch, as from time.time().
+    int64_t bounds[2] = {INT64_MIN, INT64_MAX};
+    PyObject *times[2] = {since, until};
+    for (int i = 0; i < 2; i++) {
+        if (times[i] == Py_None) continue;
+        double seconds = PyFloat_AsDouble(times[i]);
+        if (seconds == -1.0 && PyErr_Occurred()) return NULL;
+        if (seconds < -9.2e9 || seconds > 9.2e9) {
+            PyErr_SetString(PyExc_OverflowError, "time is out of range");
             return NULL;
         }
+        bounds[i] = (int64_t) (seconds * 1e9);
     }
-    return event_list;
+    PyObject *encoded;
+    if (!PyUnicode_FSConverter(directory, &encoded)) return NULL;
+    ReplayObject *self = (ReplayObject *) type->tp_alloc(type, 0);
+    if (!self) {
+        Py_DECREF(encoded);
+        return NULL;
+    }
+    const char *name = PyBytes_AS_STRING(encoded);
+    self->directory = PyMem_RawMalloc(strlen(name) + 1);
+    if (!self->directory) {
+        Py_DECREF(encoded);
+        Py_DECREF(self);
+        return PyErr_NoMemory();
+    }
+    strcpy(self->directory, name);
+    Py_DECREF(encoded);
+    self->segments = NULL;
+    self->segment = NULL;
+    self->start = start;
+    self->stop = stop_seq;
+    self->since = bounds[0];
+    self->until = bounds[1];
+    self->seq = start;
+    self->batch_size = batch_size;
+    self->seek = 1;
+    int error = 0;
+    Py_BEGIN_ALLOW_THREADS
+    if (journal_list(self->directory, &self->segments,
+                     &self->segments_len) == -1)
+        error = errno;
+    // Start from the last segment that begins at or before the range.
+    size_t first = 0;
+    for (size_t i = 1; !error && i < self->segments_len; i++) {
+        if (self->segments[i] > start) break;
+        first = i;
+    }
+    for (size_t i = first + 1; !error && self->since != INT64_MIN &&
+                               i < self->segments_len; i++) {
+        journal_segment header;
+        int valid = journal_read_header(self->directory, self->segments[i],
+                                        &header);
+        if (valid != 1 || !header.first_time ||
+            header.first_time >= self->since)
+            break;
+        first = i;
+    }
+    self->next_segment = first;
+    Py_END_ALLOW_THREADS
+    if (error) {
+        Py_DECREF(self);
+        errno = error;
+        return PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError,
+                                                    directory);
+    }
+    return (PyObject *) self;
+}
+
+static void Replay_dealloc(ReplayObject *self) {
+    PyTypeObject *type = Py_TYPE(self);
+    replay_unmap(self);
+    PyMem_RawFree(self->segments);
+    PyMem_RawFree(self->directory);
+    type->tp_free((PyObject *) self);
+    Py_DECREF(type);
 }
 
-static PyObject * build_tuple(inotify_event *event) {
-    PyObject *py_wd = PyLong_FromLong(event->wd);
-    PyObject *py_mask = PyLong_FromUnsignedLong(event->mask);
-    PyObject *py_cookie = PyLong_FromUnsignedLong(event->cookie);
-    PyObject *py_name = PyUnicode_FromString(event->name);
-    if (!py_name) {
-        PyErr_SetString(PyExc_BufferError, "Unable to read name!");
+static PyObject * Replay_next(ReplayObject *self) {
+    if (self->finished) return NULL;
+    if (self->busy) {
+        PyErr_SetString(PyExc_RuntimeError,
+                        "Replay is already being read by another thread");
         return NULL;
     }
-    Py_ssize_t len = PyUnicode_GetLength(py_name);
-    if (len <= 0) {
-        PyErr_SetString(PyExc_BufferError, "The length is 0!");
+    char *memory = NULL;
+    size_t used = 0;
+    Py_ssize_t count = 0;
+    int status;
+    self->busy = 1;
+    Py_BEGIN_ALLOW_THREADS
+    status = replay_fill(self, &memory, &used, &count);
+    Py_END_ALLOW_THREADS
+    self->busy = 0;
+    if (status != 0) {
+        PyMem_RawFree(memory);
+        if (status == REPLAY_NOMEM) return PyErr_NoMemory();
+        return PyErr_SetFromErrno(PyExc_OSError);
+    }
+    if (count == 0) {
+        PyMem_RawFree(memory);
         return NULL;
     }
-    PyObject *py_len = PyLong_FromSsize_t(len);
-    if (!py_len) {
-        PyErr_SetString(PyExc_BufferError, "Unable to set length in tuple!");
+    utils_state *state = PyType_GetModuleState(Py_TYPE(self));
+    BatchObject *batch = (BatchObject *)
+        state->batch_type->tp_alloc(state->batch_type, 0);
+    if (!batch) {
+        PyMem_RawFree(memory);
         return NULL;
     }
-    PyObject *read_event_tuple = PyTuple_Pack(5, py_wd, py_mask, py_cookie,
-                                              py_len, py_name);
-    return read_event_tuple;
+    batch->memory = memory;
+    batch->data = memory;
+    batch->nbytes = (Py_ssize_t) used;
+    batch->count = count;
+    batch->offsets = NULL;
+    batch->counts_memory = NULL;
+    batch->counts = NULL;
+    batch->reader = NULL;
+    return (PyObject *) batch;
 }
 
-static void buffer_init(void) {
-    if(buffer) buffer_cleanup;
-    buffer_size = INITIAL_BUFFER_SIZE;
-    buffer_pos = 0;
-    buffer = PyMem_RawMalloc(buffer_size);
+static PyObject * Replay_get_position(ReplayObject *self, void *closure) {
+    return PyLong_FromUnsignedLongLong(self->seq);
 }
 
-static void buffer_cleanup(void) {
-    buffer_size = -1;
-    buffer_pos = -1;
-    PyMem_RawFree(buffer);
-    buffer = NULL;
+static PyObject * Replay_get_time(ReplayObject *self, void *closure) {
+    if (!self->block_time) Py_RETURN_NONE;
+    return PyFloat_FromDouble((double) self->block_time / 1e9);
 }
 
-static void buffer_resize(ssize_t bytes) {
-    // Resize buffer to number of bytes given in bytes.
-    if (bytes <= 0) {
-        buffer_cleanup();
-        return;
+static PyGetSetDef Replay_getset[] = {
+    {
+        "position", (getter) Replay_get_position, NULL,
+        "The sequence number of the next event. A new Replay started here "
+        "carries on where this one stopped.", NULL
+    },
+    {
+        "time", (getter) Replay_get_time, NULL,
+        "When the last event returned was delivered, in seconds since the "
+        "epoch, or None.", NULL
+    },
+    {
+        NULL, NULL, NULL, NULL, NULL
+    }
+};
+
+static PyType_Slot Replay_slots[] = {
+    {Py_tp_doc, "Replay(directory, start=0, stop=None, since=None, "
+                "until=None, batch_size=4096)\n\n"
+                "Iterates over the events of the journal in directory, see "
+                "Inotify.start_journal(), as Batch objects of at most "
+                "batch_size events. Only events with a sequence number in "
+                "[start, stop) delivered in [since, until), in seconds "
+                "since the epoch, are returned. Iteration stops at the end "
+                "of what has been written so far."},
+    {Py_tp_new, Replay_new},
+    {Py_tp_dealloc, Replay_dealloc},
+    {Py_tp_iter, PyObject_SelfIter},
+    {Py_tp_iternext, Replay_next},
+    {Py_tp_getset, Replay_getset},
+    {0, NULL}
+};
+
+static PyType_Spec Replay_spec = {
+    .name = "inotipyutils.Replay",
+    .basicsize = sizeof (ReplayObject),
+    .flags = Py_TPFLAGS_DEFAULT,
+    .slots = Replay_slots
+};
+
+
+// The Fanotify type
+
+static PyObject * Fanotify_new(PyTypeObject *type, PyObject *args,
+                               PyObject *kwargs) {
+    // Wrap an existing fanotify file descriptor, which must report
+    // directory handles and names, or create (and own) a new one.
+    char *kwlist[] = {"fd", "flags", NULL};
+    int fd = -1;
+    unsigned int flags = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|iI", kwlist, &fd,
+                                     &flags))
+        return NULL;
+    fan_state *fan = PyMem_RawCalloc(1, sizeof (fan_state));
+    if (!fan) return PyErr_NoMemory();
+    int owns_fd = 0;
+    if (fd < 0) {
+        fd = fanotify_init(FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME |
+                           FAN_CLOEXEC | flags, O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            PyMem_RawFree(fan);
+            return PyErr_SetFromErrno(PyExc_OSError);
+        }
+        owns_fd = 1;
+    }
+    InotifyObject *reader = reader_new(type, fd, owns_fd);
+    if (!reader) {
+        if (owns_fd) close(fd);
+        PyMem_RawFree(fan);
+        return NULL;
+    }
+    reader->fan = fan;
+    return (PyObject *) reader;
+}
+
+static PyObject * Fanotify_mark(InotifyObject *self, PyObject *args,
+                                PyObject *kwargs) {
+    char *kwlist[] = {"path", "mask", "flags", NULL};
+    PyObject *path;
+    unsigned long long mask;
+    unsigned int flags = FAN_MARK_ADD | FAN_MARK_FILESYSTEM;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "OK|I", kwlist, &path,
+                                     &mask, &flags))
+        return NULL;
+    if (reader_check_open(self) == -1) return NULL;
+    return reader_fan_mark(self, path, mask, flags);
+}
+
+static PyObject * Fanotify_path_stats(InotifyObject *self,
+                                      PyObject *unused) {
+    return reader_path_stats(self);
+}
+
+static PyMethodDef Fanotify_methods[] = {
+    {
+        "mark", (PyCFunction) Fanotify_mark, METH_VARARGS | METH_KEYWORDS,
+        "mark(path, mask, flags=FAN_MARK_ADD | FAN_MARK_FILESYSTEM)\n\n"
+        "Call fanotify_mark() on path. By default every directory of the "
+        "filesystem holding path is watched for the events in mask, such "
+        "as FAN_CREATE | FAN_DELETE | FAN_MODIFY | FAN_RENAME | FAN_ONDIR. "
+        "Renames are only reported for FAN_RENAME, as an IN_MOVED_FROM and "
+        "IN_MOVED_TO pair; FAN_MOVED_FROM and FAN_MOVED_TO are not "
+        "delivered. Include FAN_RENAME and FAN_ONDIR so that renamed "
+        "directories are seen and no stale path is reported. "
+        "Returns the watch descriptor the events of the filesystem carry "
+        "when a mark is added, and None otherwise. Raises OSError on "
+        "failure."
+    },
+    {
+        "path_stats", (PyCFunction) Fanotify_path_stats, METH_NOARGS,
+        "Return a dict with the number of marked filesystems, of cached "
+        "directories and of cache slots, the hits and misses of the cache, "
+        "the handles that could not be resolved and the number of times "
+        "cached paths were dropped after a directory moved."
+    },
+    {
+        NULL, NULL, 0, NULL
+    }
+};
+
+static PyType_Slot Fanotify_slots[] = {
+    {Py_tp_doc, "Fanotify(fd=-1, flags=0)\n\n"
+                "A reader of a fanotify(7) descriptor, for watching whole "
+                "filesystems without a watch per directory.\n"
+                "Wraps fd if it is given, otherwise creates a new group with "
+                "fanotify_init(FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME | "
+                "FAN_CLOEXEC | flags) and closes it when the reader is "
+                "closed. Events are delivered like those of Inotify, with "
+                "the mask bits inotify shares, FAN_ONDIR as IN_ISDIR, the "
+                "watch descriptor mark() returned and the full path as the "
+                "name. A FAN_RENAME is split into an IN_MOVED_FROM and an "
+                "IN_MOVED_TO record with the same cookie. Paths are "
+                "resolved when events are read, so events from before a "
+                "directory was renamed carry its new path. Resolving them "
+                "needs CAP_DAC_READ_SEARCH; an event whose directory cannot "
+                "be found is named by its name alone. There is no drain "
+                "thread and no add_tree()."},
+    {Py_tp_new, Fanotify_new},
+    {Py_tp_methods, Fanotify_methods},
+    {0, NULL}
+};
+
+static PyType_Spec Fanotify_spec = {
+    .name = "inotipyutils.Fanotify",
+    .basicsize = sizeof (InotifyObject),
+    .flags = Py_TPFLAGS_DEFAULT,
+    .slots = Fanotify_slots
+};
+
+
+// The C API
+
+// The table exported as the capsule inotipyutils._C_API. See
+// inotipyutils.h.
+
+static InotifyObject * capi_reader(PyObject *object) {
+    // Return object as a reader of this module, or NULL with TypeError.
+    PyObject *module = PyType_GetModuleByDef(Py_TYPE(object),
+                                             &inotipy_utils);
+    if (module) {
+        utils_state *state = get_utils_state(module);
+        if (PyObject_TypeCheck(object, state->inotify_type))
+            return (InotifyObject *) object;
+    }
+    PyErr_Clear();
+    PyErr_Format(PyExc_TypeError, "expected an inotipyutils.Inotify, not %s",
+                 Py_TYPE(object)->tp_name);
+    return NULL;
+}
+
+static PyObject * capi_reader_open(int fd, int flags) {
+    PyObject *module = PyImport_ImportModule("inotipyutils");
+    if (!module) return NULL;
+    PyObject *reader = PyObject_CallMethod(module, "Inotify", "ii", fd,
+                                           flags);
+    Py_DECREF(module);
+    return reader;
+}
+
+static int capi_reader_fd(PyObject *object) {
+    InotifyObject *reader = capi_reader(object);
+    if (!reader || reader_check_open(reader) == -1) return -1;
+    return reader->fd;
+}
+
+static Py_ssize_t capi_drain_into(PyObject *object, char *buffer,
+                                  size_t capacity, size_t *used) {
+    // Like get_batch(), but into memory the caller owns. Records that do
+    // not fit stay queued for the next call.
+    *used = 0;
+    InotifyObject *reader = capi_reader(object);
+    if (!reader || reader_check_open(reader) == -1) return -1;
+    reader_lock(reader);
+    reader_settle(reader);
+    int empty = reader->iel_length == 0;
+    reader_unlock(reader);
+    if (empty) {
+        long syscalls = 0;
+        size_t bytes = 0;
+        int status = reader_fill_blocking(reader, reader->fd,
+                                          DEFAULT_DRAIN_CAPACITY, 0,
+                                          &syscalls, &bytes);
+        if (status != FILL_OK) {
+            if (PyErr_Occurred()) return -1;
+            if (status == FILL_EOF ||
+                (status == FILL_ERRNO && reader->_utils_errno == EAGAIN))
+                return 0;
+            raise_fill_error(reader, status);
+            return -1;
+        }
+    }
+    Py_ssize_t count = 0;
+    reader_lock(reader);
+    reader_settle(reader);
+    inotify_event *event;
+    while ((event = queue_peek(reader)) != NULL) {
+        size_t size = sizeof (inotify_event) + event->len;
+        if (*used + size > capacity) break;
+        memcpy(buffer + *used, event, size);
+        *used += size;
+        queue_consume(reader, event);
+        count++;
+    }
+    if (count > 0) stats_delivered(reader);
+    else if (reader->iel_length > 0) {
+        reader_unlock(reader);
+        PyErr_SetString(PyExc_ValueError,
+                        "The buffer cannot hold the next record");
+        return -1;
     }
-    buffer_size = bytes;
-    buffer = PyMem_RawRealloc(buffer, (size_t) buffer_size);
+    reader_unlock(reader);
+    return count;
 }
 
+static const struct inotify_event * capi_next_event(const char *buffer,
+                                                    size_t size,
+                                                    size_t *offset) {
+    if (*offset + sizeof (inotify_event) > size) return NULL;
+    const inotify_event *event = (const inotify_event *) (buffer + *offset);
+    size_t event_size = sizeof (inotify_event) + event->len;
+    if (*offset + event_size > size) return NULL;
+    *offset += event_size;
+    return event;
+}
+
+static int capi_moved_destination(const struct inotify_event *record,
+                                  int *wd, const char **name, size_t *len) {
+    return moved_destination((inotify_event *) record, wd, name, len);
+}
+
+static Py_ssize_t capi_wd_path(PyObject *object, int wd, char *out,
+                               size_t size) {
+    InotifyObject *reader = capi_reader(object);
+    if (!reader) return -2;
+    Py_ssize_t len = -1;
+    reader_lock(reader);
+    wd_entry *entry = tree_find(&reader->tree, wd);
+    if (entry) {
+        len = (Py_ssize_t) entry->len;
+        if (entry->len < size) memcpy(out, entry->path, entry->len + 1);
+    }
+    reader_unlock(reader);
+    return len;
+}
+
+static const InotipyUtils_CAPI utils_capi = {
+    .version = INOTIPYUTILS_API_VERSION,
+    .size = sizeof (InotipyUtils_CAPI),
+    .reader_open = capi_reader_open,
+    .reader_fd = capi_reader_fd,
+    .drain_into = capi_drain_into,
+    .next_event = capi_next_event,
+    .moved_destination = capi_moved_destination,
+    .wd_path = capi_wd_path
+};
+
 
 static PyMethodDef inotipy_utils_methods[] = {
     {
-        "read", inotipy_utils_read, METH_VARARGS | METH_KEYWORDS,
+        "read", (PyCFunction) inotipy_utils_read,
+        METH_VARARGS | METH_KEYWORDS,
         "Read from the inotify file descriptor and return the number of "
         "events read."
     },
+    {
+        "drain", (PyCFunction) inotipy_utils_drain,
+        METH_VARARGS | METH_KEYWORDS,
+        "Read every pending event from the inotify file descriptor, up to "
+        "capacity bytes, in as few read(2) calls as possible. Returns a "
+        "tuple of (events queued, syscalls made, bytes read)."
+    },
+    {
+        "wait", (PyCFunction) inotipy_utils_wait,
+        METH_VARARGS | METH_KEYWORDS,
+        "Block, without holding the GIL, until the inotify file descriptor "
+        "has events to read or timeout seconds have passed (forever if "
+        "timeout is None). Returns True if events are ready and False on "
+        "timeout."
+    },
     {
         "get_event", get_event, METH_NOARGS, "Return the oldest "
         "inotify_event struct in the form of a tuple. Removes the "
@@ -282,6 +9063,180 @@ static PyMethodDef inotipy_utils_methods[] = {
         "get_event_list", get_event_queue, METH_NOARGS, "Equivalent to "
         "creating a list of get_event() tuples."
     },
+    {
+        "get_batch", get_batch, METH_NOARGS, "Remove every event from the "
+        "queue and return them as a Batch, without building any Python "
+        "objects for them."
+    },
+    {
+        "get_columns", get_columns, METH_NOARGS, "Remove every event from "
+        "the queue and return them as a Columns object, with one typed "
+        "array per field."
+    },
+    {
+        "set_filter", (PyCFunction) set_filter,
+        METH_VARARGS | METH_KEYWORDS,
+        "set_filter(allow_mask=0, deny_mask=0, wds=None, patterns=None)\n\n"
+        "Drop events while they are parsed, before they reach the queue. "
+        "Events are kept only if they share a bit with allow_mask (when it "
+        "is not 0), share none with deny_mask, belong to one of wds (when "
+        "given) and match none of the filename patterns, such as '*.swp', "
+        "'*~' or '.#*'. IN_Q_OVERFLOW is never dropped. Without arguments "
+        "the filter is removed."
+    },
+    {
+        "filter_stats", filter_stats, METH_NOARGS,
+        "Return the number of events dropped by each rule of the filter."
+    },
+    {
+        "set_coalesce", (PyCFunction) set_coalesce,
+        METH_VARARGS | METH_KEYWORDS,
+        "set_coalesce(enabled=True, window=0.0)\n\n"
+        "Merge repeated events while they are parsed. An IN_MODIFY or "
+        "IN_CLOSE_WRITE, IN_ATTRIB, or IN_ACCESS, IN_OPEN or "
+        "IN_CLOSE_NOWRITE event is ORed into the mask of the record still "
+        "queued for the same watch descriptor, name and class, if that was "
+        "queued at most window seconds earlier (any time if window is 0). "
+        "Creation, deletion and renaming of a name end its merging. While "
+        "enabled, event tuples carry the number of raw events they stand "
+        "for as an extra item. set_coalesce(False) turns it off."
+    },
+    {
+        "coalesce_stats", coalesce_stats, METH_NOARGS,
+        "Return the number of events the coalescing stage has seen, merged "
+        "and delivered."
+    },
+    {
+        "set_pair_moves", (PyCFunction) set_pair_moves,
+        METH_VARARGS | METH_KEYWORDS,
+        "set_pair_moves(enabled=True, max_reads=1, timeout=0.5)\n\n"
+        "Pair the two halves of every rename while they are parsed. An "
+        "IN_MOVED_FROM event is held back until the IN_MOVED_TO event with "
+        "the same cookie arrives, and both are queued as one record with "
+        "IN_MOVED_FROM and IN_MOVED_TO set, whose tuple carries the "
+        "destination wd and name after the source name. Halves still "
+        "unpaired after max_reads more reads, or timeout seconds (never if "
+        "0), are queued as plain events. set_pair_moves(False) queues the "
+        "pending halves and turns it off."
+    },
+    {
+        "flush_moves", flush_moves, METH_NOARGS,
+        "Queue every pending rename half as a plain event and return how "
+        "many there were."
+    },
+    {
+        "move_stats", move_stats, METH_NOARGS,
+        "Return the number of rename halves pending, and of renames paired "
+        "and halves queued unpaired so far."
+    },
+    {
+        "add_tree", (PyCFunction) add_tree, METH_VARARGS | METH_KEYWORDS,
+        "add_tree(fd, path, mask=IN_ALL_EVENTS)\n\n"
+        "Watch path and every directory below it, walking the tree and "
+        "adding the watches without holding the GIL. Subdirectories "
+        "created or moved in later are watched automatically, and watches "
+        "the kernel drops (IN_IGNORED) are forgotten. What was created in "
+        "a new subdirectory before its watch was added is reported with an "
+        "IN_CREATE of its own, possibly twice; the contents of a directory "
+        "moved in are not reported. The names of events "
+        "on these directories are replaced by their full path, and "
+        "directories moved out of the tree are no longer watched. The mask "
+        "always includes IN_CREATE, IN_MOVED_TO and IN_ONLYDIR, and never "
+        "IN_OPEN, IN_ACCESS or IN_CLOSE_NOWRITE, which reading the "
+        "directories to walk them would trigger. Returns a tuple of "
+        "(watches added, directories that could not be watched)."
+    },
+    {
+        "wd_path", wd_path, METH_O, "Return the path of a directory "
+        "watched through add_tree(), or None."
+    },
+    {
+        "tree_stats", tree_stats, METH_NOARGS, "Return the number of "
+        "directories watched through add_tree(), how many watches have "
+        "been added and have failed so far, whether snapshots are kept, "
+        "and the number of rescans and of events they queued."
+    },
+    {
+        "set_rescan", (PyCFunction) set_rescan, METH_VARARGS | METH_KEYWORDS,
+        "set_rescan(enabled=True)\n\n"
+        "Keep a snapshot of the entries of every directory watched through "
+        "add_tree(), reading them all now without holding the GIL. After an "
+        "IN_Q_OVERFLOW, every directory is read again and what was created, "
+        "deleted or modified meanwhile is queued as IN_CREATE, IN_DELETE "
+        "and IN_MODIFY events right after it. A file modified since the "
+        "last scan may be reported twice. With enabled=False the snapshots "
+        "are dropped."
+    },
+    {
+        "rescan", (PyCFunction) rescan, METH_VARARGS | METH_KEYWORDS,
+        "rescan(fd)\n\n"
+        "Read every directory watched through add_tree() again and queue "
+        "how it differs from its snapshot, like after an IN_Q_OVERFLOW. "
+        "Returns the number of events queued, 0 without snapshots."
+    },
+    {
+        "save_snapshot", (PyCFunction) save_snapshot, METH_O,
+        "save_snapshot(path)\n\n"
+        "Write the snapshots to the file at path, and return the number of "
+        "directories saved. The file is written under a temporary name and "
+        "renamed over path once complete, so path is never left half "
+        "written. The file is meant for this machine only."
+    },
+    {
+        "load_snapshot", (PyCFunction) load_snapshot, METH_O,
+        "load_snapshot(path)\n\n"
+        "Replace the snapshots of the directories watched through "
+        "add_tree() with those saved to the file at path, matched by path, "
+        "and keep snapshots from now on. Returns the number of directories "
+        "found. A rescan() then reports what changed since they were "
+        "saved:\n\n"
+        "    add_tree(fd, root)\n"
+        "    load_snapshot(saved)\n"
+        "    rescan(fd)"
+    },
+    {
+        "set_watch_budget", (PyCFunction) set_watch_budget,
+        METH_VARARGS | METH_KEYWORDS,
+        "set_watch_budget(fd, enabled=True, limit=None, "
+        "poll_interval=1.0)\n\n"
+        "Cap the watches of the directories watched through add_tree() at "
+        "limit, or at /proc/sys/fs/inotify/max_user_watches if that is "
+        "lower. Once the cap is reached, or inotify_add_watch() fails with "
+        "ENOSPC, the directories that have gone longest without an event "
+        "lose their watch and are polled with stat(2) every poll_interval "
+        "seconds instead, by the reads that come along or by "
+        "poll_watches(). A polled directory that changes is watched again, "
+        "and what it gained, lost or had modified since it was evicted is "
+        "queued as IN_CREATE, IN_DELETE and IN_MODIFY events. Writes to "
+        "files that leave their directory untouched go unseen while it is "
+        "polled. With enabled=False every polled directory is watched "
+        "again and the cap is lifted."
+    },
+    {
+        "poll_watches", (PyCFunction) poll_watches,
+        METH_VARARGS | METH_KEYWORDS,
+        "poll_watches(fd)\n\n"
+        "Look at the polled directories now and return how many were "
+        "watched again."
+    },
+    {
+        "watch_budget_stats", watch_budget_stats, METH_NOARGS,
+        "Return the limit of the watch budget and max_user_watches, the "
+        "watches held, the directories polled, and the number of "
+        "evictions, re-armed watches, polls and ENOSPC failures so far, or "
+        "None without a budget."
+    },
+    {
+        "stats", inotipy_utils_stats, METH_NOARGS,
+        "Return what the reader has done so far: read(2) calls and bytes "
+        "read, events parsed, dropped by the filter and IN_Q_OVERFLOW events, "
+        "the current and longest queue length and the number of times the "
+        "buffer and queue were grown, how often decoded names were reused "
+        "from the name cache and how often they were not. latency is a "
+        "histogram of how long events waited between read(2) and being "
+        "handed out: item 0 counts waits under 1 microsecond, item i those "
+        "under 2**i microseconds and the last item everything longer."
+    },
     {
         "get_raw_buffer", get_raw_buffer, METH_NOARGS, "Return the raw "
         "buffer as a python bytes object."
@@ -291,22 +9246,188 @@ static PyMethodDef inotipy_utils_methods[] = {
     }
 };
 
+static int inotipy_utils_exec(PyObject *module) {
+    utils_state *state = get_utils_state(module);
+    state->inotify_type = (PyTypeObject *)
+        PyType_FromModuleAndSpec(module, &Inotify_spec, NULL);
+    if (!state->inotify_type) return -1;
+    if (PyModule_AddType(module, state->inotify_type) == -1) return -1;
+    state->poller_type = (PyTypeObject *)
+        PyType_FromModuleAndSpec(module, &Poller_spec, NULL);
+    if (!state->poller_type) return -1;
+    if (PyModule_AddType(module, state->poller_type) == -1) return -1;
+    state->batch_type = (PyTypeObject *)
+        PyType_FromModuleAndSpec(module, &Batch_spec, NULL);
+    if (!state->batch_type) return -1;
+    if (PyModule_AddType(module, state->batch_type) == -1) return -1;
+    state->event_type = (PyTypeObject *)
+        PyType_FromModuleAndSpec(module, &Event_spec, NULL);
+    if (!state->event_type) return -1;
+    if (PyModule_AddType(module, state->event_type) == -1) return -1;
+    state->columns_type = (PyTypeObject *)
+        PyType_FromModuleAndSpec(module, &Columns_spec, NULL);
+    if (!state->columns_type) return -1;
+    if (PyModule_AddType(module, state->columns_type) == -1) return -1;
+    state->column_type = (PyTypeObject *)
+        PyType_FromModuleAndSpec(module, &Column_spec, NULL);
+    if (!state->column_type) return -1;
+    if (PyModule_AddType(module, state->column_type) == -1) return -1;
+    state->stream_type = (PyTypeObject *)
+        PyType_FromModuleAndSpec(module, &Stream_spec, NULL);
+    if (!state->stream_type) return -1;
+    if (PyModule_AddType(module, state->stream_type) == -1) return -1;
+    state->subscriber_type = (PyTypeObject *)
+        PyType_FromModuleAndSpec(module, &Subscriber_spec, NULL);
+    if (!state->subscriber_type) return -1;
+    if (PyModule_AddType(module, state->subscriber_type) == -1) return -1;
+    state->replay_type = (PyTypeObject *)
+        PyType_FromModuleAndSpec(module, &Replay_spec, NULL);
+    if (!state->replay_type) return -1;
+    if (PyModule_AddType(module, state->replay_type) == -1) return -1;
+    state->fanotify_type = (PyTypeObject *)
+        PyType_FromModuleAndSpec(module, &Fanotify_spec,
+                                 (PyObject *) state->inotify_type);
+    if (!state->fanotify_type) return -1;
+    if (PyModule_AddType(module, state->fanotify_type) == -1) return -1;
+    state->default_reader = reader_new(state->inotify_type, -1, 0);
+    if (!state->default_reader) return -1;
+    PyObject *capi = PyCapsule_New((void *) &utils_capi,
+                                   INOTIPYUTILS_CAPSULE, NULL);
+    if (!capi) return -1;
+    if (PyModule_AddObject(module, "_C_API", capi) == -1) {
+        Py_DECREF(capi);
+        return -1;
+    }
+    return 0;
+}
+
+static int inotipy_utils_traverse(PyObject *module, visitproc visit,
+                                  void *arg) {
+    utils_state *state = get_utils_state(module);
+    Py_VISIT(state->inotify_type);
+    Py_VISIT(state->poller_type);
+    Py_VISIT(state->batch_type);
+    Py_VISIT(state->event_type);
+    Py_VISIT(state->columns_type);
+    Py_VISIT(state->column_type);
+    Py_VISIT(state->stream_type);
+    Py_VISIT(state->subscriber_type);
+    Py_VISIT(state->replay_type);
+    Py_VISIT(state->fanotify_type);
+    Py_VISIT(state->get_running_loop);
+    Py_VISIT(state->default_reader);
+    return 0;
+}
+
+static int inotipy_utils_clear(PyObject *module) {
+    utils_state *state = get_utils_state(module);
+    Py_CLEAR(state->default_reader);
+    Py_CLEAR(state->inotify_type);
+    Py_CLEAR(state->poller_type);
+    Py_CLEAR(state->batch_type);
+    Py_CLEAR(state->event_type);
+    Py_CLEAR(state->columns_type);
+    Py_CLEAR(state->column_type);
+    Py_CLEAR(state->stream_type);
+    Py_CLEAR(state->subscriber_type);
+    Py_CLEAR(state->replay_type);
+    Py_CLEAR(state->fanotify_type);
+    Py_CLEAR(state->get_running_loop);
+    return 0;
+}
+
+static void inotipy_utils_free(void *module) {
+    inotipy_utils_clear((PyObject *) module);
+}
+
+static PyModuleDef_Slot inotipy_utils_slots[] = {
+    {Py_mod_exec, inotipy_utils_exec},
+    {0, NULL}
+};
+
 static PyModuleDef inotipy_utils = {
     PyModuleDef_HEAD_INIT,
-    "inotipyutils",
-    NULL, //inotipy_doc,
-    -1,
-    inotipy_utils_methods
+    .m_name = "inotipyutils",
+    .m_doc = NULL, //inotipy_doc,
+    .m_size = sizeof (utils_state),
+    .m_methods = inotipy_utils_methods,
+    .m_slots = inotipy_utils_slots,
+    .m_traverse = inotipy_utils_traverse,
+    .m_clear = inotipy_utils_clear,
+    .m_free = inotipy_utils_free
 };
 
 
 PyMODINIT_FUNC PyInit_inotipyutils(void) {
-    PyObject *module = PyModule_Create(&inotipy_utils);
-    return module;
+    return PyModuleDef_Init(&inotipy_utils);
 }
 
 #undef INT_SIZE
 #undef FOUR_BYTES
 #undef SIXTEEN_BYTES
-#undef INITIAL_BUFFER_SIZE
 #undef MAX_READABLE_BYTES
+#undef MIN_READ_SIZE
+#undef DEFAULT_DRAIN_CAPACITY
+#undef PATTERN_EXACT
+#undef PATTERN_PREFIX
+#undef PATTERN_SUFFIX
+#undef PATTERN_GLOB
+#undef TREE_EMPTY
+#undef TREE_DELETED
+#undef TREE_SELF_EVENTS
+#undef TREE_EVENTS
+#undef SNAP_DIR
+#undef SNAP_SEEN
+#undef SNAP_MAGIC
+#undef SNAP_VERSION
+#undef SNAP_LOAD_ERRNO
+#undef SNAP_LOAD_INVALID
+#undef COALESCE_EMPTY
+#undef COALESCE_FORGOTTEN
+#undef COALESCE_FIRST_GENERATION
+#undef COALESCE_NONE
+#undef COALESCE_CONTENT
+#undef COALESCE_METADATA
+#undef COALESCE_ACCESS
+#undef PAIR_EMPTY
+#undef PAIR_DELETED
+#undef RING_BLOCK
+#undef RING_DROP
+#undef MIN_RING_CAPACITY
+#undef SHARED_MAGIC
+#undef SHARED_VERSION
+#undef MAX_SHARED_SUBSCRIBERS
+#undef SHARED_CHECK_NS
+#undef SHARED_MAP_ERRNO
+#undef SHARED_MAP_INVALID
+#undef JOURNAL_MAGIC
+#undef JOURNAL_VERSION
+#undef MIN_JOURNAL_SEGMENT
+#undef JOURNAL_BLOCK_NS
+#undef REPLAY_ERRNO
+#undef REPLAY_NOMEM
+#undef FAN_PATH_SLOTS
+#undef FAN_READ_SIZE
+#undef FILL_OK
+#undef FILL_ERRNO
+#undef FILL_NOMEM
+#undef FILL_EOF
+#undef FILL_WOULD_BLOCK
+#undef FILL_CLOSED
+#undef BATCH_EVENT
+#undef BATCH_NEXT
+#undef FIELD_WD
+#undef FIELD_MASK
+#undef FIELD_COOKIE
+#undef FIELD_NAME
+#undef FIELD_TUPLE
+#undef FIELD_COUNT
+#undef COLUMN_WD
+#undef COLUMN_MASK
+#undef COLUMN_COOKIE
+#undef COLUMN_NAME_OFFSET
+#undef COLUMN_NAME_LENGTH
+#undef COLUMN_NAMES
+#undef COLUMN_COUNT
+#undef LATENCY_BUCKETS
+#undef NAME_CACHE_SLOTS